@@ -0,0 +1,592 @@
+#!/usr/bin/env python
+#
+# dbg_collector.py - collects the UDP debug packets from any number of ESP8266s into indexed log files, and queries
+# them.
+#
+# Usage:
+#   dbg_collector.py collect [-d <dir>] [-k <days>]
+#   dbg_collector.py query [-d <dir>] [-t <tokens.json>] [-f <firmware.out> ...] [-D <IP>[,<IP> ...]] [-s <time>]
+#                          [-e <time>] [-g <regex>]
+#
+# Where:
+#   -d <dir>          the directory holding the log files (default logs, alongside this script).
+#   -k <days>         the number of days of log files kept, older ones being deleted (default 0, keeping everything).
+#   -t <tokens.json>  the format strings of the tokenized messages, as written by dbg_tokens.py during the build.
+#                     Defaults to build/dbg_tokens.json alongside this script.
+#   -f <firmware.out> a firmware image whose symbols name the code addresses in crash reports, which can be given more
+#                     than once. Defaults to build/delta_reader.user1.out and user2.out alongside this script.
+#   -D <IP>           only show the messages from these devices.
+#   -s <time>         only show the messages received from this time on.
+#   -e <time>         only show the messages received before this time.
+#                     Times are either "YYYY-MM-DD HH:MM[:SS]", or relative to now, e.g. "-30s", "-15m", "-2h", "-1d".
+#   -g <regex>        only show the messages matching this regular expression.
+#
+# The packets are stored as they were received, without decoding them, so that collecting costs as little as possible
+# and old logs can still be decoded with the tokens file of the firmware that sent them. Each device has its own
+# directory of segment files, a new segment being started every hour or when the current one gets too big. Each
+# segment is made up of blocks, each holding the packets received from the device over a few seconds (or up to
+# BLOCK_SIZE bytes of them), compressed with zlib. The index file alongside each segment holds the time range and
+# position of each block, so a query only needs to read and decompress the blocks it's interested in.
+#
+# The summary file alongside each segment lists the tokenized messages in each block, and the trigrams (runs of three
+# characters) of its text messages, hashed into a bitmap. When the -g regular expression is plain text (no special
+# characters) of three or more characters, a query skips the blocks that can't hold it: those where every trigram of
+# the text isn't in the bitmap, and no tokenized message has a format string that could produce the text, whatever its
+# arguments. Anything else (a regular expression, reset records, packets without a debug header) means reading every
+# block in the time range, as do segments written before the summaries were.
+#
+# Block format:  magic "DBGB", first and last receive times (doubles), packet count, compressed length, then the zlib
+#                compressed packets, each of which is the receive time (double), length (2 bytes) and packet.
+# Index format:  an entry for each block, made up of the first and last receive times (doubles), file offset (8 bytes),
+#                packet count and compressed length.
+# Summary format: an entry for each block, in the same order as the index, made up of the boot ID, the times the first
+#                and last records were logged, flags (SUMMARY_*), the number of tokenized messages, the trigram bitmap
+#                (SUMMARY_BITS bits) and then the module (1 byte) and line number (2 bytes) of each tokenized message.
+#                Everything is little-endian.
+#
+# While collecting, the number of packets and bytes received, and the number of packets lost (going by the sequence
+# numbers), are printed every STATS_INTERVAL seconds. A summary for each device is printed on exit (Ctrl-C).
+#
+
+from __future__ import print_function
+from datetime import datetime
+
+import getopt
+import heapq
+import os
+import Queue
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+
+from dbg_decode import *
+
+# The directory holding the log files, unless overridden with -d.
+DEFAULT_DIR=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'logs')
+
+# The number of bytes of packets held for a device before they're compressed and written out as a block, and the
+# maximum number of seconds they're held for, so that queries see recent packets.
+BLOCK_SIZE=65536
+BLOCK_AGE=5.0
+
+# A new segment is started once the current one is this many bytes, or this many seconds old.
+SEGMENT_SIZE=64 * 1024 * 1024
+SEGMENT_AGE=3600
+
+# The zlib compression level, trading the size of the logs against the time taken to write them.
+COMPRESS_LEVEL=1
+
+# The size of the socket's receive buffer, so that bursts of packets aren't dropped while the collector is busy.
+RECEIVE_BUFFER=4 * 1024 * 1024
+
+# The number of seconds between the statistics being printed while collecting.
+STATS_INTERVAL=10
+
+# The number of seconds a query waits for a missing packet before moving on, as udp_debug_rx.py does.
+REORDER_WAIT=0.5
+
+# The number of bits in each block's trigram bitmap. This must be a power of 2.
+SUMMARY_BITS=8192
+
+# Summary flags: the block holds records that aren't summarised (or more than one boot's packets), so has to be read
+# whatever is being searched for; and the block's boot ID and logged times are valid, it holding at least one record.
+SUMMARY_UNINDEXED=0x01
+SUMMARY_TIMES=0x02
+
+# The characters that make the -g option a regular expression rather than plain text.
+REGEX_CHARS=re.compile(r'[\\.^$*+?{}\[\]|()]')
+
+# Block and index entry structures.
+BLOCK_MAGIC='DBGB'
+BLOCK_HEADER=struct.Struct('<4sddII')
+INDEX_ENTRY=struct.Struct('<ddQII')
+PACKET_HEADER=struct.Struct('<dH')
+SUMMARY_HEADER=struct.Struct('<IIIBH')
+SUMMARY_TOKEN=struct.Struct('<BH')
+
+def segment_name(started):
+	"""Names a segment after the time it was started, so that the segments sort into time order."""
+	return time.strftime('%Y%m%d-%H%M%S', time.localtime(started))
+
+class Writer(threading.Thread):
+	"""Compresses the blocks and writes them to the segment files, away from the receiving thread. The zlib compression
+	and file writes release the GIL, so this runs alongside the receiving."""
+
+	def __init__(self, log_dir, keep_days):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.log_dir = log_dir
+		self.keep_days = keep_days
+		self.blocks = Queue.Queue()
+		self.segments = {}
+		self.last_cleanup = 0
+
+	def run(self):
+		while True:
+			item = self.blocks.get()
+			if item is None:
+				self.blocks.task_done()
+				return
+			self.write(*item)
+			self.blocks.task_done()
+			if self.keep_days > 0 and time.time() - self.last_cleanup > SEGMENT_AGE:
+				self.cleanup()
+
+	def write(self, addr, first, last, count, packets):
+		"""Writes a block of packets to the device's current segment, starting a new segment if needed."""
+		data = zlib.compress(''.join(packets), COMPRESS_LEVEL)
+		summary = summarise(packets)
+		segment = self.segments.get(addr)
+		if segment is None or segment['size'] >= SEGMENT_SIZE or first - segment['started'] >= SEGMENT_AGE:
+			device_dir = os.path.join(self.log_dir, addr)
+			if not os.path.isdir(device_dir):
+				os.makedirs(device_dir)
+			path = os.path.join(device_dir, segment_name(first))
+			while os.path.exists(path + '.seg'):
+				path += '_'
+			segment = {'path': path, 'started': first, 'size': 0}
+			self.segments[addr] = segment
+
+		# The files are opened for each block, so that there's no limit on the number of devices from open files.
+		f = open(segment['path'] + '.seg', 'ab')
+		f.write(BLOCK_HEADER.pack(BLOCK_MAGIC, first, last, count, len(data)))
+		f.write(data)
+		f.close()
+		f = open(segment['path'] + '.idx', 'ab')
+		f.write(INDEX_ENTRY.pack(first, last, segment['size'], count, len(data)))
+		f.close()
+		f = open(segment['path'] + '.sum', 'ab')
+		f.write(summary)
+		f.close()
+		segment['size'] += BLOCK_HEADER.size + len(data)
+
+	def cleanup(self):
+		"""Deletes the segments that haven't been written to for longer than the number of days being kept."""
+		self.last_cleanup = time.time()
+		cutoff = time.time() - self.keep_days * 86400
+		for addr in os.listdir(self.log_dir):
+			device_dir = os.path.join(self.log_dir, addr)
+			for name in os.listdir(device_dir):
+				path = os.path.join(device_dir, name)
+				if name.endswith('.seg') and os.path.getmtime(path) < cutoff:
+					os.remove(path)
+					for extension in ('.idx', '.sum'):
+						if os.path.exists(path[:-4] + extension):
+							os.remove(path[:-4] + extension)
+
+def trigram_bit(trigram):
+	"""Returns the bit of the summary bitmap standing for a trigram."""
+	return zlib.crc32(trigram) & (SUMMARY_BITS - 1)
+
+def summarise(packets):
+	"""Creates the summary entry of a block, from its packets (as held while collecting, each preceded by its
+	PACKET_HEADER)."""
+	bitmap = bytearray(SUMMARY_BITS // 8)
+	tokens = set()
+	flags = 0
+	boot = None
+	first = 0
+	last = 0
+	for data in packets[1::2]:
+		header = parse_header(bytearray(data[:DATAGRAM_HEADER_LEN]))
+		if header is None or (boot is not None and header[0] != boot):
+			flags |= SUMMARY_UNINDEXED
+			continue
+		boot = header[0]
+		ii = DATAGRAM_HEADER_LEN
+		while ii + RECORD_HEADER_LEN <= len(data):
+			kind = ord(data[ii])
+			length = ord(data[ii + 1])
+			logged = struct.unpack_from('<I', data, ii + 2)[0]
+			record = data[ii + RECORD_HEADER_LEN:ii + RECORD_HEADER_LEN + length]
+			ii += RECORD_HEADER_LEN + length
+			if not flags & SUMMARY_TIMES:
+				first = logged
+				flags |= SUMMARY_TIMES
+			last = logged
+			if kind == RECORD_TEXT:
+				for jj in range(len(record) - 2):
+					bit = trigram_bit(record[jj:jj + 3])
+					bitmap[bit >> 3] |= 1 << (bit & 7)
+			elif kind == RECORD_TOKEN and len(record) >= 3:
+				tokens.add(struct.unpack_from('<BH', record))
+			else:
+				flags |= SUMMARY_UNINDEXED
+	return (SUMMARY_HEADER.pack(boot or 0, first, last, flags, len(tokens)) + str(bitmap) +
+		''.join(SUMMARY_TOKEN.pack(module, line) for module, line in sorted(tokens)))
+
+def new_device():
+	"""Creates the state kept for each device while collecting."""
+	return {'packets': [], 'size': 0, 'first': 0, 'last': 0, 'boot_id': None, 'highest': 0, 'received': 0,
+		'lost': 0, 'restarts': 0}
+
+def flush(writer, addr, device):
+	"""Passes the packets held for a device to the writer, as a block."""
+	if len(device['packets']) > 0:
+		writer.blocks.put((addr, device['first'], device['last'], len(device['packets']) / 2, device['packets']))
+		device['packets'] = []
+		device['size'] = 0
+
+def count_packet(device, data):
+	"""Keeps count of the packets received and lost from a device, going by their sequence numbers."""
+	device['received'] += 1
+	header = parse_header(bytearray(data[:DATAGRAM_HEADER_LEN]))
+	if header is None:
+		return
+	boot_id, seq = header
+	if boot_id != device['boot_id']:
+		if device['boot_id'] is not None:
+			device['restarts'] += 1
+		device['boot_id'] = boot_id
+		device['highest'] = seq
+	elif seq_before(device['highest'], seq):
+		device['lost'] += (seq - device['highest'] - 1) & 0xFFFFFFFF
+		device['highest'] = seq
+	elif device['lost'] > 0:
+		# An earlier gap has been (partly) filled.
+		device['lost'] -= 1
+
+def print_summary(devices):
+	"""Prints the number of packets received and lost from each device."""
+	print('{:<16} {:>10} {:>10} {:>8} {:>9}'.format('Device', 'Received', 'Lost', 'Loss %', 'Restarts'))
+	for addr in sorted(devices):
+		device = devices[addr]
+		total = device['received'] + device['lost']
+		print('{:<16} {:>10} {:>10} {:>8.2f} {:>9}'.format(addr, device['received'], device['lost'],
+			100.0 * device['lost'] / total if total > 0 else 0, device['restarts']))
+
+def collect(log_dir, keep_days):
+	"""Receives the debug packets, storing them in the log files, until interrupted."""
+	writer = Writer(log_dir, keep_days)
+	writer.start()
+
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, RECEIVE_BUFFER)
+	s.bind(('', PORT))
+	s.settimeout(1.0)
+	print('Collecting debug packets on port {} into {}'.format(PORT, log_dir))
+
+	devices = {}
+	next_flush = time.time() + BLOCK_AGE
+	next_stats = time.time() + STATS_INTERVAL
+	packets = 0
+	received = 0
+	try:
+		while True:
+			try:
+				data, (addr, port) = s.recvfrom(2048)
+			except socket.timeout:
+				data = None
+			now = time.time()
+
+			if data is not None:
+				device = devices.get(addr)
+				if device is None:
+					device = devices[addr] = new_device()
+				if len(device['packets']) == 0:
+					device['first'] = now
+				device['last'] = now
+				device['packets'].append(PACKET_HEADER.pack(now, len(data)))
+				device['packets'].append(data)
+				device['size'] += PACKET_HEADER.size + len(data)
+				count_packet(device, data)
+				packets += 1
+				received += len(data)
+				if device['size'] >= BLOCK_SIZE:
+					flush(writer, addr, device)
+
+			# Write out anything that's been held for long enough.
+			if now >= next_flush:
+				for addr, device in devices.items():
+					if len(device['packets']) > 0 and now - device['first'] >= BLOCK_AGE:
+						flush(writer, addr, device)
+				next_flush = now + 1.0
+
+			if now >= next_stats:
+				elapsed = now - next_stats + STATS_INTERVAL
+				lost = sum(device['lost'] for device in devices.values())
+				print('{}: {} devices, {:.0f} packets/s, {:.0f} bytes/s, {} lost in total, {} blocks queued'.format(
+					datetime.now().strftime('%Y-%m-%d %H:%M:%S'), len(devices), packets / elapsed, received / elapsed,
+					lost, writer.blocks.qsize()))
+				sys.stdout.flush()
+				packets = 0
+				received = 0
+				next_stats = now + STATS_INTERVAL
+	except KeyboardInterrupt:
+		pass
+
+	# Write out everything still held, and wait for it to be written.
+	for addr, device in devices.items():
+		flush(writer, addr, device)
+	writer.blocks.put(None)
+	writer.join()
+	print('')
+	print_summary(devices)
+
+def parse_time(value):
+	"""Parses a time given on the command line, either absolute or relative to now, into seconds since the epoch."""
+	match = re.match(r'^-(\d+(?:\.\d+)?)([smhd])$', value)
+	if match is not None:
+		return time.time() - float(match.group(1)) * {'s': 1, 'm': 60, 'h': 3600, 'd': 86400}[match.group(2)]
+	for fmt in ('%Y-%m-%d %H:%M:%S', '%Y-%m-%d %H:%M', '%Y-%m-%d'):
+		try:
+			return time.mktime(time.strptime(value, fmt))
+		except ValueError:
+			pass
+	raise ValueError('Unrecognised time: "{}"'.format(value))
+
+def read_index(path):
+	"""Reads the index of a segment, returning its entries."""
+	f = open(path, 'rb')
+	data = f.read()
+	f.close()
+	return [INDEX_ENTRY.unpack_from(data, offset) for offset in range(0, len(data) - INDEX_ENTRY.size + 1,
+		INDEX_ENTRY.size)]
+
+def read_summaries(path):
+	"""Reads the summary of each block of a segment, as (boot ID, first logged, last logged, flags, tokens, bitmap).
+	Returns an empty list for segments written before there were summaries."""
+	if not os.path.exists(path):
+		return []
+	f = open(path, 'rb')
+	data = f.read()
+	f.close()
+	summaries = []
+	ii = 0
+	while ii + SUMMARY_HEADER.size + SUMMARY_BITS // 8 <= len(data):
+		boot, first, last, flags, count = SUMMARY_HEADER.unpack_from(data, ii)
+		ii += SUMMARY_HEADER.size
+		bitmap = bytearray(data[ii:ii + SUMMARY_BITS // 8])
+		ii += SUMMARY_BITS // 8
+		tokens = [SUMMARY_TOKEN.unpack_from(data, ii + jj * SUMMARY_TOKEN.size) for jj in range(count)]
+		ii += count * SUMMARY_TOKEN.size
+		if ii > len(data):
+			break
+		summaries.append((boot, first, last, flags, tokens, bitmap))
+	return summaries
+
+def format_may_contain(fmt, text):
+	"""Whether a tokenized message's format string could produce a message containing the text, whatever its arguments.
+	Each integer conversion is taken to produce any run of digits, hex digits, signs and spaces, and %c any single
+	character."""
+	pieces = []
+	conversions = []
+	piece = ''
+	end = 0
+	for match in CONVERSION.finditer(fmt):
+		piece += fmt[end:match.start()]
+		end = match.end()
+		if match.group(3) == '%':
+			piece += '%'
+		else:
+			pieces.append(piece)
+			piece = ''
+			conversions.append(r'[\s\S]?' if match.group(3) == 'c' else r'[-+ 0-9a-fA-Fx]*')
+	pieces.append(piece + fmt[end:])
+	if any(text in piece for piece in pieces):
+		return True
+
+	# Otherwise the text has to start at the end of a piece (or in the argument after it), carrying on through the
+	# arguments and pieces that follow until it ends part way through one.
+	def prefixes(piece):
+		return '(?:' + '|'.join(re.escape(piece[:ii]) for ii in range(len(piece), -1, -1)) + ')'
+	def suffixes(piece):
+		return '(?:' + '|'.join(re.escape(piece[ii:]) for ii in range(len(piece) + 1)) + ')'
+	rest = r'\Z'
+	starts = []
+	for ii in range(len(conversions) - 1, -1, -1):
+		rest = r'(?:\Z|{}(?:{}\Z|{}{}))'.format(conversions[ii], prefixes(pieces[ii + 1]), re.escape(pieces[ii + 1]),
+			rest)
+		starts.append(suffixes(pieces[ii]) + rest)
+	return len(starts) > 0 and re.match('(?:{})'.format('|'.join(starts)), text) is not None
+
+def make_search(pattern, tokens):
+	"""Prepares to skip the blocks that can't match the -g pattern, returning None if it can't be used to skip any:
+	when it's a regular expression rather than plain text, or too short to have a trigram."""
+	if pattern is None or REGEX_CHARS.search(pattern) is not None or len(pattern) < 3:
+		return None
+	return {'text': pattern, 'bits': set(trigram_bit(pattern[ii:ii + 3]) for ii in range(len(pattern) - 2)),
+		'tokens': tokens, 'matches': {}}
+
+def block_may_match(search, summary):
+	"""Whether a block, going by its summary, could hold a message containing the text being searched for."""
+	boot, first, last, flags, tokens, bitmap = summary
+	if flags & SUMMARY_UNINDEXED:
+		return True
+	for token in tokens:
+		if token not in search['matches']:
+			# Messages the tokens file doesn't know are shown as their module, line and arguments, so could match.
+			message = search['tokens']['messages'].get('{}:{}'.format(*token))
+			search['matches'][token] = message is None or format_may_contain(message['format'], search['text'])
+		if search['matches'][token]:
+			return True
+	return all(bitmap[bit >> 3] & (1 << (bit & 7)) for bit in search['bits'])
+
+def read_packets(device_dir, start, end, search=None, skipped=None):
+	"""Reads the packets received from a device between the start and end times, in the order they were received. Only
+	the blocks covering that time are read, less those that can't match the search (from make_search). The summary of
+	each block skipped is passed to skipped, so that the device times can be kept track of."""
+	names = sorted(name[:-4] for name in os.listdir(device_dir) if name.endswith('.idx'))
+	starts = [time.mktime(time.strptime(name[:15], '%Y%m%d-%H%M%S')) for name in names]
+	for ii, name in enumerate(names):
+		# Each segment ends when the next one starts, so whole segments can be skipped. The names are only to the
+		# second, so allow for the next segment having started up to a second later than its name says.
+		if start is not None and ii + 1 < len(starts) and starts[ii + 1] + 1 <= start:
+			continue
+		if end is not None and starts[ii] >= end:
+			break
+		index = read_index(os.path.join(device_dir, name + '.idx'))
+		summaries = read_summaries(os.path.join(device_dir, name + '.sum')) if search is not None else []
+		f = open(os.path.join(device_dir, name + '.seg'), 'rb')
+		for block, (first, last, offset, count, length) in enumerate(index):
+			if (start is not None and last < start) or (end is not None and first >= end):
+				continue
+			if block < len(summaries) and not block_may_match(search, summaries[block]):
+				if skipped is not None:
+					skipped(summaries[block])
+				continue
+			f.seek(offset + BLOCK_HEADER.size)
+			data = zlib.decompress(f.read(length))
+			ii = 0
+			while ii < len(data):
+				received, packet_len = PACKET_HEADER.unpack_from(data, ii)
+				ii += PACKET_HEADER.size
+				if (start is None or received >= start) and (end is None or received < end):
+					yield received, bytearray(data[ii:ii + packet_len])
+				ii += packet_len
+		f.close()
+
+def in_order(packets):
+	"""Puts a device's packets back into the order they were sent, as udp_debug_rx.py does, waiting up to REORDER_WAIT
+	(in receive time) for any that arrived out of order."""
+	pending = []
+	boots = {}
+	for received, data in packets:
+		header = parse_header(data)
+		if header is None:
+			key = (len(boots), 0)
+		else:
+			boot_id, seq = header
+			if boot_id not in boots:
+				boots[boot_id] = (len(boots), seq)
+			boot, base = boots[boot_id]
+			key = (boot, (seq - base) & 0xFFFFFFFF)
+		heapq.heappush(pending, (key, received, data))
+		while len(pending) > 0 and pending[0][1] + REORDER_WAIT <= received:
+			yield heapq.heappop(pending)[1:]
+	while len(pending) > 0:
+		yield heapq.heappop(pending)[1:]
+
+def device_messages(addr, device_dir, start, end, tokens, symbols, search):
+	"""Decodes the messages received from a device between the start and end times. Each is preceded by the time it was
+	released by in_order, which (unlike the receive time, once the packets have been put back in order) never goes
+	backwards, so that heapq.merge can merge the devices' messages."""
+	boots = {}
+	def skipped(summary):
+		# Keep the device time going over the skipped block, so that it wrapping around isn't missed.
+		boot, first, last, flags = summary[:4]
+		if flags & SUMMARY_TIMES:
+			times = boots.setdefault(boot, {'time_base': 0, 'last_time': 0})
+			device_time(times, first)
+			device_time(times, last)
+	released = 0
+	for received, data in in_order(read_packets(device_dir, start, end, search, skipped)):
+		released = max(released, received)
+		header = parse_header(data)
+		if header is None:
+			yield released, received, addr, None, '<packet without a debug header, {} bytes>'.format(len(data))
+			continue
+		times = boots.setdefault(header[0], {'time_base': 0, 'last_time': 0})
+		for logged, text in decode_records(data, tokens, symbols):
+			yield released, received, addr, device_time(times, logged), text.rstrip('\n')
+
+def query(log_dir, tokens, symbols, addrs, start, end, pattern):
+	"""Prints the messages matching the query, from all of the devices in the order they were received (each device's
+	being put back in the order they were sent)."""
+	if addrs is None:
+		addrs = sorted(os.listdir(log_dir)) if os.path.isdir(log_dir) else []
+	search = make_search(pattern.pattern if pattern is not None else None, tokens)
+	streams = [device_messages(addr, os.path.join(log_dir, addr), start, end, tokens, symbols, search) for addr in addrs
+		if os.path.isdir(os.path.join(log_dir, addr))]
+	for released, received, addr, logged, text in heapq.merge(*streams):
+		if pattern is not None and pattern.search(text) is None:
+			continue
+		dt = datetime.fromtimestamp(received).strftime('%Y-%m-%d %H-%M-%S.%f')[:-3]
+		if logged is None:
+			print(addr, dt, text, sep=': ')
+		else:
+			print(addr, dt, '{:11.6f}'.format(logged), text, sep=': ')
+
+def usage():
+	"""Prints the usage instructions."""
+	print('Usage:')
+	print('   dbg_collector.py collect [-d <dir>] [-k <days>]')
+	print('   dbg_collector.py query [-d <dir>] [-t <tokens.json>] [-f <firmware.out> ...] [-D <IP>[,<IP> ...]]')
+	print('                          [-s <time>] [-e <time>] [-g <regex>]')
+	print('')
+	print('Where:')
+	print('   -d <dir>          the directory holding the log files.')
+	print('   -k <days>         the number of days of log files kept, or 0 to keep everything.')
+	print('   -t <tokens.json>  the format strings of the tokenized messages.')
+	print('   -f <firmware.out> a firmware image whose symbols name the code addresses in crash reports.')
+	print('   -D <IP>           only show the messages from these devices.')
+	print('   -s <time>         only show the messages received from this time on.')
+	print('   -e <time>         only show the messages received before this time.')
+	print('                     Either "YYYY-MM-DD HH:MM[:SS]", or relative to now, e.g. "-15m".')
+	print('   -g <regex>        only show the messages matching this regular expression.')
+	sys.exit(1)
+
+# Pull out the command and options from the parameters.
+if len(sys.argv) < 2 or sys.argv[1] not in ('collect', 'query'):
+	usage()
+try:
+	opts, args = getopt.gnu_getopt(sys.argv[2:], 'd:k:t:f:D:s:e:g:')
+	if len(args) > 0:
+		usage()
+	log_dir = DEFAULT_DIR
+	keep_days = 0
+	tokens_file = default_tokens_file()
+	elf_files = []
+	addrs = None
+	start = None
+	end = None
+	pattern = None
+	for opt, value in opts:
+		if opt == '-d':
+			log_dir = value
+		elif opt == '-k':
+			keep_days = float(value)
+		elif opt == '-t':
+			tokens_file = value
+		elif opt == '-f':
+			elf_files.append(value)
+		elif opt == '-D':
+			addrs = value.split(',')
+		elif opt == '-s':
+			start = parse_time(value)
+		elif opt == '-e':
+			end = parse_time(value)
+		elif opt == '-g':
+			pattern = re.compile(value)
+except (getopt.GetoptError, ValueError, re.error) as e:
+	print(e)
+	usage()
+
+if sys.argv[1] == 'collect':
+	collect(log_dir, keep_days)
+else:
+	tokens = load_tokens(tokens_file)
+	if tokens is None:
+		tokens = NO_TOKENS
+		print('No tokenized message formats in "{}", tokenized messages will not be formatted.'.format(tokens_file),
+			file=sys.stderr)
+	symbols = load_symbols(elf_files if len(elf_files) > 0 else default_elf_files())
+	try:
+		query(log_dir, tokens, symbols, addrs, start, end, pattern)
+	except IOError:
+		# Most likely the output being piped into something like head, which has finished.
+		pass
@@ -0,0 +1,228 @@
+#
+# dbg_decode.py - decoding of the UDP debug packets, shared by udp_debug_rx.py and dbg_collector.py.
+#
+
+import bisect
+import json
+import os
+import re
+import struct
+import subprocess
+
+from distutils.spawn import find_executable
+
+# The UDP port the debug packets are sent to, this must match udp_debug.h.
+PORT=65432
+
+# The packet and record headers, these must match udp_debug.h.
+DATAGRAM_MAGIC=0xDB
+DATAGRAM_HEADER_LEN=9
+RECORD_HEADER_LEN=6
+
+# Record types, these must match udp_debug.h.
+RECORD_TEXT=0x01
+RECORD_TOKEN=0x02
+RECORD_RESET=0x03
+
+# The reasons for a reset, indexed by the reason in struct rst_info (user_interface.h).
+RESET_REASONS=['power on', 'hardware watchdog', 'exception', 'software watchdog', 'software restart', 'deep sleep wake',
+	'external reset']
+
+# The Xtensa exception causes that the ESP8266 can hit.
+EXCEPTION_CAUSES={0: 'IllegalInstruction', 2: 'InstructionFetchError', 3: 'LoadStoreError', 6: 'IntegerDivideByZero',
+	9: 'LoadStoreAlignment', 20: 'InstFetchProhibited', 28: 'LoadProhibited', 29: 'StoreProhibited'}
+
+# The addresses holding code (IRAM and the flash mapped by the cache), so that return addresses can be picked out of the
+# stack.
+CODE_START=0x40100000
+CODE_END=0x40300000
+
+# Where to look for the nm that understands the ESP8266's .out files, before trying the PATH and then the host's nm.
+XTENSA_TOOLS=os.path.expanduser('~/ESP8266/esp-open-sdk/xtensa-lx106-elf/bin')
+
+# Matches a printf style conversion in a format string.
+CONVERSION=re.compile(r'%([-+ #0]*(?:\d+)?(?:\.\d+)?)(hh|h|ll|l|z)?([diouxXcp%])')
+
+def read_varint(data, ii):
+	"""Reads an unsigned LEB128 encoded value, returning it and the index after it."""
+	value = 0
+	shift = 0
+	while True:
+		byte = data[ii]
+		ii += 1
+		value |= (byte & 0x7F) << shift
+		shift += 7
+		if byte < 0x80:
+			return value & 0xFFFFFFFF, ii
+
+def format_message(fmt, args):
+	"""Formats a tokenized message as the device's os_printf would have done."""
+	args = list(args)
+	def convert(match):
+		flags, size, conversion = match.groups()
+		if conversion == '%':
+			return '%'
+		value = args.pop(0) if len(args) > 0 else 0
+		if conversion in 'di':
+			bits = 16 if size == 'h' else 8 if size == 'hh' else 32
+			value &= (1 << bits) - 1
+			if value >= 1 << (bits - 1):
+				value -= 1 << bits
+			return ('%' + flags + 'd') % value
+		elif conversion == 'c':
+			return chr(value & 0xFF)
+		elif conversion == 'p':
+			return '0x%08x' % value
+		return ('%' + flags + conversion) % value
+	return CONVERSION.sub(convert, fmt)
+
+def decode_token(data, tokens):
+	"""Decodes the data of a tokenized message record into the formatted message."""
+	module = data[0]
+	line = data[1] | (data[2] << 8)
+	args = []
+	ii = 3
+	while ii < len(data):
+		value, ii = read_varint(data, ii)
+		args.append(value)
+
+	message = tokens['messages'].get('{}:{}'.format(module, line))
+	if message is None:
+		# We don't know this message, so show where it came from at least.
+		name = tokens['modules'].get(str(module), str(module))
+		return '<{}:{} {}>\n'.format(name, line, ' '.join('{:x}'.format(arg) for arg in args))
+	return format_message(message['format'], args)
+
+def find_symbol(symbols, address):
+	"""Names the function holding a code address, as function+offset, or returns None if it isn't known."""
+	if symbols is None or address < CODE_START or address >= CODE_END:
+		return None
+	ii = bisect.bisect_right(symbols, (address, 0xFFFFFFFF, '')) - 1
+	if ii < 0:
+		return None
+	start, size, name = symbols[ii]
+	if size > 0 and address >= start + size:
+		return None
+	return '{}+0x{:x}'.format(name, address - start)
+
+def code_address(symbols, address):
+	"""Formats a code address, with the function holding it if known."""
+	name = find_symbol(symbols, address)
+	return '0x{:08x}'.format(address) + ('' if name is None else ' ({})'.format(name))
+
+def decode_reset(data, symbols):
+	"""Formats a reset record: why the device restarted, and for an exception or watchdog reset, where it was and
+	the stack at the time."""
+	count = len(data) // 4
+	values = struct.unpack('<{}I'.format(count), bytes(data[:count * 4]))
+	if count < 7:
+		return '<short reset record, {} bytes>\n'.format(len(data))
+	reason, exccause, epc1, epc2, epc3, excvaddr, depc = values[:7]
+	name = RESET_REASONS[reason] if reason < len(RESET_REASONS) else 'unknown'
+	text = '*** Reset reason {} ({}).\n'.format(reason, name)
+	if name not in ('hardware watchdog', 'exception', 'software watchdog'):
+		return text
+
+	if name == 'exception':
+		text += '    Exception {} ({}), excvaddr=0x{:08x}\n'.format(exccause, EXCEPTION_CAUSES.get(exccause, 'unknown'),
+			excvaddr)
+	text += '    epc1={}\n    epc2={}\n    epc3={}\n    depc={}\n'.format(code_address(symbols, epc1),
+		code_address(symbols, epc2), code_address(symbols, epc3), code_address(symbols, depc))
+
+	# Then the stack, if it was saved, listing anything that looks like a return address as a possible caller.
+	if count > 7:
+		sp = values[7]
+		stack = values[8:]
+		text += '    Stack at 0x{:08x}:\n'.format(sp)
+		for ii in range(0, len(stack), 4):
+			words = ' '.join('{:08x}'.format(word) for word in stack[ii:ii + 4])
+			text += '    0x{:08x}: {}\n'.format(sp + ii * 4, words)
+		callers = [word for word in stack if word >= CODE_START and word < CODE_END]
+		if len(callers) > 0:
+			text += '    Possible callers:\n'
+			for word in callers:
+				text += '    {}\n'.format(code_address(symbols, word))
+	return text
+
+def decode_records(data, tokens, symbols=None):
+	"""Splits the records from a debug packet, returning the device time and text of each. The symbols, from
+	load_symbols, are used to name the code addresses in a reset record."""
+	ii = DATAGRAM_HEADER_LEN
+	while ii + RECORD_HEADER_LEN <= len(data):
+		kind = data[ii]
+		length = data[ii + 1]
+		logged = struct.unpack('<I', bytes(data[ii + 2:ii + RECORD_HEADER_LEN]))[0]
+		record = data[ii + RECORD_HEADER_LEN:ii + RECORD_HEADER_LEN + length]
+		ii += RECORD_HEADER_LEN + length
+		if kind == RECORD_TEXT:
+			yield logged, str(record.decode('latin-1'))
+		elif kind == RECORD_TOKEN:
+			yield logged, decode_token(record, tokens)
+		elif kind == RECORD_RESET:
+			yield logged, decode_reset(record, symbols)
+		else:
+			yield logged, '<unknown record type {}>\n'.format(kind)
+
+def parse_header(data):
+	"""Returns the boot ID and sequence number of a debug packet (as a bytearray), or None if it isn't one."""
+	if len(data) < DATAGRAM_HEADER_LEN or data[0] != DATAGRAM_MAGIC:
+		return None
+	return struct.unpack('<II', bytes(data[1:DATAGRAM_HEADER_LEN]))
+
+def seq_before(a, b):
+	"""Whether sequence number a comes before b, allowing for them wrapping around."""
+	return a != b and ((b - a) & 0xFFFFFFFF) < 0x80000000
+
+def device_time(device, logged):
+	"""Converts the time a record was logged (from system_get_time) into seconds since the device started, allowing for
+	the 32-bit microsecond count wrapping around every 71 minutes."""
+	if logged < device['last_time'] and device['last_time'] - logged > 0x80000000:
+		device['time_base'] += 0x100000000
+	device['last_time'] = logged
+	return (device['time_base'] + logged) / 1000000.0
+
+def default_tokens_file():
+	"""The tokens file written by the build, alongside this script."""
+	return os.path.join(os.path.dirname(os.path.abspath(__file__)), 'build', 'dbg_tokens.json')
+
+def load_tokens(tokens_file):
+	"""Loads the format strings of the tokenized messages, returning None if the file doesn't exist. Without them, the
+	tokenized messages are shown as their module, line number and raw arguments."""
+	if not os.path.exists(tokens_file):
+		return None
+	f = open(tokens_file, 'r')
+	tokens = json.load(f)
+	f.close()
+	return tokens
+
+def nm_tool():
+	"""Finds the nm used to read the firmware's symbols."""
+	tool = os.path.join(XTENSA_TOOLS, 'xtensa-lx106-elf-nm')
+	if os.path.exists(tool):
+		return tool
+	return find_executable('xtensa-lx106-elf-nm') or 'nm'
+
+def default_elf_files():
+	"""The firmware images written by the build, alongside this script."""
+	build = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'build')
+	return [os.path.join(build, 'delta_reader.user1.out'), os.path.join(build, 'delta_reader.user2.out')]
+
+def load_symbols(elf_files):
+	"""Reads the code symbols from the firmware images that exist, returning a sorted list of address, size and name,
+	or None if there are none. Both OTA images are read, as the device could be running either."""
+	symbols = []
+	for elf_file in elf_files:
+		if not os.path.exists(elf_file):
+			continue
+		try:
+			output = subprocess.check_output([nm_tool(), '-n', '-S', '--defined-only', elf_file])
+		except (OSError, subprocess.CalledProcessError):
+			continue
+		for line in output.decode('latin-1').splitlines():
+			parts = line.split()
+			if len(parts) == 4 and parts[2] in 'tTwW':
+				symbols.append((int(parts[0], 16), int(parts[1], 16), parts[3]))
+	return sorted(set(symbols)) if len(symbols) > 0 else None
+
+# The tokens used when there's no tokens file.
+NO_TOKENS={'modules': {}, 'messages': {}}
@@ -0,0 +1,170 @@
+#!/usr/bin/env python
+#
+# dbg_loadgen.py - simulates a fleet of ESP8266s sending UDP debug packets, to measure how many a collector can keep up
+# with.
+#
+# Usage:
+#   dbg_loadgen.py [-n <devices>] [-r <rate>] [-d <seconds>] [-m <messages>] [-l <percent>] [<IP>]
+#
+# Where:
+#   -n <devices>  the number of devices simulated (default 100).
+#   -r <rate>     the number of packets sent by each device per second (default 10).
+#   -d <seconds>  how long to send for (default 30).
+#   -m <messages> the number of messages in each packet (default 8).
+#   -l <percent>  the percentage of packets deliberately not sent, to check that loss is detected (default 0).
+#   <IP>          the IP address of the collector (default 127.0.0.1).
+#
+# Each simulated device sends from its own address, 127.1.x.y, as the collector tells devices apart by their address.
+# This means that the collector has to be on the same machine, listening on the loopback interface. The packets hold
+# a mixture of tokenized messages and text, in the same format as the ESP8266 sends them. The number of packets sent
+# (and skipped) is printed every second; compare this with the collector's own statistics to find the rate it can
+# sustain.
+#
+
+import getopt
+import random
+import socket
+import struct
+import sys
+import time
+
+# The UDP port and packet format of the debug packets, these must match udp_debug.h.
+PORT=65432
+DATAGRAM_MAGIC=0xDB
+RECORD_TEXT=0x01
+RECORD_TOKEN=0x02
+
+# The defaults, unless overridden by the options.
+DEFAULT_DEVICES=100
+DEFAULT_RATE=10
+DEFAULT_DURATION=30
+DEFAULT_MESSAGES=8
+
+# The maximum number of packets sent before checking the time again.
+BATCH=1000
+
+# Text messages mixed in with the tokenized ones.
+TEXT_MESSAGES=['Received EVENT_STAMODE_GOT_IP. IP = 10.0.1.{}, mask = 255.255.255.0, gateway = 10.0.1.1\n',
+	'TCP OTA connection received from 10.0.1.{}:51234\n']
+
+def varint(value):
+	"""Encodes a value as unsigned LEB128."""
+	data = ''
+	while value >= 0x80:
+		data += chr((value & 0x7F) | 0x80)
+		value >>= 7
+	return data + chr(value)
+
+def new_device(ii):
+	"""Creates a simulated device, with its own socket bound to its own address."""
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.bind(('127.1.{}.{}'.format(ii // 250, ii % 250 + 1), 0))
+	return {'socket': s, 'boot_id': random.randint(0, 0xFFFFFFFF), 'seq': 0, 'started': time.time()}
+
+def make_packet(device, messages):
+	"""Creates the next packet from a device, holding the given number of messages."""
+	now = int((time.time() - device['started']) * 1000000) & 0xFFFFFFFF
+	packet = struct.pack('<BII', DATAGRAM_MAGIC, device['boot_id'], device['seq'])
+	for ii in range(messages):
+		if random.random() < 0.1:
+			text = random.choice(TEXT_MESSAGES).format(random.randint(2, 254))
+			packet += struct.pack('<BBI', RECORD_TEXT, len(text), now) + text
+		else:
+			# Token data: module, line number, then the arguments.
+			data = struct.pack('<BH', random.randint(1, 4), random.randint(1, 1000))
+			for arg in range(random.randint(0, 3)):
+				data += varint(random.randint(0, 0xFFFFFFFF) if random.random() < 0.2 else random.randint(0, 1000))
+			packet += struct.pack('<BBI', RECORD_TOKEN, len(data), now) + data
+	device['seq'] = (device['seq'] + 1) & 0xFFFFFFFF
+	return packet
+
+def usage():
+	"""Prints the usage instructions."""
+	print 'Usage:'
+	print '   dbg_loadgen.py [-n <devices>] [-r <rate>] [-d <seconds>] [-m <messages>] [-l <percent>] [<IP>]'
+	print ''
+	print 'Where:'
+	print '   -n <devices>  the number of devices simulated (default {}).'.format(DEFAULT_DEVICES)
+	print '   -r <rate>     the number of packets sent by each device per second (default {}).'.format(DEFAULT_RATE)
+	print '   -d <seconds>  how long to send for (default {}).'.format(DEFAULT_DURATION)
+	print '   -m <messages> the number of messages in each packet (default {}).'.format(DEFAULT_MESSAGES)
+	print '   -l <percent>  the percentage of packets deliberately not sent (default 0).'
+	print '   <IP>          the IP address of the collector (default 127.0.0.1).'
+	sys.exit(1)
+
+# Pull out any options from the parameters.
+try:
+	opts, args = getopt.gnu_getopt(sys.argv[1:], 'n:r:d:m:l:')
+	count = DEFAULT_DEVICES
+	rate = DEFAULT_RATE
+	duration = DEFAULT_DURATION
+	messages = DEFAULT_MESSAGES
+	loss = 0.0
+	for opt, value in opts:
+		if opt == '-n':
+			count = int(value)
+		elif opt == '-r':
+			rate = float(value)
+		elif opt == '-d':
+			duration = float(value)
+		elif opt == '-m':
+			messages = int(value)
+		elif opt == '-l':
+			loss = float(value) / 100
+except (getopt.GetoptError, ValueError) as e:
+	print e
+	usage()
+if len(args) > 1 or count < 1 or count > 250 * 250 or rate <= 0 or messages < 1:
+	usage()
+collector = (args[0] if len(args) > 0 else '127.0.0.1', PORT)
+
+# Send the packets, spreading the devices' packets evenly over each second.
+devices = [new_device(ii) for ii in range(count)]
+interval = 1.0 / (count * rate)
+start = time.time()
+next_report = start + 1
+sent = 0
+skipped = 0
+sent_bytes = 0
+total_sent = 0
+total_skipped = 0
+ii = 0
+while True:
+	now = time.time()
+	if now - start >= duration:
+		break
+
+	# Send the packets that are due, falling behind if we can't keep up. They're sent in batches, so that the reports
+	# still come out when we're behind.
+	due = min(int((now - start) / interval), ii + BATCH)
+	while ii < due:
+		device = devices[ii % count]
+		packet = make_packet(device, messages)
+		if loss > 0 and random.random() < loss:
+			skipped += 1
+		else:
+			device['socket'].sendto(packet, collector)
+			sent += 1
+			sent_bytes += len(packet)
+		ii += 1
+
+	if now >= next_report:
+		print '{:.0f}s: {} packets/s sent, {} bytes/s, {} skipped, {} behind'.format(now - start, sent, sent_bytes,
+			skipped, max(0, int((time.time() - start) / interval) - ii))
+		sys.stdout.flush()
+		total_sent += sent
+		total_skipped += skipped
+		sent = 0
+		skipped = 0
+		sent_bytes = 0
+		next_report += 1
+
+	# Wait for the next packet to be due, unless we're already behind.
+	if ii * interval > time.time() - start:
+		time.sleep(min(interval, 0.001))
+
+total_sent += sent
+total_skipped += skipped
+elapsed = time.time() - start
+print 'Sent {} packets from {} devices in {:.1f}s ({:.0f} packets/s), {} skipped.'.format(total_sent, count, elapsed,
+	total_sent / elapsed, total_skipped)
@@ -0,0 +1,195 @@
+#!/usr/bin/env python
+#
+# dbg_tokens.py - extracts the format strings of the tokenized debug messages (DBG_LOG, DBG_INFO and the like) from the
+# source files.
+#
+# Usage:
+#   dbg_tokens.py <tokens.json> <source.c> ...
+#
+# Where:
+#   <tokens.json>  the file to write the format strings to, for udp_debug_rx.py to format the messages with.
+#   <source.c>     the source files to search for tokenized debug messages.
+#
+# Each message is identified by its module (the DBG_MODULE defined in each source file) and the line number of the
+# DBG_LOG call. The format string is recorded against every line the call spans, as that's simpler than relying on
+# which of them the compiler uses for __LINE__.
+#
+
+import json
+import os
+import re
+import sys
+
+# The header defining the module numbers.
+HEADER=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'include', 'udp_debug.h')
+
+# The maximum number of arguments to a tokenized message, this must match udp_debug.h.
+MAX_ARGS=6
+
+# Matches the macros logging a tokenized message, capturing the level, if any.
+CALL=re.compile(r'\bDBG_(LOG|ERROR|WARN|INFO|DEBUG|TRACE)\s*\(')
+
+# Matches a printf style conversion in a format string.
+CONVERSION=re.compile(r'%[-+ #0]*(\d+|\*)?(\.\d+)?(hh|h|ll|l|z)?([diouxXcps%])')
+
+# The C escape sequences with a single character code.
+ESCAPES={'n': '\n', 'r': '\r', 't': '\t', '0': '\0', '\\': '\\', '"': '"', "'": "'", 'a': '\a', 'b': '\b', 'f': '\f',
+	'v': '\v'}
+
+def strip_comments(source):
+	"""Blanks out the comments in C source, keeping the line breaks so that the line numbers don't change."""
+	result = []
+	ii = 0
+	quote = None
+	while ii < len(source):
+		c = source[ii]
+		if quote is not None:
+			result.append(c)
+			if c == '\\':
+				result.append(source[ii + 1])
+				ii += 1
+			elif c == quote:
+				quote = None
+		elif c in '"\'':
+			quote = c
+			result.append(c)
+		elif source.startswith('//', ii):
+			end = source.find('\n', ii)
+			if end < 0:
+				end = len(source)
+			ii = end
+			continue
+		elif source.startswith('/*', ii):
+			end = source.find('*/', ii + 2)
+			end = len(source) if end < 0 else end + 2
+			result.append(''.join('\n' if ch == '\n' else ' ' for ch in source[ii:end]))
+			ii = end
+			continue
+		else:
+			result.append(c)
+		ii += 1
+	return ''.join(result)
+
+def parse_string(source, ii):
+	"""Parses a C string literal starting at the opening quote, returning its value and the index after it."""
+	value = []
+	ii += 1
+	while source[ii] != '"':
+		c = source[ii]
+		if c == '\\':
+			c = source[ii + 1]
+			ii += 2
+			if c == 'x':
+				digits = re.match(r'[0-9a-fA-F]+', source[ii:]).group(0)
+				value.append(chr(int(digits, 16) & 0xFF))
+				ii += len(digits)
+			elif c in '01234567' and re.match(r'[0-7]{1,3}', source[ii - 1:]).group(0) != '0':
+				digits = re.match(r'[0-7]{1,3}', source[ii - 1:]).group(0)
+				value.append(chr(int(digits, 8) & 0xFF))
+				ii += len(digits) - 1
+			else:
+				value.append(ESCAPES.get(c, c))
+		else:
+			value.append(c)
+			ii += 1
+	return ''.join(value), ii + 1
+
+def parse_call(source, ii):
+	"""Parses the arguments of a DBG_LOG call, starting just after the opening bracket. Returns the format string (or
+	None if it isn't a string literal), the number of arguments after it, and the index after the closing bracket."""
+	# Pull out the format string, joining up adjacent literals.
+	fmt = None
+	while True:
+		while source[ii].isspace():
+			ii += 1
+		if source[ii] != '"':
+			break
+		value, ii = parse_string(source, ii)
+		fmt = value if fmt is None else fmt + value
+
+	# Count the arguments that follow, up to the closing bracket.
+	args = 0
+	depth = 0
+	while True:
+		c = source[ii]
+		if c == '"' or c == "'":
+			end = ii + 1
+			while source[end] != c:
+				end += 2 if source[end] == '\\' else 1
+			ii = end
+		elif c == '(':
+			depth += 1
+		elif c == ')':
+			if depth == 0:
+				return fmt, args, ii + 1
+			depth -= 1
+		elif c == ',' and depth == 0:
+			args += 1
+		ii += 1
+
+def read_modules():
+	"""Reads the module numbers from the header, returning a dictionary of module name to number."""
+	f = open(HEADER, 'r')
+	modules = dict((name, int(number)) for name, number in re.findall(r'#define DBG_MODULE_(\w+) (\d+)', f.read())
+		if name != 'COUNT')
+	f.close()
+	return modules
+
+# Verify the parameters.
+if len(sys.argv) < 3:
+	print 'Usage:'
+	print '   dbg_tokens.py <tokens.json> <source.c> ...'
+	sys.exit(1)
+
+modules = read_modules()
+messages = {}
+errors = 0
+for filename in sys.argv[2:]:
+	f = open(filename, 'r')
+	source = strip_comments(f.read())
+	f.close()
+
+	# Only files defining their module can log tokenized messages.
+	match = re.search(r'#define\s+DBG_MODULE\s+DBG_MODULE_(\w+)', source)
+	calls = list(CALL.finditer(source))
+	if match is None:
+		if len(calls) > 0:
+			print '{}: DBG_LOG used without defining DBG_MODULE'.format(filename)
+			errors += 1
+		continue
+	module = modules[match.group(1)]
+
+	for call in calls:
+		first = source.count('\n', 0, call.start()) + 1
+		fmt, args, end = parse_call(source, call.end())
+		last = source.count('\n', 0, end) + 1
+		location = '{}:{}'.format(filename, first)
+
+		# Check that the message can be decoded.
+		if fmt is None:
+			print '{}: DBG_LOG format is not a string literal'.format(location)
+			errors += 1
+			continue
+		conversions = [c.group(4) for c in CONVERSION.finditer(fmt) if c.group(4) != '%']
+		if 's' in conversions:
+			print '{}: DBG_LOG can\'t send strings (%s)'.format(location)
+			errors += 1
+		if len(conversions) != args:
+			print '{}: DBG_LOG format has {} conversions, but {} arguments'.format(location, len(conversions), args)
+			errors += 1
+		if args > MAX_ARGS:
+			print '{}: DBG_LOG has more than {} arguments'.format(location, MAX_ARGS)
+			errors += 1
+
+		level = call.group(1) if call.group(1) != 'LOG' else None
+		for line in range(first, last + 1):
+			messages['{}:{}'.format(module, line)] = {'file': filename, 'line': first, 'format': fmt, 'level': level}
+
+if errors > 0:
+	sys.exit(2)
+
+# Write out the messages, along with the module names so that undecodable messages can still be placed.
+f = open(sys.argv[1], 'w')
+json.dump({'modules': dict((str(number), name) for name, number in modules.items()), 'messages': messages}, f,
+	indent=1, sort_keys=True)
+f.close()
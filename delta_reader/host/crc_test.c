@@ -0,0 +1,147 @@
+/*
+ * crc_test.c: Checks that the three ways of calculating the CRC-16 in crc.c give bit-identical results, then times
+ * each of them.
+ *
+ * Usage:
+ *   crc_test [<iterations>]
+ *
+ * Each calculation is checked against the CRC-16/ARC check value (the CRC of "123456789"), and against each other for
+ * random data of every length up to TEST_LEN_MAX, calculated in one go and continued over two blocks split at a random
+ * point. The CRC-32 is checked against its check value too. Then each CRC-16 calculation is timed over a Delta
+ * inverter sized packet and over a larger block, printing the average time per byte (in ns). Exits with 0 if every
+ * check passed.
+ *
+ * The table's entries are 16-bit when CRC16_METHOD is CRC16_TABLE_RAM and 32-bit otherwise, so the Makefile builds
+ * this once for each. The times are the host's, so they only rank the calculations; on the ESP8266 a table in flash
+ * also waits on the flash cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc.h"
+
+// The longest random data checked.
+#define TEST_LEN_MAX 512
+
+// The number of random blocks checked at each length.
+#define TEST_TRIES 16
+
+// The number of times each calculation is timed over each block, unless given on the command line.
+#define TEST_ITERATIONS 20000
+
+// The standard check data, and the check values of the CRC-16 (CRC-16/ARC) and CRC-32 over it.
+#define TEST_CHECK_DATA "123456789"
+#define TEST_CHECK_CRC16 0xBB3D
+#define TEST_CHECK_CRC32 0xCBF43926
+
+// The sizes of block timed: a typical Delta inverter reply, and a larger block.
+#define TEST_PACKET_LEN 14
+#define TEST_BLOCK_LEN 4096
+
+// A CRC-16 calculation.
+typedef uint16_t (*crc16_fn)(uint16_t crc, const uint8_t *data, uint32_t len);
+
+// The CRC-16 calculations, and their names.
+static const crc16_fn TEST_FNS[] = { calculate_crc16_bitwise, calculate_crc16_nibble, calculate_crc16_table };
+static const char *TEST_NAMES[] = { "bitwise", "nibble", "table" };
+#define TEST_FN_COUNT 3
+
+// Stops the compiler from optimising away the timed calculations.
+static volatile uint16_t test_sink;
+
+/*
+ * Returns the current time (in ns).
+ */
+static uint64_t test_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Checks every CRC-16 calculation against the bitwise one for a block of data, in one go and split at the given
+ * point. Returns whether they all agree.
+ */
+static bool test_block(const uint8_t *data, uint32_t len, uint32_t split) {
+    uint16_t expected = calculate_crc16_bitwise(0, data, len);
+    for (int ii = 0; ii < TEST_FN_COUNT; ii++) {
+        uint16_t whole = TEST_FNS[ii](0, data, len);
+        uint16_t parts = TEST_FNS[ii](TEST_FNS[ii](0, data, split), &data[split], len - split);
+        if ((whole != expected) || (parts != expected)) {
+            printf("%s: %04x (split at %u: %04x) rather than %04x for %u bytes\n", TEST_NAMES[ii], whole, split,
+                   parts, expected, len);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Times a CRC-16 calculation over a block of data, returning the average time per byte (in ns).
+ */
+static double test_time(crc16_fn fn, const uint8_t *data, uint32_t len, long iterations) {
+    uint16_t crc = 0;
+    uint64_t started = test_now_ns();
+    for (long ii = 0; ii < iterations; ii++) {
+        crc = fn(crc, data, len);
+    }
+    test_sink = crc;
+    return (double)(test_now_ns() - started) / ((double)iterations * len);
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : TEST_ITERATIONS;
+    if ((argc > 2) || (iterations <= 0)) {
+        printf("Usage:\n");
+        printf("   crc_test [<iterations>]\n");
+        return 1;
+    }
+
+    // The check values.
+    bool ok = true;
+    const uint8_t *check = (const uint8_t *)TEST_CHECK_DATA;
+    uint32_t check_len = strlen(TEST_CHECK_DATA);
+    for (int ii = 0; ii < TEST_FN_COUNT; ii++) {
+        uint16_t crc = TEST_FNS[ii](0, check, check_len);
+        if (crc != TEST_CHECK_CRC16) {
+            printf("%s: check value %04x rather than %04x\n", TEST_NAMES[ii], crc, TEST_CHECK_CRC16);
+            ok = false;
+        }
+    }
+    uint32_t crc32 = calculate_crc32(0, check, check_len);
+    if (crc32 != TEST_CHECK_CRC32) {
+        printf("crc32: check value %08x rather than %08x\n", crc32, TEST_CHECK_CRC32);
+        ok = false;
+    }
+
+    // Random data of every length, split at random points.
+    uint8_t data[TEST_BLOCK_LEN];
+    srand(1);
+    for (uint32_t len = 0; ok && (len <= TEST_LEN_MAX); len++) {
+        for (int tt = 0; ok && (tt < TEST_TRIES); tt++) {
+            for (uint32_t ii = 0; ii < len; ii++) {
+                data[ii] = rand();
+            }
+            ok = test_block(data, len, (len > 0) ? rand() % (len + 1) : 0);
+        }
+    }
+    if (!ok) {
+        return 1;
+    }
+    printf("All %d CRC-16 calculations agree for lengths 0 to %d, with the table in %s.\n", TEST_FN_COUNT,
+           TEST_LEN_MAX, (CRC16_METHOD == CRC16_TABLE_RAM) ? "RAM" : "flash");
+
+    // How long each takes.
+    for (uint32_t ii = 0; ii < TEST_BLOCK_LEN; ii++) {
+        data[ii] = rand();
+    }
+    printf("%-8s %12s %12s\n", "CRC-16", "ns/byte", "ns/byte");
+    printf("%-8s %6d bytes %6d bytes\n", "", TEST_PACKET_LEN, TEST_BLOCK_LEN);
+    for (int ii = 0; ii < TEST_FN_COUNT; ii++) {
+        double packet_ns = test_time(TEST_FNS[ii], data, TEST_PACKET_LEN, iterations * 64);
+        double block_ns = test_time(TEST_FNS[ii], data, TEST_BLOCK_LEN, iterations / 4 + 1);
+        printf("%-8s %12.2f %12.2f\n", TEST_NAMES[ii], packet_ns, block_ns);
+    }
+    return 0;
+}
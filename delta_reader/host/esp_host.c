@@ -0,0 +1,985 @@
+/*
+ * esp_host.c: Runs the firmware's modules on a Linux host, in place of the ESP8266 and its SDK.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+#include "ip_addr.h"
+#include "espconn.h"
+#include "spi_flash.h"
+#include "upgrade.h"
+#include "user_interface.h"
+#include "udp_debug.h"
+#include "esp_host.h"
+
+// The number of task priorities available to the firmware.
+#define HOST_TASK_PRIORITIES 3
+
+// The number of 4 byte blocks of RTC memory, of which only those from HOST_RTC_USER_BLOCK on can be used.
+#define HOST_RTC_BLOCKS 192
+#define HOST_RTC_USER_BLOCK 64
+
+// The maximum number of connections that can be listening for TCP connections at the same time.
+#define HOST_MAX_LISTENERS 4
+
+// The maximum number of UDP connections created with espconn_create.
+#define HOST_MAX_UDP 4
+
+// The largest UDP datagram received.
+#define HOST_UDP_MAX 2048
+
+// Stores the address used by simulated remote systems in an ip_addr structure.
+#define HOST_REMOTE_ADDR(ip) IP4_ADDR(ip, 192, 168, 1, 100)
+
+// Value marking a file saved by host_state_save ("HOST").
+#define HOST_STATE_MAGIC 0x54534F48
+
+// Structure holding a task registered with system_os_task, and the events posted to it.
+typedef struct {
+    os_task_t task;       // The task's handler, or NULL if there isn't one at this priority.
+    os_event_t *queue;    // The firmware's queue of events, used as a ring buffer.
+    uint8_t len;          // The number of events that the queue can hold.
+    uint8_t head;         // The index of the next event to be handled.
+    uint8_t count;        // The number of events waiting to be handled.
+} host_task_t;
+
+// Structure holding a TCP connection, either simulated or a real socket.
+typedef struct host_conn {
+    struct espconn conn;        // The connection passed to the firmware, which must be first.
+    esp_tcp tcp;                // The TCP specific details of the connection.
+    host_send_callback send;    // The call-back receiving what the firmware sends, if simulated.
+    int fd;                     // The socket, or -1 if simulated.
+    bool closing;               // Whether the firmware has asked for the connection to be closed.
+    bool held;                  // Whether reception is being held back.
+    uint32_t held_since;        // The system time at which reception was held back.
+    uint32_t opened;            // The system time at which the connection was opened.
+    struct host_conn *next;     // The next connection.
+} host_conn;
+
+// Structure holding what survives a reboot of the ESP8266, as saved to a file.
+typedef struct {
+    uint32_t magic;                 // HOST_STATE_MAGIC.
+    uint8_t unit;                   // The unit running.
+    uint32_t rtc[HOST_RTC_BLOCKS];  // The RTC memory.
+} host_state_t;
+
+bool host_virtual_time = false;
+bool host_verbose = false;
+uint32_t host_flash_erase_us = 0;
+uint32_t host_flash_write_us = 0;
+uint32_t host_flash_read_us = 0;
+uint32_t host_rx_call_us = 0;
+uint32_t host_rx_byte_ns = 0;
+uint8_t host_unit = UPGRADE_FW_BIN1;
+bool host_rebooted = false;
+host_stats_t host_stats;
+bool host_sockets = false;
+uint32_t host_ip = 0;
+uint16_t host_rx_max = 1460;
+uint32_t host_rx_window = 0;
+host_closed_callback host_closed = NULL;
+
+// The current debug level of each module, as set by udp_debug.c on the ESP8266.
+uint8_t dbg_levels[DBG_MODULE_COUNT] = { [0 ... DBG_MODULE_COUNT - 1] = DBG_DEFAULT_LEVEL };
+
+// The simulated system time (in us).
+LOCAL uint32_t host_time = 0;
+
+// The real time (in ns) at which the system time started, when it's not simulated.
+LOCAL uint64_t host_start_ns = 0;
+
+// The tasks registered at each priority.
+LOCAL host_task_t host_tasks[HOST_TASK_PRIORITIES];
+
+// The timers currently armed, in no particular order.
+LOCAL os_timer_t *host_timers = NULL;
+
+// The flash, only allocated once host_flash_init has been called.
+LOCAL uint8_t *host_flash = NULL;
+
+// The RTC memory.
+LOCAL uint32_t host_rtc[HOST_RTC_BLOCKS];
+
+// The flag set by system_upgrade_flag_set.
+LOCAL uint8_t host_upgrade_flag = UPGRADE_FLAG_IDLE;
+
+// The connections listening for TCP connections, and their sockets (-1 if simulated).
+LOCAL struct espconn *host_listeners[HOST_MAX_LISTENERS];
+LOCAL int host_listener_fds[HOST_MAX_LISTENERS];
+
+// The UDP connections created, their sockets (-1 if simulated), and where each last received datagram came from.
+LOCAL struct espconn *host_udp_conns[HOST_MAX_UDP];
+LOCAL int host_udp_fds[HOST_MAX_UDP];
+LOCAL remot_info host_udp_remotes[HOST_MAX_UDP];
+
+// The TCP connections that are currently open.
+LOCAL host_conn *host_conns = NULL;
+
+// The TCP port used by the next simulated remote system.
+LOCAL uint16_t host_next_port = 50000;
+
+/*
+ * Returns the current time (in ns) from the given clock.
+ */
+LOCAL uint64_t host_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the time (in us) used to measure how long the firmware spends doing something: the system time when it's
+ * simulated, otherwise the CPU time used by the host.
+ */
+LOCAL uint64_t host_busy_us() {
+    if (host_virtual_time) {
+        return host_time;
+    }
+    return host_clock_ns(CLOCK_THREAD_CPUTIME_ID) / 1000;
+}
+
+uint32 system_get_time(void) {
+    if (host_virtual_time) {
+        return host_time;
+    }
+    if (host_start_ns == 0) {
+        host_start_ns = host_clock_ns(CLOCK_MONOTONIC);
+    }
+    return (uint32_t)((host_clock_ns(CLOCK_MONOTONIC) - host_start_ns) / 1000);
+}
+
+void host_advance(uint32_t us) {
+    if (host_virtual_time) {
+        host_time += us;
+    } else if (us > 0) {
+        usleep(us);
+    }
+}
+
+void host_advance_to(uint32_t time) {
+    if (host_virtual_time && ((int32_t)(time - host_time) > 0)) {
+        host_time = time;
+    }
+}
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen) {
+    if ((prio >= HOST_TASK_PRIORITIES) || (qlen == 0)) {
+        return false;
+    }
+    host_tasks[prio].task = task;
+    host_tasks[prio].queue = queue;
+    host_tasks[prio].len = qlen;
+    host_tasks[prio].head = 0;
+    host_tasks[prio].count = 0;
+    return true;
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par) {
+    host_task_t *task = &host_tasks[prio % HOST_TASK_PRIORITIES];
+    if ((task->task == NULL) || (task->count == task->len)) {
+        return false;
+    }
+    os_event_t *event = &task->queue[(task->head + task->count) % task->len];
+    event->sig = sig;
+    event->par = par;
+    task->count++;
+    return true;
+}
+
+bool host_run_task() {
+    for (int8_t prio = HOST_TASK_PRIORITIES - 1; prio >= 0; prio--) {
+        host_task_t *task = &host_tasks[prio];
+        if (task->count > 0) {
+            os_event_t event = task->queue[task->head];
+            task->head = (task->head + 1) % task->len;
+            task->count--;
+
+            uint64_t started = host_busy_us();
+            task->task(&event);
+            host_stats.task_us += host_busy_us() - started;
+            host_stats.tasks++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Removes a timer from the list of those armed, if it's there.
+ */
+LOCAL void host_unlink_timer(os_timer_t *ptimer) {
+    for (os_timer_t **link = &host_timers; *link != NULL; link = &(*link)->timer_next) {
+        if (*link == ptimer) {
+            *link = ptimer->timer_next;
+            break;
+        }
+    }
+    ptimer->timer_next = NULL;
+}
+
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg) {
+    host_unlink_timer(ptimer);
+    ptimer->timer_func = pfunction;
+    ptimer->timer_arg = parg;
+}
+
+void os_timer_arm_us(os_timer_t *ptimer, uint32_t microseconds, bool repeat_flag) {
+    host_unlink_timer(ptimer);
+    ptimer->timer_expire = system_get_time() + microseconds;
+    ptimer->timer_period = repeat_flag ? microseconds : 0;
+    ptimer->timer_next = host_timers;
+    host_timers = ptimer;
+}
+
+void os_timer_arm(os_timer_t *ptimer, uint32_t milliseconds, bool repeat_flag) {
+    os_timer_arm_us(ptimer, milliseconds * 1000, repeat_flag);
+}
+
+void os_timer_disarm(os_timer_t *ptimer) {
+    host_unlink_timer(ptimer);
+}
+
+uint32_t host_next_timer() {
+    uint32_t now = system_get_time();
+    uint32_t next = HOST_NEVER;
+    for (os_timer_t *timer = host_timers; timer != NULL; timer = timer->timer_next) {
+        uint32_t expire = ((int32_t)(timer->timer_expire - now) < 0) ? now : timer->timer_expire;
+        if ((next == HOST_NEVER) || ((int32_t)(expire - next) < 0)) {
+            next = expire;
+        }
+    }
+    return next;
+}
+
+bool host_run_timers() {
+    bool fired = false;
+    while (true) {
+        // Find the timer that expired first, as the call-backs can arm and disarm any of them.
+        uint32_t now = system_get_time();
+        os_timer_t *expired = NULL;
+        for (os_timer_t *timer = host_timers; timer != NULL; timer = timer->timer_next) {
+            if (((int32_t)(now - timer->timer_expire) >= 0) &&
+                ((expired == NULL) || ((int32_t)(timer->timer_expire - expired->timer_expire) < 0))) {
+                expired = timer;
+            }
+        }
+        if (expired == NULL) {
+            return fired;
+        }
+
+        host_unlink_timer(expired);
+        if (expired->timer_period > 0) {
+            expired->timer_expire += expired->timer_period;
+            expired->timer_next = host_timers;
+            host_timers = expired;
+        }
+        expired->timer_func(expired->timer_arg);
+        fired = true;
+    }
+}
+
+void os_delay_us(uint16_t us) {
+    host_advance(us);
+}
+
+unsigned long os_random(void) {
+    return (unsigned long)random();
+}
+
+int os_printf(const char *format, ...) {
+    if (!host_verbose) {
+        return 0;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = vfprintf(stderr, format, args);
+    va_end(args);
+    return len;
+}
+
+/*
+ * Prints a tokenized debug message, as its module, line number and raw argument values.
+ */
+void dbg_log(uint8_t module, uint16_t line, uint8_t nargs, ...) {
+    if (!host_verbose) {
+        return;
+    }
+    fprintf(stderr, "[%10u] DBG %d:%d", system_get_time(), module, line);
+    va_list args;
+    va_start(args, nargs);
+    for (uint8_t ii = 0; ii < nargs; ii++) {
+        fprintf(stderr, " %u", va_arg(args, uint32_t));
+    }
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+uint8_t *host_flash_init() {
+    if (host_flash == NULL) {
+        host_flash = (uint8_t *)os_malloc(HOST_FLASH_SIZE);
+    }
+    os_memset(host_flash, 0xFF, HOST_FLASH_SIZE);
+    return host_flash;
+}
+
+uint8_t *host_flash_open(const char *filename) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (ftruncate(fd, HOST_FLASH_SIZE) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    uint8_t *flash = (uint8_t *)mmap(NULL, HOST_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (flash == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Anything new in the file is erased.
+    if (st.st_size < HOST_FLASH_SIZE) {
+        os_memset(&flash[st.st_size], 0xFF, HOST_FLASH_SIZE - st.st_size);
+    }
+    host_flash = flash;
+    return host_flash;
+}
+
+bool host_state_load(const char *filename) {
+    host_state_t state;
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = (fread(&state, sizeof(state), 1, f) == 1) && (state.magic == HOST_STATE_MAGIC);
+    fclose(f);
+    if (ok) {
+        host_unit = state.unit;
+        os_memcpy(host_rtc, state.rtc, sizeof(host_rtc));
+    }
+    return ok;
+}
+
+bool host_state_save(const char *filename) {
+    host_state_t state;
+    os_memset(&state, 0, sizeof(state));
+    state.magic = HOST_STATE_MAGIC;
+    state.unit = host_unit;
+    os_memcpy(state.rtc, host_rtc, sizeof(host_rtc));
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = (fwrite(&state, sizeof(state), 1, f) == 1);
+    return (fclose(f) == 0) && ok;
+}
+
+/*
+ * Models the time taken by a flash operation, which keeps the ESP8266's CPU busy.
+ */
+LOCAL void host_flash_busy(uint32_t sector_us, uint32_t len) {
+    uint32_t us = (uint32_t)(((uint64_t)sector_us * len) / SPI_FLASH_SEC_SIZE);
+    host_stats.flash_us += us;
+    host_advance(us);
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+    if ((host_flash == NULL) || ((uint32_t)(sec + 1) * SPI_FLASH_SEC_SIZE > HOST_FLASH_SIZE)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+    os_memset(&host_flash[sec * SPI_FLASH_SEC_SIZE], 0xFF, SPI_FLASH_SEC_SIZE);
+    host_stats.erases++;
+    host_flash_busy(host_flash_erase_us, SPI_FLASH_SEC_SIZE);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+    if ((host_flash == NULL) || (des_addr % 4) || (size % 4) || (des_addr > HOST_FLASH_SIZE) ||
+        (size > HOST_FLASH_SIZE - des_addr)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    // Writing can only clear bits, just as with real flash, so anything not erased first is caught.
+    const uint8_t *src = (const uint8_t *)src_addr;
+    for (uint32_t ii = 0; ii < size; ii++) {
+        host_flash[des_addr + ii] &= src[ii];
+    }
+    host_stats.written += size;
+    host_flash_busy(host_flash_write_us, size);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+    if ((host_flash == NULL) || (src_addr % 4) || (size % 4) || (src_addr > HOST_FLASH_SIZE) ||
+        (size > HOST_FLASH_SIZE - src_addr)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+    os_memcpy(des_addr, &host_flash[src_addr], size);
+    host_stats.read += size;
+    host_flash_busy(host_flash_read_us, size);
+    return SPI_FLASH_RESULT_OK;
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size) {
+    if ((src_addr < HOST_RTC_USER_BLOCK) || (src_addr * 4 + load_size > HOST_RTC_BLOCKS * 4)) {
+        return false;
+    }
+    os_memcpy(des_addr, &host_rtc[src_addr], load_size);
+    return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size) {
+    if ((des_addr < HOST_RTC_USER_BLOCK) || (des_addr * 4 + save_size > HOST_RTC_BLOCKS * 4)) {
+        return false;
+    }
+    os_memcpy(&host_rtc[des_addr], src_addr, save_size);
+    return true;
+}
+
+uint8 system_upgrade_userbin_check(void) {
+    return host_unit;
+}
+
+void system_upgrade_flag_set(uint8 flag) {
+    host_upgrade_flag = flag;
+}
+
+uint8 system_upgrade_flag_check(void) {
+    return host_upgrade_flag;
+}
+
+void system_upgrade_reboot(void) {
+    // The boot loader starts the other unit once an upgrade has finished.
+    if (host_upgrade_flag == UPGRADE_FLAG_FINISH) {
+        host_unit = (host_unit == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    }
+    host_upgrade_flag = UPGRADE_FLAG_IDLE;
+    host_rebooted = true;
+}
+
+void system_restart(void) {
+    host_rebooted = true;
+}
+
+void system_soft_wdt_feed(void) {
+}
+
+void system_timer_reinit(void) {
+}
+
+uint32 system_get_free_heap_size(void) {
+    return 40 * 1024;
+}
+
+uint8 wifi_station_get_connect_status(void) {
+    return STATION_GOT_IP;
+}
+
+/*
+ * Returns the IP address that real sockets are bound to, as in ip_addr_t.
+ */
+LOCAL uint32_t host_ip_addr() {
+    return (host_ip != 0) ? host_ip : htonl(INADDR_LOOPBACK);
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info) {
+    info->ip.addr = host_ip_addr();
+    IP4_ADDR(&info->netmask, 255, 0, 0, 0);
+    IP4_ADDR(&info->gw, 127, 0, 0, 1);
+    return true;
+}
+
+/*
+ * Returns the host connection for a connection passed to the firmware, or NULL if it isn't one.
+ */
+LOCAL host_conn *host_find_conn(struct espconn *conn) {
+    for (host_conn *hc = host_conns; hc != NULL; hc = hc->next) {
+        if (&hc->conn == conn) {
+            return hc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Creates a socket bound to the host's IP address, returning -1 if it can't be.
+ */
+LOCAL int host_bind(int type, uint16_t port) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (host_rx_window > 0) {
+        // Connections accepted from a listening socket take on its receive buffer size.
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &host_rx_window, sizeof(host_rx_window));
+    }
+    struct sockaddr_in addr;
+    os_memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = host_ip_addr();
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+sint8 espconn_accept(struct espconn *espconn) {
+    for (uint8_t ii = 0; ii < HOST_MAX_LISTENERS; ii++) {
+        if (host_listeners[ii] == NULL) {
+            host_listener_fds[ii] = -1;
+            if (host_sockets) {
+                int fd = host_bind(SOCK_STREAM, espconn->proto.tcp->local_port);
+                if ((fd < 0) || (listen(fd, HOST_MAX_LISTENERS) != 0)) {
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    return ESPCONN_ISCONN;
+                }
+                host_listener_fds[ii] = fd;
+            }
+            host_listeners[ii] = espconn;
+            espconn->state = ESPCONN_LISTEN;
+            return ESPCONN_OK;
+        }
+    }
+    return ESPCONN_MAXNUM;
+}
+
+/*
+ * Returns the index of a UDP connection created with espconn_create, or -1 if it isn't one.
+ */
+LOCAL int8_t host_find_udp(struct espconn *conn) {
+    for (uint8_t ii = 0; ii < HOST_MAX_UDP; ii++) {
+        if (host_udp_conns[ii] == conn) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+sint8 espconn_create(struct espconn *espconn) {
+    if (espconn->type != ESPCONN_UDP) {
+        return ESPCONN_ARG;
+    }
+    for (uint8_t ii = 0; ii < HOST_MAX_UDP; ii++) {
+        if (host_udp_conns[ii] == NULL) {
+            host_udp_fds[ii] = -1;
+            if (host_sockets) {
+                host_udp_fds[ii] = host_bind(SOCK_DGRAM, espconn->proto.udp->local_port);
+                if (host_udp_fds[ii] < 0) {
+                    return ESPCONN_ISCONN;
+                }
+            }
+            host_udp_conns[ii] = espconn;
+            return ESPCONN_OK;
+        }
+    }
+    return ESPCONN_MAXNUM;
+}
+
+sint8 espconn_delete(struct espconn *espconn) {
+    int8_t udp = host_find_udp(espconn);
+    if (udp >= 0) {
+        if (host_udp_fds[udp] >= 0) {
+            close(host_udp_fds[udp]);
+        }
+        host_udp_conns[udp] = NULL;
+    }
+    return ESPCONN_OK;
+}
+
+/*
+ * Sends a datagram on a UDP connection, to the remote address and port set in the connection.
+ */
+LOCAL sint8 host_udp_send(int8_t udp, uint8 *psent, uint16 length) {
+    if (host_udp_fds[udp] < 0) {
+        return ESPCONN_OK;
+    }
+    struct sockaddr_in addr;
+    os_memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(host_udp_conns[udp]->proto.udp->remote_port);
+    os_memcpy(&addr.sin_addr.s_addr, host_udp_conns[udp]->proto.udp->remote_ip, 4);
+    if (sendto(host_udp_fds[udp], psent, length, 0, (struct sockaddr *)&addr, sizeof(addr)) != length) {
+        return ESPCONN_IF;
+    }
+    return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    int8_t udp = host_find_udp(espconn);
+    if (udp >= 0) {
+        return host_udp_send(udp, psent, length);
+    }
+    host_conn *hc = host_find_conn(espconn);
+    if ((hc == NULL) || hc->closing) {
+        return ESPCONN_ARG;
+    }
+    if (hc->fd >= 0) {
+        if (send(hc->fd, psent, length, MSG_NOSIGNAL) != length) {
+            return ESPCONN_CONN;
+        }
+    } else if (hc->send != NULL) {
+        hc->send(espconn, psent, length);
+    }
+    return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn) {
+    host_conn *hc = host_find_conn(espconn);
+    if (hc == NULL) {
+        return ESPCONN_ARG;
+    }
+
+    // As with the SDK, the disconnect call-back comes later, from host_poll (or host_tcp_disconnect if simulated).
+    hc->closing = true;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length) {
+    return espconn_send(espconn, psent, length);
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb) {
+    espconn->proto.tcp->connect_callback = connect_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb) {
+    espconn->proto.tcp->disconnect_callback = discon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb) {
+    espconn->proto.tcp->reconnect_callback = recon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb) {
+    espconn->recv_callback = recv_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb) {
+    espconn->sent_callback = sent_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn *pespconn) {
+    host_conn *hc = host_find_conn(pespconn);
+    if (hc == NULL) {
+        return ESPCONN_ARG;
+    }
+    if (!hc->held) {
+        hc->held = true;
+        hc->held_since = system_get_time();
+        host_stats.holds++;
+    }
+    return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn *pespconn) {
+    host_conn *hc = host_find_conn(pespconn);
+    if (hc == NULL) {
+        return ESPCONN_ARG;
+    }
+    if (hc->held) {
+        hc->held = false;
+        host_stats.held_us += system_get_time() - hc->held_since;
+    }
+    return ESPCONN_OK;
+}
+
+sint8 espconn_get_connection_info(struct espconn *pespconn, remot_info **pcon_info, uint8 typeflags) {
+    int8_t udp = host_find_udp(pespconn);
+    if ((udp < 0) || (host_udp_fds[udp] < 0)) {
+        return ESPCONN_ARG;
+    }
+    *pcon_info = &host_udp_remotes[udp];
+    return ESPCONN_OK;
+}
+
+sint8 espconn_igmp_join(ip_addr_t *host_ip, ip_addr_t *multicast_ip) {
+    return ESPCONN_OK;
+}
+
+sint8 espconn_igmp_leave(ip_addr_t *host_ip, ip_addr_t *multicast_ip) {
+    return ESPCONN_OK;
+}
+
+/*
+ * Creates a connection accepted by a listener, with its own espconn as the SDK gives every incoming connection, and
+ * passes it to the listener's connect call-back.
+ */
+LOCAL host_conn *host_open_conn(struct espconn *listener, int fd, uint32_t remote_ip, uint16_t remote_port) {
+    host_conn *hc = (host_conn *)os_zalloc(sizeof(host_conn));
+    hc->conn.type = ESPCONN_TCP;
+    hc->conn.state = ESPCONN_CONNECT;
+    hc->conn.proto.tcp = &hc->tcp;
+    hc->tcp = *listener->proto.tcp;
+    os_memcpy(hc->tcp.remote_ip, &remote_ip, 4);
+    hc->tcp.remote_port = remote_port;
+    hc->conn.recv_callback = listener->recv_callback;
+    hc->conn.sent_callback = listener->sent_callback;
+    hc->fd = fd;
+    hc->opened = system_get_time();
+    hc->next = host_conns;
+    host_conns = hc;
+
+    if (hc->tcp.connect_callback != NULL) {
+        hc->tcp.connect_callback(&hc->conn);
+    }
+    return hc;
+}
+
+/*
+ * Passes received data to a connection's receive call-back, measuring how long it takes.
+ */
+LOCAL void host_receive(struct espconn *conn, char *data, uint16_t len) {
+    uint64_t started = host_busy_us();
+    if (host_virtual_time) {
+        host_advance(host_rx_call_us + (uint32_t)(((uint64_t)host_rx_byte_ns * len) / 1000));
+    }
+    conn->recv_callback(conn, data, len);
+    host_stats.rx_us += host_busy_us() - started;
+    host_stats.rx_calls++;
+    host_stats.rx_bytes += len;
+}
+
+/*
+ * Closes a connection, calling its disconnect call-back and freeing it.
+ */
+LOCAL void host_close_conn(host_conn *hc) {
+    if (hc->held) {
+        espconn_recv_unhold(&hc->conn);
+    }
+    for (host_conn **link = &host_conns; *link != NULL; link = &(*link)->next) {
+        if (*link == hc) {
+            *link = hc->next;
+            break;
+        }
+    }
+    if (hc->fd >= 0) {
+        close(hc->fd);
+    }
+    if (hc->tcp.disconnect_callback != NULL) {
+        hc->tcp.disconnect_callback(&hc->conn);
+    }
+    if ((hc->fd >= 0) && (host_closed != NULL)) {
+        host_closed(&hc->conn, system_get_time() - hc->opened);
+    }
+    os_free(hc);
+}
+
+struct espconn *host_tcp_connect(uint16_t port, host_send_callback send) {
+    struct espconn *listener = NULL;
+    for (uint8_t ii = 0; ii < HOST_MAX_LISTENERS; ii++) {
+        if ((host_listeners[ii] != NULL) && (host_listeners[ii]->proto.tcp->local_port == port)) {
+            listener = host_listeners[ii];
+        }
+    }
+    if (listener == NULL) {
+        return NULL;
+    }
+
+    ip_addr_t remote;
+    HOST_REMOTE_ADDR(&remote);
+    host_conn *hc = host_open_conn(listener, -1, remote.addr, host_next_port++);
+    hc->send = send;
+    return &hc->conn;
+}
+
+void host_tcp_deliver(struct espconn *conn, const uint8_t *data, uint16_t len) {
+    if (conn->recv_callback == NULL) {
+        return;
+    }
+
+    // The firmware is given its own copy, as it would be given a buffer of the TCP stack's.
+    char *copy = (char *)os_malloc(len);
+    os_memcpy(copy, data, len);
+    host_receive(conn, copy, len);
+    os_free(copy);
+}
+
+bool host_tcp_listening(uint16_t port) {
+    for (uint8_t ii = 0; ii < HOST_MAX_LISTENERS; ii++) {
+        if ((host_listeners[ii] != NULL) && (host_listeners[ii]->proto.tcp->local_port == port)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool host_tcp_held(struct espconn *conn) {
+    host_conn *hc = host_find_conn(conn);
+    return (hc != NULL) && hc->held;
+}
+
+void host_tcp_disconnect(struct espconn *conn) {
+    host_conn *hc = host_find_conn(conn);
+    if (hc != NULL) {
+        host_close_conn(hc);
+    }
+}
+
+/*
+ * Returns the connection using a socket, or NULL if there isn't one (it may have been closed by a call-back).
+ */
+LOCAL host_conn *host_find_fd(int fd) {
+    for (host_conn *hc = host_conns; hc != NULL; hc = hc->next) {
+        if (hc->fd == fd) {
+            return hc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Accepts a connection on a listening socket.
+ */
+LOCAL void host_accept(struct espconn *listener, int listen_fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd >= 0) {
+        host_open_conn(listener, fd, addr.sin_addr.s_addr, ntohs(addr.sin_port));
+    }
+}
+
+/*
+ * Reads a datagram that's arrived on a UDP connection's socket, passing it to the receive call-back.
+ */
+LOCAL void host_read_udp(int8_t udp) {
+    char *data = (char *)os_malloc(HOST_UDP_MAX);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t len = recvfrom(host_udp_fds[udp], data, HOST_UDP_MAX, MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+    if (len >= 0) {
+        struct espconn *conn = host_udp_conns[udp];
+        host_udp_remotes[udp].state = ESPCONN_NONE;
+        host_udp_remotes[udp].remote_port = ntohs(addr.sin_port);
+        os_memcpy(host_udp_remotes[udp].remote_ip, &addr.sin_addr.s_addr, 4);
+        if (conn->recv_callback != NULL) {
+            conn->recv_callback(conn, data, len);
+        }
+    }
+    os_free(data);
+}
+
+/*
+ * Reads what's arrived on a connection's socket, passing it to the receive call-back a segment at a time, or closes
+ * the connection if the remote end has.
+ */
+LOCAL void host_read(host_conn *hc) {
+    char *data = (char *)os_malloc(host_rx_max);
+    ssize_t len = recv(hc->fd, data, host_rx_max, MSG_DONTWAIT);
+    if (len > 0) {
+        if (hc->conn.recv_callback != NULL) {
+            host_receive(&hc->conn, data, len);
+        }
+    } else if ((len == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+        host_close_conn(hc);
+    }
+    os_free(data);
+}
+
+void host_poll(uint32_t timeout_us) {
+    // Close whatever the firmware has finished with first.
+    host_conn *hc = host_conns;
+    while (hc != NULL) {
+        host_conn *next = hc->next;
+        if (hc->closing) {
+            host_close_conn(hc);
+            timeout_us = 0;
+        }
+        hc = next;
+    }
+
+    // Wait on the listening and UDP sockets, and the connections that aren't being held back.
+    uint16_t count = HOST_MAX_LISTENERS + HOST_MAX_UDP;
+    for (hc = host_conns; hc != NULL; hc = hc->next) {
+        count++;
+    }
+    struct pollfd *fds = (struct pollfd *)os_zalloc(count * sizeof(struct pollfd));
+    uint16_t nfds = 0;
+    for (uint8_t ii = 0; ii < HOST_MAX_LISTENERS; ii++) {
+        if ((host_listeners[ii] != NULL) && (host_listener_fds[ii] >= 0)) {
+            fds[nfds].fd = host_listener_fds[ii];
+            fds[nfds++].events = POLLIN;
+        }
+    }
+    uint16_t first_udp = nfds;
+    for (uint8_t ii = 0; ii < HOST_MAX_UDP; ii++) {
+        if ((host_udp_conns[ii] != NULL) && (host_udp_fds[ii] >= 0)) {
+            fds[nfds].fd = host_udp_fds[ii];
+            fds[nfds++].events = POLLIN;
+        }
+    }
+    uint16_t first_conn = nfds;
+    for (hc = host_conns; hc != NULL; hc = hc->next) {
+        if ((hc->fd >= 0) && (!hc->held)) {
+            fds[nfds].fd = hc->fd;
+            fds[nfds++].events = POLLIN;
+        }
+    }
+    if (poll(fds, nfds, (timeout_us + 999) / 1000) > 0) {
+        for (uint16_t ii = 0; ii < nfds; ii++) {
+            if (fds[ii].revents == 0) {
+                continue;
+            } else if ((ii >= first_udp) && (ii < first_conn)) {
+                for (uint8_t jj = 0; jj < HOST_MAX_UDP; jj++) {
+                    if ((host_udp_conns[jj] != NULL) && (host_udp_fds[jj] == fds[ii].fd)) {
+                        host_read_udp(jj);
+                    }
+                }
+            } else if (ii < first_conn) {
+                for (uint8_t jj = 0; jj < HOST_MAX_LISTENERS; jj++) {
+                    if ((host_listeners[jj] != NULL) && (host_listener_fds[jj] == fds[ii].fd)) {
+                        host_accept(host_listeners[jj], fds[ii].fd);
+                    }
+                }
+            } else if (((hc = host_find_fd(fds[ii].fd)) != NULL) && (!hc->held) && (!hc->closing)) {
+                host_read(hc);
+            }
+        }
+    }
+    os_free(fds);
+}
+
+void host_close_sockets() {
+    for (uint8_t ii = 0; ii < HOST_MAX_LISTENERS; ii++) {
+        if ((host_listeners[ii] != NULL) && (host_listener_fds[ii] >= 0)) {
+            close(host_listener_fds[ii]);
+            host_listener_fds[ii] = -1;
+        }
+    }
+    for (uint8_t ii = 0; ii < HOST_MAX_UDP; ii++) {
+        if ((host_udp_conns[ii] != NULL) && (host_udp_fds[ii] >= 0)) {
+            close(host_udp_fds[ii]);
+            host_udp_fds[ii] = -1;
+        }
+    }
+    for (host_conn *hc = host_conns; hc != NULL; hc = hc->next) {
+        if (hc->fd >= 0) {
+            close(hc->fd);
+            hc->fd = -1;
+        }
+    }
+}
@@ -0,0 +1,201 @@
+/*
+ * esp_host.h: Runs the firmware's modules on a Linux host, in place of the ESP8266 and its SDK.
+ *
+ * The SDK's tasks, timers, flash, RTC memory and upgrade functions are provided here, along with espconn connections.
+ * These are either simulated (driven by the host program calling host_tcp_connect and host_tcp_deliver), or with
+ * host_sockets set, real sockets on the host (driven by the host program calling host_poll). The flash can be kept in a
+ * file, and what survives a reboot (the unit running, and the RTC memory) saved and loaded, so that a host program can
+ * restart itself just as the ESP8266 reboots. Real UDP connections receive whatever is sent to their port, but
+ * multicast group membership isn't modelled: something standing in for the group has to forward datagrams to them.
+ *
+ * Time is either real, or simulated: with host_virtual_time set, the system time only moves on when the host program
+ * moves it on, or when an operation that takes time on the ESP8266 (a flash erase, say) is modelled. The host program
+ * is then in full control of the order in which things happen, so that timings can be measured without hardware.
+ */
+#ifndef _ESP_HOST_H
+#define _ESP_HOST_H
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "espconn.h"
+#include "spi_flash.h"
+#include "user_interface.h"
+
+// The number of bytes of flash on the simulated ESP8266.
+#define HOST_FLASH_SIZE (4 * 1024 * 1024)
+
+// The value returned by host_next_timer when no timer is armed.
+#define HOST_NEVER 0xFFFFFFFF
+
+// Structure holding what's been measured while running, all times being in microseconds.
+typedef struct {
+    uint32_t rx_calls;  // The number of receive call-backs made.
+    uint64_t rx_bytes;  // The number of bytes passed to the receive call-backs.
+    uint64_t rx_us;     // The time spent in the receive call-backs.
+    uint32_t tasks;     // The number of task events handled.
+    uint64_t task_us;   // The time spent handling task events.
+    uint32_t erases;    // The number of flash sectors erased.
+    uint64_t written;   // The number of bytes written to flash.
+    uint64_t read;      // The number of bytes read from flash.
+    uint64_t flash_us;  // The time spent erasing, writing and reading flash (only if modelled).
+    uint32_t holds;     // The number of times reception was held.
+    uint64_t held_us;   // The time for which reception was held.
+} host_stats_t;
+
+// Flag as to whether the system time is simulated, rather than real.
+extern bool host_virtual_time;
+
+// Flag as to whether debug output (os_printf and the DBG_ macros) is printed to stderr.
+extern bool host_verbose;
+
+// The time (in us) taken to erase a flash sector, write a sector's worth of bytes, and read a sector's worth of bytes.
+// These are zero (not modelled) unless set by the host program.
+extern uint32_t host_flash_erase_us;
+extern uint32_t host_flash_write_us;
+extern uint32_t host_flash_read_us;
+
+// The time taken by each receive call-back on the ESP8266 as well as that of what it calls: a fixed time (in us) for
+// each call, plus a time (in ns) for each byte received. Only used with simulated time.
+extern uint32_t host_rx_call_us;
+extern uint32_t host_rx_byte_ns;
+
+// The unit currently running (UPGRADE_FW_BIN1 or UPGRADE_FW_BIN2).
+extern uint8_t host_unit;
+
+// Flag as to whether system_upgrade_reboot has been called since the host program last cleared it.
+extern bool host_rebooted;
+
+// What's been measured since the host program last cleared it.
+extern host_stats_t host_stats;
+
+// Flag as to whether connections are real sockets on the host, rather than simulated. This must be set before the
+// firmware starts listening.
+extern bool host_sockets;
+
+// The IP address (as in ip_addr_t) that real sockets are bound to, and that wifi_get_ip_info reports. Zero for
+// 127.0.0.1.
+extern uint32_t host_ip;
+
+// The most bytes passed to each receive call-back from a real socket, as the TCP stack passes on a segment at a time.
+extern uint16_t host_rx_max;
+
+// The receive buffer size of real sockets, standing in for the TCP receive window, or zero for the host's default.
+extern uint32_t host_rx_window;
+
+/*
+ * Call-back through which the host program hears of a real connection closing, once the firmware has. It's given how
+ * long (in us) the connection was open.
+ */
+typedef void (*host_closed_callback)(struct espconn *conn, uint32_t open_us);
+
+// The call-back told of real connections closing, if any.
+extern host_closed_callback host_closed;
+
+/*
+ * Sets up the flash, erased to 0xFF.
+ *
+ * @return The flash, HOST_FLASH_SIZE bytes, which the host program may fill directly.
+ */
+uint8_t *host_flash_init();
+
+/*
+ * Sets up the flash in a file, so that it's kept between runs. The file is created, erased to 0xFF, if it doesn't
+ * exist.
+ *
+ * @return The flash, HOST_FLASH_SIZE bytes, or NULL if the file can't be used.
+ */
+uint8_t *host_flash_open(const char *filename);
+
+/*
+ * Loads what survives a reboot of the ESP8266 (the unit running, and the RTC memory) from a file saved by
+ * host_state_save. Nothing is loaded if the file doesn't exist, as if the ESP8266 had just been powered up.
+ *
+ * @return Whether the state was loaded.
+ */
+bool host_state_load(const char *filename);
+
+/*
+ * Saves what survives a reboot of the ESP8266 to a file, to be loaded once the host program has restarted.
+ *
+ * @return Whether the state was saved.
+ */
+bool host_state_save(const char *filename);
+
+/*
+ * Moves the system time on, as if the CPU was busy for that long. Real time is unaffected.
+ */
+void host_advance(uint32_t us);
+
+/*
+ * Moves the simulated system time on to the given time, if it's later. Real time is unaffected.
+ */
+void host_advance_to(uint32_t time);
+
+/*
+ * Handles a single posted task event, the highest priority first.
+ *
+ * @return Whether there was an event to handle.
+ */
+bool host_run_task();
+
+/*
+ * Fires any timers that have expired.
+ *
+ * @return Whether any timer fired.
+ */
+bool host_run_timers();
+
+/*
+ * The system time at which the next timer expires, or HOST_NEVER if none are armed.
+ */
+uint32_t host_next_timer();
+
+/*
+ * Call-back through which the host program receives whatever is sent on a simulated connection.
+ */
+typedef void (*host_send_callback)(struct espconn *conn, const uint8_t *data, uint16_t len);
+
+/*
+ * Simulates an incoming TCP connection, passing it to the call-back registered on the connection listening to the
+ * port.
+ *
+ * @param port The TCP port connected to.
+ * @param send The call-back receiving what the firmware sends on the new connection.
+ * @return The new connection, or NULL if nothing is listening to the port.
+ */
+struct espconn *host_tcp_connect(uint16_t port, host_send_callback send);
+
+/*
+ * Passes received data to a simulated connection's receive call-back, as a single TCP segment.
+ */
+void host_tcp_deliver(struct espconn *conn, const uint8_t *data, uint16_t len);
+
+/*
+ * Whether the firmware is listening for TCP connections on a port.
+ */
+bool host_tcp_listening(uint16_t port);
+
+/*
+ * Whether reception on a connection is currently being held back with espconn_recv_hold.
+ */
+bool host_tcp_held(struct espconn *conn);
+
+/*
+ * Simulates the remote end closing a connection, calling its disconnect call-back and freeing it.
+ */
+void host_tcp_disconnect(struct espconn *conn);
+
+/*
+ * Waits for activity on the real sockets, accepting connections, passing received data to the receive call-backs and
+ * closing connections, until there's been some or the time runs out.
+ *
+ * @param timeout_us The longest time (in us) to wait.
+ */
+void host_poll(uint32_t timeout_us);
+
+/*
+ * Closes all of the real sockets, without calling any call-backs, as the ESP8266 drops everything when it reboots.
+ */
+void host_close_sockets();
+
+#endif
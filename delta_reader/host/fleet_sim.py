@@ -0,0 +1,209 @@
+#!/usr/bin/env python
+#
+# fleet_sim.py - multicast upgrades a simulated fleet of ESP8266s with udp_flash.py, losing datagrams at random, and
+# reports how long each fleet size takes.
+#
+# Usage:
+#   fleet_sim.py [-n <sizes>] [-l <loss>] [-s <bytes>]
+#
+# Where:
+#   -n <sizes>  the fleet sizes to try, separated by commas (default 1,2,4,8).
+#   -l <loss>   the chance of each datagram being lost, on its way to each device and back (default 0.05).
+#   -s <bytes>  the length of the images sent (default 65536).
+#
+# Each device is a build/ota_server listening on its own loopback address (127.0.1.1, 127.0.1.2, ...), with its flash
+# in a temporary file that starts out running an old image from user1.bin's unit. There's no multicast on the loopback
+# interface, so a hub stands in for the group: udp_flash.py sends it the multicast datagrams with -g, and it forwards
+# each one to every device, and their replies back, losing each datagram (independently for each device) with the
+# given chance. Datagrams sent to a device directly aren't lost.
+#
+# Once udp_flash.py is done and the devices have rebooted, it's run again without any devices, as when repairing
+# others, so that both images are announced and sent to the group again. Each device must then be running the new
+# user2.bin, having ignored the user1.bin built from the same firmware, with the old image it would roll back to left
+# intact.
+#
+import getopt
+import os
+import random
+import select
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+# The directory holding this script, the server standing in for each device below it and udp_flash.py above it.
+HOST_DIR = os.path.dirname(os.path.abspath(__file__))
+SERVER = os.path.join(HOST_DIR, 'build', 'ota_server')
+UDP_FLASH = os.path.join(os.path.dirname(HOST_DIR), 'udp_flash.py')
+
+# The UDP port the devices listen to, this must match tcp_ota.c.
+PORT = 65057
+
+# The flash address of each unit's image, these must match tcp_ota.c.
+FIRMWARE_SIZE = 503808
+UNIT_BASES = [4 * 1024, 4 * 1024 + FIRMWARE_SIZE + 16 * 1024 + 4 * 1024]
+
+# The start of a firmware image, the rest being random.
+IMAGE_HEADER = '\xEA\x04\x00\x00\x00\x00\x10\x40\x00\x00\x00\x00'
+
+# The number of seconds to wait for a device to start, and for the devices to reboot into new firmware and confirm its
+# health.
+START_TIMEOUT = 5
+REBOOT_WAIT = 3.5
+
+class Hub(threading.Thread):
+	"""Stands in for the multicast group, forwarding datagrams between the flasher and the devices and losing some.
+	Each device is sent datagrams from a socket on its own address, so that what the hub forwards back to the flasher
+	appears to come from the device."""
+	def __init__(self, addresses, loss):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.loss = loss
+		self.rand = random.Random(1)
+		self.group = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+		self.group.bind(('127.0.0.1', 0))
+		self.port = self.group.getsockname()[1]
+		self.devices = {}
+		for address in addresses:
+			s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+			s.bind((address, 0))
+			self.devices[s] = address
+		self.flasher = None
+		self.stopping = False
+
+	def run(self):
+		sockets = [self.group] + self.devices.keys()
+		while not self.stopping:
+			for s in select.select(sockets, [], [], 0.1)[0]:
+				data, sender = s.recvfrom(2048)
+				if s == self.group:
+					self.flasher = sender
+					for device, address in self.devices.items():
+						if self.rand.random() >= self.loss:
+							device.sendto(data, (address, PORT))
+				elif self.flasher and self.rand.random() >= self.loss:
+					s.sendto(data, self.flasher)
+
+def random_image(rand, size):
+	"""Returns a random image that tcp_ota.c accepts."""
+	return IMAGE_HEADER + ''.join(chr(rand.getrandbits(8)) for ii in xrange(size - len(IMAGE_HEADER)))
+
+def start_device(directory, address, old_image):
+	"""Starts a device running the old image from user1.bin's unit, returning its process once it's listening."""
+	flash = os.path.join(directory, address + '.flash')
+	with open(flash, 'wb') as f:
+		f.write('\xFF' * UNIT_BASES[0] + old_image)
+	log = os.path.join(directory, address + '.log')
+	process = subprocess.Popen([SERVER, '-i', address, '-f', flash], stdout=open(log, 'w'), stderr=subprocess.STDOUT)
+	deadline = time.time() + START_TIMEOUT
+	while time.time() < deadline:
+		with open(log) as f:
+			if 'listening' in f.read():
+				return process
+		time.sleep(0.05)
+	process.kill()
+	raise IOError('{}: ota_server failed to start'.format(address))
+
+def udp_flash(directory, port, addresses):
+	"""Runs udp_flash.py through the hub, returning its exit code and output."""
+	process = subprocess.Popen([sys.executable, UDP_FLASH, '-g', '127.0.0.1:{}'.format(port),
+		os.path.join(directory, 'user1.bin'), os.path.join(directory, 'user2.bin')] + addresses,
+		stdout=subprocess.PIPE)
+	output = process.communicate()[0]
+	return process.returncode, output
+
+def check_device(directory, address, old_image, images):
+	"""Returns what's wrong with a device once it has been upgraded, or None if it's running the new user2.bin with
+	the old image kept to roll back to."""
+	with open(os.path.join(directory, address + '.flash'), 'rb') as f:
+		flash = f.read()
+	try:
+		with open(os.path.join(directory, address + '.flash.state'), 'rb') as f:
+			unit = ord(f.read()[4])
+	except (IOError, IndexError):
+		return 'never rebooted'
+	if unit != 1:
+		return 'running unit {}'.format(unit)
+	if flash[UNIT_BASES[1]:UNIT_BASES[1] + len(images[1])] != images[1]:
+		return 'user2.bin not flashed'
+	if flash[UNIT_BASES[0]:UNIT_BASES[0] + len(old_image)] != old_image:
+		return 'rollback image overwritten'
+	return None
+
+def run_fleet(size, loss, images, old_image):
+	"""Upgrades a fleet of the given size, printing how it went. Returns whether every device was upgraded."""
+	directory = tempfile.mkdtemp()
+	addresses = ['127.0.1.{}'.format(ii + 1) for ii in range(size)]
+	devices = []
+	hub = None
+	try:
+		for address in addresses:
+			devices.append(start_device(directory, address, old_image))
+		hub = Hub(addresses, loss)
+		hub.start()
+		for ii in range(2):
+			with open(os.path.join(directory, 'user{}.bin'.format(ii + 1)), 'wb') as f:
+				f.write(images[ii])
+
+		started = time.time()
+		code, output = udp_flash(directory, hub.port, addresses)
+		elapsed = time.time() - started
+		sent = 0
+		for line in output.splitlines():
+			if 'bytes sent' in line:
+				sent = int(line.split(', ')[1].split()[0])
+
+		# Give the devices time to reboot, then make sure the images being sent again don't start them off again.
+		time.sleep(REBOOT_WAIT)
+		udp_flash(directory, hub.port, [])
+		time.sleep(REBOOT_WAIT)
+		problems = [(address, check_device(directory, address, old_image, images)) for address in addresses]
+		problems = ['{}: {}'.format(address, problem) for address, problem in problems if problem]
+		print '{:>6} {:>8.1f} {:>8} {:>10} {:>10}  {}'.format(size, elapsed,
+			len([line for line in output.splitlines() if line.startswith('Round')]), sent,
+			'OK' if code == 0 and not problems else 'FAILED', ', '.join(problems))
+		sys.stdout.flush()
+		return code == 0 and not problems
+	finally:
+		if hub:
+			hub.stopping = True
+			hub.join()
+		for device in devices:
+			device.kill()
+			device.wait()
+		shutil.rmtree(directory)
+
+def usage():
+	print 'Usage:'
+	print '   fleet_sim.py [-n <sizes>] [-l <loss>] [-s <bytes>]'
+	sys.exit(1)
+
+try:
+	opts, args = getopt.getopt(sys.argv[1:], 'n:l:s:')
+except getopt.GetoptError:
+	usage()
+sizes = [1, 2, 4, 8]
+loss = 0.05
+image_size = 65536
+for opt, value in opts:
+	if opt == '-n':
+		sizes = [int(size) for size in value.split(',')]
+	elif opt == '-l':
+		loss = float(value)
+	elif opt == '-s':
+		image_size = int(value)
+if args or image_size <= len(IMAGE_HEADER) or image_size > FIRMWARE_SIZE:
+	usage()
+
+rand = random.Random(1)
+old_image = random_image(rand, image_size)
+images = [random_image(rand, image_size) for ii in range(2)]
+print '{:>6} {:>8} {:>8} {:>10} {:>10}'.format('Fleet', 'Secs', 'Rounds', 'Bytes', 'Result')
+failed = False
+for size in sizes:
+	if not run_fleet(size, loss, images, old_image):
+		failed = True
+sys.exit(1 if failed else 0)
@@ -0,0 +1,124 @@
+/*
+ * heatshrink_test.c: Decodes a heatshrink compressed file with heatshrink.c, checking the result against the original.
+ *
+ * Usage:
+ *   heatshrink_test <compressed> <original>
+ *
+ * The compressed bytes are fed to the decoder in blocks of random sizes, and the output call-back suspends decoding
+ * at random points (as tcp_ota.c does at a patch copy operation), so that every way of splitting the input and output
+ * is exercised. Exits with 0 if the decoded bytes match the original.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink.h"
+
+// The largest block of compressed bytes passed to the decoder at once, a full TCP window's worth.
+#define TEST_BLOCK_MAX 5840
+
+// The most empty blocks passed to the decoder at the end, to flush out what it has decoded.
+#define TEST_FLUSH_TRIES 1000
+
+// Structure holding what's expected of the decoder's output.
+typedef struct {
+    const uint8_t *original;  // The bytes that were compressed.
+    size_t len;               // The number of bytes that were compressed.
+    size_t decoded;           // The number of bytes passed to the output call-back so far.
+    uint32_t suspends;        // The number of times decoding has been suspended.
+    int mismatch;             // Whether a decoded byte didn't match the original.
+} test_output_t;
+
+/*
+ * Reads a whole file, returning NULL if it can't be read.
+ */
+static uint8_t *test_read_file(const char *filename, size_t *len) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(*len + 1);
+    if (fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * Checks decoded bytes against the original, using only some of them now and then.
+ */
+static uint32_t test_output_cb(void *arg, const uint8_t *data, uint32_t len) {
+    test_output_t *out = (test_output_t *)arg;
+    uint32_t used = len;
+    if ((rand() % 8) == 0) {
+        used = rand() % len;
+        out->suspends++;
+    }
+    if ((out->decoded + used > out->len) || memcmp(data, &out->original[out->decoded], used)) {
+        out->mismatch = 1;
+        return HEATSHRINK_ABANDON;
+    }
+    out->decoded += used;
+    return used;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage:\n");
+        printf("   heatshrink_test <compressed> <original>\n");
+        return 1;
+    }
+
+    size_t compressed_len;
+    test_output_t out;
+    memset(&out, 0, sizeof(out));
+    uint8_t *compressed = test_read_file(argv[1], &compressed_len);
+    uint8_t *original = test_read_file(argv[2], &out.len);
+    if ((compressed == NULL) || (original == NULL)) {
+        printf("%s: can't be read\n", (compressed == NULL) ? argv[1] : argv[2]);
+        return 2;
+    }
+    out.original = original;
+    srand(compressed_len);
+
+    heatshrink_decoder hsd;
+    heatshrink_decoder_init(&hsd, test_output_cb, &out);
+    size_t pos = 0;
+    uint32_t blocks = 0;
+    while ((pos < compressed_len) && (!out.mismatch)) {
+        size_t block = 1 + rand() % TEST_BLOCK_MAX;
+        if (block > compressed_len - pos) {
+            block = compressed_len - pos;
+        }
+
+        // Keep passing on what's left of the block while the output call-back suspends decoding, as tcp_ota.c does
+        // once the copy operation it suspended for is done.
+        while ((block > 0) && (!out.mismatch)) {
+            uint32_t used = heatshrink_decode(&hsd, &compressed[pos], block);
+            if (used == HEATSHRINK_ABANDON) {
+                break;
+            }
+            pos += used;
+            block -= used;
+        }
+        blocks++;
+    }
+
+    // Anything decoded but not yet used is passed on with empty blocks, which the output call-back may still suspend.
+    for (uint32_t ii = 0; (ii < TEST_FLUSH_TRIES) && (!out.mismatch) && (out.decoded < out.len); ii++) {
+        if (heatshrink_decode(&hsd, NULL, 0) == HEATSHRINK_ABANDON) {
+            break;
+        }
+    }
+
+    int ok = (!out.mismatch) && (out.decoded == out.len);
+    printf("%-8s %8zu -> %8zu bytes in %u blocks, %u suspends%s\n", ok ? "OK" : "FAILED", compressed_len, out.decoded,
+           blocks, out.suspends, out.mismatch ? ", mismatched" : "");
+    free(compressed);
+    free(original);
+    return ok ? 0 : 3;
+}
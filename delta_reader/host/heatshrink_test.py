@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+#
+# heatshrink_test.py - checks that heatshrink.c decodes whatever tcp_flash.py's compressor produces.
+#
+# Usage:
+#   heatshrink_test.py [<file> ...]
+#
+# Where:
+#   <file>  further files (firmware images, say) to round-trip, as well as the built in test data.
+#
+# Each case is compressed with tcp_flash.heatshrink_compress, then decoded by build/heatshrink_test, which feeds the
+# decoder in random blocks and suspends it at random points. Exits with 0 if every case decodes to the original.
+#
+import os
+import random
+import subprocess
+import sys
+
+# The directory holding this script, the host programs being built below it and tcp_flash.py above it.
+HOST_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HOST_DIR))
+import tcp_flash
+
+# The program decoding each case, and the directory the files passed to it are written to.
+BUILD_DIR = os.path.join(HOST_DIR, 'build')
+DECODER = os.path.join(BUILD_DIR, 'heatshrink_test')
+
+def test_cases():
+	"""Returns the built in test data, as (name, data) pairs, covering literals, back-references that overlap the
+	bytes they produce, the longest back-references and the furthest offsets."""
+	rand = random.Random(1)
+	text = ' '.join(rand.choice(['inverter', 'voltage', 'current', 'power', 'energy', '0', '1', '230.4', '{}'])
+		for ii in xrange(20000))
+	image = bytearray(rand.getrandbits(8) for ii in xrange(65536))
+	for ii in xrange(0, len(image), 1024):
+		# Runs of code and tables repeat throughout a firmware image, at all distances.
+		length = rand.randint(1, 200)
+		start = rand.randint(0, max(0, ii - 2048))
+		image[ii:ii + length] = image[start:start + length]
+	return [
+		('empty', ''),
+		('single byte', 'A'),
+		('short text', 'Hello, inverter.\r\n'),
+		('zeroes', '\0' * 65536),
+		('repeated', 'abc' * 10000),
+		('window apart', ''.join(chr(ii & 0xFF) for ii in xrange(1024)) * 8),
+		('random', str(bytearray(rand.getrandbits(8) for ii in xrange(16384)))),
+		('text', text),
+		('image-like', str(image)),
+	]
+
+def run_case(name, data):
+	"""Round-trips a single case, returning True if it decodes to the original."""
+	original = os.path.join(BUILD_DIR, 'heatshrink_test.orig')
+	compressed = os.path.join(BUILD_DIR, 'heatshrink_test.hs')
+	with open(original, 'wb') as f:
+		f.write(data)
+	with open(compressed, 'wb') as f:
+		f.write(tcp_flash.heatshrink_compress(data))
+	process = subprocess.Popen([DECODER, compressed, original], stdout=subprocess.PIPE)
+	output = process.communicate()[0].strip()
+	os.remove(original)
+	os.remove(compressed)
+	print '{:<24} {}'.format(name, output)
+	return process.returncode == 0
+
+cases = test_cases()
+for filename in sys.argv[1:]:
+	with open(filename, 'rb') as f:
+		cases.append((os.path.basename(filename), f.read()))
+
+failed = 0
+for name, data in cases:
+	if not run_case(name, data):
+		failed += 1
+print '{} of {} cases passed'.format(len(cases) - failed, len(cases))
+sys.exit(1 if failed > 0 else 0)
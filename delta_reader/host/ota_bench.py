@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+#
+# ota_bench.py - measures tcp_ota.c's throughput, and the CPU time spent in its receive call-back, over real TCP at a
+# range of TCP segment sizes.
+#
+# Usage:
+#   ota_bench.py [-s <sizes>] [-e <us>] [-p <us>] [-R <us>] [<image>]
+#
+# Where:
+#   -s <sizes>  the segment sizes to try, separated by commas (default 1,16,64,256,536,1024,1460).
+#   -e <us>     the time taken to erase a flash sector, passed on to ota_server (default 0).
+#   -p <us>     the time taken to write a sector's worth of bytes to flash, passed on to ota_server (default 0).
+#   -R <us>     the time taken to read a sector's worth of bytes from flash, passed on to ota_server (default 0).
+#   <image>     the firmware image to send. If none is given, a random image of the largest size is sent.
+#
+# For each segment size, build/ota_server is started afresh with its flash in a temporary file, and passes what arrives
+# to tcp_ota.c at most that many bytes at a time, as the ESP8266's TCP stack would with that MSS. The image is sent in
+# segment sized writes, with Nagle's algorithm off. The time is taken from tcp_ota.c asking for the image to its
+# reporting success, and the call-back figures are those ota_server reports once the connection has closed.
+#
+# The flash times default to zero, so that the figures reflect tcp_ota.c's own work rather than waiting on the flash.
+#
+import getopt
+import os
+import random
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# The directory holding this script, and the server being benchmarked below it.
+HOST_DIR = os.path.dirname(os.path.abspath(__file__))
+SERVER = os.path.join(HOST_DIR, 'build', 'ota_server')
+
+# The TCP port that tcp_ota.c listens to.
+PORT = 65056
+
+# The segment sizes tried unless overridden with -s, from the smallest possible to a full Ethernet MSS.
+DEFAULT_SIZES = [1, 16, 64, 256, 536, 1024, 1460]
+
+# The largest firmware image, this must match ESP_FLASH_MAX in the firmware's Makefile.
+FIRMWARE_SIZE = 503808
+
+# The size of a flash sector.
+SECTOR_SIZE = 4096
+
+# The start of a firmware image that tcp_ota.c accepts, the rest being random.
+IMAGE_HEADER = '\xEA\x04\x00\x00\x00\x00\x10\x40\x00\x00\x00\x00'
+
+# The number of seconds to wait for the server to start, or for a reply from it.
+TIMEOUT = 60
+
+class LineReader:
+	"""Reads CR/LF terminated lines from a socket."""
+	def __init__(self, s):
+		self.s = s
+		self.buffer = ''
+
+	def read_line(self):
+		while '\n' not in self.buffer:
+			data = self.s.recv(256)
+			if not data:
+				raise IOError('Connection closed')
+			self.buffer += data
+		line, self.buffer = self.buffer.split('\n', 1)
+		return line.rstrip('\r')
+
+def random_image():
+	"""Returns a random image of the largest size, in whole sectors."""
+	rand = random.Random(1)
+	size = FIRMWARE_SIZE - FIRMWARE_SIZE % SECTOR_SIZE
+	return IMAGE_HEADER + ''.join(chr(rand.getrandbits(8)) for ii in xrange(size - len(IMAGE_HEADER)))
+
+def start_server(directory, segment, flash_args):
+	"""Starts ota_server with a fresh flash, returning its process once it's listening."""
+	flash = os.path.join(directory, 'flash.{}'.format(segment))
+	process = subprocess.Popen([SERVER, '-x', '-f', flash, '-s', str(segment)] + flash_args, stdout=subprocess.PIPE)
+	line = process.stdout.readline()
+	if not line.startswith('listening'):
+		process.kill()
+		raise IOError('ota_server failed to start')
+	return process
+
+def upgrade(image, segment):
+	"""Sends an image to the server a segment at a time, returning the seconds from 'Ready' to success."""
+	s = socket.create_connection(('127.0.0.1', PORT), TIMEOUT)
+	s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+	reader = LineReader(s)
+	s.sendall('OTA\r\nGetNextFlash\r\n')
+	reader.read_line()
+	s.sendall('FirmwareLength: {}\r\n'.format(len(image)))
+	response = reader.read_line()
+	if response != 'Ready':
+		raise IOError(response)
+
+	started = time.time()
+	for ii in xrange(0, len(image), segment):
+		s.sendall(image[ii:ii + segment])
+	response = reader.read_line()
+	elapsed = time.time() - started
+	s.close()
+	if not response.startswith('Flash upgrade success'):
+		raise IOError(response)
+	return elapsed
+
+def read_stats(process):
+	"""Returns the figures ota_server reports once the connection has closed, as a dictionary of integers."""
+	for line in process.stdout:
+		if line.startswith('closed '):
+			return dict((key, int(value)) for key, value in (field.split('=') for field in line.split()[1:]))
+	raise IOError('ota_server exited without reporting')
+
+def usage():
+	print 'Usage:'
+	print '   ota_bench.py [-s <sizes>] [-e <us>] [-p <us>] [-R <us>] [<image>]'
+	sys.exit(1)
+
+try:
+	opts, args = getopt.getopt(sys.argv[1:], 's:e:p:R:')
+except getopt.GetoptError:
+	usage()
+sizes = DEFAULT_SIZES
+flash_args = []
+for opt, value in opts:
+	if opt == '-s':
+		sizes = [int(size) for size in value.split(',')]
+	else:
+		flash_args += [opt, value]
+if len(args) > 1:
+	usage()
+elif args:
+	with open(args[0], 'rb') as f:
+		image = f.read()
+else:
+	image = random_image()
+
+print '{:>8} {:>10} {:>8} {:>10} {:>10} {:>8} {:>10}'.format('Segment', 'KB/s', 'Secs', 'Callbacks', 'CPU ms', 'us/call',
+	'Task ms')
+directory = tempfile.mkdtemp()
+failed = False
+try:
+	for segment in sizes:
+		process = start_server(directory, segment, flash_args)
+		try:
+			elapsed = upgrade(image, segment)
+			stats = read_stats(process)
+			process.wait()
+		except (IOError, socket.error) as e:
+			print '{:>8} failed: {}'.format(segment, e)
+			process.kill()
+			process.wait()
+			failed = True
+			continue
+		print '{:>8} {:>10.1f} {:>8.3f} {:>10} {:>10.1f} {:>8.2f} {:>10.1f}'.format(segment,
+			len(image) / 1024.0 / elapsed, elapsed, stats['rx_calls'], stats['rx_us'] / 1000.0,
+			float(stats['rx_us']) / max(stats['rx_calls'], 1), stats['task_us'] / 1000.0)
+		sys.stdout.flush()
+finally:
+	shutil.rmtree(directory)
+sys.exit(1 if failed else 0)
@@ -0,0 +1,159 @@
+/*
+ * ota_server.c: Runs tcp_ota.c on the host as an ESP8266 would run it, listening for OTA connections on a real TCP
+ * socket and keeping its flash in a file, so that tcp_flash.py (or anything else speaking the protocol) can upgrade it.
+ *
+ * Usage:
+ *   ota_server [-i <ip>] [-f <flash>] [-s <segment>] [-w <window>] [-e <us>] [-p <us>] [-R <us>] [-x] [-v]
+ *
+ * Where:
+ *   -i <ip>       the IP address to listen on (default 127.0.0.1).
+ *   -f <flash>    the file holding the flash (default ota_server.flash), what survives a reboot being kept in
+ *                 <flash>.state.
+ *   -s <segment>  the most bytes passed to each receive call-back, as the TCP stack passes on a segment at a time
+ *                 (default 1460).
+ *   -w <window>   the receive buffer size of each connection, standing in for the TCP receive window (default 5840).
+ *   -e <us>       the time taken to erase a flash sector (default 0).
+ *   -p <us>       the time taken to write a sector's worth of bytes to flash (default 0).
+ *   -R <us>       the time taken to read a sector's worth of bytes from flash (default 0).
+ *   -x            exits once tcp_ota.c reboots, rather than restarting.
+ *   -v            prints tcp_ota.c's debug output.
+ *
+ * Time is real, and the flash times (if any) are spent sleeping, nothing else running meanwhile, as on the ESP8266.
+ * When tcp_ota.c reboots, the server saves its state and restarts itself, coming back up running the other unit just
+ * as the ESP8266 would, so that it can be upgraded over and over.
+ *
+ * A line is printed as each OTA connection closes, giving what was measured while it was open:
+ *   closed rx_bytes=<n> rx_calls=<n> rx_us=<us> tasks=<n> task_us=<us> flash_us=<us> holds=<n> held_us=<us>
+ *          open_us=<us>
+ * where rx_us is the CPU time spent in the receive call-backs and task_us that spent in tcp_ota.c's flash task.
+ */
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "espconn.h"
+#include "user_interface.h"
+#include "tcp_ota.h"
+#include "esp_host.h"
+
+// The TCP port that tcp_ota.c listens to, this must match tcp_ota.c.
+#define SERVER_OTA_PORT 65056
+
+// The longest time (in us) to wait for a socket before checking the timers again.
+#define SERVER_POLL_MAX 100000
+
+// The most characters in the name of the file holding the state.
+#define SERVER_FILENAME_MAX 256
+
+// Flag as to whether to exit once tcp_ota.c reboots.
+LOCAL bool server_exit = false;
+
+/*
+ * Prints what was measured while an OTA connection was open, then starts measuring afresh.
+ */
+LOCAL void server_closed_cb(struct espconn *conn, uint32_t open_us) {
+    printf("closed rx_bytes=%llu rx_calls=%u rx_us=%llu tasks=%u task_us=%llu flash_us=%llu holds=%u held_us=%llu "
+           "open_us=%u\n", (unsigned long long)host_stats.rx_bytes, host_stats.rx_calls,
+           (unsigned long long)host_stats.rx_us, host_stats.tasks, (unsigned long long)host_stats.task_us,
+           (unsigned long long)host_stats.flash_us, host_stats.holds, (unsigned long long)host_stats.held_us, open_us);
+    fflush(stdout);
+    os_memset(&host_stats, 0, sizeof(host_stats));
+}
+
+/*
+ * Displays how the server is used, then exits.
+ */
+LOCAL void usage() {
+    printf("Usage:\n");
+    printf("   ota_server [-i <ip>] [-f <flash>] [-s <segment>] [-w <window>] [-e <us>] [-p <us>] [-R <us>]\n");
+    printf("              [-x] [-v]\n");
+    printf("\n");
+    printf("Where:\n");
+    printf("   -i <ip>       the IP address to listen on (default 127.0.0.1).\n");
+    printf("   -f <flash>    the file holding the flash (default ota_server.flash).\n");
+    printf("   -s <segment>  the most bytes passed to each receive call-back (default %u).\n", host_rx_max);
+    printf("   -w <window>   the receive buffer size of each connection (default %u).\n", host_rx_window);
+    printf("   -e <us>       the time taken to erase a flash sector (default %u).\n", host_flash_erase_us);
+    printf("   -p <us>       the time taken to write a sector to flash (default %u).\n", host_flash_write_us);
+    printf("   -R <us>       the time taken to read a sector from flash (default %u).\n", host_flash_read_us);
+    printf("   -x            exits once tcp_ota.c reboots, rather than restarting.\n");
+    printf("   -v            prints tcp_ota.c's debug output.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *flash_file = "ota_server.flash";
+    host_sockets = true;
+    host_rx_window = 5840;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:f:s:w:e:p:R:xv")) != -1) {
+        switch (opt) {
+            case 'i': host_ip = inet_addr(optarg); break;
+            case 'f': flash_file = optarg; break;
+            case 's': host_rx_max = atoi(optarg); break;
+            case 'w': host_rx_window = atoi(optarg); break;
+            case 'e': host_flash_erase_us = atoi(optarg); break;
+            case 'p': host_flash_write_us = atoi(optarg); break;
+            case 'R': host_flash_read_us = atoi(optarg); break;
+            case 'x': server_exit = true; break;
+            case 'v': host_verbose = true; break;
+            default: usage();
+        }
+    }
+    if ((host_rx_max == 0) || (host_ip == INADDR_NONE) || (optind != argc)) {
+        usage();
+    }
+
+    char state_file[SERVER_FILENAME_MAX];
+    snprintf(state_file, sizeof(state_file), "%s.state", flash_file);
+    if (host_flash_open(flash_file) == NULL) {
+        printf("%s: can't be used as flash\n", flash_file);
+        return 2;
+    }
+    host_state_load(state_file);
+    host_closed = server_closed_cb;
+    ota_check_boot();
+    ota_init();
+    if (!host_tcp_listening(SERVER_OTA_PORT)) {
+        printf("can't listen on port %u\n", SERVER_OTA_PORT);
+        return 2;
+    }
+    printf("listening ip=%s unit=%u\n", (host_ip != 0) ? inet_ntoa(*(struct in_addr *)&host_ip) : "127.0.0.1",
+           host_unit);
+    fflush(stdout);
+
+    // Run the tasks and timers, waiting on the sockets whenever there's nothing else to do.
+    while (!host_rebooted) {
+        bool busy = host_run_task();
+        busy |= host_run_timers();
+        uint32_t wait = 0;
+        if (!busy) {
+            uint32_t next = host_next_timer();
+            wait = (next == HOST_NEVER) ? SERVER_POLL_MAX : next - system_get_time();
+            if ((int32_t)wait < 0) {
+                wait = 0;
+            } else if (wait > SERVER_POLL_MAX) {
+                wait = SERVER_POLL_MAX;
+            }
+        }
+        host_poll(wait);
+    }
+
+    // The ESP8266 drops everything as it reboots, keeping only the flash and what's in RTC memory.
+    if (!host_state_save(state_file)) {
+        printf("%s: can't be saved\n", state_file);
+        return 2;
+    }
+    host_close_sockets();
+    printf("rebooted unit=%u\n", host_unit);
+    fflush(stdout);
+    if (!server_exit) {
+        execv("/proc/self/exe", argv);
+        printf("can't restart\n");
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * ota_sim.c: Simulates TCP OTA upgrades through tcp_ota.c, with a modelled WiFi link and flash, reporting how long
+ * each image takes from end to end.
+ *
+ * Usage:
+ *   ota_sim [-r <bytes/s>] [-s <segment>] [-w <window>] [-e <us>] [-p <us>] [-R <us>] [-c <us>] [-b <ns>]
+ *           [-d <n>] [-v] [<image> ...]
+ *
+ * Where:
+ *   -r <bytes/s>  the rate at which the link delivers data (default 256000).
+ *   -s <segment>  the number of bytes in each TCP segment (default 1460).
+ *   -w <window>   the TCP receive window, the most bytes sent but not yet passed to tcp_ota.c (default 5840).
+ *   -e <us>       the time taken to erase a flash sector (default 45000).
+ *   -p <us>       the time taken to write a sector's worth of bytes to flash (default 11200).
+ *   -R <us>       the time taken to read a sector's worth of bytes from flash (default 250).
+ *   -c <us>       the time taken by each receive call-back, as well as that per byte (default 30).
+ *   -b <ns>       the time taken by each byte passed to the receive call-back (default 250).
+ *   -d <n>        sends a patch instead of each image, against a running image that differs from it in every n-th
+ *                 sector (starting with the first, so that the header differs).
+ *   -v            prints tcp_ota.c's debug output.
+ *   <image>       the firmware images to send. If none are given, a random image of the largest size is sent.
+ *
+ * Time is simulated, so the results depend only on the figures above: the defaults are typical of a 4MB SPI flash
+ * chip and an ESP8266 on a reasonable WiFi link. The link sends a segment at a time, as long as the window allows, so
+ * the sender stalls whenever tcp_ota.c holds back reception for long enough.
+ *
+ * The "Serial" column shows how long the same image would take if every sector were written to flash inside the
+ * receive call-back, with nothing received in the meantime. With a patch, the "Bytes" column is the length of the
+ * patch, which is what crosses the link.
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+#include "espconn.h"
+#include "user_interface.h"
+#include "crc.h"
+#include "tcp_ota.h"
+#include "esp_host.h"
+
+// The TCP port that tcp_ota.c listens to, this must match tcp_ota.c.
+#define SIM_OTA_PORT 65056
+
+// The patch operations that copy bytes from the running image, and insert literal bytes, these must match tcp_ota.c.
+#define SIM_PATCH_COPY 0x01
+#define SIM_PATCH_INSERT 0x02
+
+// The maximum number of bytes of replies from tcp_ota.c held until a whole line has arrived.
+#define SIM_REPLY_MAX 256
+
+// The simulated time (in us) after which an upgrade is abandoned.
+#define SIM_TIME_LIMIT 600000000
+
+// Structure holding the simulated link, sending the image from the remote system.
+typedef struct {
+    const uint8_t *data;    // The bytes being sent.
+    uint32_t len;           // The number of bytes to send.
+    uint32_t arrived;       // The number of bytes that have arrived at the ESP8266.
+    uint32_t delivered;     // The number of bytes passed to tcp_ota.c.
+    uint32_t next_arrival;  // The system time at which the segment being sent arrives, HOST_NEVER if none is.
+} sim_link_t;
+
+// Structure holding the state of the upgrade, as seen by the remote system.
+typedef struct {
+    char reply[SIM_REPLY_MAX];  // The start of a reply line still to be completed.
+    uint16_t reply_len;         // The number of bytes in the reply line.
+    bool unit_known;            // Whether tcp_ota.c has said which unit it wants.
+    bool ready;                 // Whether tcp_ota.c has asked for the image to be sent.
+    bool success;               // Whether tcp_ota.c has reported the upgrade as successful.
+    char error[SIM_REPLY_MAX];  // The error reported by tcp_ota.c, empty if there hasn't been one.
+} sim_remote_t;
+
+// The settings of the link.
+LOCAL uint32_t sim_rate = 256000;
+LOCAL uint32_t sim_segment = 1460;
+LOCAL uint32_t sim_window = 5840;
+
+// Every how many sectors the running image differs from those sent, or zero to send the images in full.
+LOCAL uint32_t sim_diff = 0;
+
+// The link, and the remote system's view of the upgrade.
+LOCAL sim_link_t sim_link;
+LOCAL sim_remote_t sim_remote;
+
+/*
+ * Handles a complete line sent by tcp_ota.c, without its CR/LF.
+ */
+LOCAL void sim_reply_line(const char *line) {
+    if ((!strcmp(line, "user1.bin")) || (!strcmp(line, "user2.bin"))) {
+        sim_remote.unit_known = true;
+    } else if (!strcmp(line, "Ready")) {
+        sim_remote.ready = true;
+    } else if (!strncmp(line, "Flash upgrade success", 21)) {
+        sim_remote.success = true;
+    } else if (!strncmp(line, "ERR", 3)) {
+        strcpy(sim_remote.error, line);
+    }
+}
+
+/*
+ * Receives whatever tcp_ota.c sends to the remote system, a line at a time.
+ */
+LOCAL void sim_send_cb(struct espconn *conn, const uint8_t *data, uint16_t len) {
+    for (uint16_t ii = 0; ii < len; ii++) {
+        if (data[ii] == '\n') {
+            if ((sim_remote.reply_len > 0) && (sim_remote.reply[sim_remote.reply_len - 1] == '\r')) {
+                sim_remote.reply_len--;
+            }
+            sim_remote.reply[sim_remote.reply_len] = '\0';
+            sim_reply_line(sim_remote.reply);
+            sim_remote.reply_len = 0;
+        } else if (sim_remote.reply_len < SIM_REPLY_MAX - 1) {
+            sim_remote.reply[sim_remote.reply_len++] = data[ii];
+        }
+    }
+}
+
+/*
+ * The number of bytes in the segment starting at the given position of the image.
+ */
+LOCAL uint32_t sim_segment_len(uint32_t pos) {
+    return (sim_link.len - pos < sim_segment) ? sim_link.len - pos : sim_segment;
+}
+
+/*
+ * The time (in us) the link takes to send a number of bytes.
+ */
+LOCAL uint32_t sim_link_time(uint32_t len) {
+    return (uint32_t)(((uint64_t)len * 1000000) / sim_rate);
+}
+
+/*
+ * Starts sending the next segment, if there's one to send and it fits in the window.
+ */
+LOCAL void sim_link_send(uint32_t now) {
+    sim_link.next_arrival = HOST_NEVER;
+    if ((sim_link.arrived < sim_link.len) &&
+        (sim_link.arrived - sim_link.delivered + sim_segment_len(sim_link.arrived) <= sim_window)) {
+        sim_link.next_arrival = now + sim_link_time(sim_segment_len(sim_link.arrived));
+    }
+}
+
+/*
+ * Moves the link on to the current time, noting the segments that have arrived in the meantime.
+ */
+LOCAL void sim_link_update() {
+    uint32_t now = system_get_time();
+    while ((sim_link.next_arrival != HOST_NEVER) && ((int32_t)(now - sim_link.next_arrival) >= 0)) {
+        sim_link.arrived += sim_segment_len(sim_link.arrived);
+        sim_link_send(sim_link.next_arrival);
+    }
+}
+
+/*
+ * Passes the next segment that has arrived to tcp_ota.c.
+ */
+LOCAL void sim_link_deliver(struct espconn *conn) {
+    uint32_t len = sim_segment_len(sim_link.delivered);
+    host_tcp_deliver(conn, &sim_link.data[sim_link.delivered], len);
+    sim_link.delivered += len;
+    if (sim_link.next_arrival == HOST_NEVER) {
+        // The window has opened up again.
+        sim_link_send(system_get_time());
+    }
+}
+
+/*
+ * Passes a header line to tcp_ota.c, straight away.
+ */
+LOCAL void sim_header(struct espconn *conn, const char *line) {
+    host_tcp_deliver(conn, (const uint8_t *)line, strlen(line));
+}
+
+/*
+ * Appends a patch operation to a patch, with its little-endian arguments.
+ */
+LOCAL uint32_t sim_patch_op(uint8_t *patch, uint32_t pos, uint8_t op, uint32_t arg0, uint32_t arg1) {
+    patch[pos++] = op;
+    for (uint8_t ii = 0; ii < ((op == SIM_PATCH_COPY) ? 8 : 4); ii++) {
+        patch[pos++] = ((ii < 4) ? arg0 : arg1) >> (8 * (ii % 4));
+    }
+    return pos;
+}
+
+/*
+ * Puts a running image in the flash that differs from the given image in every "sim_diff"-th sector, and creates the
+ * patch turning it into the given image: a copy operation for each run of unchanged sectors, and an insert operation
+ * for each changed sector.
+ */
+LOCAL uint8_t *sim_make_patch(uint8_t *flash, const uint8_t *image, uint32_t len, uint32_t *patch_len) {
+    uint8_t *running = &flash[SPI_FLASH_SEC_SIZE];
+    os_memcpy(running, image, len);
+
+    uint8_t *patch = (uint8_t *)os_malloc(len + 9 * (len / SPI_FLASH_SEC_SIZE + 2));
+    uint32_t pos = 0;
+    uint32_t copy_from = 0;
+    for (uint32_t offset = 0; offset < len; offset += SPI_FLASH_SEC_SIZE) {
+        if ((offset / SPI_FLASH_SEC_SIZE) % sim_diff != 0) {
+            continue;
+        }
+        uint32_t sector_len = (len - offset < SPI_FLASH_SEC_SIZE) ? len - offset : SPI_FLASH_SEC_SIZE;
+        for (uint32_t ii = 0; ii < sector_len; ii++) {
+            running[offset + ii] = ~image[offset + ii];
+        }
+        if (offset > copy_from) {
+            pos = sim_patch_op(patch, pos, SIM_PATCH_COPY, copy_from, offset - copy_from);
+        }
+        pos = sim_patch_op(patch, pos, SIM_PATCH_INSERT, sector_len, 0);
+        os_memcpy(&patch[pos], &image[offset], sector_len);
+        pos += sector_len;
+        copy_from = offset + sector_len;
+    }
+    if (len > copy_from) {
+        pos = sim_patch_op(patch, pos, SIM_PATCH_COPY, copy_from, len - copy_from);
+    }
+    *patch_len = pos;
+    return patch;
+}
+
+/*
+ * Runs a single upgrade of the given image in a fresh ESP8266, printing how it went.
+ */
+LOCAL void sim_upgrade(const char *name, const uint8_t *image, uint32_t len) {
+    host_virtual_time = true;
+    uint8_t *flash = host_flash_init();
+    ota_init();
+
+    // Send a patch against the running image instead, if asked.
+    const uint8_t *payload = image;
+    uint32_t payload_len = len;
+    uint8_t *patch = NULL;
+    if (sim_diff > 0) {
+        patch = sim_make_patch(flash, image, len, &payload_len);
+        payload = patch;
+    }
+    os_memset(&host_stats, 0, sizeof(host_stats));
+    uint32_t start = system_get_time();
+
+    // Go through the header, the replies coming back straight away.
+    struct espconn *conn = host_tcp_connect(SIM_OTA_PORT, sim_send_cb);
+    if (conn == NULL) {
+        printf("%-24s tcp_ota.c isn't listening\n", name);
+        return;
+    }
+    char line[64];
+    sim_header(conn, "OTA\r\nGetNextFlash\r\n");
+    if (patch != NULL) {
+        sprintf(line, "PatchLength: %u\r\n", payload_len);
+        sim_header(conn, line);
+    }
+    sprintf(line, "FirmwareCRC32: %08x\r\n", calculate_crc32(0, image, len));
+    sim_header(conn, line);
+    sprintf(line, "FirmwareLength: %u\r\n", len);
+    sim_header(conn, line);
+
+    // Send the image, letting tcp_ota.c's tasks and timers run whenever nothing is being received.
+    if (sim_remote.unit_known && sim_remote.ready) {
+        sim_link.data = payload;
+        sim_link.len = payload_len;
+        sim_link_send(system_get_time());
+    }
+    while (sim_remote.ready && (!sim_remote.success) && (sim_remote.error[0] == '\0') &&
+           (system_get_time() - start < SIM_TIME_LIMIT)) {
+        sim_link_update();
+        if ((sim_link.delivered < sim_link.arrived) && (!host_tcp_held(conn))) {
+            sim_link_deliver(conn);
+        } else if ((!host_run_task()) && (!host_run_timers())) {
+            uint32_t next = host_next_timer();
+            if ((sim_link.next_arrival != HOST_NEVER) &&
+                ((next == HOST_NEVER) || ((int32_t)(sim_link.next_arrival - next) < 0))) {
+                next = sim_link.next_arrival;
+            }
+            if (next == HOST_NEVER) {
+                strcpy(sim_remote.error, "Stalled");
+                break;
+            }
+            host_advance_to(next);
+        }
+    }
+    uint32_t elapsed = system_get_time() - start;
+    if (patch != NULL) {
+        os_free(patch);
+    }
+
+    if (!sim_remote.success) {
+        printf("%-24s %8u failed after %.3fs: %s\n", name, payload_len, elapsed / 1000000.0,
+               (sim_remote.error[0] != '\0') ? sim_remote.error : "Timed out");
+        return;
+    }
+    uint32_t sectors = (len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+    uint64_t flash_us = (uint64_t)sectors * (host_flash_erase_us + host_flash_write_us);
+    uint64_t serial_us = sim_link_time(payload_len) + flash_us + (uint64_t)sectors * host_flash_read_us;
+    printf("%-24s %8u %8u %8.3f %8.3f %8.3f %8.3f %8.3f %8u\n", name, payload_len, sectors,
+           sim_link_time(payload_len) / 1000000.0,
+           flash_us / 1000000.0, serial_us / 1000000.0, elapsed / 1000000.0, host_stats.held_us / 1000000.0,
+           host_stats.holds);
+}
+
+/*
+ * Reads a firmware image from a file, returning NULL if it can't be read.
+ */
+LOCAL uint8_t *sim_read_image(const char *filename, uint32_t *len) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t *image = (uint8_t *)os_malloc(FIRMWARE_SIZE + 1);
+    *len = fread(image, 1, FIRMWARE_SIZE + 1, f);
+    fclose(f);
+    if ((*len == 0) || (*len > FIRMWARE_SIZE)) {
+        os_free(image);
+        return NULL;
+    }
+    return image;
+}
+
+/*
+ * Creates a random image of the largest size, with a header that tcp_ota.c accepts.
+ */
+LOCAL uint8_t *sim_random_image(uint32_t *len) {
+    *len = FIRMWARE_SIZE - (FIRMWARE_SIZE % SPI_FLASH_SEC_SIZE);
+    uint8_t *image = (uint8_t *)os_malloc(*len);
+    for (uint32_t ii = 0; ii < *len; ii++) {
+        image[ii] = os_random();
+    }
+    static const uint8_t header[12] = { 0xEA, 0x04, 0x00, 0x00, 0x00, 0x00, 0x10, 0x40, 0x00, 0x00, 0x00, 0x00 };
+    os_memcpy(image, header, sizeof(header));
+    return image;
+}
+
+/*
+ * Runs the upgrade in a child process, so that each image starts with a freshly booted tcp_ota.c.
+ */
+LOCAL void sim_run(const char *name, const uint8_t *image, uint32_t len) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sim_upgrade(name, image, len);
+        fflush(stdout);
+        exit(0);
+    } else if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/*
+ * Prints the usage instructions.
+ */
+LOCAL void usage() {
+    printf("Usage:\n");
+    printf("   ota_sim [-r <bytes/s>] [-s <segment>] [-w <window>] [-e <us>] [-p <us>] [-R <us>] [-c <us>] [-b <ns>]\n");
+    printf("           [-d <n>] [-v] [<image> ...]\n");
+    printf("\n");
+    printf("Where:\n");
+    printf("   -r <bytes/s>  the rate at which the link delivers data (default %u).\n", sim_rate);
+    printf("   -s <segment>  the number of bytes in each TCP segment (default %u).\n", sim_segment);
+    printf("   -w <window>   the TCP receive window (default %u).\n", sim_window);
+    printf("   -e <us>       the time taken to erase a flash sector (default %u).\n", host_flash_erase_us);
+    printf("   -p <us>       the time taken to write a sector to flash (default %u).\n", host_flash_write_us);
+    printf("   -R <us>       the time taken to read a sector from flash (default %u).\n", host_flash_read_us);
+    printf("   -c <us>       the time taken by each receive call-back (default %u).\n", host_rx_call_us);
+    printf("   -b <ns>       the time taken by each byte received (default %u).\n", host_rx_byte_ns);
+    printf("   -d <n>        sends a patch against a running image differing in every n-th sector.\n");
+    printf("   -v            prints tcp_ota.c's debug output.\n");
+    printf("   <image>       the firmware images to send, a random image if none are given.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    host_flash_erase_us = 45000;
+    host_flash_write_us = 11200;
+    host_flash_read_us = 250;
+    host_rx_call_us = 30;
+    host_rx_byte_ns = 250;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:w:e:p:R:c:b:d:v")) != -1) {
+        switch (opt) {
+            case 'r': sim_rate = atoi(optarg); break;
+            case 's': sim_segment = atoi(optarg); break;
+            case 'w': sim_window = atoi(optarg); break;
+            case 'e': host_flash_erase_us = atoi(optarg); break;
+            case 'p': host_flash_write_us = atoi(optarg); break;
+            case 'R': host_flash_read_us = atoi(optarg); break;
+            case 'c': host_rx_call_us = atoi(optarg); break;
+            case 'b': host_rx_byte_ns = atoi(optarg); break;
+            case 'd': sim_diff = atoi(optarg); break;
+            case 'v': host_verbose = true; break;
+            default: usage();
+        }
+    }
+    if ((sim_rate == 0) || (sim_segment == 0) || (sim_segment > sim_window)) {
+        usage();
+    }
+
+    printf("%-24s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Image", "Bytes", "Sectors", "Link s", "Flash s", "Serial s",
+           "Total s", "Held s", "Holds");
+    if (optind == argc) {
+        uint32_t len;
+        uint8_t *image = sim_random_image(&len);
+        sim_run("(random)", image, len);
+        os_free(image);
+    }
+    int code = 0;
+    for (int ii = optind; ii < argc; ii++) {
+        uint32_t len;
+        uint8_t *image = sim_read_image(argv[ii], &len);
+        if (image == NULL) {
+            printf("%-24s can't be read, or is empty or too big\n", argv[ii]);
+            code = 2;
+            continue;
+        }
+        sim_run(argv[ii], image, len);
+        os_free(image);
+    }
+    return code;
+}
@@ -0,0 +1,30 @@
+/*
+ * c_types.h: The SDK's basic types, for building the firmware's modules on the host.
+ */
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+typedef uint64_t u_int64;
+
+// Everything is in ordinary memory on the host, so the placement attributes do nothing.
+#define LOCAL static
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define IRAM_ATTR
+
+#define BIT(nr) (1UL << (nr))
+
+#endif
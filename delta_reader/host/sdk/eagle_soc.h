@@ -0,0 +1,9 @@
+/*
+ * eagle_soc.h: The ESP8266's registers, for building the firmware's modules on the host. There are none to use.
+ */
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+
+#include "c_types.h"
+
+#endif
@@ -0,0 +1,9 @@
+/*
+ * gpio.h: The SDK's GPIO functions, for building the firmware's modules on the host. There are no pins to drive.
+ */
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include "c_types.h"
+
+#endif
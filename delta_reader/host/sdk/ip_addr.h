@@ -0,0 +1,32 @@
+/*
+ * ip_addr.h: The SDK's IP address types, for building the firmware's modules on the host.
+ */
+#ifndef __IP_ADDR_H__
+#define __IP_ADDR_H__
+
+#include "c_types.h"
+
+// Addresses are held in network byte order, as in the SDK.
+typedef struct ip_addr {
+    uint32_t addr;
+} ip_addr_t;
+
+struct ip_info {
+    struct ip_addr ip;
+    struct ip_addr netmask;
+    struct ip_addr gw;
+};
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+    (ipaddr)->addr = ((uint32_t)((d) & 0xff) << 24) | ((uint32_t)((c) & 0xff) << 16) | \
+                     ((uint32_t)((b) & 0xff) << 8) | (uint32_t)((a) & 0xff)
+
+#define ip4_addr1(ipaddr) (((uint8_t *)(ipaddr))[0])
+#define ip4_addr2(ipaddr) (((uint8_t *)(ipaddr))[1])
+#define ip4_addr3(ipaddr) (((uint8_t *)(ipaddr))[2])
+#define ip4_addr4(ipaddr) (((uint8_t *)(ipaddr))[3])
+
+#define IP2STR(ipaddr) ip4_addr1(ipaddr), ip4_addr2(ipaddr), ip4_addr3(ipaddr), ip4_addr4(ipaddr)
+#define IPSTR "%d.%d.%d.%d"
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * mem.h: The SDK's heap functions, for building the firmware's modules on the host.
+ */
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <stdlib.h>
+
+#define os_malloc malloc
+#define os_zalloc(s) calloc(1, s)
+#define os_calloc calloc
+#define os_realloc realloc
+#define os_free free
+
+#endif
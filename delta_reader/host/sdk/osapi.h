@@ -0,0 +1,36 @@
+/*
+ * osapi.h: The SDK's OS functions, for building the firmware's modules on the host. They are implemented by esp_host.c.
+ */
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "os_type.h"
+
+#define os_bzero(s, n) memset(s, 0, n)
+#define os_memcmp memcmp
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_strcat strcat
+#define os_strchr strchr
+#define os_strcmp strcmp
+#define os_strcpy strcpy
+#define os_strlen strlen
+#define os_strncmp strncmp
+#define os_strncpy strncpy
+#define os_strstr strstr
+#define os_sprintf sprintf
+#define os_snprintf snprintf
+
+int os_printf(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg);
+void os_timer_arm(os_timer_t *ptimer, uint32_t milliseconds, bool repeat_flag);
+void os_timer_arm_us(os_timer_t *ptimer, uint32_t microseconds, bool repeat_flag);
+void os_timer_disarm(os_timer_t *ptimer);
+void os_delay_us(uint16_t us);
+unsigned long os_random(void);
+
+#endif
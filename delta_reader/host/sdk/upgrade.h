@@ -0,0 +1,20 @@
+/*
+ * upgrade.h: The SDK's firmware upgrade functions, for building the firmware's modules on the host.
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "c_types.h"
+
+#define UPGRADE_FW_BIN1 0x00
+#define UPGRADE_FW_BIN2 0x01
+
+#define UPGRADE_FLAG_IDLE 0x00
+#define UPGRADE_FLAG_START 0x01
+#define UPGRADE_FLAG_FINISH 0x02
+
+void system_upgrade_flag_set(uint8 flag);
+uint8 system_upgrade_flag_check(void);
+void system_upgrade_reboot(void);
+
+#endif
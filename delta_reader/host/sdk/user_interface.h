@@ -0,0 +1,41 @@
+/*
+ * user_interface.h: The SDK's system and WiFi functions, for building the firmware's modules on the host. The host is
+ * always connected, with the address given to esp_host.c.
+ */
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+#include "os_type.h"
+#include "ip_addr.h"
+#include "upgrade.h"
+
+#define STATION_IF 0x00
+#define SOFTAP_IF 0x01
+
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+
+enum {
+    STATION_IDLE = 0,
+    STATION_CONNECTING,
+    STATION_WRONG_PASSWORD,
+    STATION_NO_AP_FOUND,
+    STATION_CONNECT_FAIL,
+    STATION_GOT_IP
+};
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen);
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par);
+uint32 system_get_time(void);
+uint8 system_upgrade_userbin_check(void);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+void system_soft_wdt_feed(void);
+void system_restart(void);
+uint32 system_get_free_heap_size(void);
+void system_timer_reinit(void);
+
+uint8 wifi_station_get_connect_status(void);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * string_builder_bench.c: Checks string_builder.c's fixes, then times building the payloads that delta_reader and
+ * web-bootstrap built with it.
+ *
+ * Usage:
+ *   string_builder_bench [<iterations>]
+ *
+ * The fixes checked are to the terminator written by append_string_builder, which used to go one character past the
+ * end of the string, and to the size resize_string_builder grows the buffer to when doubling it isn't enough, which
+ * used to be too small. Each is checked on a builder whose buffer starts out full of junk.
+ *
+ * The payloads are:
+ *   tagwriter    delta_reader's tag JSON for all 33 inverter values, wrapped in the HTTP POST to the tagwriter service.
+ *   wifi_status  web-bootstrap's WiFi status JSON, with the access point and station both up.
+ *
+ * Each payload is built with the same appends as the original code made, and checked against the same text built
+ * with sprintf before being timed. A line is printed for each, giving its length and the average time (in ns) taken to
+ * build it and free the builder. Exits with 1 if any check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+#include "ip_addr.h"
+#include "string_builder.h"
+
+// The number of times each payload is built, unless given on the command line.
+#define BENCH_ITERATIONS 200000
+
+// The most bytes in an expected payload.
+#define BENCH_PAYLOAD_MAX 2048
+
+// The format of a MAC address, as the SDK's MACSTR.
+#define BENCH_MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+
+// The tags of delta_reader's inverter values, as sent to the tagwriter service.
+static const char *BENCH_TAGS[] = {
+    "instant-current-i1", "instant-voltage-i1", "instant-power-i1", "average-current-i1", "average-voltage-i1",
+    "average-power-i1", "internal-temp-ac", "internal-temp-dc", "instant-current-ac", "instant-voltage-ac",
+    "instant-power-ac", "instant-frequency-ac", "average-current-ac", "average-voltage-ac", "average-power-ac",
+    "average-frequency-ac", "day-energy", "day-run-time", "week-energy", "week-run-time", "month-energy",
+    "month-run-time", "year-energy", "year-run-time", "total-energy", "total-run-time", "solar-current-limit",
+    "solar-voltage-limit", "solar-power-limit", "current-max-ac", "voltage-min-ac", "voltage-max-ac", "power-ac"
+};
+
+// The number of inverter values.
+#define BENCH_TAG_COUNT 33
+
+// The inverter values, filled in by main.
+static uint32_t bench_values[BENCH_TAG_COUNT];
+
+// The WiFi details reported in web-bootstrap's status.
+static const uint8_t BENCH_AP_IP[4] = { 192, 168, 4, 1 };
+static const uint8_t BENCH_AP_MAC[6] = { 0x1a, 0xfe, 0x34, 0x0b, 0xc2, 0x5d };
+static const uint8_t BENCH_STATION_IP[4] = { 10, 0, 1, 123 };
+static const uint8_t BENCH_STATION_MAC[6] = { 0x18, 0xfe, 0x34, 0x0b, 0xc2, 0x5d };
+#define BENCH_SSID "HomeNetwork"
+#define BENCH_CLIENTS 2
+#define BENCH_RSSI -67
+
+/*
+ * Builds delta_reader's tagwriter request: the tag JSON, then the HTTP request holding it.
+ */
+static string_builder *bench_tagwriter() {
+    string_builder *content = create_string_builder(128);
+    bool add_ok = true;
+    add_ok &= append_string_builder(content, "{\"tags\":{");
+    for (uint8_t ii = 0; ii < BENCH_TAG_COUNT; ii++) {
+        if (ii > 0) {
+            add_ok &= append_string_builder(content, ",\"");
+        } else {
+            add_ok &= append_string_builder(content, "\"");
+        }
+        add_ok &= append_string_builder(content, BENCH_TAGS[ii]);
+        add_ok &= append_string_builder(content, "\":");
+        add_ok &= append_int32_string_builder(content, bench_values[ii]);
+    }
+    add_ok &= append_string_builder(content, "}}");
+
+    string_builder *sb = create_string_builder(content->len + 100);
+    add_ok &= append_string_builder(sb, "POST /tagwriter HTTP/1.1\r\n" \
+            "Content-Type: application/json\r\n" \
+            "Connection: close\r\n" \
+            "Content-Length: ");
+    add_ok &= append_int32_string_builder(sb, content->len);
+    add_ok &= append_string_builder(sb, "\r\n\r\n");
+    add_ok &= append_string_builder_to_string_builder(sb, content);
+    free_string_builder(content);
+    if (!add_ok) {
+        free_string_builder(sb);
+        return NULL;
+    }
+    return sb;
+}
+
+/*
+ * Writes what bench_tagwriter should build.
+ */
+static int bench_tagwriter_expected(char *buf) {
+    char content[BENCH_PAYLOAD_MAX];
+    int len = sprintf(content, "{\"tags\":{");
+    for (uint8_t ii = 0; ii < BENCH_TAG_COUNT; ii++) {
+        len += sprintf(&content[len], "%s\"%s\":%u", (ii > 0) ? "," : "", BENCH_TAGS[ii], bench_values[ii]);
+    }
+    len += sprintf(&content[len], "}}");
+    return sprintf(buf, "POST /tagwriter HTTP/1.1\r\nContent-Type: application/json\r\nConnection: close\r\n"
+                   "Content-Length: %d\r\n\r\n%s", len, content);
+}
+
+/*
+ * Builds web-bootstrap's WiFi status JSON, for a device in station and access point mode, connected to its network.
+ */
+static string_builder *bench_wifi_status() {
+    string_builder *sb = create_string_builder(128);
+    char buf[20];
+    char mac_str[18];
+    append_string_builder(sb, "{\"opmode\": \"");
+    append_string_builder(sb, "Station and Access Point");
+    os_sprintf(buf, IPSTR, BENCH_AP_IP[0], BENCH_AP_IP[1], BENCH_AP_IP[2], BENCH_AP_IP[3]);
+    append_string_builder(sb, "\", \"ap\": { \"ip\": \"");
+    append_string_builder(sb, buf);
+    append_string_builder(sb, "\"");
+    append_string_builder(sb, ", \"mac\": \"");
+    os_sprintf(mac_str, BENCH_MACSTR, BENCH_AP_MAC[0], BENCH_AP_MAC[1], BENCH_AP_MAC[2], BENCH_AP_MAC[3],
+               BENCH_AP_MAC[4], BENCH_AP_MAC[5]);
+    append_string_builder(sb, mac_str);
+    append_string_builder(sb, "\", \"clientCount\": ");
+    append_int32_string_builder(sb, BENCH_CLIENTS);
+    append_string_builder(sb, "}");
+    append_string_builder(sb, ", \"station\": { \"status\": ");
+    append_string_builder(sb, "\"Connected\", \"ip\": \"");
+    os_sprintf(buf, IPSTR, BENCH_STATION_IP[0], BENCH_STATION_IP[1], BENCH_STATION_IP[2], BENCH_STATION_IP[3]);
+    append_string_builder(sb, buf);
+    append_string_builder(sb, "\"");
+    append_string_builder(sb, ", \"ssid\": \"");
+    append_string_builder(sb, BENCH_SSID);
+    append_string_builder(sb, "\"");
+    append_string_builder(sb, ", \"mac\": \"");
+    os_sprintf(mac_str, BENCH_MACSTR, BENCH_STATION_MAC[0], BENCH_STATION_MAC[1], BENCH_STATION_MAC[2],
+               BENCH_STATION_MAC[3], BENCH_STATION_MAC[4], BENCH_STATION_MAC[5]);
+    append_string_builder(sb, mac_str);
+    append_string_builder(sb, "\", \"rssi\": ");
+    append_int32_string_builder(sb, BENCH_RSSI);
+    append_string_builder(sb, " }");
+    append_string_builder(sb, "}");
+    return sb;
+}
+
+/*
+ * Writes what bench_wifi_status should build.
+ */
+static int bench_wifi_status_expected(char *buf) {
+    return sprintf(buf, "{\"opmode\": \"Station and Access Point\", \"ap\": { \"ip\": \"" IPSTR "\", \"mac\": \""
+                   BENCH_MACSTR "\", \"clientCount\": %d}, \"station\": { \"status\": \"Connected\", \"ip\": \"" IPSTR
+                   "\", \"ssid\": \"%s\", \"mac\": \"" BENCH_MACSTR "\", \"rssi\": %d }}",
+                   BENCH_AP_IP[0], BENCH_AP_IP[1], BENCH_AP_IP[2], BENCH_AP_IP[3], BENCH_AP_MAC[0], BENCH_AP_MAC[1],
+                   BENCH_AP_MAC[2], BENCH_AP_MAC[3], BENCH_AP_MAC[4], BENCH_AP_MAC[5], BENCH_CLIENTS,
+                   BENCH_STATION_IP[0], BENCH_STATION_IP[1], BENCH_STATION_IP[2], BENCH_STATION_IP[3], BENCH_SSID,
+                   BENCH_STATION_MAC[0], BENCH_STATION_MAC[1], BENCH_STATION_MAC[2], BENCH_STATION_MAC[3],
+                   BENCH_STATION_MAC[4], BENCH_STATION_MAC[5], BENCH_RSSI);
+}
+
+/*
+ * Checks the fixes to string_builder.c, printing the result. Returns whether they worked.
+ */
+static bool bench_check_fixes() {
+    char expected[BENCH_PAYLOAD_MAX];
+
+    // The terminator must follow the string, with junk beyond it.
+    string_builder *sb = create_string_builder(64);
+    memset(sb->buf, '#', sb->allocated);
+    sb->buf[0] = '\0';
+    bool ok = append_string_builder(sb, "abc") && append_string_builder(sb, "def") && (sb->len == 6) &&
+              (strcmp(sb->buf, "abcdef") == 0);
+    free_string_builder(sb);
+    if (!ok) {
+        printf("%-12s terminator misplaced\n", "fixes");
+        return false;
+    }
+
+    // A string more than doubling the builder must fit, along with its terminator.
+    sb = create_string_builder(16);
+    memset(sb->buf, '#', sb->allocated);
+    sb->buf[0] = '\0';
+    int len = sprintf(expected, "0123456789");
+    ok = append_string_builder(sb, expected);
+    memset(&expected[len], 'x', 100);
+    expected[len + 100] = '\0';
+    ok = ok && append_string_builder(sb, &expected[len]) && (sb->len == len + 100) && (sb->len < sb->allocated) &&
+         (strcmp(sb->buf, expected) == 0);
+    free_string_builder(sb);
+    if (!ok) {
+        printf("%-12s resize too small\n", "fixes");
+        return false;
+    }
+    printf("%-12s OK\n", "fixes");
+    return true;
+}
+
+/*
+ * Returns the current time (in ns).
+ */
+static uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Checks that a payload is built as expected, then times building it, printing the result. Returns whether the
+ * payload matched.
+ */
+static bool bench_payload(const char *name, string_builder *(*build)(), int (*expected)(char *), long iterations) {
+    char buf[BENCH_PAYLOAD_MAX];
+    int len = expected(buf);
+    string_builder *sb = build();
+    if ((sb == NULL) || (sb->len != len) || (memcmp(sb->buf, buf, len + 1) != 0)) {
+        printf("%-12s mismatch:\n%s\n", name, (sb != NULL) ? sb->buf : "(NULL)");
+        free_string_builder(sb);
+        return false;
+    }
+    free_string_builder(sb);
+
+    uint64_t started = bench_now_ns();
+    for (long ii = 0; ii < iterations; ii++) {
+        free_string_builder(build());
+    }
+    printf("%-12s %6d bytes %8.1f ns\n", name, len, (double)(bench_now_ns() - started) / iterations);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : BENCH_ITERATIONS;
+    if ((argc > 2) || (iterations <= 0)) {
+        printf("Usage:\n");
+        printf("   %s [<iterations>]\n", argv[0]);
+        return 1;
+    }
+
+    // Inverter values of every magnitude, from single digits to the energy totals.
+    srand(1);
+    for (uint8_t ii = 0; ii < BENCH_TAG_COUNT; ii++) {
+        bench_values[ii] = (uint32_t)rand() >> (rand() % 31);
+    }
+
+    if (!bench_check_fixes()) {
+        return 1;
+    }
+    printf("string_builder.c, %ld iterations:\n", iterations);
+    bool ok = bench_payload("tagwriter", bench_tagwriter, bench_tagwriter_expected, iterations);
+    ok &= bench_payload("wifi_status", bench_wifi_status, bench_wifi_status_expected, iterations);
+    return ok ? 0 : 1;
+}
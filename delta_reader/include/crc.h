@@ -0,0 +1,71 @@
+/*
+ * crc.h: Cyclic redundancy check calculations.
+ */
+#ifndef _CRC_H
+#define _CRC_H
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "espmissingincludes.h"
+
+// The reflected CRC-16 polynomial used by the Delta inverter (0x8005, as in Modbus).
+#define CRC16_POLY 0xA001
+
+// The ways of calculating the CRC-16, chosen with CRC16_METHOD (set in the Makefile): a bit at a time, a nibble at a
+// time (16 entry table, 32 bytes), or a byte at a time (256 entry table) with the table in flash (1K) or RAM (512
+// bytes, with the code in IRAM).
+#define CRC16_BITWISE 0
+#define CRC16_NIBBLE 1
+#define CRC16_TABLE_FLASH 2
+#define CRC16_TABLE_RAM 3
+
+#ifndef CRC16_METHOD
+#define CRC16_METHOD CRC16_TABLE_RAM
+#endif
+
+// The CRC-16 calculation used, all of them giving the same result.
+#if CRC16_METHOD == CRC16_BITWISE
+#define calculate_crc16 calculate_crc16_bitwise
+#elif CRC16_METHOD == CRC16_NIBBLE
+#define calculate_crc16 calculate_crc16_nibble
+#else
+#define calculate_crc16 calculate_crc16_table
+#endif
+
+/*
+ * Calculates the standard (zlib/Ethernet) CRC-32 value of a block of data. The calculation can be continued over
+ * several blocks by passing the result for the previous block as "crc", starting with zero.
+ *
+ * @param crc The CRC-32 value of the preceding data, or zero to start a new calculation.
+ * @param data The data to include in the calculation.
+ * @param len The number of bytes of data.
+ * @return The CRC-32 value of all of the data so far.
+ */
+uint32_t ICACHE_FLASH_ATTR calculate_crc32(uint32_t crc, const uint8_t *data, uint32_t len);
+
+/*
+ * Calculates the CRC-16 value (reflected polynomial 0xA001, initial value zero, as used by the Delta inverter) of a
+ * block of data, a bit at a time. The calculation can be continued over several blocks by passing the result for the
+ * previous block as "crc", starting with zero.
+ *
+ * @param crc The CRC-16 value of the preceding data, or zero to start a new calculation.
+ * @param data The data to include in the calculation.
+ * @param len The number of bytes of data.
+ * @return The CRC-16 value of all of the data so far.
+ */
+uint16_t ICACHE_FLASH_ATTR calculate_crc16_bitwise(uint16_t crc, const uint8_t *data, uint32_t len);
+
+/*
+ * Calculates the CRC-16 value of a block of data, as calculate_crc16_bitwise, a nibble at a time using a 16 entry
+ * table.
+ */
+uint16_t ICACHE_FLASH_ATTR calculate_crc16_nibble(uint16_t crc, const uint8_t *data, uint32_t len);
+
+/*
+ * Calculates the CRC-16 value of a block of data, as calculate_crc16_bitwise, a byte at a time using a 256 entry
+ * table. This is in IRAM when CRC16_METHOD is CRC16_TABLE_RAM, otherwise in flash, so has no ICACHE_FLASH_ATTR here.
+ */
+uint16_t calculate_crc16_table(uint16_t crc, const uint8_t *data, uint32_t len);
+
+#endif
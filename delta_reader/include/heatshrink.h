@@ -0,0 +1,81 @@
+/*
+ * heatshrink.h: Streaming decoder for heatshrink (LZSS) compressed data, using a small fixed window.
+ *
+ * The format is that of the heatshrink library (https://github.com/atomicobject/heatshrink), with the window and
+ * look-ahead sizes below, i.e. data compressed with "heatshrink -e -w 10 -l 5".
+ *
+ * The decoder only needs the C library's stdint.h and stddef.h, and allocates nothing itself, so that it can be built
+ * and tested on any host as well as the ESP8266.
+ */
+#ifndef _HEATSHRINK_H
+#define _HEATSHRINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Attribute given to the decoder's functions. The firmware's Makefile sets this to keep them in flash, as
+// ICACHE_FLASH_ATTR does for the rest of the firmware.
+#ifndef HEATSHRINK_ATTR
+#define HEATSHRINK_ATTR
+#endif
+
+// The number of bits used for back-reference offsets. The decoder needs a window of 2^bits bytes.
+#define HEATSHRINK_WINDOW_BITS 10
+
+// The number of bits used for back-reference lengths.
+#define HEATSHRINK_LOOKAHEAD_BITS 5
+
+// The number of bytes in the decoder's window.
+#define HEATSHRINK_WINDOW_SIZE (1 << HEATSHRINK_WINDOW_BITS)
+
+// Returned by the output call-back to abandon decoding, and by heatshrink_decode once it has been abandoned.
+#define HEATSHRINK_ABANDON 0xFFFFFFFF
+
+/*
+ * Call-back used to pass decoded bytes on. Returns the number of bytes used, or HEATSHRINK_ABANDON if decoding is to be
+ * abandoned. Using fewer bytes than were passed suspends decoding, the rest being passed on again (before anything
+ * else) the next time heatshrink_decode is called.
+ */
+typedef uint32_t (*heatshrink_output_cb)(void *arg, const uint8_t *data, uint32_t len);
+
+/*
+ * Type used to define the states of the decoder.
+ */
+typedef enum {
+    HEATSHRINK_TAG,
+    HEATSHRINK_LITERAL,
+    HEATSHRINK_INDEX,
+    HEATSHRINK_COUNT,
+    HEATSHRINK_COPY
+} heatshrink_state_t;
+
+/*
+ * Structure for heatshrink decoders.
+ */
+typedef struct heatshrink_decoder {
+    heatshrink_output_cb output; // The call-back that receives the decoded bytes.
+    void *arg;                   // The argument passed to the output call-back.
+    heatshrink_state_t state;    // The current state of the decoder.
+    uint32_t bit_buf;            // Input bits that have not yet been used.
+    uint8_t bit_count;           // The number of valid bits in "bit_buf".
+    uint16_t index;              // The offset of the back-reference being decoded.
+    uint16_t count;              // The number of bytes of the back-reference still to be copied.
+    uint16_t head;               // The position in the window at which the next decoded byte is stored.
+    uint16_t flushed;            // The position in the window of the first byte not yet passed to the output.
+    uint8_t window[HEATSHRINK_WINDOW_SIZE]; // The most recently decoded bytes, used by back-references.
+} heatshrink_decoder;
+
+/*
+ * Sets up a heatshrink decoder, supplied by the caller, to pass its decoded bytes to the supplied call-back.
+ */
+void HEATSHRINK_ATTR heatshrink_decoder_init(heatshrink_decoder *hsd, heatshrink_output_cb output, void *arg);
+
+/*
+ * Decodes a block of compressed bytes, which may end part way through an encoded symbol. All bytes decoded are passed
+ * to the output call-back before this returns, unless it suspends decoding. Returns the number of bytes of the block
+ * used, which is fewer than "len" if decoding was suspended, or HEATSHRINK_ABANDON if the output call-back abandoned
+ * decoding. Once suspended, decoding carries on (with a block of no bytes, if need be) from where it left off.
+ */
+uint32_t HEATSHRINK_ATTR heatshrink_decode(heatshrink_decoder *hsd, const uint8_t *data, uint32_t len);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * json_writer.h: Writes JSON directly into a fixed buffer, without any memory allocation.
+ *
+ * A writer never writes past the end of its buffer, but keeps counting the characters it would have written, so the
+ * same code can be run twice: first with a NULL buffer to find the exact length needed, then again into a buffer of
+ * that size (typically one holding something else, such as an HTTP header, in front of the JSON). The code can also be
+ * run once for each window of a small buffer, so that the JSON can be sent a piece at a time without ever holding all
+ * of it in memory.
+ */
+#ifndef _JSON_WRITER_H
+#define _JSON_WRITER_H
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "espmissingincludes.h"
+
+// The deepest nesting of objects that a writer keeps track of.
+#define JSON_MAX_DEPTH 8
+
+/*
+ * Structure for JSON writers.
+ */
+typedef struct json_writer {
+    char *buf;         // The buffer written to, or NULL if only the length is being found.
+    int skip;          // The number of characters counted but not stored before the start of the buffer.
+    int size;          // The size of the buffer, including room for the NULL terminator.
+    int len;           // The number of characters written so far, including any that didn't fit in the buffer.
+    uint8_t depth;     // The number of objects currently open.
+    uint8_t has_value; // A bit for each open object, set once it holds a value, so the next one needs a comma.
+    bool too_deep;     // Whether the objects were ever nested deeper than JSON_MAX_DEPTH.
+} json_writer;
+
+/*
+ * Starts writing JSON into a buffer. The buffer is always kept NULL terminated, so its size must include room for the
+ * terminator.
+ *
+ * @param json The writer.
+ * @param buf The buffer to write into, or NULL to find the length of the JSON without writing it anywhere.
+ * @param size The size of the buffer, zero if it's NULL.
+ */
+void ICACHE_FLASH_ATTR json_init(json_writer *json, char *buf, int size);
+
+/*
+ * Starts writing a window of the JSON into a buffer, the first "skip" characters being counted but not stored. The
+ * buffer is always kept NULL terminated.
+ *
+ * @param json The writer.
+ * @param buf The buffer to write the window into.
+ * @param size The size of the buffer, including room for the NULL terminator.
+ * @param skip The number of characters of JSON before the window.
+ */
+void ICACHE_FLASH_ATTR json_init_window(json_writer *json, char *buf, int size, int skip);
+
+/*
+ * Opens an object, either at the top level or as the value of the last key written.
+ */
+void ICACHE_FLASH_ATTR json_begin_object(json_writer *json);
+
+/*
+ * Closes the current object.
+ */
+void ICACHE_FLASH_ATTR json_end_object(json_writer *json);
+
+/*
+ * Writes the key of the next value in the current object, escaping it if required.
+ */
+void ICACHE_FLASH_ATTR json_key(json_writer *json, const char *key);
+
+/*
+ * Writes a string value, escaping it if required.
+ */
+void ICACHE_FLASH_ATTR json_string(json_writer *json, const char *str);
+
+/*
+ * Writes a 32-bit signed integer value.
+ */
+void ICACHE_FLASH_ATTR json_int32(json_writer *json, int32_t val);
+
+/*
+ * Whether all of the JSON written so far fitted in the buffer, and the objects were nested no deeper than
+ * JSON_MAX_DEPTH.
+ */
+bool ICACHE_FLASH_ATTR json_ok(const json_writer *json);
+
+/*
+ * The number of characters stored in the buffer, not including any skipped or that didn't fit.
+ */
+int ICACHE_FLASH_ATTR json_stored(const json_writer *json);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * rs485.h: Interrupt driven, half-duplex communications over an RS485 bus, receiving via UART 0.
+ *
+ * Neither sending nor receiving blocks: the driver enable is raised, and lowered again once the last byte has left
+ * the UART, using timers and the UART's interrupts, and the frames received are gathered by the interrupts. The
+ * microsecond timers are used, so the firmware must be built with USE_US_TIMER, and system_timer_reinit must be
+ * called at the very start of user_init.
+ */
+#ifndef _RS485_H
+#define _RS485_H
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "espmissingincludes.h"
+
+// The outcome of waiting for a frame, passed to the receive call-back: either the expected number of bytes arrived, or
+// they didn't all arrive in time.
+#define RS485_RX_FRAME 0
+#define RS485_RX_TIMEOUT 1
+
+// The most bytes that can be sent at once, the size of the UART's transmit FIFO.
+#define RS485_TX_MAX_LEN 128
+
+/*
+ * Call-back for when a frame has been received, or the wait for it has timed out.
+ *
+ * @param status RS485_RX_FRAME or RS485_RX_TIMEOUT.
+ * @param len The number of bytes received into the buffer.
+ */
+typedef void (*rs485_rx_callback)(uint8_t status, uint8_t len);
+
+/*
+ * Call-back for when a frame has been sent, and the bus released.
+ */
+typedef void (*rs485_tx_callback)();
+
+/*
+ * Sets up the UARTs for the bus. The driver enable pin must already be set up as a GPIO. The interrupts post the
+ * given signal to the given task, which must call rs485_event with the event's parameter. This is done so that the
+ * bus can share a task with other work, as there are only three task priorities.
+ *
+ * @param baud_rate The bus's baud rate (8 data bits, no parity, 1 stop bit).
+ * @param tx_uart The UART used to send, UART0 or UART1.
+ * @param de_gpio The number of the GPIO driving the transceiver's driver enable, which is high while sending.
+ * @param task_pri The priority of the task that the events are posted to.
+ * @param sig The signal posted to the task.
+ */
+void ICACHE_FLASH_ATTR rs485_init(uint32_t baud_rate, uint8_t tx_uart, uint8_t de_gpio, uint8_t task_pri,
+                                  os_signal_t sig);
+
+/*
+ * Starts sending a frame, returning straight away. The data is copied, so needn't be kept.
+ *
+ * @param data The bytes to send.
+ * @param len The number of bytes, no more than RS485_TX_MAX_LEN.
+ * @param callback The call-back for when the frame has been sent, NULL if it's not needed.
+ * @return Whether the frame is being sent, false if another one still is, or it's too long.
+ */
+bool ICACHE_FLASH_ATTR rs485_send(const uint8_t *data, uint8_t len, rs485_tx_callback callback);
+
+/*
+ * Starts waiting for a frame of a known length, discarding anything already received. The wait times out after the
+ * time the frame takes to send at the baud rate, plus the time allowed for the other end to start replying, timed
+ * from when any frame still being sent has finished.
+ *
+ * @param buf The buffer that the frame is received into.
+ * @param len The length of the frame.
+ * @param turnaround_ms The number of milliseconds allowed for the other end to start replying.
+ * @param callback The call-back for when the frame has been received, or the wait times out.
+ */
+void ICACHE_FLASH_ATTR rs485_receive(uint8_t *buf, uint8_t len, uint16_t turnaround_ms, rs485_rx_callback callback);
+
+/*
+ * Handles an event posted by the interrupts. To be called by the task given to rs485_init when it receives the
+ * signal.
+ *
+ * @param par The event's parameter.
+ */
+void ICACHE_FLASH_ATTR rs485_event(os_param_t par);
+
+/*
+ * The number of microseconds taken to send a number of bytes at the bus's baud rate.
+ */
+uint32_t ICACHE_FLASH_ATTR rs485_frame_time_us(uint8_t len);
+
+#endif
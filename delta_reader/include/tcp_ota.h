@@ -8,9 +8,18 @@
 #ifndef TCP_OTA_H
 #define TCP_OTA_H
 
+/*
+ * Checks whether the running firmware has just been flashed, and if so counts this boot of it, rolling back to the
+ * previous firmware if it has already restarted too many times without being confirmed healthy.
+ * This must be called first thing at start-up, so that firmware that crashes during start-up is still rolled back.
+ */
+void ICACHE_FLASH_ATTR ota_check_boot();
+
 /*
  * Initialises the required connection information to listen for OTA messages.
  * WiFi must first have been set up for this to succeed.
+ * If the running firmware has just been flashed (as found by ota_check_boot), it is rolled back to the previous
+ * firmware unless it gets an IP address and listens for OTA connections within a minute.
  */
 void ICACHE_FLASH_ATTR ota_init();
 
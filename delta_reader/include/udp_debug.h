@@ -13,15 +13,159 @@
 // The UDP destination port for the debug packets.
 #define DBG_PORT 65432
 
-// The number of bytes to use for the debug message buffer.
-#define DBG_BUFFER_LEN 128
+// The number of bytes in the ring buffer holding debug records waiting to be sent. Must be a power of 2.
+#define DBG_RING_LEN 2048
+
+// The maximum number of bytes of text in a single debug record. Longer lines are split over multiple records.
+#define DBG_LINE_LEN 128
+
+// The maximum number of bytes sent in a single debug datagram, keeping it within a single Ethernet frame.
+#define DBG_DATAGRAM_LEN 1460
+
+// The priority of the task used to send the debug output. This is the lowest, so that debugging gets out of the way.
+#define DBG_TASK_PRI 0
+
+// The queue length for the task used to send the debug output.
+#define DBG_QUEUE_LEN 2
 
 // Stores the address to which debug packets are sent in an ip_addr structure.
 #define DBG_ADDR(ip) (ip)[0] = 10; (ip)[1] = 0; (ip)[2] = 1; (ip)[3] = 253;
 
+// The interval (in ms) at which the average cost of sending each debug datagram is reported.
+#define DBG_STATS_INTERVAL 60000
+
+// Uncomment to create and delete the UDP connection for every debug datagram (as was done originally), to compare the
+// cost of doing so with that of keeping the connection open.
+//#define DBG_CONN_PER_LINE
+
+// Each debug datagram starts with a header: DBG_DATAGRAM_MAGIC, a boot ID (4 bytes) that's chosen at random each time
+// the ESP8266 starts, and a sequence number (4 bytes) counting the datagrams sent since then, both little-endian. The
+// receiving side uses these to put the datagrams back in order and notice any that go missing.
+#define DBG_DATAGRAM_MAGIC 0xDB
+#define DBG_DATAGRAM_HEADER_LEN 9
+
+// The header is followed by one or more records, each made up of a record type byte, a length byte, the time at which
+// the record was logged (4 bytes, little-endian, from system_get_time), and then the record data, its length being
+// given by the length byte.
+#define DBG_RECORD_HEADER_LEN 6
+
+// Record type: text output from os_printf.
+#define DBG_RECORD_TEXT 0x01
+
+// Record type: a tokenized message from DBG_LOG. The data is the module (1 byte) and line number (2 bytes,
+// little-endian) of the DBG_LOG call, followed by each argument as an unsigned LEB128 encoded 32-bit value.
+#define DBG_RECORD_TOKEN 0x02
+
+// Record type: the reason for the last reset, sent once at start-up. The data is the reason, exception cause, epc1,
+// epc2, epc3, excvaddr and depc from system_get_rst_info, 4 bytes each (little-endian). After an exception or watchdog
+// reset, these are followed by the stack pointer and a snapshot of the stack (4 bytes per word) from just before the
+// reset.
+#define DBG_RECORD_RESET 0x03
+
+// The modules that log tokenized messages, so that the receiving side can find the format string of each message, and
+// so that each can have its own debug level. Every source file using DBG_LOG defines DBG_MODULE as one of these.
+#define DBG_MODULE_MAIN 1
+#define DBG_MODULE_OTA 2
+#define DBG_MODULE_DEBUG 3
+#define DBG_MODULE_BUILDER 4
+
+// The number of entries needed in an array indexed by module.
+#define DBG_MODULE_COUNT 5
+
+// The debug levels, from the most to the least important. A message is only logged if its level is no higher than
+// the module's current debug level, so DBG_LEVEL_NONE turns off all of a module's messages.
+#define DBG_LEVEL_NONE 0
+#define DBG_LEVEL_ERROR 1
+#define DBG_LEVEL_WARN 2
+#define DBG_LEVEL_INFO 3
+#define DBG_LEVEL_DEBUG 4
+#define DBG_LEVEL_TRACE 5
+
+// The most detailed debug level compiled in, usually set by the Makefile. Messages above this level are removed by the
+// compiler altogether, so cost nothing at all.
+#ifndef DBG_COMPILE_LEVEL
+#define DBG_COMPILE_LEVEL DBG_LEVEL_TRACE
+#endif
+
+// The debug level of every module at start-up, until changed by a control datagram.
+#define DBG_DEFAULT_LEVEL DBG_LEVEL_INFO
+
+// The UDP port listened to for control datagrams, which set the debug level of each module. Each is made up of the
+// DBG_CONTROL_MAGIC, followed by pairs of bytes: a module (or 0 for all modules) and the debug level to give it. The
+// reply holds the same magic, followed by the debug level of each module in turn, starting with module 1.
+#define DBG_CONTROL_PORT 65433
+#define DBG_CONTROL_MAGIC "DBGL"
+#define DBG_CONTROL_MAGIC_LEN 4
+
+// The maximum number of arguments to a tokenized message.
+#define DBG_MAX_ARGS 6
+
+// Counts the arguments (up to DBG_MAX_ARGS) passed to DBG_LOG after the format string.
+#define DBG_NARGS(...) DBG_NARGS_N(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0, dummy)
+#define DBG_NARGS_N(format, a1, a2, a3, a4, a5, a6, n, ...) n
+
+// Picks the DBG_LOG_<n> macro for the number of arguments, which drops the format string.
+#define DBG_LOG_SELECT(n) DBG_LOG_SELECT_N(n)
+#define DBG_LOG_SELECT_N(n) DBG_LOG_##n
+#define DBG_LOG_0(format) dbg_log(DBG_MODULE, __LINE__, 0)
+#define DBG_LOG_1(format, a1) dbg_log(DBG_MODULE, __LINE__, 1, a1)
+#define DBG_LOG_2(format, a1, a2) dbg_log(DBG_MODULE, __LINE__, 2, a1, a2)
+#define DBG_LOG_3(format, a1, a2, a3) dbg_log(DBG_MODULE, __LINE__, 3, a1, a2, a3)
+#define DBG_LOG_4(format, a1, a2, a3, a4) dbg_log(DBG_MODULE, __LINE__, 4, a1, a2, a3, a4)
+#define DBG_LOG_5(format, a1, a2, a3, a4, a5) dbg_log(DBG_MODULE, __LINE__, 5, a1, a2, a3, a4, a5)
+#define DBG_LOG_6(format, a1, a2, a3, a4, a5, a6) dbg_log(DBG_MODULE, __LINE__, 6, a1, a2, a3, a4, a5, a6)
+
+/*
+ * Logs a tokenized debug message, taking a format string followed by its arguments. Rather than the formatted message,
+ * only the module and line number of the call and the raw argument values are sent. The format string isn't even
+ * compiled in: dbg_tokens.py extracts the format strings from the source files at build time, and udp_debug_rx.py
+ * uses them to format the messages as they arrive. Only integer arguments (%d, %u, %x, %c and the like) can be sent
+ * this way, not strings.
+ */
+#define DBG_LOG(...) DBG_LOG_SELECT(DBG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+
+// The current debug level of each module.
+extern uint8_t dbg_levels[DBG_MODULE_COUNT];
+
+// Whether messages of the given level are currently logged by this source file's module. This is a constant false for
+// levels that aren't compiled in, so that anything depending on it is removed.
+#define DBG_ENABLED(level) (((level) <= DBG_COMPILE_LEVEL) && ((level) <= dbg_levels[DBG_MODULE]))
+
+/*
+ * Logs a tokenized debug message (as DBG_LOG) at the given level, if that level is currently enabled for the module.
+ */
+#define DBG_LOG_LEVEL(level, ...) do { if (DBG_ENABLED(level)) { DBG_LOG(__VA_ARGS__); } } while (0)
+#define DBG_ERROR(...) DBG_LOG_LEVEL(DBG_LEVEL_ERROR, __VA_ARGS__)
+#define DBG_WARN(...) DBG_LOG_LEVEL(DBG_LEVEL_WARN, __VA_ARGS__)
+#define DBG_INFO(...) DBG_LOG_LEVEL(DBG_LEVEL_INFO, __VA_ARGS__)
+#define DBG_DEBUG(...) DBG_LOG_LEVEL(DBG_LEVEL_DEBUG, __VA_ARGS__)
+#define DBG_TRACE(...) DBG_LOG_LEVEL(DBG_LEVEL_TRACE, __VA_ARGS__)
+
+/*
+ * Prints a debug message with os_printf at the given level, if that level is currently enabled for the module. This is
+ * for messages that can't be tokenized, such as those including strings, which are sent as text instead.
+ */
+#define DBG_PRINTF(level, ...) do { if (DBG_ENABLED(level)) { os_printf(__VA_ARGS__); } } while (0)
+
 /*
  * Performs the required initialisation to pass debug information through the network.
  */
 void ICACHE_FLASH_ATTR dbg_init();
 
+/*
+ * Re-creates the debug connection, needed whenever the IP address changes.
+ */
+void ICACHE_FLASH_ATTR dbg_reconnect();
+
+/*
+ * Queues a tokenized debug message to be sent. Use DBG_LOG rather than calling this directly.
+ */
+void dbg_log(uint8_t module, uint16_t line, uint8_t nargs, ...);
+
+/*
+ * Called instead of the SDK's system_restart_local (through the linker's -wrap option) as the ESP8266 restarts after
+ * an exception or watchdog reset, saving the stack to RTC memory to be sent once it has restarted.
+ */
+void __wrap_system_restart_local();
+
 #endif
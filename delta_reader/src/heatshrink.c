@@ -0,0 +1,136 @@
+/*
+ * heatshrink.c: Streaming decoder for heatshrink (LZSS) compressed data, using a small fixed window.
+ */
+#include "heatshrink.h"
+
+/*
+ * Sets up a heatshrink decoder, supplied by the caller, to pass its decoded bytes to the supplied call-back.
+ */
+void HEATSHRINK_ATTR heatshrink_decoder_init(heatshrink_decoder *hsd, heatshrink_output_cb output, void *arg) {
+    hsd->output = output;
+    hsd->arg = arg;
+    hsd->state = HEATSHRINK_TAG;
+    hsd->bit_buf = 0;
+    hsd->bit_count = 0;
+    hsd->index = 0;
+    hsd->count = 0;
+    hsd->head = 0;
+    hsd->flushed = 0;
+
+    // Back-references before the start of the data refer to zeroes.
+    for (size_t ii = 0; ii < HEATSHRINK_WINDOW_SIZE; ii++) {
+        hsd->window[ii] = 0;
+    }
+}
+
+/*
+ * Reads a number of bits (most significant first) from the input, returning zero if there aren't enough yet. Any
+ * partial bits are kept for the next call.
+ */
+static uint8_t HEATSHRINK_ATTR get_bits(heatshrink_decoder *hsd, uint8_t count, const uint8_t **data, uint32_t *len,
+                                      uint16_t *value) {
+    while (hsd->bit_count < count) {
+        if (*len == 0) {
+            return 0;
+        }
+        hsd->bit_buf = (hsd->bit_buf << 8) | **data;
+        (*data)++;
+        (*len)--;
+        hsd->bit_count += 8;
+    }
+
+    hsd->bit_count -= count;
+    *value = (hsd->bit_buf >> hsd->bit_count) & ((1 << count) - 1);
+    return 1;
+}
+
+// Results of passing decoded bytes on to the output call-back.
+#define FLUSH_DONE 0
+#define FLUSH_SUSPENDED 1
+#define FLUSH_ABANDONED 2
+
+/*
+ * Passes any decoded bytes that have not yet been output to the output call-back, moving back to the start of the
+ * window once it's full and has all been passed on.
+ */
+static uint8_t HEATSHRINK_ATTR flush_output(heatshrink_decoder *hsd) {
+    if (hsd->head > hsd->flushed) {
+        uint32_t used = hsd->output(hsd->arg, &hsd->window[hsd->flushed], hsd->head - hsd->flushed);
+        if (used == HEATSHRINK_ABANDON) {
+            return FLUSH_ABANDONED;
+        }
+        hsd->flushed += used;
+        if (hsd->flushed < hsd->head) {
+            return FLUSH_SUSPENDED;
+        }
+    }
+
+    if (hsd->head == HEATSHRINK_WINDOW_SIZE) {
+        hsd->head = 0;
+        hsd->flushed = 0;
+    }
+    return FLUSH_DONE;
+}
+
+/*
+ * Stores a decoded byte in the window, passing the window on to the output whenever it fills.
+ */
+static uint8_t HEATSHRINK_ATTR put_byte(heatshrink_decoder *hsd, uint8_t c) {
+    hsd->window[hsd->head++] = c;
+    return (hsd->head == HEATSHRINK_WINDOW_SIZE) ? flush_output(hsd) : FLUSH_DONE;
+}
+
+/*
+ * Decodes a block of compressed bytes, which may end part way through an encoded symbol. All bytes decoded are passed
+ * to the output call-back before this returns, unless it suspends decoding. Returns the number of bytes of the block
+ * used, which is fewer than "len" if decoding was suspended, or HEATSHRINK_ABANDON if the output call-back abandoned
+ * decoding. Once suspended, decoding carries on (with a block of no bytes, if need be) from where it left off.
+ */
+uint32_t HEATSHRINK_ATTR heatshrink_decode(heatshrink_decoder *hsd, const uint8_t *data, uint32_t len) {
+    uint32_t remaining = len;
+    uint16_t value;
+
+    // Pass on whatever was left over when decoding was last suspended, before decoding any more.
+    uint8_t result = flush_output(hsd);
+    while (result == FLUSH_DONE) {
+        if (hsd->state == HEATSHRINK_TAG) {
+            // A set bit introduces a literal byte, a clear bit a back-reference.
+            if (!get_bits(hsd, 1, &data, &remaining, &value)) {
+                break;
+            }
+            hsd->state = value ? HEATSHRINK_LITERAL : HEATSHRINK_INDEX;
+        } else if (hsd->state == HEATSHRINK_LITERAL) {
+            if (!get_bits(hsd, 8, &data, &remaining, &value)) {
+                break;
+            }
+            hsd->state = HEATSHRINK_TAG;
+            result = put_byte(hsd, (uint8_t)value);
+        } else if (hsd->state == HEATSHRINK_INDEX) {
+            // Offsets are stored less one.
+            if (!get_bits(hsd, HEATSHRINK_WINDOW_BITS, &data, &remaining, &value)) {
+                break;
+            }
+            hsd->index = value + 1;
+            hsd->state = HEATSHRINK_COUNT;
+        } else if (hsd->state == HEATSHRINK_COUNT) {
+            // Lengths are also stored less one.
+            if (!get_bits(hsd, HEATSHRINK_LOOKAHEAD_BITS, &data, &remaining, &value)) {
+                break;
+            }
+            hsd->count = value + 1;
+            hsd->state = HEATSHRINK_COPY;
+        } else if (hsd->count > 0) {
+            // Copy byte by byte, as the reference may overlap the bytes it produces.
+            hsd->count--;
+            result = put_byte(hsd, hsd->window[(hsd->head - hsd->index) & (HEATSHRINK_WINDOW_SIZE - 1)]);
+        } else {
+            hsd->state = HEATSHRINK_TAG;
+        }
+    }
+
+    // Pass on everything decoded from this block.
+    if (result == FLUSH_DONE) {
+        result = flush_output(hsd);
+    }
+    return (result == FLUSH_ABANDONED) ? HEATSHRINK_ABANDON : len - remaining;
+}
@@ -0,0 +1,166 @@
+/*
+ * json_writer.c: Writes JSON directly into a fixed buffer, without any memory allocation.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "espmissingincludes.h"
+
+#include "json_writer.h"
+
+// The hexadecimal digits, for escaping control characters.
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/*
+ * Writes a character, if it's within the window and there's room for it (and the NULL terminator) in the buffer. It's
+ * counted either way.
+ */
+LOCAL void ICACHE_FLASH_ATTR json_putc(json_writer *json, char c) {
+    int pos = json->len - json->skip;
+    if ((pos >= 0) && (pos + 1 < json->size)) {
+        json->buf[pos] = c;
+        json->buf[pos + 1] = '\0';
+    }
+    json->len++;
+}
+
+/*
+ * Writes a string as it is, without quotes or escaping.
+ */
+LOCAL void ICACHE_FLASH_ATTR json_puts(json_writer *json, const char *str) {
+    while (*str != '\0') {
+        json_putc(json, *str++);
+    }
+}
+
+/*
+ * Writes a string in quotes, escaping the quotes, backslashes and control characters within it.
+ */
+LOCAL void ICACHE_FLASH_ATTR json_put_quoted(json_writer *json, const char *str) {
+    json_putc(json, '"');
+    for (; *str != '\0'; str++) {
+        uint8_t c = (uint8_t)*str;
+        if ((c == '"') || (c == '\\')) {
+            json_putc(json, '\\');
+            json_putc(json, c);
+        } else if (c < 0x20) {
+            json_puts(json, "\\u00");
+            json_putc(json, HEX_DIGITS[c >> 4]);
+            json_putc(json, HEX_DIGITS[c & 0x0F]);
+        } else {
+            json_putc(json, c);
+        }
+    }
+    json_putc(json, '"');
+}
+
+/*
+ * Starts writing JSON into a buffer. The buffer is always kept NULL terminated, so its size must include room for the
+ * terminator.
+ */
+void ICACHE_FLASH_ATTR json_init(json_writer *json, char *buf, int size) {
+    json_init_window(json, buf, size, 0);
+}
+
+/*
+ * Starts writing a window of the JSON into a buffer, the first "skip" characters being counted but not stored. The
+ * buffer is always kept NULL terminated.
+ */
+void ICACHE_FLASH_ATTR json_init_window(json_writer *json, char *buf, int size, int skip) {
+    json->buf = buf;
+    json->skip = skip;
+    json->size = (buf == NULL) ? 0 : size;
+    json->len = 0;
+    json->depth = 0;
+    json->has_value = 0;
+    json->too_deep = false;
+    if (json->size > 0) {
+        json->buf[0] = '\0';
+    }
+}
+
+/*
+ * Opens an object, either at the top level or as the value of the last key written.
+ */
+void ICACHE_FLASH_ATTR json_begin_object(json_writer *json) {
+    if (json->depth == JSON_MAX_DEPTH) {
+        json->too_deep = true;
+    } else {
+        json->depth++;
+        json->has_value &= ~(1 << (json->depth - 1));
+    }
+    json_putc(json, '{');
+}
+
+/*
+ * Closes the current object.
+ */
+void ICACHE_FLASH_ATTR json_end_object(json_writer *json) {
+    if (json->depth > 0) {
+        json->depth--;
+    }
+    json_putc(json, '}');
+}
+
+/*
+ * Writes the key of the next value in the current object, escaping it if required.
+ */
+void ICACHE_FLASH_ATTR json_key(json_writer *json, const char *key) {
+    // Separate this from the object's previous value, if any.
+    if (json->depth > 0) {
+        uint8_t bit = 1 << (json->depth - 1);
+        if (json->has_value & bit) {
+            json_putc(json, ',');
+        }
+        json->has_value |= bit;
+    }
+    json_put_quoted(json, key);
+    json_putc(json, ':');
+}
+
+/*
+ * Writes a string value, escaping it if required.
+ */
+void ICACHE_FLASH_ATTR json_string(json_writer *json, const char *str) {
+    json_put_quoted(json, str);
+}
+
+/*
+ * Writes a 32-bit signed integer value.
+ */
+void ICACHE_FLASH_ATTR json_int32(json_writer *json, int32_t val) {
+    // Work out the digits backwards, using an unsigned value so that the most negative value can be negated.
+    char digits[10];
+    uint8_t count = 0;
+    uint32_t uval = (val < 0) ? -(uint32_t)val : (uint32_t)val;
+    do {
+        digits[count++] = '0' + (uval % 10);
+        uval /= 10;
+    } while (uval > 0);
+
+    if (val < 0) {
+        json_putc(json, '-');
+    }
+    while (count > 0) {
+        json_putc(json, digits[--count]);
+    }
+}
+
+/*
+ * Whether all of the JSON written so far fitted in the buffer, and the objects were nested no deeper than
+ * JSON_MAX_DEPTH.
+ */
+bool ICACHE_FLASH_ATTR json_ok(const json_writer *json) {
+    return ((json->buf == NULL) || (json->len - json->skip < json->size)) && !json->too_deep;
+}
+
+/*
+ * The number of characters stored in the buffer, not including any skipped or that didn't fit.
+ */
+int ICACHE_FLASH_ATTR json_stored(const json_writer *json) {
+    int stored = json->len - json->skip;
+    if (stored > json->size - 1) {
+        stored = json->size - 1;
+    }
+    return (stored < 0) ? 0 : stored;
+}
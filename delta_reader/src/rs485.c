@@ -0,0 +1,360 @@
+/*
+ * rs485.c: Interrupt driven, half-duplex communications over an RS485 bus, receiving via UART 0.
+ *
+ * To send a frame, the driver enable is raised and the line left idle for a byte time, then the whole frame is put in
+ * the UART's transmit FIFO. The FIFO empty interrupt fires once the last byte has started to go out, after which the
+ * driver enable is dropped once that byte and a guard bit have had time to finish. Each of these waits is timed from
+ * the baud rate with a microsecond timer, rather than busy waiting, so the CPU is free for the WiFi throughout.
+ *
+ * Rather than polling the UART for the reply to each request, the UART's FIFO full and receive timeout interrupts
+ * gather the bytes into the caller's buffer as they arrive. The FIFO full threshold is kept at the number of bytes
+ * still needed, so the interrupt fires as soon as the last byte of the frame arrives, and a task is posted to hand it
+ * on. The receive timeout interrupt picks up any stragglers below the threshold, such as after a discarded leading
+ * zero. The wait for the whole frame is timed from the baud rate and the frame's length, so a missing reply is given
+ * up on as soon as it can't arrive, rather than after a fixed number of polls.
+ */
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "gpio.h"
+#include "espmissingincludes.h"
+
+#include "driver/uart.h"
+
+#include "rs485.h"
+
+// The number of bits sent for each byte: a start bit, 8 data bits and a stop bit.
+#define RS485_BITS_PER_BYTE 10
+
+// The number of byte times that the line must be idle before the receive timeout interrupt picks up the bytes in the
+// FIFO.
+#define RS485_RX_TOUT_BYTES 2
+
+// The largest FIFO full threshold that the UART supports.
+#define RS485_MAX_THRESHOLD 0x7F
+
+// The transmit FIFO empty threshold, so that the interrupt fires once the last byte is out of the FIFO.
+#define RS485_TX_EMPTY_THRESHOLD 1
+
+// The number of bit times that the driver is enabled for before the first byte is sent, so the other end sees an
+// idle line before the first start bit.
+#define RS485_LEAD_BITS 10
+
+// The number of bit times that the driver is left enabled for after the last stop bit, to be sure it's been sent.
+#define RS485_GUARD_BITS 1
+
+// The parameters of the events posted to the task.
+#define RS485_EVENT_RX 0
+#define RS485_EVENT_TX 1
+
+// The states of the receiver.
+#define RS485_STATE_IDLE 0
+#define RS485_STATE_RECEIVING 1
+#define RS485_STATE_DONE 2
+
+// The states of the transmitter: idle, waiting before the first byte, sending from the FIFO, or waiting for the last
+// byte to finish.
+#define RS485_TX_IDLE 0
+#define RS485_TX_LEAD 1
+#define RS485_TX_SENDING 2
+#define RS485_TX_TRAIL 3
+
+// The bus's baud rate.
+LOCAL uint32_t baud = 0;
+
+// The UART used to send.
+LOCAL uint8_t tx_uart = UART1;
+
+// The GPIO bit for the driver enable.
+LOCAL uint32_t de_bit = 0;
+
+// The priority of the task that the events from the interrupts are posted to.
+LOCAL uint8_t event_task_pri = 0;
+
+// The signal posted to the task with the events.
+LOCAL os_signal_t event_sig = 0;
+
+// The current state of the receiver, shared with the interrupt handler.
+LOCAL volatile uint8_t rx_state = RS485_STATE_IDLE;
+
+// The buffer that the current frame is received into.
+LOCAL uint8_t *rx_buf = NULL;
+
+// The number of bytes expected in the current frame.
+LOCAL uint8_t rx_expected = 0;
+
+// The number of bytes of the current frame received so far.
+LOCAL volatile uint8_t rx_len = 0;
+
+// The call-back for the current frame.
+LOCAL rs485_rx_callback rx_callback = NULL;
+
+// The timer used to give up on a frame that hasn't arrived in time.
+LOCAL os_timer_t rx_timer;
+
+// The number of milliseconds to wait for the current frame, once the frame being sent has finished.
+LOCAL uint32_t rx_timeout_ms = 0;
+
+// Whether the receive timer is waiting to be started, once the frame being sent has finished.
+LOCAL bool rx_timer_pending = false;
+
+// The current state of the transmitter.
+LOCAL uint8_t tx_state = RS485_TX_IDLE;
+
+// The frame being sent.
+LOCAL uint8_t tx_buf[RS485_TX_MAX_LEN];
+
+// The number of bytes in the frame being sent.
+LOCAL uint8_t tx_len = 0;
+
+// The call-back for the frame being sent.
+LOCAL rs485_tx_callback tx_callback = NULL;
+
+// The microsecond timer used to time the driver enable around the frame being sent.
+LOCAL os_timer_t tx_timer;
+
+/*
+ * The number of microseconds taken to send a number of bits at the bus's baud rate, rounded up.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR bit_time_us(uint32_t bits) {
+    return (baud == 0) ? 0 : (bits * 1000000 + baud - 1) / baud;
+}
+
+/*
+ * Sets the FIFO full threshold, so the interrupt fires once the given number of bytes have arrived.
+ */
+LOCAL void set_rx_threshold(uint8_t count) {
+    if (count > RS485_MAX_THRESHOLD) {
+        count = RS485_MAX_THRESHOLD;
+    }
+    WRITE_PERI_REG(UART_CONF1(UART0),
+                   ((count & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((RS485_RX_TOUT_BYTES & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S) |
+                   UART_RX_TOUT_EN |
+                   ((RS485_TX_EMPTY_THRESHOLD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S));
+}
+
+/*
+ * Interrupt handler for the UARTs, which moves any received bytes from the FIFO into the frame being received, and
+ * notes when the frame being sent has left the FIFO. This runs from IRAM, so mustn't call anything in flash.
+ */
+LOCAL void rs485_intr_handler(void *arg) {
+    // The transmit FIFO empty interrupt is only wanted once per frame.
+    if ((READ_PERI_REG(UART_INT_ST(tx_uart)) & UART_TXFIFO_EMPTY_INT_ST) != 0) {
+        CLEAR_PERI_REG_MASK(UART_INT_ENA(tx_uart), UART_TXFIFO_EMPTY_INT_ENA);
+        WRITE_PERI_REG(UART_INT_CLR(tx_uart), UART_TXFIFO_EMPTY_INT_CLR);
+        system_os_post(event_task_pri, event_sig, RS485_EVENT_TX);
+    }
+
+    uint32_t status = READ_PERI_REG(UART_INT_ST(UART0));
+    if ((status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) != 0) {
+        uint8_t count = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+        for (uint8_t ii = 0; ii < count; ii++) {
+            uint8_t rx_char = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
+            if (rx_state != RS485_STATE_RECEIVING) {
+                // Nothing is wanted at the moment, discard it.
+            } else if ((rx_char == 0) && (rx_len == 0)) {
+                // Discard this leading zero, it's a comms artifact.
+            } else {
+                rx_buf[rx_len++] = rx_char;
+                if (rx_len == rx_expected) {
+                    // The frame is complete, pass it on straight away.
+                    rx_state = RS485_STATE_DONE;
+                    system_os_post(event_task_pri, event_sig, RS485_EVENT_RX);
+                }
+            }
+        }
+
+        // Fire again when the rest of the frame is in, or the next byte if nothing's wanted.
+        set_rx_threshold((rx_state == RS485_STATE_RECEIVING) ? rx_expected - rx_len : 1);
+    }
+
+    // Only clear the interrupts after the FIFO has been drained, else the FIFO full one just fires again.
+    WRITE_PERI_REG(UART_INT_CLR(UART0), status);
+}
+
+/*
+ * Call-back for when a frame hasn't arrived in time.
+ */
+LOCAL void ICACHE_FLASH_ATTR rx_timeout_cb(void *arg) {
+    // The frame may be completed by the interrupt at any moment, in which case the task will hand it on.
+    ETS_UART_INTR_DISABLE();
+    bool timed_out = (rx_state == RS485_STATE_RECEIVING);
+    if (timed_out) {
+        rx_state = RS485_STATE_IDLE;
+        set_rx_threshold(1);
+    }
+    ETS_UART_INTR_ENABLE();
+
+    if (timed_out && (rx_callback != NULL)) {
+        rx_callback(RS485_RX_TIMEOUT, rx_len);
+    }
+}
+
+/*
+ * Call-back for the driver enable timer, which either starts sending the frame once the line has been driven idle for
+ * long enough, or releases the bus once the last byte has been sent.
+ */
+LOCAL void ICACHE_FLASH_ATTR tx_timer_cb(void *arg) {
+    if (tx_state == RS485_TX_LEAD) {
+        // The whole frame fits in the FIFO, so it can all be handed over now.
+        for (uint8_t ii = 0; ii < tx_len; ii++) {
+            WRITE_PERI_REG(UART_FIFO(tx_uart), tx_buf[ii]);
+        }
+        tx_state = RS485_TX_SENDING;
+        ETS_UART_INTR_DISABLE();
+        WRITE_PERI_REG(UART_INT_CLR(tx_uart), UART_TXFIFO_EMPTY_INT_CLR);
+        SET_PERI_REG_MASK(UART_INT_ENA(tx_uart), UART_TXFIFO_EMPTY_INT_ENA);
+        ETS_UART_INTR_ENABLE();
+    } else if (tx_state == RS485_TX_TRAIL) {
+        gpio_output_set(0, de_bit, de_bit, 0);
+        tx_state = RS485_TX_IDLE;
+
+        // The wait for any reply starts now.
+        if (rx_timer_pending) {
+            rx_timer_pending = false;
+            os_timer_arm(&rx_timer, rx_timeout_ms, 0);
+        }
+        if (tx_callback != NULL) {
+            tx_callback();
+        }
+    }
+}
+
+/*
+ * Handles the last of the frame being sent leaving the FIFO, waiting for it to finish before releasing the bus.
+ */
+LOCAL void ICACHE_FLASH_ATTR tx_event() {
+    if (tx_state != RS485_TX_SENDING) {
+        return;
+    }
+
+    // The last byte is still being shifted out, as may be the one before it, depending on when the interrupt fired.
+    uint8_t count = (READ_PERI_REG(UART_STATUS(tx_uart)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+    tx_state = RS485_TX_TRAIL;
+    os_timer_arm_us(&tx_timer, bit_time_us((count + 1) * RS485_BITS_PER_BYTE + RS485_GUARD_BITS), 0);
+}
+
+/*
+ * Handles a received frame, passing it on to its call-back.
+ */
+LOCAL void ICACHE_FLASH_ATTR rx_event() {
+    // Ignore anything left over from a frame that has since timed out, or been replaced.
+    if (rx_state != RS485_STATE_DONE) {
+        return;
+    }
+    os_timer_disarm(&rx_timer);
+    rx_timer_pending = false;
+    rx_state = RS485_STATE_IDLE;
+    if (rx_callback != NULL) {
+        rx_callback(RS485_RX_FRAME, rx_len);
+    }
+}
+
+/*
+ * Sets up the UARTs for the bus.
+ */
+void ICACHE_FLASH_ATTR rs485_init(uint32_t baud_rate, uint8_t tx_uart_no, uint8_t de_gpio, uint8_t task_pri,
+                                  os_signal_t sig) {
+    baud = baud_rate;
+    tx_uart = tx_uart_no;
+    de_bit = BIT(de_gpio);
+    event_task_pri = task_pri;
+    event_sig = sig;
+
+    // The driver enable is an output, low until there's something to send.
+    gpio_output_set(0, de_bit, de_bit, 0);
+
+    ETS_UART_INTR_DISABLE();
+    uart_div_modify(UART0, UART_CLK_FREQ / baud_rate);
+
+    // Reset the FIFOs, and clear anything pending.
+    SET_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST | UART_TXFIFO_RST);
+    CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST | UART_TXFIFO_RST);
+    set_rx_threshold(1);
+    WRITE_PERI_REG(UART_INT_CLR(UART0), 0xFFFF);
+    if (tx_uart != UART0) {
+        uart_div_modify(tx_uart, UART_CLK_FREQ / baud_rate);
+        SET_PERI_REG_MASK(UART_CONF0(tx_uart), UART_RXFIFO_RST | UART_TXFIFO_RST);
+        CLEAR_PERI_REG_MASK(UART_CONF0(tx_uart), UART_RXFIFO_RST | UART_TXFIFO_RST);
+        WRITE_PERI_REG(UART_CONF1(tx_uart),
+                       (RS485_TX_EMPTY_THRESHOLD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S);
+        WRITE_PERI_REG(UART_INT_ENA(tx_uart), 0);
+        WRITE_PERI_REG(UART_INT_CLR(tx_uart), 0xFFFF);
+    }
+
+    // Only the receive interrupts are wanted.
+    WRITE_PERI_REG(UART_INT_ENA(UART0), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+    ETS_UART_INTR_ATTACH(rs485_intr_handler, NULL);
+    ETS_UART_INTR_ENABLE();
+
+    os_timer_disarm(&rx_timer);
+    os_timer_setfn(&rx_timer, (os_timer_func_t *)rx_timeout_cb, NULL);
+    os_timer_disarm(&tx_timer);
+    os_timer_setfn(&tx_timer, (os_timer_func_t *)tx_timer_cb, NULL);
+}
+
+/*
+ * Starts sending a frame, returning straight away.
+ */
+bool ICACHE_FLASH_ATTR rs485_send(const uint8_t *data, uint8_t len, rs485_tx_callback callback) {
+    if ((tx_state != RS485_TX_IDLE) || (len > RS485_TX_MAX_LEN)) {
+        return false;
+    }
+    os_memcpy(tx_buf, data, len);
+    tx_len = len;
+    tx_callback = callback;
+
+    // Drive the line idle for a moment before sending the frame.
+    tx_state = RS485_TX_LEAD;
+    gpio_output_set(de_bit, 0, de_bit, 0);
+    os_timer_arm_us(&tx_timer, bit_time_us(RS485_LEAD_BITS), 0);
+    return true;
+}
+
+/*
+ * Starts waiting for a frame of a known length, discarding anything already received.
+ */
+void ICACHE_FLASH_ATTR rs485_receive(uint8_t *buf, uint8_t len, uint16_t turnaround_ms, rs485_rx_callback callback) {
+    os_timer_disarm(&rx_timer);
+    rx_timer_pending = false;
+
+    ETS_UART_INTR_DISABLE();
+    SET_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST);
+    CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST);
+    rx_buf = buf;
+    rx_expected = len;
+    rx_len = 0;
+    rx_callback = callback;
+    rx_state = RS485_STATE_RECEIVING;
+    set_rx_threshold(len);
+    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
+    ETS_UART_INTR_ENABLE();
+
+    // Allow for the frame itself, rounded up to the next millisecond, as well as the other end's turnaround. The other
+    // end can't start replying until anything being sent has finished.
+    rx_timeout_ms = turnaround_ms + (rs485_frame_time_us(len) + 999) / 1000;
+    if (tx_state == RS485_TX_IDLE) {
+        os_timer_arm(&rx_timer, rx_timeout_ms, 0);
+    } else {
+        rx_timer_pending = true;
+    }
+}
+
+/*
+ * Handles an event posted by the interrupts.
+ */
+void ICACHE_FLASH_ATTR rs485_event(os_param_t par) {
+    if (par == RS485_EVENT_TX) {
+        tx_event();
+    } else {
+        rx_event();
+    }
+}
+
+/*
+ * The number of microseconds taken to send a number of bytes at the bus's baud rate.
+ */
+uint32_t ICACHE_FLASH_ATTR rs485_frame_time_us(uint8_t len) {
+    return bit_time_us((uint32_t)len * RS485_BITS_PER_BYTE);
+}
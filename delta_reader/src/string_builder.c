@@ -11,8 +11,12 @@
 #include "espmissingincludes.h"
 #include "user_interface.h"
 
+#include "udp_debug.h"
 #include "string_builder.h"
 
+// The module used to identify this file's tokenized debug messages.
+#define DBG_MODULE DBG_MODULE_BUILDER
+
 LOCAL bool ICACHE_FLASH_ATTR resize_string_builder(string_builder *buf, unsigned int additional_required);
 
 /*
@@ -67,15 +71,15 @@ bool ICACHE_FLASH_ATTR append_string_builder(string_builder *buf, const char *st
         // We need to increase the size of the builder to fit the string in.
         if (!resize_string_builder(buf, len - free)) {
             // We were unable to resize the builder.
-            os_printf("Unable to resize builder for string \"%s\".", str);
+            DBG_PRINTF(DBG_LEVEL_ERROR, "Unable to resize builder for string \"%s\".\n", str);
             return false;
         }
     }
 
     // Add the string.
     os_memmove(&buf->buf[buf->len], str, len - 1);
-    buf->buf[buf->len + len] = '\0';
     buf->len += len - 1;
+    buf->buf[buf->len] = '\0';
     return true;
 }
 
@@ -90,7 +94,7 @@ bool ICACHE_FLASH_ATTR append_string_builder_to_string_builder(string_builder *b
         // We need to increase the size of the builder to fit the string in.
         if (!resize_string_builder(buf, source->len - free + 1)) {
             // We were unable to resize the builder.
-            os_printf("Unable to resize builder for string builder appending\n.");
+            DBG_ERROR("Unable to resize builder for string builder appending.\n");
             return false;
         }
     }
@@ -134,9 +138,9 @@ LOCAL bool ICACHE_FLASH_ATTR resize_string_builder(string_builder *buf,
                                                    unsigned int additional_required) {
     // Find the new size of the builder.
     int new_size;
-    if ((buf->allocated + buf->allocated - buf->len) < additional_required) {
+    if (buf->allocated < additional_required) {
         // Merely doubling the builder won't help, create the additional requried.
-        new_size = buf->len + additional_required;
+        new_size = buf->allocated + additional_required;
     } else {
         new_size = buf->allocated + buf->allocated;
     }
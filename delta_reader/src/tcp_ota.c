@@ -1,6 +1,9 @@
 /*
  * tcp_ota.c: Over The Air (OTA) firmware upgrade via direct TCP/IP connection.
  *
+ * A whole fleet of devices can also be upgraded at once via UDP multicast, with each device reporting the sectors it
+ * is missing so that the sender can repeat just those.
+ *
  * NOTE that this does not perform any security checks, so don't rely on this for production use!
  *
  * Author: Ian Marshall
@@ -17,13 +20,112 @@
 #include "user_interface.h"
 #include "upgrade.h"
 #include "espmissingincludes.h"
+#include "crc.h"
+#include "heatshrink.h"
+#include "udp_debug.h"
 #include "tcp_ota.h"
 
+// The module used to identify this file's tokenized debug messages.
+#define DBG_MODULE DBG_MODULE_OTA
+
 // The TCP port used to listen to for connections.
 #define OTA_PORT 65056
 
-// The number of bytes to use for the OTA message buffer (NOT the firmware buffer).
-#define OTA_BUFFER_LEN 32
+// The maximum number of bytes in a header line, including the CR/LF.
+#define OTA_LINE_MAX 256
+
+// The number of sector buffers used for the firmware. While one sector is being written to flash, the next is filled.
+#define OTA_SECTOR_BUFFERS 2
+
+// The priority of the task used to write firmware sectors to flash.
+#define OTA_WRITE_PRI 2
+
+// The queue length for the task used to write firmware sectors to flash, with room for a sector from each buffer and
+// the next part of a patch copy operation, as well as a sector from each multicast buffer (which may still be queued
+// when a TCP upgrade takes over).
+#define OTA_WRITE_QUEUE_LEN (2 * OTA_SECTOR_BUFFERS + 1)
+
+// Flash write task event: the sector buffer given by the event's parameter is to be written to flash.
+#define OTA_EVENT_SECTOR 0
+
+// Flash write task event: the next part of the queued patch copy operation is to be carried out.
+#define OTA_EVENT_COPY 1
+
+// Flash write task event: the multicast sector buffer given by the event's parameter is to be written to flash.
+#define OTA_EVENT_MCAST_SECTOR 2
+
+// The number of bytes read from the running firmware image at a time when applying a patch's copy operations.
+#define OTA_COPY_CHUNK 256
+
+// Patch operation: copies bytes from the running firmware image. Followed by a 32-bit little-endian source offset
+// within the running image, and a 32-bit little-endian length.
+#define PATCH_OP_COPY 0x01
+
+// Patch operation: inserts literal bytes. Followed by a 32-bit little-endian length, and then that many bytes.
+#define PATCH_OP_INSERT 0x02
+
+// The RTC user memory block holding the progress of the current OTA upgrade, so that it can be resumed after the
+// connection drops (or even the ESP8266 resets).
+#define OTA_RESUME_RTC_BLOCK 64
+
+// Value marking the OTA resume information in RTC memory as valid ("OTAR").
+#define OTA_RESUME_MAGIC 0x5241544F
+
+// The RTC user memory block holding the health check of a newly flashed image, following the resume information.
+#define OTA_HEALTH_RTC_BLOCK 72
+
+// Value marking a newly flashed image as still to be confirmed healthy in RTC memory ("OTAH").
+#define OTA_HEALTH_MAGIC 0x4841544F
+
+// The time (in ms) a newly flashed image has to get an IP address and listen for OTA connections before the previous
+// image is booted instead.
+#define OTA_HEALTH_TIMEOUT 60000
+
+// The interval (in ms) at which the health of a newly flashed image is checked.
+#define OTA_HEALTH_INTERVAL 500
+
+// The number of times a newly flashed image may be started (crashing or being reset before it is confirmed healthy)
+// before the previous image is booted instead.
+#define OTA_HEALTH_MAX_BOOTS 3
+
+// The UDP port used to listen for multicast OTA datagrams.
+#define OTA_MCAST_PORT 65057
+
+// Stores the multicast group address to which multicast OTA datagrams are sent in an ip_addr structure.
+#define OTA_MCAST_ADDR(ip) IP4_ADDR(ip, 239, 255, 80, 56)
+
+// Value identifying multicast OTA datagrams ("OTAM").
+#define OTA_MCAST_MAGIC 0x4D41544F
+
+// The number of bytes in the header of each multicast OTA datagram.
+#define OTA_MCAST_HEADER_LEN 16
+
+// The maximum number of firmware bytes in a multicast data datagram. Sectors are sent in chunks of this size.
+#define OTA_MCAST_CHUNK 1024
+
+// The maximum number of sectors in a firmware image.
+#define OTA_MCAST_MAX_SECTORS ((FIRMWARE_SIZE + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE)
+
+// The number of bytes in the bitmap of sectors received.
+#define OTA_MCAST_BITMAP_LEN ((OTA_MCAST_MAX_SECTORS + 7) / 8)
+
+// Multicast datagram types. Announcements are followed by the 32-bit image length and 32-bit CRC-32, then optionally
+// those of the image being sent for the other unit, data by up to a chunk of firmware, and status replies (sent
+// directly to the sender) by the received sector bitmap.
+#define OTA_MCAST_ANNOUNCE 0x01
+#define OTA_MCAST_DATA 0x02
+#define OTA_MCAST_QUERY 0x03
+#define OTA_MCAST_STATUS 0x04
+
+// Flags used in status replies.
+#define OTA_MCAST_STATUS_COMPLETE 0x01
+
+// The interval (in ms) at which the multicast group membership is checked against the station's IP address.
+#define OTA_MCAST_JOIN_INTERVAL 5000
+
+// When a sector is still being written, reception is held once the free space in the sector being filled drops below
+// this many bytes (a full TCP segment), so that the next segment can never overrun both buffers.
+#define OTA_HOLD_THRESHOLD 1460
 
 // Structure holding the TCP connection information for the OTA connection.
 LOCAL struct espconn ota_conn;
@@ -34,9 +136,46 @@ LOCAL esp_tcp ota_proto;
 // Timer used for rebooting the ESP8266 after an OTA upgrade is complete.
 LOCAL os_timer_t ota_reboot_timer;
 
-// Buffer used to hold the new firmware until we have received it all. This is not statically allocated, to avoid 
-// constantly blocking out the memory used, even when no OTA upgrade is in progress.
-LOCAL uint8_t *ota_firmware = NULL;
+// Flag as to whether the OTA connection is being listened for.
+LOCAL bool ota_listening = false;
+
+// Timer used for checking the health of a newly flashed image.
+LOCAL os_timer_t ota_health_timer;
+
+// Flag as to whether the running image has just been flashed, and its health is being checked.
+LOCAL bool ota_health_checking = false;
+
+// The time (in ms) for which the health of a newly flashed image has been checked.
+LOCAL uint32_t ota_health_elapsed = 0;
+
+// Buffers used to hold the new firmware until each sector is written to flash. These are not statically allocated, to
+// avoid constantly blocking out the memory used, even when no OTA upgrade is in progress.
+LOCAL uint8_t *ota_firmware[OTA_SECTOR_BUFFERS];
+
+// The index of the sector buffer currently being filled with received firmware.
+LOCAL uint8_t ota_fill_buf = 0;
+
+// Flags as to whether each sector buffer is waiting to be written to flash by the write task.
+LOCAL bool ota_sector_pending[OTA_SECTOR_BUFFERS];
+
+// The flash address to which each pending sector buffer is to be written.
+LOCAL uint32_t ota_sector_address[OTA_SECTOR_BUFFERS];
+
+// The number of firmware bytes held in each pending sector buffer.
+LOCAL uint32_t ota_sector_len[OTA_SECTOR_BUFFERS];
+
+// The CRC-32 value of the firmware image up to the end of each pending sector buffer.
+LOCAL uint32_t ota_sector_crc[OTA_SECTOR_BUFFERS];
+
+// The queue used for posting sectors to the flash write task.
+LOCAL os_event_t ota_write_queue[OTA_WRITE_QUEUE_LEN];
+
+// The connection currently sending the firmware, used to reply from the flash write task.
+LOCAL struct espconn *ota_active_conn = NULL;
+
+// Flag as to whether reception on the OTA connection is currently being held back until a sector has been written, or
+// a patch copy operation has been carried out.
+LOCAL bool ota_held = false;
 
 // The total number of bytes expected for the firmware image that is to be flashed.
 LOCAL uint32_t ota_firmware_size = 0;
@@ -44,15 +183,157 @@ LOCAL uint32_t ota_firmware_size = 0;
 // The total number of bytes received for the firmware image that is to be flashed.
 LOCAL uint32_t ota_firmware_received = 0;
 
-// The number of bytes that have currently been received into the "ota_firmware" buffer, which is reset every 4KB.
+// The total number of bytes of the firmware image that have been written to flash.
+LOCAL uint32_t ota_firmware_written = 0;
+
+// The CRC-32 value of the firmware image received so far.
+LOCAL uint32_t ota_firmware_crc = 0;
+
+// The CRC-32 value expected for the whole firmware image, as supplied by the remote system.
+LOCAL uint32_t ota_expected_crc = 0;
+
+// Flag as to whether the remote system has supplied the expected CRC-32 value for the firmware image.
+LOCAL bool ota_expected_crc_set = false;
+
+// The number of bytes that have currently been received into the "ota_firmware" fill buffer, which is reset every 4KB.
 LOCAL uint32_t ota_firmware_len = 0;
 
-// Buffer used for receiving header information via TCP, allowing the header information to be split over multiple 
-// packets.
-LOCAL uint8_t ota_buffer[OTA_BUFFER_LEN];
+// Buffer holding the start of a header line that has been split over multiple packets. Complete lines are parsed where
+// they were received, so this is only allocated once a line is split.
+LOCAL char *ota_line = NULL;
+
+// The number of bytes currently held in the header line buffer.
+LOCAL uint16_t ota_line_len = 0;
+
+// The total number of bytes expected for the patch that is to be applied to the running image, or zero if the full
+// firmware image is being sent.
+LOCAL uint32_t ota_patch_size = 0;
+
+// The total number of patch bytes received so far.
+LOCAL uint32_t ota_patch_received = 0;
+
+// Flag as to whether the firmware (or patch) is being sent heatshrink compressed.
+LOCAL bool ota_compressed = false;
+
+// The decoder used for heatshrink compressed firmware, only allocated while compressed firmware is being received.
+LOCAL heatshrink_decoder *ota_decoder = NULL;
+
+// Flag as to whether the remote system can resume an interrupted upgrade, and wants to know as each sector is written.
+LOCAL bool ota_resumable = false;
+
+// Structure holding the progress of an OTA upgrade in RTC memory. The image is identified by its unit, length and
+// CRC-32, so that only an interrupted upgrade of the very same image is resumed.
+typedef struct {
+    uint32_t magic;        // OTA_RESUME_MAGIC when the information is valid.
+    uint32_t unit;         // The unit being flashed (UPGRADE_FW_BIN1 or UPGRADE_FW_BIN2).
+    uint32_t size;         // The length of the firmware image.
+    uint32_t expected_crc; // The CRC-32 of the whole firmware image.
+    uint32_t committed;    // The number of bytes of the image that have been written to flash.
+    uint32_t crc;          // The CRC-32 of the bytes that have been written to flash.
+} ota_resume_t;
+
+// Structure holding the health check of a newly flashed image in RTC memory. RTC memory survives resets, so crashes
+// are counted, but not a power cycle, after which the new image is kept.
+typedef struct {
+    uint32_t magic;        // OTA_HEALTH_MAGIC while the image is still to be confirmed healthy.
+    uint32_t unit;         // The unit flashed with the new image (UPGRADE_FW_BIN1 or UPGRADE_FW_BIN2).
+    uint32_t boots;        // The number of times the new image has been started.
+} ota_health_t;
+
+// Structure holding the UDP connection information for multicast OTA datagrams.
+LOCAL struct espconn ota_mcast_conn;
+
+// UDP specific protocol structure for multicast OTA datagrams.
+LOCAL esp_udp ota_mcast_proto;
+
+// Timer used to (re-)join the multicast group whenever the station's IP address changes.
+LOCAL os_timer_t ota_mcast_join_timer;
+
+// The IP address with which the multicast group was joined, or zero if it hasn't been.
+LOCAL uint32_t ota_mcast_joined_ip = 0;
+
+// The session number of the multicast upgrade in progress, or zero if there isn't one.
+LOCAL uint32_t ota_mcast_session = 0;
 
-// The number of bytes currently used in the OTA buffer.
-LOCAL uint8_t ota_buffer_len = 0;
+// The length of the firmware image being received via multicast.
+LOCAL uint32_t ota_mcast_size = 0;
+
+// The CRC-32 of the firmware image being received via multicast.
+LOCAL uint32_t ota_mcast_crc = 0;
+
+// The number of sectors in the firmware image being received via multicast.
+LOCAL uint16_t ota_mcast_sectors = 0;
+
+// Bitmap of the sectors that have been written to flash for the multicast upgrade.
+LOCAL uint8_t ota_mcast_received[OTA_MCAST_BITMAP_LEN];
+
+// Buffers in which sectors are assembled from their multicast chunks, only allocated during a multicast upgrade. While
+// one sector is being written to flash by the write task, the next is assembled in the other.
+LOCAL uint8_t *ota_mcast_buf[OTA_SECTOR_BUFFERS];
+
+// The index of the multicast buffer in which the current sector is being assembled.
+LOCAL uint8_t ota_mcast_fill_buf = 0;
+
+// Flags as to whether each multicast buffer holds a whole sector waiting to be written to flash by the write task.
+LOCAL bool ota_mcast_pending[OTA_SECTOR_BUFFERS];
+
+// The sector held in each multicast buffer, the one being assembled in the fill buffer being -1 for none.
+LOCAL int32_t ota_mcast_buf_sector[OTA_SECTOR_BUFFERS];
+
+// Bitmap of the chunks received for the sector currently being assembled.
+LOCAL uint8_t ota_mcast_chunks = 0;
+
+// Flag as to whether the multicast upgrade has been completed, and we're waiting to reboot.
+LOCAL bool ota_mcast_complete = false;
+
+// The session number of the last multicast upgrade whose image was rejected, so that its announcements are ignored.
+LOCAL uint32_t ota_mcast_rejected = 0;
+
+// The length over which the CRC-32 of the running image was last worked out, or zero if it hasn't been.
+LOCAL uint32_t ota_running_size = 0;
+
+// The CRC-32 of the first "ota_running_size" bytes of the running image.
+LOCAL uint32_t ota_running_crc = 0;
+
+// Type used to define the states of the patch decoder.
+typedef enum {
+    PATCH_OP,
+    PATCH_ARGS,
+    PATCH_INSERT
+} patch_state_t;
+
+// The current state of the patch decoder.
+LOCAL patch_state_t ota_patch_state = PATCH_OP;
+
+// The operation code of the patch operation currently being decoded.
+LOCAL uint8_t ota_patch_op = 0;
+
+// The arguments of the patch operation currently being decoded, which may be split over multiple packets.
+LOCAL uint8_t ota_patch_args[8];
+
+// The number of argument bytes received so far for the current patch operation.
+LOCAL uint8_t ota_patch_args_len = 0;
+
+// The number of literal bytes still to be received for the current patch insert operation.
+LOCAL uint32_t ota_patch_insert_remaining = 0;
+
+// The flash address of the next byte to be copied by the patch copy operation being carried out by the flash write
+// task.
+LOCAL uint32_t ota_copy_address = 0;
+
+// The number of bytes still to be copied by the patch copy operation being carried out by the flash write task.
+LOCAL uint32_t ota_copy_remaining = 0;
+
+// Flag as to whether a patch copy event is waiting in the flash write task's queue.
+LOCAL bool ota_copy_posted = false;
+
+// Received bytes that follow a patch copy operation still being carried out, kept until it's done. Only allocated
+// while there are any.
+LOCAL uint8_t *ota_backlog = NULL;
+
+// The number of bytes in the backlog buffer, and the number of them that have since been handled.
+LOCAL uint32_t ota_backlog_len = 0;
+LOCAL uint32_t ota_backlog_pos = 0;
 
 // Type used to define the possible status values of OTA upgrades.
 typedef enum {
@@ -76,7 +357,19 @@ LOCAL uint32_t ota_ip = 0;
 LOCAL uint16_t ota_port = 0;
 
 // Forward definitions.
-LOCAL uint8_t ICACHE_FLASH_ATTR parse_header_line();
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_reset();
+LOCAL void ICACHE_FLASH_ATTR ota_confirm_health();
+LOCAL bool ICACHE_FLASH_ATTR ota_header_line(struct espconn *conn, const char *line, uint16_t len);
+LOCAL void ICACHE_FLASH_ATTR ota_free_line();
+LOCAL uint32_t ICACHE_FLASH_ATTR parse_header_number(const char *line, uint16_t len, uint16_t start);
+LOCAL bool ICACHE_FLASH_ATTR parse_header_hex(const char *line, uint16_t len, uint16_t start, uint32_t *value);
+LOCAL bool ICACHE_FLASH_ATTR ota_resume_allowed();
+LOCAL bool ICACHE_FLASH_ATTR ota_read_resume(ota_resume_t *resume);
+LOCAL bool ICACHE_FLASH_ATTR ota_store_firmware(struct espconn *conn, const uint8_t *data, uint32_t len);
+LOCAL bool ICACHE_FLASH_ATTR ota_receive_payload(struct espconn *conn, const uint8_t *data, uint32_t len);
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_decoded_cb(void *arg, const uint8_t *data, uint32_t len);
+LOCAL void ICACHE_FLASH_ATTR ota_copy_sector();
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_write_sector(uint8_t buf);
 
 /*
  * Handles the receiving of information for the OTA update process.
@@ -106,273 +399,1247 @@ LOCAL void ICACHE_FLASH_ATTR ota_rx_cb(void *arg, char *data, uint16_t len) {
     // Rx: "OTA\r\n"
     // Rx: "GetNextFlash\r\n"
     // Tx: "user1.bin\r\n" or "user2.bin\r\n", depending on which binary is the next one to be flashed.
+    // Rx: "PatchLength: <len>\r\n" (optional), where "<len>" is the number of bytes (in ASCII) in a patch against the
+    //     currently running firmware, which is sent instead of the full firmware.
+    // Rx: "FirmwareEncoding: heatshrink\r\n" (optional), if the firmware (or patch) is sent heatshrink compressed.
+    // Rx: "FirmwareCRC32: <crc>\r\n" (optional), where "<crc>" is the CRC-32 (in hex) of the full firmware image.
+    // Rx: "Resumable\r\n" (optional), if an interrupted upgrade of the same full (not patched or compressed) image
+    //     with the same CRC-32 can be resumed.
     // Rx: "FirmwareLength: <len>\r\n", where "<len>" is the number of bytes (in ASCII) to be sent in the firmware.
+    // Tx: "ResumeFrom: <offset>\r\n" (only if resumable), where "<offset>" is the number of bytes (in ASCII) of the
+    //     image already written to flash, which are not to be sent again.
     // Tx: "Ready\r\n"
-    // Rx: <Firmware>, for "<len>" bytes.
-    // Tx: "Flashing\r\n" or "Invalid\r\n".
+    // Rx: <Firmware>, for "<len>" bytes (less any resume offset), or <Patch> for the patch length's bytes.
+    // Tx: "Committed: <len>\r\n" (only if resumable) as each sector bar the last is written to flash.
+    // Tx: "Flashing\r\n" or "Invalid\r\n". The firmware is only booted once its CRC-32 matches, both as received
+    //     and when read back from flash.
     // Tx: "Rebooting\r\n"
-    uint16_t unbuffered_start = 0;
-    if ((ota_state == CONNECTION_ESTABLISHED) || (ota_state == RECEIVING_HEADER)) {
-        // Store the received bytes into the buffer.
-        for (uint16_t ii = 0; ii < len; ii++) {
-            if (ota_buffer_len < (OTA_BUFFER_LEN - 1)) {
-                ota_buffer[ota_buffer_len++] = data[ii];
-            } else {
-                // The buffer has overflowed, remember where we left off.
-                unbuffered_start = ii;
-                break;
+    if (ota_state == RECEIVING_FIRMWARE) {
+        // Store received bytes in the firmware buffers, there are no more header lines to process.
+        ota_receive_payload(conn, data, len);
+        return;
+    }
+
+    // Work through the header lines in place, only buffering the start of a line that carries on in the next packet.
+    uint16_t pos = 0;
+    while ((pos < len) && ((ota_state == CONNECTION_ESTABLISHED) || (ota_state == RECEIVING_HEADER))) {
+        uint16_t end = pos;
+        while ((end < len) && (data[end] != '\n')) {
+            end++;
+        }
+        bool complete = (end < len);
+        uint16_t count = (complete ? end + 1 : len) - pos;
+        const char *line = &data[pos];
+        pos += count;
+
+        if ((ota_line_len > 0) || (!complete)) {
+            // The line is split over packets, so it has to be gathered up in the buffer.
+            if (ota_line_len + count > OTA_LINE_MAX) {
+                const char msg[] = "ERR: Header line too long\r\n";
+                espconn_send(conn, (uint8_t *)msg, sizeof(msg) - 1);
+                ota_state = ERROR;
+                return;
+            }
+            if (ota_line == NULL) {
+                ota_line = (char *)os_malloc(OTA_LINE_MAX);
+                if (ota_line == NULL) {
+                    espconn_send(conn, "ERR: Unable to allocate OTA buffer.\r\n", 37);
+                    ota_state = ERROR;
+                    return;
+                }
             }
+            os_memcpy(&ota_line[ota_line_len], line, count);
+            ota_line_len += count;
+            if (!complete) {
+                // The rest of the line is still to come.
+                return;
+            }
+            line = ota_line;
+            count = ota_line_len;
         }
-    } else if (ota_state == RECEIVING_FIRMWARE) {
-        // Store received bytes in the firmware buffer.
-        uint32_t copy_len = (uint32_t)len;
-        if ((copy_len + ota_firmware_len) > SPI_FLASH_SEC_SIZE) {
-            copy_len = SPI_FLASH_SEC_SIZE - ota_firmware_len;
+
+        // Process the line, without its CR/LF.
+        ota_line_len = 0;
+        count--;
+        if ((count > 0) && (line[count - 1] == '\r')) {
+            count--;
         }
-        if ((copy_len + ota_firmware_received) > ota_firmware_size) {
-            copy_len = ota_firmware_size - ota_firmware_len;
+        if (!ota_header_line(conn, line, count)) {
+            return;
         }
-        os_memmove(&ota_firmware[ota_firmware_len], data, copy_len);
-        ota_firmware_len += copy_len;
-        ota_firmware_received += copy_len;
-        if (copy_len < len) {
-            unbuffered_start = copy_len;
-        }
-    }
-
-    bool repeat = true;
-    while (repeat) {
-        uint8_t eol = 0;
-        switch (ota_state) {
-            case CONNECTION_ESTABLISHED: {
-                // A connection has just been established. We expect an initial line of "OTA".
-                eol = parse_header_line();
-                if (eol > 0) {
-                    // We have a line, it should be "OTA".
-                    if (strncmp("OTA", ota_buffer, eol - 2)) {
-                        // Oh dear, it's not.
-                        espconn_send(conn, "ERR: Invalid protocol\r\n", 23);
-                        ota_state = ERROR;
-                        return;
-                    } else {
-                        // We do, move to the next line in the header.
-                        ota_state = RECEIVING_HEADER;
-                    }
-                }
-                break;
+    }
+
+    // Once the header is over, the buffer is no longer needed, and anything left is the start of the firmware.
+    if ((ota_state != CONNECTION_ESTABLISHED) && (ota_state != RECEIVING_HEADER)) {
+        ota_free_line();
+    }
+    if ((ota_state == RECEIVING_FIRMWARE) && (pos < len)) {
+        ota_receive_payload(conn, (uint8_t *)&data[pos], (uint32_t)(len - pos));
+    }
+}
+
+/*
+ * Handles a single header line, without its CR/LF. Returns false if the OTA process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_header_line(struct espconn *conn, const char *line, uint16_t len) {
+    switch (ota_state) {
+        case CONNECTION_ESTABLISHED: {
+            // A connection has just been established. We expect an initial line of "OTA".
+            if ((len != 3) || strncmp("OTA", line, 3)) {
+                // Oh dear, it's not.
+                espconn_send(conn, "ERR: Invalid protocol\r\n", 23);
+                ota_state = ERROR;
+                return false;
             }
-            case RECEIVING_HEADER: {
-                // We are now receiving header lines.
-                eol = parse_header_line();
-                if (eol > 0) {
-                    // We have a line, see what it is.
-                    if (!strncmp("GetNextFlash", ota_buffer, eol - 2)) {
-                        // The remote device has requested to know what the next flash unit is.
-                        uint8_t unit = system_upgrade_userbin_check(); // Note, returns the current unit!
-                        if (unit == UPGRADE_FW_BIN1) {
-                            espconn_send(conn, "user2.bin\r\n", 11);
-                        } else {
-                            espconn_send(conn, "user1.bin\r\n", 11);
-                        }
-                    } else if ((eol > 17) && (!strncmp("FirmwareLength:", ota_buffer, 15))) {
-                        // The remote system is preparing to send the firmware. The expected length is supplied here.
-                        uint32_t size = 0;
-                        for (uint8_t ii = 16; ii < ota_buffer_len; ii++) {
-                            if ((ota_buffer[ii] >= '0') && (ota_buffer[ii] <= '9')) {
-                                size *= 10;
-                                size += ota_buffer[ii] - '0';
-                            } else if ((ota_buffer[ii] == '\r') || (ota_buffer[ii] == '\n')) {
-                                // We have finished the firmware size.
-                                break;
-                            } else if ((ota_buffer[ii] != ' ') && (ota_buffer[ii] != ',')) {
-                                // Anything that's not a number, space or new-line is invalid.
-                                size = 0;
-                                break;
-                            }
-                        }
 
-                        if (size == 0) {
-                            // We either didn't get a length, or the length is invalid.
-                            espconn_send(conn, "ERR: Invalid firmware length\r\n", 30);
-                            ota_state = ERROR;
-                            return;
-                        } else if (size > FIRMWARE_SIZE) {
-                            // The size of the incoming firmware image is too big to fit.
-                            espconn_send(conn, "ERR: Firmware length is too big\r\n", 33);
+            // It is, move to the next line in the header.
+            ota_state = RECEIVING_HEADER;
+            break;
+        }
+        case RECEIVING_HEADER: {
+            // We are now receiving header lines, see what this one is.
+            if ((len == 12) && (!strncmp("GetNextFlash", line, 12))) {
+                // The remote device has requested to know what the next flash unit is.
+                uint8_t unit = system_upgrade_userbin_check(); // Note, returns the current unit!
+                if (unit == UPGRADE_FW_BIN1) {
+                    espconn_send(conn, "user2.bin\r\n", 11);
+                } else {
+                    espconn_send(conn, "user1.bin\r\n", 11);
+                }
+            } else if ((len > 12) && (!strncmp("PatchLength:", line, 12))) {
+                // The remote system will send a patch against the running firmware, rather than the firmware.
+                ota_patch_size = parse_header_number(line, len, 12);
+                if (ota_patch_size == 0) {
+                    espconn_send(conn, "ERR: Invalid patch length\r\n", 27);
+                    ota_state = ERROR;
+                    return false;
+                }
+            } else if ((len > 17) && (!strncmp("FirmwareEncoding:", line, 17))) {
+                // The remote system has specified how the firmware is encoded.
+                uint16_t start = 17;
+                while ((start < len) && (line[start] == ' ')) {
+                    start++;
+                }
+                if ((len - start == 10) && (!strncmp("heatshrink", &line[start], 10))) {
+                    ota_compressed = true;
+                } else if ((len - start == 8) && (!strncmp("identity", &line[start], 8))) {
+                    ota_compressed = false;
+                } else {
+                    espconn_send(conn, "ERR: Unsupported firmware encoding\r\n", 36);
+                    ota_state = ERROR;
+                    return false;
+                }
+            } else if ((len == 9) && (!strncmp("Resumable", line, 9))) {
+                // The remote system is able to resume an interrupted upgrade.
+                ota_resumable = true;
+            } else if ((len > 14) && (!strncmp("FirmwareCRC32:", line, 14))) {
+                // The remote system has supplied the CRC-32 of the firmware image, to check it against.
+                ota_expected_crc_set = parse_header_hex(line, len, 14, &ota_expected_crc);
+                if (!ota_expected_crc_set) {
+                    espconn_send(conn, "ERR: Invalid firmware CRC\r\n", 27);
+                    ota_state = ERROR;
+                    return false;
+                }
+            } else if ((len > 15) && (!strncmp("FirmwareLength:", line, 15))) {
+                // The remote system is preparing to send the firmware. The expected length is supplied here.
+                uint32_t size = parse_header_number(line, len, 15);
+                if (size == 0) {
+                    // We either didn't get a length, or the length is invalid.
+                    espconn_send(conn, "ERR: Invalid firmware length\r\n", 30);
+                    ota_state = ERROR;
+                    return false;
+                } else if (size > FIRMWARE_SIZE) {
+                    // The size of the incoming firmware image is too big to fit.
+                    espconn_send(conn, "ERR: Firmware length is too big\r\n", 33);
+                    ota_state = ERROR;
+                    return false;
+                } else if (ota_mcast_complete) {
+                    // A multicast upgrade has just finished, and we're about to reboot into it.
+                    espconn_send(conn, "ERR: Multicast upgrade in progress\r\n", 36);
+                    ota_state = ERROR;
+                    return false;
+                } else {
+                    // Ready to begin flashing! This takes over from any multicast upgrade in progress, and overwrites
+                    // the image we'd otherwise roll back to.
+                    ota_mcast_reset();
+                    ota_confirm_health();
+                    for (uint8_t ii = 0; ii < OTA_SECTOR_BUFFERS; ii++) {
+                        ota_firmware[ii] = (uint8_t *)os_malloc(SPI_FLASH_SEC_SIZE);
+                        ota_sector_pending[ii] = false;
+                        if (ota_firmware[ii] == NULL) {
+                            espconn_send(conn, "ERR: Unable to allocate OTA buffer.\r\n", 37);
                             ota_state = ERROR;
-                            return;
-                        } else {
-                            // Ready to begin flashing!
-                            ota_firmware = (uint8_t *)os_malloc(SPI_FLASH_SEC_SIZE);
-                            if (ota_firmware == NULL) {
-                                espconn_send(conn, "ERR: Unable to allocate OTA buffer.\r\n", 37);
-                                ota_state = ERROR;
-                                return;
-                            }
-                            ota_firmware_size = size;
-                            ota_firmware_received = 0;
-                            ota_firmware_len = 0;  
-                            ota_state = RECEIVING_FIRMWARE;
-
-                            // Copy any remaining bytes from the OTA buffer to the firmware buffer.
-                            uint8_t remaining = ota_buffer_len - eol - 1;
-                            if (remaining > 0) {
-                                os_memmove(ota_firmware, &ota_buffer[eol + 1], remaining);
-                                ota_firmware_received = ota_firmware_len = (uint32_t)remaining;
-                            }
-
-                            espconn_send(conn, "Ready\r\n", 7);
+                            return false;
                         }
-                    } else {
-                        // We received an unexpected header line, abort.
-                        espconn_send(conn, "ERR: Unexpected header.\r\n", 25);
-                        ota_state = ERROR;
-                        return;
                     }
-                }
-                break;
-            }
-            case RECEIVING_FIRMWARE: {
-                // We are now receiving the firmware image.
-                if ((ota_firmware_len == SPI_FLASH_SEC_SIZE) || (ota_firmware_received == ota_firmware_size)) {
-                    // We have received a sector's worth of data, or the remainder of the flash image, flash it.
-                    if (ota_firmware_received <= SPI_FLASH_SEC_SIZE) {
-                        // This is the first block, check the header.
-                        if (ota_firmware[0] != 0xEA) {
-                            espconn_send(conn, "ERR: IROM magic missing.\r\n", 26);
-                            ota_state = ERROR;
-                            return;
-                        } else if ((ota_firmware[1] != 0x04) || (ota_firmware[2] > 0x03) || 
-                                   ((ota_firmware[3] >> 4) > 0x06)) {
-                            espconn_send(conn, "ERR: Flash header invalid.\r\n", 28);
-                            ota_state = ERROR;
-                            return;
-                        } else if (((uint16_t *)ota_firmware)[3] != 0x4010) {
-                            espconn_send(conn, "ERR: Invalid entry address.\r\n", 29);
+                    if (ota_compressed) {
+                        ota_decoder = (heatshrink_decoder *)os_malloc(sizeof(heatshrink_decoder));
+                        if (ota_decoder == NULL) {
+                            espconn_send(conn, "ERR: Unable to allocate OTA buffer.\r\n", 37);
                             ota_state = ERROR;
-                            return;
-                        } else if (((uint32_t *)ota_firmware)[2] != 0x00000000) {
-                            espconn_send(conn, "ERR: Invalid start offset.\r\n", 28);
-                            ota_state = ERROR;
-                            return;
+                            return false;
                         }
+                        heatshrink_decoder_init(ota_decoder, ota_decoded_cb, conn);
                     }
+                    ota_active_conn = conn;
+                    ota_fill_buf = 0;
+                    ota_firmware_size = size;
+                    ota_firmware_received = 0;
+                    ota_firmware_written = 0;
+                    ota_firmware_crc = 0;
+                    ota_firmware_len = 0;  
+                    ota_patch_received = 0;
+                    ota_patch_state = PATCH_OP;
+                    ota_state = RECEIVING_FIRMWARE;
 
-                    // Zero out any remaining bytes in the last block, to avoid writing dirty data.
-                    if (ota_firmware_len < SPI_FLASH_SEC_SIZE) {
-                        os_memset(&ota_firmware[ota_firmware_len], 0, SPI_FLASH_SEC_SIZE - ota_firmware_len);
-                    }
-
-                    // Find out the starting address for the flash write.
-                    int address;
-                    uint8_t current = system_upgrade_userbin_check();
-                    if (current == UPGRADE_FW_BIN1) {
-                        // The next flash, user2.bin, will start after 4KB boot, user1, 16KB user params, 4KB reserved.
-                        address = 4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024;
+                    // See if we can carry on from where an earlier attempt left off.
+                    ota_resume_t resume;
+                    if (ota_resume_allowed() && ota_read_resume(&resume)) {
+                        ota_firmware_received = resume.committed;
+                        ota_firmware_written = resume.committed;
+                        ota_firmware_crc = resume.crc;
+                        DBG_INFO("Resuming OTA upgrade from %d bytes.\n", resume.committed);
+                        char reply[40];
+                        os_sprintf(reply, "ResumeFrom: %d\r\nReady\r\n", resume.committed);
+                        espconn_send(conn, reply, os_strlen(reply));
                     } else {
-                        // The next flash, user1.bin, will start after 4KB boot.
-                        address = 4*1024;
+                        espconn_send(conn, "Ready\r\n", 7);
                     }
-                    address += ota_firmware_received - ota_firmware_len;
+                }
+            } else {
+                // We received an unexpected header line, abort.
+                espconn_send(conn, "ERR: Unexpected header.\r\n", 25);
+                ota_state = ERROR;
+                return false;
+            }
+            break;
+        }
+        default:
+            // Firmware bytes are handled by ota_receive_payload, nothing else needs doing here.
+            break;
+    }
+    return true;
+}
 
+/*
+ * Frees the buffer used for header lines split over multiple packets.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_free_line() {
+    if (ota_line != NULL) {
+        os_free(ota_line);
+        ota_line = NULL;
+    }
+    ota_line_len = 0;
+}
 
-                    // Erase the flash block.
-                    if ((address % SPI_FLASH_SEC_SIZE) == 0) {
-                        spi_flash_erase_sector(address / SPI_FLASH_SEC_SIZE);
-                    }
+/*
+ * Parses a decimal number from a header line of the supplied length, starting at the supplied index. Returns zero if
+ * the number is missing or invalid.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR parse_header_number(const char *line, uint16_t len, uint16_t start) {
+    uint32_t value = 0;
+    for (uint16_t ii = start; ii < len; ii++) {
+        if ((line[ii] >= '0') && (line[ii] <= '9')) {
+            value *= 10;
+            value += line[ii] - '0';
+        } else if ((line[ii] != ' ') && (line[ii] != ',')) {
+            // Anything that's not a number or space is invalid.
+            return 0;
+        }
+    }
+    return value;
+}
 
-                    // Write the new flash block.
-                    //os_printf("Flashing address %05x, total received = %d.\n", address, ota_firmware_received);
-                    SpiFlashOpResult res = spi_flash_write(address, (uint32_t *)ota_firmware, SPI_FLASH_SEC_SIZE);
-                    ota_firmware_len = 0;
-                    if (res != SPI_FLASH_RESULT_OK) {
-                        espconn_send(conn, "ERR: Flash failed.\r\n", 20);
-                        ota_state = ERROR;
-                        return;
-                    }
+/*
+ * Parses a hexadecimal number from a header line of the supplied length, starting at the supplied index. Returns false
+ * if the number is missing or invalid.
+ */
+LOCAL bool ICACHE_FLASH_ATTR parse_header_hex(const char *line, uint16_t len, uint16_t start, uint32_t *value) {
+    uint8_t digits = 0;
+    *value = 0;
+    for (uint16_t ii = start; ii < len; ii++) {
+        uint8_t c = line[ii];
+        if (c == ' ') {
+            continue;
+        } else if ((c >= '0') && (c <= '9')) {
+            c -= '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            c -= 'a' - 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+            c -= 'A' - 10;
+        } else {
+            // Anything that's not a hex digit or space is invalid.
+            return false;
+        }
+        *value = (*value << 4) | c;
+        digits++;
+    }
+    return (digits > 0) && (digits <= 8);
+}
 
-                    if (ota_firmware_received == ota_firmware_size) {
-                        // We've flashed all of the firmware now, reboot into the new firmware.
-                        os_printf("Preparing to update firmware.\n");
-                        espconn_send(conn, "Flash upgrade success. Rebooting in 2s.\r\n", 41);
-                        os_free(ota_firmware);
-                        ota_firmware_size = 0;
-                        ota_firmware_received = 0;
-                        ota_firmware_len = 0;
-                        ota_state = REBOOTING;
-                        system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
-                        os_printf("Scheduling reboot.\n");
-                        os_timer_disarm(&ota_reboot_timer);
-                        os_timer_setfn(&ota_reboot_timer, (os_timer_func_t *)system_upgrade_reboot, NULL);
-                        os_timer_arm(&ota_reboot_timer, 2000, 1);
-                    }
-                }
-                break;
-            }
+/*
+ * Returns the flash address at which the firmware image for a unit (UPGRADE_FW_BIN1 or UPGRADE_FW_BIN2) starts.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_unit_base(uint8_t unit) {
+    if (unit == UPGRADE_FW_BIN1) {
+        // user1.bin starts after 4KB boot.
+        return 4*1024;
+    } else {
+        // user2.bin starts after 4KB boot, user1, 16KB user params, 4KB reserved.
+        return 4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024;
+    }
+}
+
+/*
+ * Returns the flash address at which the next firmware image (i.e. the one not currently running) starts.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_flash_base() {
+    // Note, system_upgrade_userbin_check returns the current unit!
+    if (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) {
+        return ota_unit_base(UPGRADE_FW_BIN2);
+    } else {
+        return ota_unit_base(UPGRADE_FW_BIN1);
+    }
+}
+
+/*
+ * Releases the firmware sector buffers, and any back-pressure applied to the OTA connection.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_free_firmware() {
+    for (uint8_t ii = 0; ii < OTA_SECTOR_BUFFERS; ii++) {
+        if (ota_firmware[ii] != NULL) {
+            os_free(ota_firmware[ii]);
+            ota_firmware[ii] = NULL;
+        }
+        ota_sector_pending[ii] = false;
+    }
+    if (ota_held && (ota_active_conn != NULL)) {
+        espconn_recv_unhold(ota_active_conn);
+    }
+    ota_held = false;
+    if (ota_decoder != NULL) {
+        os_free(ota_decoder);
+        ota_decoder = NULL;
+    }
+    if (ota_backlog != NULL) {
+        os_free(ota_backlog);
+        ota_backlog = NULL;
+    }
+    ota_backlog_len = 0;
+    ota_backlog_pos = 0;
+    ota_copy_remaining = 0;
+    ota_firmware_size = 0;
+    ota_firmware_received = 0;
+    ota_firmware_written = 0;
+    ota_firmware_len = 0;
+}
+
+/*
+ * Returns true if the progress of the current upgrade can be recorded for resuming. This is only possible for full
+ * images identified by their CRC-32, as the position within a patch or compressed stream can't be resumed.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_resume_allowed() {
+    return ota_expected_crc_set && (ota_patch_size == 0) && (!ota_compressed);
+}
+
+/*
+ * Records the progress of the current upgrade in RTC memory. A "committed" length of zero clears the record.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_save_resume(uint32_t committed, uint32_t crc) {
+    ota_resume_t resume;
+    resume.magic = (committed > 0) ? OTA_RESUME_MAGIC : 0;
+    resume.unit = (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    resume.size = ota_firmware_size;
+    resume.expected_crc = ota_expected_crc;
+    resume.committed = committed;
+    resume.crc = crc;
+    system_rtc_mem_write(OTA_RESUME_RTC_BLOCK, &resume, sizeof(resume));
+}
+
+/*
+ * Reads the progress of an earlier attempt at the current upgrade from RTC memory. Returns false if there's nothing
+ * that can be resumed.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_read_resume(ota_resume_t *resume) {
+    if (!system_rtc_mem_read(OTA_RESUME_RTC_BLOCK, resume, sizeof(ota_resume_t))) {
+        return false;
+    }
+    uint32_t unit = (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    return (resume->magic == OTA_RESUME_MAGIC) && (resume->unit == unit) && (resume->size == ota_firmware_size) && 
+           (resume->expected_crc == ota_expected_crc) && (resume->committed < ota_firmware_size) &&
+           ((resume->committed % SPI_FLASH_SEC_SIZE) == 0);
+}
+
+/*
+ * Works out the CRC-32 of the given number of bytes of flash, starting at a sector boundary. The supplied sector buffer
+ * is used to hold the data read. Returns false if the flash can't be read.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_flash_crc(uint32_t address, uint8_t *buf, uint32_t size, uint32_t *crc) {
+    uint32_t remaining = size;
+    *crc = 0;
+    while (remaining > 0) {
+        uint32_t len = (remaining < SPI_FLASH_SEC_SIZE) ? remaining : SPI_FLASH_SEC_SIZE;
+        if (spi_flash_read(address, (uint32_t *)buf, SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
+            return false;
         }
+        *crc = calculate_crc32(*crc, buf, len);
+        address += SPI_FLASH_SEC_SIZE;
+        remaining -= len;
+        system_soft_wdt_feed();
+    }
+    return true;
+}
 
-        // Clear out the processed bytes from the buffer, if any.
-        repeat = false;
-        if ((ota_state == CONNECTION_ESTABLISHED) || (ota_state == RECEIVING_HEADER)) {
-            // In these states, we're still going to be using the buffer.
-            if (eol < (ota_buffer_len - 1)) {
-                // There are still more characters in the buffer yet to process, move them to the start of the buffer.
-                os_memmove(&ota_buffer[0], &ota_buffer[eol + 1], ota_buffer_len - eol - 1);
-                ota_buffer_len = ota_buffer_len - eol - 1;
-                repeat = true;
-            } else {
-                ota_buffer_len = 0;
+/*
+ * Reads the newly written firmware image back from flash, checking that its CRC-32 matches that expected. The supplied
+ * sector buffer is used to hold the data read.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_verify_flash(uint8_t *buf, uint32_t size, uint32_t expected_crc) {
+    uint32_t crc;
+    if (!ota_flash_crc(ota_flash_base(), buf, size, &crc)) {
+        return false;
+    }
+
+    if (crc != expected_crc) {
+        DBG_ERROR("Flash CRC %08x, expected %08x.\n", crc, expected_crc);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Records the health check of a newly flashed image in RTC memory. A "unit" of -1 clears the record.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_save_health(int8_t unit, uint32_t boots) {
+    ota_health_t health;
+    health.magic = (unit >= 0) ? OTA_HEALTH_MAGIC : 0;
+    health.unit = unit;
+    health.boots = boots;
+    system_rtc_mem_write(OTA_HEALTH_RTC_BLOCK, &health, sizeof(health));
+}
+
+/*
+ * Marks the running image as healthy, so that it is kept.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_confirm_health() {
+    if (ota_health_checking) {
+        DBG_INFO("New firmware confirmed healthy after %dms.\n", ota_health_elapsed);
+        os_timer_disarm(&ota_health_timer);
+        ota_health_checking = false;
+        ota_save_health(-1, 0);
+    }
+}
+
+/*
+ * Gives up on the running image, rebooting into the previous one.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_rollback() {
+    DBG_ERROR("New firmware failed its health check, rolling back.\n");
+    os_timer_disarm(&ota_health_timer);
+    ota_save_health(-1, 0);
+    system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+    system_upgrade_reboot();
+}
+
+/*
+ * Timer call-back checking the health of a newly flashed image. It is healthy once it has an IP address and is
+ * listening for OTA connections, so that it can always be upgraded again.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_health_cb(void *arg) {
+    ota_health_elapsed += OTA_HEALTH_INTERVAL;
+    if ((wifi_station_get_connect_status() == STATION_GOT_IP) && ota_listening) {
+        ota_confirm_health();
+    } else if (ota_health_elapsed >= OTA_HEALTH_TIMEOUT) {
+        ota_rollback();
+    }
+}
+
+/*
+ * Checks whether the running image has just been flashed, and if so counts this boot of it, so that its health is
+ * checked once ota_init is called. An image that keeps restarting before being confirmed healthy is rolled back
+ * straight away.
+ */
+void ICACHE_FLASH_ATTR ota_check_boot() {
+    ota_health_t health;
+    if ((!system_rtc_mem_read(OTA_HEALTH_RTC_BLOCK, &health, sizeof(health))) || (health.magic != OTA_HEALTH_MAGIC)) {
+        // Nothing was flashed, or it has already been confirmed.
+        return;
+    } else if (health.unit != system_upgrade_userbin_check()) {
+        // The new image was never booted, so there's nothing to check.
+        ota_save_health(-1, 0);
+        return;
+    } else if (++health.boots > OTA_HEALTH_MAX_BOOTS) {
+        ota_rollback();
+        return;
+    }
+
+    DBG_INFO("Checking health of new firmware, boot %d.\n", health.boots);
+    ota_save_health(health.unit, health.boots);
+    ota_health_checking = true;
+    ota_health_elapsed = 0;
+}
+
+/*
+ * Marks the newly written firmware as ready to boot, and schedules a reboot into it. The new firmware has to prove
+ * itself healthy once booted, or the current firmware is booted again.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_schedule_reboot() {
+    ota_save_health((system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1, 0);
+    system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+    DBG_INFO("Scheduling reboot.\n");
+    os_timer_disarm(&ota_reboot_timer);
+    os_timer_setfn(&ota_reboot_timer, (os_timer_func_t *)system_upgrade_reboot, NULL);
+    os_timer_arm(&ota_reboot_timer, 2000, 1);
+}
+
+/*
+ * Writes a pending sector buffer to flash. Once the final sector has been written, the upgrade is completed and a
+ * reboot is scheduled. Returns false if the write failed, in which case the OTA connection has been told of the error.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_write_sector(uint8_t buf) {
+    uint32_t address = ota_sector_address[buf];
+
+    // Erase the flash block.
+    if ((address % SPI_FLASH_SEC_SIZE) == 0) {
+        spi_flash_erase_sector(address / SPI_FLASH_SEC_SIZE);
+    }
+
+    // Write the new flash block.
+    //os_printf("Flashing address %05x, total written = %d.\n", address, ota_firmware_written);
+    SpiFlashOpResult res = spi_flash_write(address, (uint32_t *)ota_firmware[buf], SPI_FLASH_SEC_SIZE);
+    ota_sector_pending[buf] = false;
+    if (res != SPI_FLASH_RESULT_OK) {
+        espconn_send(ota_active_conn, "ERR: Flash failed.\r\n", 20);
+        ota_state = ERROR;
+        return false;
+    }
+    ota_firmware_written += ota_sector_len[buf];
+
+    if (ota_firmware_written < ota_firmware_size) {
+        // Record how far we've got, in case we need to resume.
+        if (ota_resume_allowed()) {
+            ota_save_resume(ota_firmware_written, ota_sector_crc[buf]);
+        }
+        if (ota_resumable) {
+            char reply[32];
+            os_sprintf(reply, "Committed: %d\r\n", ota_firmware_written);
+            espconn_send(ota_active_conn, reply, os_strlen(reply));
+        }
+    } else {
+        // We've flashed all of the firmware now, there's nothing left to resume whatever happens next.
+        ota_save_resume(0, 0);
+
+        // Make sure it's what we were meant to get before booting it.
+        if (ota_expected_crc_set && (ota_firmware_crc != ota_expected_crc)) {
+            DBG_ERROR("Firmware CRC %08x, expected %08x.\n", ota_firmware_crc, ota_expected_crc);
+            espconn_send(ota_active_conn, "ERR: Firmware CRC mismatch.\r\n", 29);
+            ota_state = ERROR;
+            return false;
+        } else if (!ota_verify_flash(ota_firmware[buf], ota_firmware_size, ota_firmware_crc)) {
+            espconn_send(ota_active_conn, "ERR: Flash verification failed.\r\n", 33);
+            ota_state = ERROR;
+            return false;
+        }
+
+        // Reboot into the new firmware.
+        DBG_INFO("Preparing to update firmware.\n");
+        espconn_send(ota_active_conn, "Flash upgrade success. Rebooting in 2s.\r\n", 41);
+        ota_free_firmware();
+        ota_state = REBOOTING;
+        ota_schedule_reboot();
+    }
+    return true;
+}
+
+/*
+ * Lets the data flow again once nothing is holding it back: no patch copy operation is outstanding, and there's room
+ * in the sector buffers for the next segment.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_release_hold() {
+    uint8_t prev = (ota_fill_buf + OTA_SECTOR_BUFFERS - 1) % OTA_SECTOR_BUFFERS;
+    if (ota_held && (ota_state == RECEIVING_FIRMWARE) && (ota_copy_remaining == 0) && (ota_backlog == NULL) &&
+        !(ota_sector_pending[prev] && ((SPI_FLASH_SEC_SIZE - ota_firmware_len) < OTA_HOLD_THRESHOLD))) {
+        ota_held = false;
+        espconn_recv_unhold(ota_active_conn);
+    }
+}
+
+/*
+ * Task used to write firmware sectors to flash outside of the receive call-back, so that the TCP stack can keep
+ * receiving the next sector while the flash is busy. Patch copy operations are also carried out here, a sector at a
+ * time, as they read from flash rather than the network.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_write_task(os_event_t *event) {
+    if (event->sig == OTA_EVENT_COPY) {
+        // The connection may have been dropped since this event was posted.
+        ota_copy_posted = false;
+        if ((ota_state == RECEIVING_FIRMWARE) && (ota_copy_remaining > 0)) {
+            ota_copy_sector();
+        }
+        return;
+    } else if (event->sig == OTA_EVENT_MCAST_SECTOR) {
+        // The multicast upgrade may have been abandoned since this event was posted.
+        uint8_t buf = (uint8_t)event->par;
+        if (ota_mcast_pending[buf]) {
+            ota_mcast_write_sector(buf);
+        }
+        return;
+    }
+
+    // The connection may have been dropped, or the sector already written, since this event was posted.
+    uint8_t buf = (uint8_t)event->par;
+    if ((ota_state != RECEIVING_FIRMWARE) || (!ota_sector_pending[buf])) {
+        return;
+    }
+
+    if (ota_write_sector(buf)) {
+        ota_release_hold();
+    }
+}
+
+/*
+ * Checks the header at the start of the first sector of a firmware image. Returns the error to report if it isn't one
+ * that can be booted, or NULL if it is.
+ */
+LOCAL const char *ICACHE_FLASH_ATTR ota_header_error(const uint8_t *sector) {
+    if (sector[0] != 0xEA) {
+        return "ERR: IROM magic missing.\r\n";
+    } else if ((sector[1] != 0x04) || (sector[2] > 0x03) || ((sector[3] >> 4) > 0x06)) {
+        return "ERR: Flash header invalid.\r\n";
+    } else if (((const uint16_t *)sector)[3] != 0x4010) {
+        return "ERR: Invalid entry address.\r\n";
+    } else if (((const uint32_t *)sector)[2] != 0x00000000) {
+        return "ERR: Invalid start offset.\r\n";
+    }
+    return NULL;
+}
+
+/*
+ * Validates the filled sector buffer, and hands it to the flash write task. Returns false if the OTA process has been
+ * aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_queue_sector(struct espconn *conn) {
+    uint8_t *sector = ota_firmware[ota_fill_buf];
+    if (ota_firmware_received <= SPI_FLASH_SEC_SIZE) {
+        // This is the first block, check the header.
+        const char *error = ota_header_error(sector);
+        if (error != NULL) {
+            espconn_send(conn, (uint8_t *)error, os_strlen(error));
+            ota_state = ERROR;
+            return false;
+        }
+    }
+
+    // Zero out any remaining bytes in the last block, to avoid writing dirty data.
+    if (ota_firmware_len < SPI_FLASH_SEC_SIZE) {
+        os_memset(&sector[ota_firmware_len], 0, SPI_FLASH_SEC_SIZE - ota_firmware_len);
+    }
+    ota_sector_address[ota_fill_buf] = ota_flash_base() + ota_firmware_received - ota_firmware_len;
+    ota_sector_len[ota_fill_buf] = ota_firmware_len;
+    ota_sector_crc[ota_fill_buf] = ota_firmware_crc;
+
+    // The next buffer to fill must have been written out already. If the flash task hasn't got to it yet (a large
+    // delivery from the TCP stack can fill more than a sector at once), write it now rather than lose the data.
+    uint8_t next = (ota_fill_buf + 1) % OTA_SECTOR_BUFFERS;
+    if (ota_sector_pending[next] && !ota_write_sector(next)) {
+        return false;
+    }
+
+    // Pass the sector to the flash write task, and start filling the next buffer.
+    ota_sector_pending[ota_fill_buf] = true;
+    system_os_post(OTA_WRITE_PRI, OTA_EVENT_SECTOR, (os_param_t)ota_fill_buf);
+    ota_fill_buf = next;
+    ota_firmware_len = 0;
+    return true;
+}
+
+/*
+ * Stores received firmware bytes in the sector buffers, queueing each sector for flashing as it fills. Returns false
+ * if the OTA process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_store_firmware(struct espconn *conn, const uint8_t *data, uint32_t len) {
+    while ((len > 0) && (ota_state == RECEIVING_FIRMWARE)) {
+        // Copy as much as fits in both the current sector and the remainder of the firmware image.
+        uint32_t copy_len = len;
+        if ((copy_len + ota_firmware_len) > SPI_FLASH_SEC_SIZE) {
+            copy_len = SPI_FLASH_SEC_SIZE - ota_firmware_len;
+        }
+        if ((copy_len + ota_firmware_received) > ota_firmware_size) {
+            copy_len = ota_firmware_size - ota_firmware_received;
+        }
+        if (copy_len == 0) {
+            // Anything after the end of the firmware image is ignored.
+            break;
+        }
+        os_memcpy(&ota_firmware[ota_fill_buf][ota_firmware_len], data, copy_len);
+        ota_firmware_crc = calculate_crc32(ota_firmware_crc, data, copy_len);
+        ota_firmware_len += copy_len;
+        ota_firmware_received += copy_len;
+        data += copy_len;
+        len -= copy_len;
+
+        if ((ota_firmware_len == SPI_FLASH_SEC_SIZE) || (ota_firmware_received == ota_firmware_size)) {
+            // We have received a sector's worth of data, or the remainder of the flash image, flash it.
+            if (!ota_queue_sector(conn)) {
+                return false;
             }
+        }
+    }
+
+    // Hold back further data if the previous sector is still being written, and the next segment might not fit.
+    uint8_t prev = (ota_fill_buf + OTA_SECTOR_BUFFERS - 1) % OTA_SECTOR_BUFFERS;
+    if ((ota_state == RECEIVING_FIRMWARE) && (!ota_held) && ota_sector_pending[prev] && 
+        ((SPI_FLASH_SEC_SIZE - ota_firmware_len) < OTA_HOLD_THRESHOLD)) {
+        ota_held = true;
+        espconn_recv_hold(conn);
+    }
+    return ota_state != ERROR;
+}
 
-            if (unbuffered_start > 0) {
-                // Store unbuffered bytes to the end of the buffer.
-                for (uint16_t ii = unbuffered_start; ii < len; ii++) {
-                    if (ota_buffer_len < (OTA_BUFFER_LEN - 1)) {
-                        ota_buffer[ota_buffer_len++] = data[ii];
-                        unbuffered_start = 0;
-                        repeat = true;
+/*
+ * Queues a patch copy operation, which the flash write task carries out a sector at a time by reading bytes from the
+ * running firmware image into the firmware buffers. Reception is held back until it's done. Returns false if the OTA
+ * process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_patch_copy(struct espconn *conn, uint32_t offset, uint32_t len) {
+    if ((offset > FIRMWARE_SIZE) || (len > FIRMWARE_SIZE - offset)) {
+        espconn_send(conn, "ERR: Patch copy out of range.\r\n", 31);
+        ota_state = ERROR;
+        return false;
+    } else if (len > ota_firmware_size - ota_firmware_received) {
+        espconn_send(conn, "ERR: Patch exceeds firmware length.\r\n", 37);
+        ota_state = ERROR;
+        return false;
+    }
+
+    if (len > 0) {
+        ota_copy_address = ota_unit_base(system_upgrade_userbin_check()) + offset;
+        ota_copy_remaining = len;
+        if (!ota_copy_posted) {
+            ota_copy_posted = true;
+            system_os_post(OTA_WRITE_PRI, OTA_EVENT_COPY, 0);
+        }
+        if (!ota_held) {
+            ota_held = true;
+            espconn_recv_hold(conn);
+        }
+    }
+    return true;
+}
+
+/*
+ * Checks that a patch has produced the whole firmware image, once all of it has been handled. Returns false if the OTA
+ * process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_check_patch(struct espconn *conn) {
+    if ((ota_state == RECEIVING_FIRMWARE) && (ota_patch_received == ota_patch_size) && (ota_copy_remaining == 0) &&
+        ((ota_patch_state != PATCH_OP) || (ota_firmware_received != ota_firmware_size))) {
+        // The whole patch has arrived, but it didn't produce the whole firmware image.
+        espconn_send(conn, "ERR: Patch incomplete.\r\n", 24);
+        ota_state = ERROR;
+        return false;
+    }
+    return ota_state != ERROR;
+}
+
+/*
+ * Decodes received patch bytes, rebuilding the new firmware image from the running image and the patch's literal
+ * bytes. Returns the number of bytes handled, which is fewer than "len" if a copy operation has been queued (the rest
+ * must wait until it's been carried out), or HEATSHRINK_ABANDON if the OTA process has been aborted.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_apply_patch(struct espconn *conn, const uint8_t *data, uint32_t len) {
+    // Anything after the end of the patch is ignored.
+    const uint8_t *start = data;
+    uint32_t remaining = ota_patch_size - ota_patch_received;
+    if (remaining > len) {
+        remaining = len;
+    }
+
+    while ((remaining > 0) && (ota_state == RECEIVING_FIRMWARE) && (ota_copy_remaining == 0)) {
+        switch (ota_patch_state) {
+            case PATCH_OP: {
+                // Start of a new operation.
+                ota_patch_op = *data++;
+                remaining--;
+                if ((ota_patch_op != PATCH_OP_COPY) && (ota_patch_op != PATCH_OP_INSERT)) {
+                    espconn_send(conn, "ERR: Invalid patch operation.\r\n", 31);
+                    ota_state = ERROR;
+                    return HEATSHRINK_ABANDON;
+                }
+                ota_patch_args_len = 0;
+                ota_patch_state = PATCH_ARGS;
+                break;
+            }
+            case PATCH_ARGS: {
+                // Collect the operation's arguments, which may be split across packets.
+                uint8_t needed = (ota_patch_op == PATCH_OP_COPY) ? 8 : 4;
+                while ((remaining > 0) && (ota_patch_args_len < needed)) {
+                    ota_patch_args[ota_patch_args_len++] = *data++;
+                    remaining--;
+                }
+                if (ota_patch_args_len == needed) {
+                    uint32_t arg0 = ota_patch_args[0] | (ota_patch_args[1] << 8) | 
+                                    (ota_patch_args[2] << 16) | (ota_patch_args[3] << 24);
+                    if (ota_patch_op == PATCH_OP_COPY) {
+                        uint32_t arg1 = ota_patch_args[4] | (ota_patch_args[5] << 8) | 
+                                        (ota_patch_args[6] << 16) | (ota_patch_args[7] << 24);
+                        if (!ota_patch_copy(conn, arg0, arg1)) {
+                            return HEATSHRINK_ABANDON;
+                        }
+                        ota_patch_state = PATCH_OP;
                     } else {
-                        // The buffer has overflowed again, remember where we left off.
-                        unbuffered_start = ii;
-                        break;
+                        ota_patch_insert_remaining = arg0;
+                        ota_patch_state = (arg0 > 0) ? PATCH_INSERT : PATCH_OP;
                     }
                 }
+                break;
             }
-        } else if (ota_state == RECEIVING_FIRMWARE) {
-            if (unbuffered_start > 0) {
-                // Store unbuffered bytes in the firmware buffer.
-                uint32_t copy_len = (uint32_t)(len - unbuffered_start);
-                if ((copy_len + ota_firmware_len) > SPI_FLASH_SEC_SIZE) {
-                    copy_len = SPI_FLASH_SEC_SIZE - ota_firmware_len;
+            case PATCH_INSERT: {
+                // Pass literal bytes straight through to the firmware buffers.
+                uint32_t copy_len = (remaining < ota_patch_insert_remaining) ? remaining : ota_patch_insert_remaining;
+                if (copy_len > ota_firmware_size - ota_firmware_received) {
+                    espconn_send(conn, "ERR: Patch exceeds firmware length.\r\n", 37);
+                    ota_state = ERROR;
+                    return HEATSHRINK_ABANDON;
                 }
-                if ((copy_len + ota_firmware_received) > ota_firmware_size) {
-                    copy_len = ota_firmware_size - ota_firmware_len;
+                if (!ota_store_firmware(conn, data, copy_len)) {
+                    return HEATSHRINK_ABANDON;
                 }
-                os_memmove(&ota_firmware[ota_firmware_len], &data[unbuffered_start], copy_len);
-                ota_firmware_len += copy_len;
-                ota_firmware_received += copy_len;
-                if (copy_len < (len - unbuffered_start)) {
-                    unbuffered_start += copy_len;
-                } else {
-                    unbuffered_start = 0;
+                data += copy_len;
+                remaining -= copy_len;
+                ota_patch_insert_remaining -= copy_len;
+                if (ota_patch_insert_remaining == 0) {
+                    ota_patch_state = PATCH_OP;
                 }
-                repeat = true;
+                break;
             }
         }
     }
+
+    ota_patch_received += data - start;
+    if (!ota_check_patch(conn)) {
+        return HEATSHRINK_ABANDON;
+    }
+
+    // Once the copy has been carried out, carry on from the operation after it. Otherwise, everything has been used,
+    // including anything after the end of the patch.
+    return (ota_copy_remaining > 0) ? (uint32_t)(data - start) : len;
 }
 
-// Returns the number of bytes in the message buffer for a single header line, or zero if no header is found.
-LOCAL uint8_t ICACHE_FLASH_ATTR parse_header_line() {
-    for (uint8_t ii = 0; ii < ota_buffer_len - 1; ii++) {
-        if ((ota_buffer[ii] == '\r') && (ota_buffer[ii + 1] == '\n')) {
-            // We have found the end of line markers.
-            return ii + 1;
+/*
+ * Handles firmware (or patch) bytes once any compression has been removed. Returns the number of bytes handled, which
+ * is fewer than "len" if a patch copy operation has been queued, or HEATSHRINK_ABANDON if the OTA process has been
+ * aborted.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_decoded_cb(void *arg, const uint8_t *data, uint32_t len) {
+    struct espconn *conn = (struct espconn *)arg;
+    if (ota_patch_size > 0) {
+        return ota_apply_patch(conn, data, len);
+    } else {
+        return ota_store_firmware(conn, data, len) ? len : HEATSHRINK_ABANDON;
+    }
+}
+
+/*
+ * Handles bytes of the payload, decompressing them first if required. While a patch copy operation is outstanding,
+ * the decoder is suspended, carrying on with any bytes it had already decoded once it's next called. Returns the
+ * number of bytes handled, or HEATSHRINK_ABANDON if the OTA process has been aborted.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR ota_decode_payload(struct espconn *conn, const uint8_t *data, uint32_t len) {
+    if (ota_decoder != NULL) {
+        return heatshrink_decode(ota_decoder, data, len);
+    } else {
+        return ota_decoded_cb(conn, data, len);
+    }
+}
+
+/*
+ * Keeps received bytes that can't be handled until the outstanding patch copy operation has been carried out, after
+ * any already kept. Returns false if the OTA process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_keep_backlog(struct espconn *conn, const uint8_t *data, uint32_t len) {
+    uint32_t kept = ota_backlog_len - ota_backlog_pos;
+    uint8_t *backlog = (uint8_t *)os_malloc(kept + len);
+    if (backlog == NULL) {
+        espconn_send(conn, "ERR: Unable to allocate OTA buffer.\r\n", 37);
+        ota_state = ERROR;
+        return false;
+    }
+    if (ota_backlog != NULL) {
+        os_memcpy(backlog, &ota_backlog[ota_backlog_pos], kept);
+        os_free(ota_backlog);
+    }
+    os_memcpy(&backlog[kept], data, len);
+    ota_backlog = backlog;
+    ota_backlog_len = kept + len;
+    ota_backlog_pos = 0;
+    return true;
+}
+
+/*
+ * Handles the bytes received after the header. Any that follow a patch copy operation are kept until it has been
+ * carried out. Returns false if the OTA process has been aborted.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_receive_payload(struct espconn *conn, const uint8_t *data, uint32_t len) {
+    uint32_t used = 0;
+    if ((ota_copy_remaining == 0) && (ota_backlog == NULL)) {
+        used = ota_decode_payload(conn, data, len);
+        if ((used == HEATSHRINK_ABANDON) || (ota_state != RECEIVING_FIRMWARE)) {
+            return ota_state != ERROR;
         }
     }
+    return (used == len) || ota_keep_backlog(conn, &data[used], len - used);
+}
 
-    // If we get here, we didn't find the end of line markers.
-    return 0;
+/*
+ * Handles the bytes kept back while a patch copy operation was carried out, until they run out or another copy is
+ * queued. Reception resumes once they've all been handled.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_catch_up() {
+    // Even with nothing kept, the decoder may have been suspended with decoded bytes still to pass on.
+    uint32_t len = ota_backlog_len - ota_backlog_pos;
+    uint32_t used = ota_decode_payload(ota_active_conn, (ota_backlog != NULL) ? &ota_backlog[ota_backlog_pos] : NULL,
+                                       len);
+    if ((used == HEATSHRINK_ABANDON) || (ota_state != RECEIVING_FIRMWARE)) {
+        return;
+    }
+    ota_backlog_pos += used;
+    if (ota_copy_remaining > 0) {
+        // Another copy has been queued, catch up again once that's done.
+        return;
+    }
+
+    if (ota_backlog != NULL) {
+        os_free(ota_backlog);
+        ota_backlog = NULL;
+    }
+    ota_backlog_len = 0;
+    ota_backlog_pos = 0;
+    if (ota_check_patch(ota_active_conn)) {
+        ota_release_hold();
+    }
+}
+
+/*
+ * Carries out the next part of the outstanding patch copy operation, reading from the running firmware image up to the
+ * end of the sector buffer being filled, so that the flash write task gets to write that sector before the next part.
+ * Once the copy is complete, the bytes kept back behind it are handled.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_copy_sector() {
+    uint32_t len = SPI_FLASH_SEC_SIZE - ota_firmware_len;
+    if (len > ota_copy_remaining) {
+        len = ota_copy_remaining;
+    }
+
+    // Flash reads must be word aligned, so read into an aligned buffer with room for the leading/trailing bytes.
+    uint32_t words[(OTA_COPY_CHUNK / 4) + 2];
+    while ((len > 0) && (ota_state == RECEIVING_FIRMWARE)) {
+        uint32_t skip = ota_copy_address & 0x03;
+        uint32_t chunk = (len < OTA_COPY_CHUNK) ? len : OTA_COPY_CHUNK;
+        if (spi_flash_read(ota_copy_address - skip, words, (skip + chunk + 3) & ~0x03) != SPI_FLASH_RESULT_OK) {
+            espconn_send(ota_active_conn, "ERR: Flash read failed.\r\n", 25);
+            ota_state = ERROR;
+            return;
+        }
+        if (!ota_store_firmware(ota_active_conn, &((uint8_t *)words)[skip], chunk)) {
+            return;
+        }
+        ota_copy_address += chunk;
+        ota_copy_remaining -= chunk;
+        len -= chunk;
+    }
+
+    if (ota_state != RECEIVING_FIRMWARE) {
+        return;
+    } else if (ota_copy_remaining > 0) {
+        ota_copy_posted = true;
+        system_os_post(OTA_WRITE_PRI, OTA_EVENT_COPY, 0);
+    } else {
+        ota_catch_up();
+    }
+}
+
+/*
+ * Reads a little-endian 16-bit value from a (possibly unaligned) datagram.
+ */
+LOCAL uint16_t ICACHE_FLASH_ATTR get_le16(const uint8_t *data) {
+    return data[0] | (data[1] << 8);
+}
+
+/*
+ * Reads a little-endian 32-bit value from a (possibly unaligned) datagram.
+ */
+LOCAL uint32_t ICACHE_FLASH_ATTR get_le32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+}
+
+/*
+ * Sends the status of the multicast upgrade back to the sender of the datagram just received.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_send_status(struct espconn *conn) {
+    remot_info *remote = NULL;
+    if (espconn_get_connection_info(conn, &remote, 0) != ESPCONN_OK) {
+        return;
+    }
+    os_memcpy(conn->proto.udp->remote_ip, remote->remote_ip, 4);
+    conn->proto.udp->remote_port = remote->remote_port;
+
+    // Status: header, flags, padding, missing sector count, received sector bitmap.
+    uint8_t reply[OTA_MCAST_HEADER_LEN + 4 + OTA_MCAST_BITMAP_LEN];
+    uint16_t missing = 0;
+    for (uint16_t ii = 0; ii < ota_mcast_sectors; ii++) {
+        if ((ota_mcast_received[ii / 8] & (1 << (ii % 8))) == 0) {
+            missing++;
+        }
+    }
+    uint16_t bitmap_len = (ota_mcast_sectors + 7) / 8;
+    os_memset(reply, 0, sizeof(reply));
+    os_memcpy(&reply[0], "OTAM", 4);
+    reply[4] = ota_mcast_session & 0xFF;
+    reply[5] = (ota_mcast_session >> 8) & 0xFF;
+    reply[6] = (ota_mcast_session >> 16) & 0xFF;
+    reply[7] = (ota_mcast_session >> 24) & 0xFF;
+    reply[8] = OTA_MCAST_STATUS;
+    reply[9] = (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    reply[14] = (4 + bitmap_len) & 0xFF;
+    reply[15] = ((4 + bitmap_len) >> 8) & 0xFF;
+    reply[OTA_MCAST_HEADER_LEN] = ota_mcast_complete ? OTA_MCAST_STATUS_COMPLETE : 0;
+    reply[OTA_MCAST_HEADER_LEN + 2] = missing & 0xFF;
+    reply[OTA_MCAST_HEADER_LEN + 3] = (missing >> 8) & 0xFF;
+    os_memcpy(&reply[OTA_MCAST_HEADER_LEN + 4], ota_mcast_received, bitmap_len);
+    espconn_send(conn, reply, OTA_MCAST_HEADER_LEN + 4 + bitmap_len);
+}
+
+/*
+ * Abandons any multicast upgrade in progress.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_reset() {
+    for (uint8_t ii = 0; ii < OTA_SECTOR_BUFFERS; ii++) {
+        if (ota_mcast_buf[ii] != NULL) {
+            os_free(ota_mcast_buf[ii]);
+            ota_mcast_buf[ii] = NULL;
+        }
+        ota_mcast_pending[ii] = false;
+        ota_mcast_buf_sector[ii] = -1;
+    }
+    ota_mcast_session = 0;
+    ota_mcast_fill_buf = 0;
+    ota_mcast_chunks = 0;
+    ota_mcast_complete = false;
+}
+
+/*
+ * Returns true if the given sector is waiting in a multicast buffer to be written to flash.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_mcast_sector_pending(uint16_t sector) {
+    for (uint8_t ii = 0; ii < OTA_SECTOR_BUFFERS; ii++) {
+        if (ota_mcast_pending[ii] && (ota_mcast_buf_sector[ii] == sector)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Hands a fully assembled multicast sector to the flash write task, and starts assembling the next sector in the other
+ * buffer. The first sector's header is checked first, the whole upgrade being abandoned if it isn't an image that can
+ * be booted, as the TCP upgrade would be.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_queue_sector() {
+    uint8_t buf = ota_mcast_fill_buf;
+    if (ota_mcast_buf_sector[buf] == 0) {
+        if (ota_header_error(ota_mcast_buf[buf]) != NULL) {
+            DBG_ERROR("Multicast OTA session %08x rejected, its image header is invalid.\n", ota_mcast_session);
+            ota_mcast_rejected = ota_mcast_session;
+            ota_mcast_reset();
+            return;
+        }
+    }
+    ota_mcast_pending[buf] = true;
+    system_os_post(OTA_WRITE_PRI, OTA_EVENT_MCAST_SECTOR, (os_param_t)buf);
+    ota_mcast_fill_buf = (buf + 1) % OTA_SECTOR_BUFFERS;
+    ota_mcast_buf_sector[ota_mcast_fill_buf] = -1;
+    ota_mcast_chunks = 0;
+}
+
+/*
+ * Writes a fully assembled multicast sector buffer to flash, from the flash write task, completing the upgrade if it
+ * was the last sector missing.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_write_sector(uint8_t buf) {
+    uint16_t sector = (uint16_t)ota_mcast_buf_sector[buf];
+    uint32_t address = ota_flash_base() + sector * SPI_FLASH_SEC_SIZE;
+    spi_flash_erase_sector(address / SPI_FLASH_SEC_SIZE);
+    SpiFlashOpResult res = spi_flash_write(address, (uint32_t *)ota_mcast_buf[buf], SPI_FLASH_SEC_SIZE);
+    ota_mcast_pending[buf] = false;
+    if (res != SPI_FLASH_RESULT_OK) {
+        // Leave the sector marked as missing, so that it's sent again.
+        DBG_ERROR("Multicast OTA flash of sector %d failed.\n", sector);
+        return;
+    }
+    ota_mcast_received[sector / 8] |= 1 << (sector % 8);
+
+    // See if that was the last one.
+    for (uint16_t ii = 0; ii < ota_mcast_sectors; ii++) {
+        if ((ota_mcast_received[ii / 8] & (1 << (ii % 8))) == 0) {
+            return;
+        }
+    }
+
+    if (!ota_verify_flash(ota_mcast_buf[buf], ota_mcast_size, ota_mcast_crc)) {
+        // Something went wrong, start again from scratch, the sender will see that every sector is missing.
+        DBG_ERROR("Multicast OTA verification failed.\n");
+        os_memset(ota_mcast_received, 0, OTA_MCAST_BITMAP_LEN);
+    } else {
+        // Let the sender know we're done, and reboot into the new firmware.
+        DBG_INFO("Multicast OTA upgrade complete.\n");
+        ota_mcast_complete = true;
+        ota_mcast_send_status(&ota_mcast_conn);
+        ota_schedule_reboot();
+    }
+}
+
+/*
+ * Checks whether the running image is the one with the given length and CRC-32. The running image's CRC-32 is only
+ * worked out again if the length differs from last time, as the same announcement is repeated every repair round.
+ */
+LOCAL bool ICACHE_FLASH_ATTR ota_running_image_is(uint32_t size, uint32_t crc) {
+    if ((size == 0) || (size > FIRMWARE_SIZE)) {
+        return false;
+    }
+    if (size != ota_running_size) {
+        uint8_t *buf = (uint8_t *)os_malloc(SPI_FLASH_SEC_SIZE);
+        if (buf == NULL) {
+            return false;
+        }
+        bool read = ota_flash_crc(ota_unit_base(system_upgrade_userbin_check()), buf, size, &ota_running_crc);
+        os_free(buf);
+        if (!read) {
+            return false;
+        }
+        ota_running_size = size;
+    }
+    return crc == ota_running_crc;
+}
+
+/*
+ * Handles the receiving of multicast OTA datagrams.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_rx_cb(void *arg, char *pdata, uint16_t len) {
+    struct espconn *conn = (struct espconn *)arg;
+    const uint8_t *data = (const uint8_t *)pdata;
+    if ((len < OTA_MCAST_HEADER_LEN) || (get_le32(data) != OTA_MCAST_MAGIC)) {
+        return;
+    }
+    uint32_t session = get_le32(&data[4]);
+    uint8_t type = data[8];
+    uint8_t unit = data[9];
+    uint16_t sector = get_le16(&data[10]);
+    uint16_t offset = get_le16(&data[12]);
+    uint16_t data_len = get_le16(&data[14]);
+    const uint8_t *payload = &data[OTA_MCAST_HEADER_LEN];
+    if ((data_len > len - OTA_MCAST_HEADER_LEN) || (session == 0)) {
+        return;
+    }
+
+    // Ignore images for the unit that's running, and anything while a TCP upgrade is underway.
+    uint8_t next = (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    if ((unit != next) || (ota_state != NOT_STARTED)) {
+        return;
+    }
+
+    if (type == OTA_MCAST_ANNOUNCE) {
+        // A new image is on its way, get ready for it. While a newly flashed image is still proving itself healthy,
+        // the image it would roll back to mustn't be overwritten.
+        if ((session == ota_mcast_session) || (session == ota_mcast_rejected) || ota_mcast_complete ||
+            ota_health_checking || (data_len < 8)) {
+            return;
+        }
+        uint32_t size = get_le32(payload);
+        if ((size == 0) || (size > FIRMWARE_SIZE)) {
+            return;
+        }
+        if ((data_len >= 16) && ota_running_image_is(get_le32(&payload[8]), get_le32(&payload[12]))) {
+            // We're already running the firmware being sent, having been flashed with its image for the other unit.
+            return;
+        }
+        ota_mcast_reset();
+        for (uint8_t ii = 0; ii < OTA_SECTOR_BUFFERS; ii++) {
+            ota_mcast_buf[ii] = (uint8_t *)os_malloc(SPI_FLASH_SEC_SIZE);
+            if (ota_mcast_buf[ii] == NULL) {
+                DBG_ERROR("Unable to allocate multicast OTA buffer.\n");
+                ota_mcast_reset();
+                return;
+            }
+        }
+        DBG_INFO("Multicast OTA session %08x announced, %d bytes.\n", session, size);
+        ota_mcast_session = session;
+        ota_mcast_size = size;
+        ota_mcast_crc = get_le32(&payload[4]);
+        ota_mcast_sectors = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+        os_memset(ota_mcast_received, 0, OTA_MCAST_BITMAP_LEN);
+    } else if (session != ota_mcast_session) {
+        // Not the session we're part of.
+        return;
+    } else if (type == OTA_MCAST_QUERY) {
+        // The sender wants to know what we're missing.
+        ota_mcast_send_status(conn);
+    } else if ((type == OTA_MCAST_DATA) && (!ota_mcast_complete)) {
+        // Check the chunk fits within the image, and that we haven't already got the sector.
+        uint32_t sector_len = ota_mcast_size - sector * SPI_FLASH_SEC_SIZE;
+        if (sector_len > SPI_FLASH_SEC_SIZE) {
+            sector_len = SPI_FLASH_SEC_SIZE;
+        }
+        if ((sector >= ota_mcast_sectors) || ((offset % OTA_MCAST_CHUNK) != 0) || (offset >= sector_len) || 
+            (data_len > OTA_MCAST_CHUNK) || (data_len != ((sector_len - offset < OTA_MCAST_CHUNK) ? 
+                                                          sector_len - offset : OTA_MCAST_CHUNK)) ||
+            (ota_mcast_received[sector / 8] & (1 << (sector % 8))) || ota_mcast_sector_pending(sector)) {
+            return;
+        }
+
+        // Sectors are assembled one at a time, a partial sector is dropped (and sent again later) if another starts.
+        // If the write task hasn't yet got to the sector last assembled in this buffer, the chunk is dropped too.
+        uint8_t buf = ota_mcast_fill_buf;
+        if (ota_mcast_pending[buf]) {
+            return;
+        }
+        if (ota_mcast_buf_sector[buf] != sector) {
+            ota_mcast_buf_sector[buf] = sector;
+            ota_mcast_chunks = 0;
+            os_memset(ota_mcast_buf[buf], 0, SPI_FLASH_SEC_SIZE);
+        }
+        os_memcpy(&ota_mcast_buf[buf][offset], payload, data_len);
+        ota_mcast_chunks |= 1 << (offset / OTA_MCAST_CHUNK);
+
+        // Have the sector written once every chunk has arrived, outside of this call-back as erasing and writing it
+        // (and reading back the whole image after the last one) takes far too long to hold up the network stack.
+        uint8_t all_chunks = (1 << ((sector_len + OTA_MCAST_CHUNK - 1) / OTA_MCAST_CHUNK)) - 1;
+        if (ota_mcast_chunks == all_chunks) {
+            ota_mcast_queue_sector();
+        }
+    }
+}
+
+/*
+ * Timer call-back used to join the multicast group once we have an IP address, and re-join it if the address changes.
+ */
+LOCAL void ICACHE_FLASH_ATTR ota_mcast_join_cb(void *arg) {
+    struct ip_info info;
+    if ((wifi_station_get_connect_status() != STATION_GOT_IP) || (!wifi_get_ip_info(STATION_IF, &info)) ||
+        (info.ip.addr == ota_mcast_joined_ip)) {
+        return;
+    }
+
+    ip_addr_t group;
+    OTA_MCAST_ADDR(&group);
+    if (ota_mcast_joined_ip != 0) {
+        ip_addr_t old;
+        old.addr = ota_mcast_joined_ip;
+        espconn_igmp_leave(&old, &group);
+    }
+    if (espconn_igmp_join(&info.ip, &group) == ESPCONN_OK) {
+        ota_mcast_joined_ip = info.ip.addr;
+    }
 }
 
 /*
@@ -385,13 +1652,14 @@ LOCAL void ICACHE_FLASH_ATTR ota_disc_cb(void *arg) {
         ota_port = 0;
         ota_state = NOT_STARTED;
 
-        ota_buffer_len = 0;
-        if (ota_firmware != NULL) {
-            os_free(ota_firmware);
-            ota_firmware = NULL;
-            ota_firmware_size = 0;
-            ota_firmware_len = 0;
-        }
+        ota_free_line();
+        ota_patch_size = 0;
+        ota_compressed = false;
+        ota_expected_crc_set = false;
+        ota_resumable = false;
+        ota_held = false;
+        ota_free_firmware();
+        ota_active_conn = NULL;
     }
 }
 
@@ -408,8 +1676,8 @@ LOCAL void ICACHE_FLASH_ATTR ota_recon_cb(void *arg, int8_t err) {
  */
 LOCAL void ICACHE_FLASH_ATTR ota_tcp_connect_cb(void *arg) {
     struct espconn *conn = (struct espconn *)arg;
-    os_printf("TCP OTA connection received from "IPSTR":%d\n",
-              IP2STR(conn->proto.tcp->remote_ip), conn->proto.tcp->remote_port);
+    DBG_PRINTF(DBG_LEVEL_INFO, "TCP OTA connection received from "IPSTR":%d\n",
+               IP2STR(conn->proto.tcp->remote_ip), conn->proto.tcp->remote_port);
 
     // See if this connection is allowed.
     if (ota_ip == 0) {
@@ -423,6 +1691,8 @@ LOCAL void ICACHE_FLASH_ATTR ota_tcp_connect_cb(void *arg) {
 /*
  * Initialises the required connection information to listen for OTA messages.
  * WiFi must first have been set up for this to succeed.
+ * If the running firmware has just been flashed (as found by ota_check_boot), it is rolled back to the previous
+ * firmware unless it gets an IP address and listens for OTA connections within a minute.
  */
 void ICACHE_FLASH_ATTR ota_init() {
     ota_proto.local_port = OTA_PORT;
@@ -430,5 +1700,26 @@ void ICACHE_FLASH_ATTR ota_init() {
     ota_conn.state = ESPCONN_NONE;
     ota_conn.proto.tcp = &ota_proto;
     espconn_regist_connectcb(&ota_conn, ota_tcp_connect_cb);
-    espconn_accept(&ota_conn);
+    ota_listening = (espconn_accept(&ota_conn) == ESPCONN_OK);
+
+    // Set up the task used to write firmware sectors to flash while the next sector is being received.
+    system_os_task(ota_write_task, OTA_WRITE_PRI, ota_write_queue, OTA_WRITE_QUEUE_LEN);
+
+    // Listen for multicast upgrades, joining the multicast group once we have an IP address.
+    ota_mcast_proto.local_port = OTA_MCAST_PORT;
+    ota_mcast_conn.type = ESPCONN_UDP;
+    ota_mcast_conn.state = ESPCONN_NONE;
+    ota_mcast_conn.proto.udp = &ota_mcast_proto;
+    espconn_create(&ota_mcast_conn);
+    espconn_regist_recvcb(&ota_mcast_conn, ota_mcast_rx_cb);
+    os_timer_disarm(&ota_mcast_join_timer);
+    os_timer_setfn(&ota_mcast_join_timer, (os_timer_func_t *)ota_mcast_join_cb, NULL);
+    os_timer_arm(&ota_mcast_join_timer, OTA_MCAST_JOIN_INTERVAL, 1);
+
+    // If we've just been flashed, make sure we're working before settling on this image.
+    if (ota_health_checking) {
+        os_timer_disarm(&ota_health_timer);
+        os_timer_setfn(&ota_health_timer, (os_timer_func_t *)ota_health_cb, NULL);
+        os_timer_arm(&ota_health_timer, OTA_HEALTH_INTERVAL, 1);
+    }
 }
@@ -4,6 +4,7 @@
  * Author: Ian Marshall
  * Date: 14/06/2016
  */
+#include <stdarg.h>
 #include "ets_sys.h"
 #include "osapi.h"
 #include "os_type.h"    
@@ -13,49 +14,435 @@
 #include "espmissingincludes.h"
 #include "udp_debug.h"
 
+// The module used to identify this file's tokenized debug messages.
+#define DBG_MODULE DBG_MODULE_DEBUG
+
+// The RTC user memory block holding the details of a crash until they're sent, clear of the blocks used by tcp_ota.c.
+#define DBG_CRASH_RTC_BLOCK 80
+
+// Value marking the crash details in RTC memory as valid ("CRSH").
+#define DBG_CRASH_MAGIC 0x48535243
+
+// The number of words of the stack saved when the ESP8266 crashes.
+#define DBG_CRASH_STACK_WORDS 32
+
+// The address just past the top of the stack.
+#define DBG_STACK_END 0x3FFFFFB0
+
+// Structure holding the details of a crash in RTC memory, saved as the ESP8266 restarts. The reason, exception cause
+// and registers are already kept by the SDK, so only the stack is saved here.
+typedef struct {
+    uint32_t magic;                         // DBG_CRASH_MAGIC when the details are valid.
+    uint32_t reason;                        // The reason for the reset, from the SDK's reset information.
+    uint32_t sp;                            // The stack pointer when the stack was saved.
+    uint32_t stack_words;                   // The number of words of the stack saved.
+    uint32_t stack[DBG_CRASH_STACK_WORDS];  // The stack, starting from the frame that crashed.
+} dbg_crash_t;
+
+// The SDK's restart function, called once the crash details have been saved.
+void __real_system_restart_local();
+
 // Structure holding the TCP connection information for the debug communications.
 LOCAL struct espconn dbg_conn;
 
+// Flag as to whether the debug connection has been created.
+LOCAL bool dbg_connected = false;
+
 // UDP specific protocol structure for the debug communications.
 LOCAL esp_udp dbg_proto;
 
-// Buffer used for storing debug message bytes until a new line (\n) character is received, or it fills up.
-LOCAL char dbg_buffer[DBG_BUFFER_LEN];
+// Ring buffer holding the debug records until the debug task sends them. Only dbg_putc and dbg_log write to it (moving
+// the head), and only the debug task reads from it (moving the tail), so no locking is needed.
+LOCAL uint8_t dbg_ring[DBG_RING_LEN];
+
+// The index in the ring buffer at which the next debug record is stored.
+LOCAL volatile uint16_t dbg_ring_head = 0;
+
+// The index in the ring buffer of the next debug record to be sent.
+LOCAL volatile uint16_t dbg_ring_tail = 0;
+
+// The number of debug bytes thrown away because the ring buffer was full, not yet reported.
+LOCAL volatile uint32_t dbg_dropped = 0;
+
+// Buffer used for storing debug message bytes until a new line (\n) character is received, or it fills up. Room is left
+// at the start for the record header.
+LOCAL uint8_t dbg_line[DBG_RECORD_HEADER_LEN + DBG_LINE_LEN];
+
+// The number of text bytes currently used in the debug line buffer.
+LOCAL uint8_t dbg_line_len = 0;
+
+// Buffer used to assemble each debug datagram from the ring buffer.
+LOCAL uint8_t dbg_datagram[DBG_DATAGRAM_LEN];
+
+// The queue used for posting to the debug task.
+LOCAL os_event_t dbg_queue[DBG_QUEUE_LEN];
+
+// The boot ID sent in each debug datagram, chosen at random during initialisation.
+LOCAL uint32_t dbg_boot_id = 0;
+
+// The sequence number of the next debug datagram to be sent.
+LOCAL uint32_t dbg_sequence = 0;
+
+// Flag as to whether the debug task has been set up, so that it can be posted to.
+LOCAL bool dbg_ready = false;
+
+// Flag as to whether the debug task has been posted, and hasn't run yet.
+LOCAL volatile bool dbg_posted = false;
+
+// The number of debug datagrams sent since the statistics were last reported.
+LOCAL uint32_t dbg_stats_datagrams = 0;
+
+// The total time (in us) spent sending the debug datagrams since the statistics were last reported.
+LOCAL uint32_t dbg_stats_time = 0;
+
+// Timer used for reporting the cost of sending the debug datagrams.
+LOCAL os_timer_t dbg_stats_timer;
+
+// The current debug level of each module.
+uint8_t dbg_levels[DBG_MODULE_COUNT] = { DBG_DEFAULT_LEVEL, DBG_DEFAULT_LEVEL, DBG_DEFAULT_LEVEL, DBG_DEFAULT_LEVEL,
+    DBG_DEFAULT_LEVEL };
+
+// Structure holding the UDP connection information for receiving the debug control datagrams.
+LOCAL struct espconn dbg_control_conn;
+
+// UDP specific protocol structure for receiving the debug control datagrams.
+LOCAL esp_udp dbg_control_proto;
+
+/*
+ * Creates the UDP "connection" used to send the debug messages.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_create() {
+    // Set the destination IP address and port.
+    DBG_ADDR(dbg_proto.remote_ip);
+    dbg_proto.remote_port = DBG_PORT;
+
+    // Prepare the UDP "connection" structure.
+    dbg_conn.type = ESPCONN_UDP;
+    dbg_conn.state = ESPCONN_NONE;
+    dbg_conn.proto.udp = &dbg_proto;
+    dbg_connected = (espconn_create(&dbg_conn) == ESPCONN_OK);
+}
+
+/*
+ * Posts the debug task to send what's in the ring buffer, unless it has already been posted.
+ */
+LOCAL void dbg_post() {
+    if (dbg_ready && (!dbg_posted)) {
+        dbg_posted = true;
+        system_os_post(DBG_TASK_PRI, 0, 0);
+    }
+}
+
+/*
+ * Writes a 32-bit value to a buffer, little-endian.
+ */
+LOCAL void dbg_put_le32(uint8_t *buf, uint32_t value) {
+    buf[0] = value & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    buf[2] = (value >> 16) & 0xFF;
+    buf[3] = (value >> 24) & 0xFF;
+}
+
+/*
+ * Fills in the header of a record, stamping it with the current time.
+ */
+LOCAL void dbg_record_header(uint8_t *record, uint8_t type, uint8_t len) {
+    record[0] = type;
+    record[1] = len;
+    dbg_put_le32(&record[2], system_get_time());
+}
 
-// The number of bytes currently used in the debug buffer.
-LOCAL uint8_t dbg_buffer_len = 0;
+/*
+ * Stores a complete record in the ring buffer, to be sent by the debug task. The record is dropped if it won't fit.
+ */
+LOCAL void dbg_store(const uint8_t *record, uint16_t len) {
+    uint16_t head = dbg_ring_head;
+    uint16_t free = (dbg_ring_tail - head - 1) & (DBG_RING_LEN - 1);
+    if (len > free) {
+        dbg_dropped += len;
+    } else {
+        for (uint16_t ii = 0; ii < len; ii++) {
+            dbg_ring[(head + ii) & (DBG_RING_LEN - 1)] = record[ii];
+        }
+        dbg_ring_head = (head + len) & (DBG_RING_LEN - 1);
+    }
+    dbg_post();
+}
 
 /*
- * Receives a single character of output for debugging. This is used to send through the data via UDP.
+ * Receives a single character of output for debugging. Each line is stored in the ring buffer as a text record once
+ * it is complete (or fills the line buffer), and the debug task sends it through via UDP.
  */
 LOCAL void dbg_putc(char c) {
-    // Add the character to the buffer.
-    dbg_buffer[dbg_buffer_len++] = c;
-
-    // See if we're ready to send the buffer through - a new-line (with other data) or full buffer will trigger a transmission.
-    if (((c == '\n') && (dbg_buffer_len > 1)) || (dbg_buffer_len == DBG_BUFFER_LEN)) {
-        // Set the destination IP address and port.
-        DBG_ADDR(dbg_proto.remote_ip);
-        dbg_proto.remote_port = DBG_PORT;
-
-        // Prepare the UDP "connection" structure.
-        dbg_conn.type = ESPCONN_UDP;
-        dbg_conn.state = ESPCONN_NONE;
-        dbg_conn.proto.udp = &dbg_proto;
-
-        // Send the debug message via a UDP packet.
-        espconn_create(&dbg_conn);
-        espconn_send(&dbg_conn, dbg_buffer, dbg_buffer_len);
-        espconn_delete(&dbg_conn);
+    // Add the character to the line buffer.
+    dbg_line[DBG_RECORD_HEADER_LEN + dbg_line_len++] = c;
+
+    // See if we're ready to send the line through - a new-line (with other data) or full buffer will trigger a transmission.
+    if (((c == '\n') && (dbg_line_len > 1)) || (dbg_line_len == DBG_LINE_LEN)) {
+        dbg_record_header(dbg_line, DBG_RECORD_TEXT, dbg_line_len);
+        dbg_store(dbg_line, DBG_RECORD_HEADER_LEN + dbg_line_len);
+        dbg_line_len = 0;
+    }
+}
+
+/*
+ * Queues a tokenized debug message to be sent. Use DBG_LOG rather than calling this directly.
+ */
+void dbg_log(uint8_t module, uint16_t line, uint8_t nargs, ...) {
+    // Five bytes is enough for any LEB128 encoded 32-bit value.
+    uint8_t record[DBG_RECORD_HEADER_LEN + 3 + 5 * DBG_MAX_ARGS];
+    uint8_t len = DBG_RECORD_HEADER_LEN;
+    record[len++] = module;
+    record[len++] = line & 0xFF;
+    record[len++] = line >> 8;
+
+    va_list args;
+    va_start(args, nargs);
+    for (uint8_t ii = 0; ii < nargs; ii++) {
+        uint32_t value = va_arg(args, uint32_t);
+        while (value >= 0x80) {
+            record[len++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        record[len++] = value;
+    }
+    va_end(args);
 
-        // Reset the buffer.
-        dbg_buffer_len = 0;
+    dbg_record_header(record, DBG_RECORD_TOKEN, len - DBG_RECORD_HEADER_LEN);
+    dbg_store(record, len);
+}
+
+/*
+ * Sends the debug records from the ring buffer, once we have an IP address. Each datagram holds as many whole records
+ * as will fit, preceded by the datagram header and a note of any bytes that were dropped. One datagram is sent each
+ * time the task runs, the task being posted again if there's more to come.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_task(os_event_t *event) {
+    dbg_posted = false;
+
+    // Keep everything in the ring buffer until we have an IP address to send it from, so that what's logged while
+    // starting up (the reset reason in particular) isn't lost.
+    if (wifi_station_get_connect_status() != STATION_GOT_IP) {
+        return;
+    }
+
+    // Report any dropped bytes first.
+    uint16_t len = DBG_DATAGRAM_HEADER_LEN;
+    uint32_t dropped = dbg_dropped;
+    if (dropped > 0) {
+        dbg_dropped -= dropped;
+        uint8_t text_len = os_sprintf(&dbg_datagram[len + DBG_RECORD_HEADER_LEN], "Debug: %d bytes dropped.\n",
+                                      dropped);
+        dbg_record_header(&dbg_datagram[len], DBG_RECORD_TEXT, text_len);
+        len += DBG_RECORD_HEADER_LEN + text_len;
+    }
+
+    // Take as many whole records as will fit.
+    uint16_t tail = dbg_ring_tail;
+    uint16_t head = dbg_ring_head;
+    while (tail != head) {
+        uint16_t record_len = DBG_RECORD_HEADER_LEN + dbg_ring[(tail + 1) & (DBG_RING_LEN - 1)];
+        if (len + record_len > DBG_DATAGRAM_LEN) {
+            break;
+        }
+        for (uint16_t ii = 0; ii < record_len; ii++) {
+            dbg_datagram[len++] = dbg_ring[(tail + ii) & (DBG_RING_LEN - 1)];
+        }
+        tail = (tail + record_len) & (DBG_RING_LEN - 1);
+    }
+    dbg_ring_tail = tail;
+    if (len == DBG_DATAGRAM_HEADER_LEN) {
+        return;
+    }
+
+    // Fill in the datagram header.
+    dbg_datagram[0] = DBG_DATAGRAM_MAGIC;
+    dbg_put_le32(&dbg_datagram[1], dbg_boot_id);
+    dbg_put_le32(&dbg_datagram[5], dbg_sequence++);
+
+    // Send the debug records via a UDP packet.
+    uint32_t started = system_get_time();
+#ifdef DBG_CONN_PER_LINE
+    dbg_create();
+#endif
+    if (dbg_connected) {
+        espconn_send(&dbg_conn, dbg_datagram, len);
+    }
+#ifdef DBG_CONN_PER_LINE
+    espconn_delete(&dbg_conn);
+    dbg_connected = false;
+#endif
+    dbg_stats_time += system_get_time() - started;
+    dbg_stats_datagrams++;
+
+    // Come back for the rest, giving everything else a chance to run first.
+    if (tail != head) {
+        dbg_post();
+    }
+}
+
+/*
+ * Timer call-back reporting the average cost of sending each debug datagram.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_stats_cb(void *arg) {
+    if (dbg_stats_datagrams > 0) {
+        uint32_t datagrams = dbg_stats_datagrams;
+        uint32_t time = dbg_stats_time;
+        dbg_stats_datagrams = 0;
+        dbg_stats_time = 0;
+        DBG_DEBUG("Debug: %d datagrams, %dus each.\n", datagrams, time / datagrams);
+    }
+}
+
+/*
+ * Called instead of the SDK's system_restart_local (through the linker's -wrap option) as the ESP8266 restarts after
+ * an exception or watchdog reset, saving the stack to RTC memory to be sent once it has restarted. This stays in RAM,
+ * as there's no telling what state the flash cache is in.
+ */
+void __wrap_system_restart_local() {
+    register uint32_t sp __asm__("a1");
+    uint32_t stack = sp;
+
+    // The SDK has already saved its reset information at the start of RTC memory, so we know why we're restarting.
+    struct rst_info info;
+    system_rtc_mem_read(0, &info, sizeof(info));
+
+    // Skip the stack used by the SDK's own exception and watchdog handlers, to get back to the frame that crashed.
+    uint32_t offset;
+    if (info.reason == REASON_EXCEPTION_RST) {
+        offset = 0x1A0;
+    } else if (info.reason == REASON_SOFT_WDT_RST) {
+        offset = 0x1B0;
+    } else if (info.reason == REASON_WDT_RST) {
+        offset = 0x10;
+    } else {
+        __real_system_restart_local();
+        return;
+    }
+
+    dbg_crash_t crash;
+    crash.magic = DBG_CRASH_MAGIC;
+    crash.reason = info.reason;
+    crash.sp = stack + offset;
+    crash.stack_words = 0;
+    for (uint32_t *word = (uint32_t *)crash.sp;
+            (word < (uint32_t *)DBG_STACK_END) && (crash.stack_words < DBG_CRASH_STACK_WORDS); word++) {
+        crash.stack[crash.stack_words++] = *word;
+    }
+    system_rtc_mem_write(DBG_CRASH_RTC_BLOCK, &crash, sizeof(crash));
+    __real_system_restart_local();
+}
+
+/*
+ * Sends the reason for the last reset, along with the stack saved by __wrap_system_restart_local if it crashed.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_report_reset() {
+    uint8_t record[DBG_RECORD_HEADER_LEN + 4 * (9 + DBG_CRASH_STACK_WORDS)];
+    uint8_t len = DBG_RECORD_HEADER_LEN;
+    struct rst_info *info = system_get_rst_info();
+    uint32_t values[] = { info->reason, info->exccause, info->epc1, info->epc2, info->epc3, info->excvaddr,
+        info->depc };
+    for (uint8_t ii = 0; ii < sizeof(values) / sizeof(values[0]); ii++) {
+        dbg_put_le32(&record[len], values[ii]);
+        len += 4;
+    }
+
+    // Add the stack, if it was saved for this reset, making sure it isn't sent again.
+    dbg_crash_t crash;
+    if (system_rtc_mem_read(DBG_CRASH_RTC_BLOCK, &crash, sizeof(crash)) && (crash.magic == DBG_CRASH_MAGIC)) {
+        if ((crash.reason == info->reason) && (crash.stack_words <= DBG_CRASH_STACK_WORDS)) {
+            dbg_put_le32(&record[len], crash.sp);
+            len += 4;
+            for (uint8_t ii = 0; ii < crash.stack_words; ii++) {
+                dbg_put_le32(&record[len], crash.stack[ii]);
+                len += 4;
+            }
+        }
+        crash.magic = 0;
+        system_rtc_mem_write(DBG_CRASH_RTC_BLOCK, &crash, sizeof(crash.magic));
+    }
+
+    dbg_record_header(record, DBG_RECORD_RESET, len - DBG_RECORD_HEADER_LEN);
+    dbg_store(record, len);
+}
+
+/*
+ * Receive call-back for the debug control datagrams. Sets the debug level of each module listed, then replies to the
+ * sender with the debug levels of all the modules.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_control_rx_cb(void *arg, char *data, unsigned short len) {
+    struct espconn *conn = (struct espconn *)arg;
+    if ((len < DBG_CONTROL_MAGIC_LEN) || (os_memcmp(data, DBG_CONTROL_MAGIC, DBG_CONTROL_MAGIC_LEN) != 0)) {
+        return;
     }
+
+    // Set the debug levels, ignoring unknown modules.
+    for (unsigned short ii = DBG_CONTROL_MAGIC_LEN; ii + 1 < len; ii += 2) {
+        uint8_t module = data[ii];
+        uint8_t level = data[ii + 1];
+        if (level > DBG_LEVEL_TRACE) {
+            level = DBG_LEVEL_TRACE;
+        }
+        if (module == 0) {
+            for (uint8_t jj = 1; jj < DBG_MODULE_COUNT; jj++) {
+                dbg_levels[jj] = level;
+            }
+        } else if (module < DBG_MODULE_COUNT) {
+            dbg_levels[module] = level;
+        }
+    }
+
+    // Reply to whoever sent the datagram.
+    remot_info *remote = NULL;
+    if (espconn_get_connection_info(conn, &remote, 0) != ESPCONN_OK) {
+        return;
+    }
+    os_memcpy(conn->proto.udp->remote_ip, remote->remote_ip, 4);
+    conn->proto.udp->remote_port = remote->remote_port;
+    uint8_t reply[DBG_CONTROL_MAGIC_LEN + DBG_MODULE_COUNT - 1];
+    os_memcpy(reply, DBG_CONTROL_MAGIC, DBG_CONTROL_MAGIC_LEN);
+    os_memcpy(&reply[DBG_CONTROL_MAGIC_LEN], &dbg_levels[1], DBG_MODULE_COUNT - 1);
+    espconn_send(conn, reply, sizeof(reply));
+}
+
+/*
+ * Re-creates the debug connection, needed whenever the IP address changes.
+ */
+void ICACHE_FLASH_ATTR dbg_reconnect() {
+    if (dbg_connected) {
+        espconn_delete(&dbg_conn);
+    }
+    dbg_create();
+
+    // Send whatever was logged while we had no IP address.
+    dbg_post();
 }
 
 /*
  * Performs the required initialisation to pass debug information through the network.
  */
 void ICACHE_FLASH_ATTR dbg_init() {
+    dbg_boot_id = os_random();
+#ifndef DBG_CONN_PER_LINE
+    dbg_create();
+#endif
+    system_os_task(dbg_task, DBG_TASK_PRI, dbg_queue, DBG_QUEUE_LEN);
+    dbg_ready = true;
     os_install_putc1(dbg_putc);
+
+    // Report why we restarted, ahead of anything else (apart from what was logged before we were ready).
+    dbg_report_reset();
+
+    // Listen for changes to the debug levels.
+    dbg_control_proto.local_port = DBG_CONTROL_PORT;
+    dbg_control_conn.type = ESPCONN_UDP;
+    dbg_control_conn.state = ESPCONN_NONE;
+    dbg_control_conn.proto.udp = &dbg_control_proto;
+    espconn_create(&dbg_control_conn);
+    espconn_regist_recvcb(&dbg_control_conn, dbg_control_rx_cb);
+
+    // Report the cost of sending the debug datagrams every so often.
+    os_timer_disarm(&dbg_stats_timer);
+    os_timer_setfn(&dbg_stats_timer, (os_timer_func_t *)dbg_stats_cb, NULL);
+    os_timer_arm(&dbg_stats_timer, DBG_STATS_INTERVAL, 1);
 }
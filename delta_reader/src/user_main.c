@@ -19,7 +19,12 @@
 
 #include "tcp_ota.h"
 #include "udp_debug.h"
-#include "string_builder.h"
+#include "crc.h"
+#include "rs485.h"
+#include "json_writer.h"
+
+// The module used to identify this file's tokenized debug messages.
+#define DBG_MODULE DBG_MODULE_MAIN
 
 // Change the below values to suit your own network.
 #define SSID "-----------------"
@@ -106,6 +111,24 @@ static const char *COMMAND_TAGS[] = {
 // The number of commands that are to be sent to the Delta inverter for data retrieval.
 #define COMMAND_COUNT 33
 
+// The number of milliseconds between polls of the inverter. Each command is only sent every so many polls, as set in
+// COMMAND_PERIODS.
+#define POLL_INTERVAL_MS 5000
+
+// The number of milliseconds between reports of the values to the server, whatever the poll interval. A change in an
+// inverter's health is reported at the end of the poll that found it, without waiting.
+#define REPORT_INTERVAL_MS 60000
+
+// The number of polls between reports.
+#define REPORT_PERIOD (REPORT_INTERVAL_MS / POLL_INTERVAL_MS)
+
+// The number of polls between sending each command: the instantaneous values every poll, the averages and
+// temperatures every minute, and the slowly changing energy and running time counters and limits every five minutes.
+static const uint8_t COMMAND_PERIODS[] = {
+    1, 1, 1, 12, 12, 12, 12, 12, 1, 1, 1, 1, 12, 12, 12, 12, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60,
+    60, 60, 60, 60, 60, 60, 60
+};
+
 // Stores the address to which the results from the inverter are sent via HTTP in an ip_addr structure.
 #define REMOTE_ADDR(ip) (ip)[0] = 10; (ip)[1] = 0; (ip)[2] = 1; (ip)[3] = 253;
 
@@ -128,17 +151,80 @@ static const uint8_t INVERTER_ADDR = 0x05;
 // The address expected when receiving packets from the inverter.
 static const uint8_t GATEWAY_ADDR = 0x06;
 
-// The chain ID of the inverter.
-static const uint8_t INVERTER_ID = 0x01;
-
 // The end of text character in the packets.
 static const uint8_t ETX = 0x03;
 
-// The priority of the disconnect task.
-static const uint8_t DISCONNECT_PRI = 1;
+// The priority of the main task, which handles both disconnecting from the web server and frames from the inverter,
+// as there are only three task priorities to go round.
+#define MAIN_TASK_PRI 1
+
+// The number of events that can be queued for the main task.
+#define MAIN_QUEUE_LEN 4
+
+// The signals handled by the main task.
+#define MAIN_SIG_DISCONNECT 0
+#define MAIN_SIG_RS485 1
+#define MAIN_SIG_REPORT 2
+
+// The baud rate of the RS485 bus to the inverter.
+#define INVERTER_BAUD_RATE 19200
+
+// The range of the number of milliseconds allowed for an inverter to start replying to a request, on top of the time
+// taken to send the reply itself. The longest is used until the inverter's turnaround has been measured.
+#define INVERTER_TURNAROUND_MIN_MS 10
+#define INVERTER_TURNAROUND_MAX_MS 200
+
+// The number of milliseconds to wait before trying again to send a request while the bus is still busy sending the one
+// before, and the most tries before the request is skipped for this poll.
+#define SEND_RETRY_MS 10
+#define SEND_TRIES_MAX 5
 
-// The number of receive retries that will be attempted before the commjnication is considered to have timed out.
-static const uint8_t RETRY_LIMIT = 200;
+// The health of an inverter, as reported to the server.
+#define HEALTH_UNKNOWN 0
+#define HEALTH_HEALTHY 1
+#define HEALTH_UNHEALTHY 2
+
+// The commands supported by the Solivia inverters, as indexes into COMMANDS.
+static const uint8_t SOLIVIA_COMMANDS[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+    26, 27, 28, 29, 30, 31, 32
+};
+
+/*
+ * Structure for the inverters on the bus: how to talk to each one, and what has been received from it. The values
+ * reported are copied when each poll completes, so that every window of the request is written from the same values,
+ * even if the next poll starts while it's still being sent.
+ */
+typedef struct inverter {
+    uint8_t id;                            // The inverter's chain ID on the bus.
+    const char *model;                     // The inverter's model, sent with its values.
+    const uint8_t *commands;               // The commands the inverter supports, as indexes into COMMANDS.
+    uint8_t command_count;                 // The number of commands the inverter supports.
+    const char *group;                     // The tagwriter group marked healthy or unhealthy for the inverter.
+    uint32_t values[COMMAND_COUNT];        // The current values received from the inverter.
+    bool polled[COMMAND_COUNT];            // Whether each value has been received since the last report.
+    bool responding;                       // Whether the inverter replied to the last request sent to it.
+    bool dropped;                          // Whether the inverter has been dropped from the current poll.
+    uint8_t reported_health;               // The health last reported to the server.
+    int32_t turnaround_avg_us;             // The smoothed time the inverter takes to start replying, in microseconds.
+    int32_t turnaround_dev_us;             // The mean deviation of the turnaround, in microseconds.
+    bool turnaround_known;                 // Whether the turnaround has been measured since the last timeout.
+    uint32_t report_values[COMMAND_COUNT]; // The values sent in the tag data, copied when the report is made.
+    bool report_polled[COMMAND_COUNT];     // Whether each value was received since the report before.
+    uint8_t report_health;                 // The change in health sent in the tag data, HEALTH_UNKNOWN if none.
+} inverter;
+
+// The inverters daisy-chained on the bus. Change the below values to suit your own site, with one line per inverter.
+static inverter inverters[] = {
+    {.id = 0x01, .model = "Solivia 3.3", .commands = SOLIVIA_COMMANDS, .command_count = sizeof(SOLIVIA_COMMANDS),
+     .group = "2"}
+};
+
+// The number of inverters on the bus.
+#define INVERTER_COUNT (sizeof(inverters) / sizeof(inverters[0]))
+
+// The inverter that the current request was sent to.
+static inverter *current_inverter = NULL;
 
 // The current command index that we are processing.
 static uint8_t current_command_index = 0;
@@ -149,8 +235,24 @@ uint8_t data_len = 0;
 // The number of bytes expected in the reply message, including data and overhead.
 uint8_t expected_len = 0;
 
-// The current values received from the inverter.
-static uint32_t inverter_values[COMMAND_COUNT];
+// The number of polls started so far, used to tell which commands are due.
+static uint32_t poll_count = 0;
+
+// The indexes of the inverters, and of the commands, due in the current poll, in the order they're sent.
+static uint8_t poll_inverters[INVERTER_COUNT * COMMAND_COUNT];
+static uint8_t poll_commands[INVERTER_COUNT * COMMAND_COUNT];
+
+// The number of commands due in the current poll.
+static uint16_t poll_queue_len = 0;
+
+// The position in the poll queue of the command currently being sent.
+static uint16_t poll_pos = 0;
+
+// Whether a poll is in progress.
+static bool polling = false;
+
+// The time at which the last request finished being sent, from system_get_time.
+static uint32_t request_sent_time = 0;
 
 // Incoming serial buffer for receiving data from the Delta inverter.
 static uint8_t rx_buffer[RX_BUFFER_LENGTH];
@@ -158,12 +260,6 @@ static uint8_t rx_buffer[RX_BUFFER_LENGTH];
 // The number of bytes in the current RX serial buffer.
 static uint8_t rx_buffer_len = 0;
 
-// The number of attempts that have been made to read a reply packet in the current command cycle.
-static uint8_t rx_attempts = 0;
-
-// Flag as to whether a time out has occurred.
-static bool timeout = true;
-
 // Flag as to whether we're waiting for the remote site's response.
 static bool awaiting_response = true;
 
@@ -176,42 +272,49 @@ static esp_tcp proto;
 // The timer used for knowing when to start the transmissions to the Delta inverter.
 static os_timer_t transmit_timer;
 
-// The timer used for checking for receptions from the Delta inverter.
-static os_timer_t serial_rx_timer;
+// The timer used for trying again to send a request that the bus was too busy to send.
+static os_timer_t retry_timer;
 
-// Buffer that is used to hold the contents of an HTTP message to be sent.
-static string_builder *value_buf = NULL;
+// The number of times that the current request couldn't be sent.
+static uint8_t send_failures = 0;
 
-/*
- * Calculates the CRC-16 value that is used by the inverter. Note that the first
- * character of the packet is NOT included in the calculations. This is done to match
- * the calculations made by the inverter.
- *
- * @param packet The packet from which the CRC value is calculated.
- * @param end The number of bytes in the packet to include in the calculations. This
- *     number includes the first byte of the packet, which is not actually used in
- *     the CRC calculation.
- * @return The CRC-16 value computed for the packet.
- */
-uint16_t calculate_crc16(uint8_t *packet, uint8_t end) {
-    const uint16_t POLY = 0x0A001;
-    uint16_t crc = 0;
-
-    // We start from 1 to exclude the STX byte.
-    for (int ii = 1; ii < end; ii++) {
-        crc ^= packet[ii];
-        for (int jj = 0; jj < 8; jj++)
-        {
-            if (crc & 0x01) {
-                crc = (crc >> 1) ^ POLY;
-            } else {
-                crc = (crc >> 1);
-            }
-        }
-    }
-    
-    return crc;
-}
+// The queue of events for the main task.
+static os_event_t main_queue[MAIN_QUEUE_LEN];
+
+// Forward definitions.
+LOCAL void ICACHE_FLASH_ATTR inverter_rx_cb(uint8_t status, uint8_t len);
+
+// The HTTP header sent in front of the contents of a tagwriter POST, completed with the length of the contents.
+#define TAGWRITER_HEADER "POST /tagwriter HTTP/1.1\r\n" \
+        "Content-Type: application/json\r\n" \
+        "Connection: close\r\n" \
+        "Content-Length: %d\r\n\r\n"
+
+// The number of characters of an HTTP request sent at a time. The request is written a window at a time, just before
+// the window is sent, so only this much of it is ever held in memory. The first window must fit the whole header.
+#define SEND_WINDOW_LEN 256
+
+// Function that writes the JSON contents of a tagwriter POST. It's called once to find the length of the contents,
+// then again for each window of them sent, so must write the same thing each time.
+typedef void (*content_writer)(json_writer *json);
+
+// Buffer that is used to hold the window of the HTTP message being sent.
+static char *value_buf = NULL;
+
+// The function writing the contents of the HTTP message being sent.
+static content_writer value_writer = NULL;
+
+// The length of the contents of the HTTP message being sent.
+static int value_len = 0;
+
+// The number of characters of the contents that have been written to the connection so far.
+static int value_sent = 0;
+
+// Flag as to whether a report was held back because the previous one was still being sent.
+static bool report_pending = false;
+
+// Flag as to whether a report is due at the end of the current poll.
+static bool report_due = false;
 
 /*
  * Call-back for when we get a response from the web server.
@@ -238,11 +341,13 @@ LOCAL void ICACHE_FLASH_ATTR response_cb(void *arg, char *data, uint16_t len) {
     // Make sure the reply starts with "HTTP/1.? "
     if ((data[0] != 'H') ||(data[1] != 'T') ||(data[2] != 'T') || (data[3] != 'P') || (data[4] != '/') ||
             (data[5] != '1') || (data[6] != '.') || (data[8] != ' ')) {
-        os_printf("Unexpected HTTP header received.\n");
-        for (int ii = 0; ii < 8; ii++) {
-            os_printf("%02x ", data[ii]);
+        DBG_WARN("Unexpected HTTP header received.\n");
+        if (DBG_ENABLED(DBG_LEVEL_WARN)) {
+            for (int ii = 0; ii < 8; ii++) {
+                os_printf("%02x ", data[ii]);
+            }
+            os_printf("\n");
         }
-        os_printf("\n");
     } else {
         // Get the status code from the response.
         uint16_t status = 0;
@@ -258,23 +363,47 @@ LOCAL void ICACHE_FLASH_ATTR response_cb(void *arg, char *data, uint16_t len) {
 
         if (status != 200) {
             // There was a problem.
-            os_printf("Error returned from remote server: \"%s\".\n", data);
+            DBG_PRINTF(DBG_LEVEL_WARN, "Error returned from remote server: \"%s\".\n", data);
         }
     }
 
     // Close the connection ASAP, now we're done with it.
-    system_os_post(DISCONNECT_PRI, 0, 0);
+    system_os_post(MAIN_TASK_PRI, MAIN_SIG_DISCONNECT, 0);
 }
 
 /*
- * Disconnects a TCP connection, if still connected.
+ * Frees the buffer of the HTTP request, once it has been sent or has failed. If a report was held back meanwhile, it's
+ * made now that the report values are free to change.
  */
-LOCAL void ICACHE_FLASH_ATTR disconnect_task(os_event_t *event) {
-    int8_t res = espconn_disconnect(&conn);
+LOCAL void ICACHE_FLASH_ATTR free_value_buf() {
     if (value_buf != NULL) {
-        free_string_builder(value_buf);
+        os_free(value_buf);
         value_buf = NULL;
     }
+    if (report_pending) {
+        system_os_post(MAIN_TASK_PRI, MAIN_SIG_REPORT, 0);
+    }
+}
+
+/*
+ * Disconnects a TCP connection, if still connected.
+ */
+LOCAL void ICACHE_FLASH_ATTR disconnect() {
+    int8_t res = espconn_disconnect(&conn);
+    free_value_buf();
+}
+
+/*
+ * Writes the next window of the HTTP message's contents into the send buffer, after the first "start" characters.
+ * Returns the number of characters in the buffer.
+ */
+LOCAL int ICACHE_FLASH_ATTR fill_window(int start) {
+    json_writer json;
+    json_init_window(&json, &value_buf[start], SEND_WINDOW_LEN + 1 - start, value_sent);
+    value_writer(&json);
+    int stored = json_stored(&json);
+    value_sent += stored;
+    return start + stored;
 }
 
 /*
@@ -282,41 +411,52 @@ LOCAL void ICACHE_FLASH_ATTR disconnect_task(os_event_t *event) {
  */
 LOCAL void ICACHE_FLASH_ATTR connect_cb(void *arg) {
     struct espconn *conn = (struct espconn *)arg;
-    os_printf("Connected to server.\n");
+    DBG_DEBUG("Connected to server.\n");
 
     // Register a call-back for when we receive data.
     espconn_regist_recvcb(conn, response_cb);
     awaiting_response = true;
 
-    // Send through the HTTP request.
+    // Send through the HTTP header, and as much of the contents as fits after it. The rest is sent as each window
+    // completes.
     if (value_buf != NULL) {
-        int8_t res = espconn_send(conn, value_buf->buf, value_buf->len);
-        os_printf("Sent %d bytes with result %d.\n", value_buf->len, res);
+        value_sent = 0;
+        int len = fill_window(os_sprintf(value_buf, TAGWRITER_HEADER, value_len));
+        int8_t res = espconn_send(conn, (uint8_t *)value_buf, len);
+        DBG_DEBUG("Sent %d bytes with result %d.\n", len, res);
     } else {
-        os_printf("Transmission cancelled, buffer is NULL.\n");
+        DBG_WARN("Transmission cancelled, buffer is NULL.\n");
     }
 }
 
+/*
+ * Call-back for when a window of the HTTP request has been sent, sending the next one, if there's any more.
+ */
+LOCAL void ICACHE_FLASH_ATTR sent_cb(void *arg) {
+    struct espconn *conn = (struct espconn *)arg;
+    if ((value_buf == NULL) || (value_sent >= value_len)) {
+        return;
+    }
+
+    int len = fill_window(0);
+    int8_t res = espconn_send(conn, (uint8_t *)value_buf, len);
+    DBG_DEBUG("Sent %d more bytes with result %d.\n", len, res);
+}
+
 /*
  * Call-back for when HTTP connection has been disconnected.
  */
 LOCAL void ICACHE_FLASH_ATTR disconnect_cb(void *arg) {
-    if (value_buf != NULL) {
-        free_string_builder(value_buf);
-        value_buf = NULL;
-    }
-    os_printf("Disconnected from server.\n");
+    free_value_buf();
+    DBG_DEBUG("Disconnected from server.\n");
 }
 
 /*
  * Call-back for when a HTTP connection has failed - reconnected is a misleading name, sadly.
  */
 LOCAL void ICACHE_FLASH_ATTR reconnect_cb(void *arg, int8_t err) {
-    if (value_buf != NULL) {
-        free_string_builder(value_buf);
-        value_buf = NULL;
-    }
-    os_printf("Connection failed to server - %d.\n", err);
+    free_value_buf();
+    DBG_WARN("Connection failed to server - %d.\n", err);
 }
 
 /*
@@ -333,76 +473,125 @@ LOCAL void ICACHE_FLASH_ATTR send_inverter_values() {
 
     // Register the required call-back functions.
     espconn_regist_connectcb(&conn, connect_cb);
+    espconn_regist_sentcb(&conn, sent_cb);
     espconn_regist_disconcb(&conn, disconnect_cb);
     espconn_regist_reconcb(&conn, reconnect_cb);
 
     // Connect to the server.
-    os_printf("Connecting to server.\n");
+    DBG_DEBUG("Connecting to server.\n");
     int8_t res = espconn_connect(&conn);
     switch (res) {
         case 0:
             // This is normal, ignore it.
             break;
         case ESPCONN_MEM:
-            os_printf("Unable to connect to server - out of memory.\n");
+            DBG_ERROR("Unable to connect to server - out of memory.\n");
             break;
         case ESPCONN_TIMEOUT:
-            os_printf("Unable to connect to server - timeout.\n");
+            DBG_ERROR("Unable to connect to server - timeout.\n");
             break;
         case ESPCONN_ISCONN:
-            os_printf("Unable to connect to server - already connected.\n");
+            DBG_ERROR("Unable to connect to server - already connected.\n");
             break;
         case ESPCONN_ARG:
-            os_printf("Unable to connect to server - illegal argument.\n");
+            DBG_ERROR("Unable to connect to server - illegal argument.\n");
             break;
         default:
-            os_printf("Unable to connect to server - unknown error - %d.\n", res);
+            DBG_ERROR("Unable to connect to server - unknown error - %d.\n", res);
             break;
     }
+    if (res != 0) {
+        free_value_buf();
+    }
 }
 
 /*
- * Sends an HTTP POST message to the tagwriter service with the supplied contents.
+ * Sends an HTTP POST message to the tagwriter service, with the contents written by the supplied function. Only the
+ * length of the contents is found now, for the header, the contents themselves being written a window at a time as
+ * they're sent.
  */
-LOCAL void ICACHE_FLASH_ATTR tagwriter_post(string_builder *content) {
+LOCAL void ICACHE_FLASH_ATTR tagwriter_post(content_writer write_content) {
     if (value_buf != NULL) {
-        // The old value buffer didn't get freed for some reason, free it now.
-        free_string_builder(value_buf);
-        value_buf = NULL;
+        // The previous request is still being sent, and needs its buffer and contents until it's done.
+        DBG_ERROR("Unable to send HTTP request, the previous one is still being sent.\n");
+        return;
     }
 
-    // Create a buffer for holding the full HTTP request, header + contents.
-    string_builder *sb = create_string_builder(content->len + 100);
-    if (sb == NULL) {
-        free_string_builder(content);
-        os_printf("Unable to create string builder to send packet.");
-    } else {
-        // Create the HTTP header.
-        bool add_ok = true;
-        add_ok &= append_string_builder(sb, "POST /tagwriter HTTP/1.1\r\n" \
-                "Content-Type: application/json\r\n" \
-                "Connection: close\r\n" \
-                "Content-Length: ");
-        add_ok &= append_int32_string_builder(sb, content->len);
-        add_ok &= append_string_builder(sb, "\r\n\r\n");
-
-        // Add the contents.
-        add_ok &= append_string_builder_to_string_builder(sb, content);
-        free_string_builder(content);
-
-        if (add_ok) {
-            // Store the buffer in the value buffer pointer.
-            value_buf = sb;
-
-            // Send the HTTP request.
-            send_inverter_values();
-        } else {
-            // Something went wrong with the creation of the request.
-            value_buf = NULL;
-            free_string_builder(sb);
-            os_printf("Unable to prepare HTTP message contents for transmission.\n");
+    // Find the length of the contents.
+    json_writer json;
+    json_init(&json, NULL, 0);
+    write_content(&json);
+    if (!json_ok(&json)) {
+        DBG_ERROR("Unable to prepare HTTP message contents for transmission.\n");
+        return;
+    }
+
+    // Create the buffer for sending the request through, a window at a time.
+    value_buf = (char *)os_malloc(SEND_WINDOW_LEN + 1);
+    if (value_buf == NULL) {
+        DBG_ERROR("Unable to allocate %d bytes to send packet.\n", SEND_WINDOW_LEN + 1);
+        return;
+    }
+    value_writer = write_content;
+    value_len = json.len;
+    value_sent = 0;
+    DBG_DEBUG("Prepared HTTP request with contents of length %d.\n", value_len);
+    send_inverter_values();
+}
+
+/*
+ * Writes the values received from the inverters as the contents of a tagwriter POST, grouped by inverter, along with
+ * any changes in their health. The values are those copied when the report was made, and only those received since
+ * the report before are written.
+ */
+LOCAL void ICACHE_FLASH_ATTR write_tag_values(json_writer *json) {
+    bool health_changed = false;
+    json_begin_object(json);
+    json_key(json, "inverters");
+    json_begin_object(json);
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        inverter *inv = &inverters[ii];
+        health_changed |= (inv->report_health != HEALTH_UNKNOWN);
+
+        // Inverters without any new values are left out.
+        uint8_t jj = 0;
+        while ((jj < COMMAND_COUNT) && !inv->report_polled[jj]) {
+            jj++;
+        }
+        if (jj == COMMAND_COUNT) {
+            continue;
+        }
+
+        char id[4];
+        os_sprintf(id, "%d", inv->id);
+        json_key(json, id);
+        json_begin_object(json);
+        json_key(json, "model");
+        json_string(json, inv->model);
+        json_key(json, "tags");
+        json_begin_object(json);
+        for (; jj < COMMAND_COUNT; jj++) {
+            if (inv->report_polled[jj]) {
+                json_key(json, COMMAND_TAGS[jj]);
+                json_int32(json, inv->report_values[jj]);
+            }
+        }
+        json_end_object(json);
+        json_end_object(json);
+    }
+    json_end_object(json);
+    if (health_changed) {
+        json_key(json, "groups");
+        json_begin_object(json);
+        for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+            if (inverters[ii].report_health != HEALTH_UNKNOWN) {
+                json_key(json, inverters[ii].group);
+                json_string(json, (inverters[ii].report_health == HEALTH_HEALTHY) ? "healthy" : "unhealthy");
+            }
         }
+        json_end_object(json);
     }
+    json_end_object(json);
 }
 
 // Debugs out the contents of a packet.
@@ -414,81 +603,63 @@ void ICACHE_FLASH_ATTR debug_print_packet(uint8_t *packet, uint8_t length) {
 }
 
 /*
- * Transmits an array of data to the UART. This is provided to make it easy to switch between UARTs 0/1.
+ * Call-back for when a request has been sent to an inverter, from which its turnaround is timed.
  */
-void ICACHE_FLASH_ATTR uart_tx_array(uint8_t *array, uint8_t len) {
-    // UART 0.
-    //uart0_tx_buffer(array, len);
-
-    // UART 1.
-    os_printf("tx (%d): ", len);
-    for (uint8_t ii = 0; ii < len; ii++) {
-        uart_tx_one_char(UART1, array[ii]);
-        os_printf("%02x ", array[ii]);
-    }
-    os_printf("\n");
+LOCAL void ICACHE_FLASH_ATTR request_sent_cb() {
+    request_sent_time = system_get_time();
 }
 
 /*
- * Reads all of the characters from the UART's buffer, and discards them.
+ * Updates the estimate of an inverter's turnaround with the time taken to receive a reply, of the given length, that
+ * was complete at the given time.
  */
-LOCAL bool flush_uart() {
-    uint8_t rx_len = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
-    while (rx_len > 0) {
-        READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-        rx_len = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+LOCAL void ICACHE_FLASH_ATTR update_turnaround(inverter *inv, uint8_t len, uint32_t received_time) {
+    int32_t sample = (int32_t)(received_time - request_sent_time - rs485_frame_time_us(len));
+    if (sample < 0) {
+        sample = 0;
+    }
+    if (!inv->turnaround_known) {
+        inv->turnaround_avg_us = sample;
+        inv->turnaround_dev_us = sample / 2;
+        inv->turnaround_known = true;
+    } else {
+        int32_t err = sample - inv->turnaround_avg_us;
+        inv->turnaround_avg_us += err / 8;
+        inv->turnaround_dev_us += ((err < 0 ? -err : err) - inv->turnaround_dev_us) / 4;
     }
 }
 
 /*
- * Reads characters from the serial port, if any are currently pending.
+ * The number of milliseconds to allow for an inverter to start replying: the smoothed turnaround plus four times its
+ * deviation, within the allowed range.
  */
-LOCAL bool uart_rx() {
-    // See how many bytes have been received so far.
-    uint8_t rx_len = (READ_PERI_REG(UART_STATUS(UART0)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
-    if (rx_len > 0) {
-        // Add the received bytes to the buffer.
-        char rx_char;
-        //os_printf("rx (%d): ", rx_len);
-        for (uint8_t ii = 0; ii < rx_len; ii++) {
-            rx_char = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-            //os_printf("%02x ", rx_char);
-            if ((rx_char == 0) && (rx_buffer_len == 0)) {
-                // Discard this leading zero, it's a comms artifact.
-            } else if (rx_buffer_len >= RX_BUFFER_LENGTH) {
-                // Too many bytes, discard.
-            } else {
-                // Store the received byte.
-                rx_buffer[rx_buffer_len++] = rx_char;
-            }
-
-            if (rx_buffer_len >= expected_len) {
-                // We have received enough characters to process the message.
-                //os_printf("\n");
-                return true;
-            }
-        }
-        //os_printf("\n");
+LOCAL uint16_t ICACHE_FLASH_ATTR turnaround_ms(const inverter *inv) {
+    if (!inv->turnaround_known) {
+        return INVERTER_TURNAROUND_MAX_MS;
     }
-
-    // If we get here, we don't yet have enough bytes for a full packet.
-    return false;
+    uint32_t ms = (inv->turnaround_avg_us + 4 * inv->turnaround_dev_us + 999) / 1000;
+    if (ms < INVERTER_TURNAROUND_MIN_MS) {
+        return INVERTER_TURNAROUND_MIN_MS;
+    }
+    return (ms > INVERTER_TURNAROUND_MAX_MS) ? INVERTER_TURNAROUND_MAX_MS : ms;
 }
 
 /*
- * Sends a request to the inverter for a single data point.
+ * Sends a request to the current inverter for a single data point, then waits for the reply. Returns false if the bus
+ * was still busy, in which case nothing is waited for.
  */
-void ICACHE_FLASH_ATTR send_data_request() {
+bool ICACHE_FLASH_ATTR send_data_request() {
     // Prepare the packet for transmission to the inverter.
     uint8_t tx_packet[9];
-    os_printf("Preparing packet for command #%d\n", current_command_index);
+    DBG_TRACE("Preparing packet for command #%d to inverter %d\n", current_command_index, current_inverter->id);
     tx_packet[0] = STX;
     tx_packet[1] = INVERTER_ADDR;
-    tx_packet[2] = INVERTER_ID;
+    tx_packet[2] = current_inverter->id;
     tx_packet[3] = COMMAND_LEN;
     tx_packet[4] = COMMANDS[current_command_index][0];
     tx_packet[5] = COMMANDS[current_command_index][1];
-    uint16_t crc = calculate_crc16(tx_packet, 6);
+    // The STX byte isn't included in the CRC, to match the inverter's calculation.
+    uint16_t crc = calculate_crc16(0, &tx_packet[1], 5);
     tx_packet[6] = (crc & 0x00FF);
     tx_packet[7] = (crc & 0xFF00) >> 8;
     tx_packet[8] = ETX;
@@ -496,172 +667,260 @@ void ICACHE_FLASH_ATTR send_data_request() {
     // Determine how much data to expect as a reply.
     data_len = COMMAND_LENGTHS[current_command_index];
     expected_len = data_len + PACKET_OVERHEAD + COMMAND_LEN;
-    os_printf("Expected len = %d.\n", expected_len);
-
-    // Flush the serial receive buffer, to ensure that no previous messages get in the way.
-    flush_uart();
-    rx_buffer_len = 0;
-    rx_attempts = 0;
-
-    // Send the request to the inverter, setting GPIO 4 to high for the transmission (for the RS485 converter).
-    gpio_output_set(BIT4, 0, BIT4, 0);
-    os_delay_us(1000);
-    uart_tx_array(tx_packet, 9);
-    os_delay_us(5000);
-    gpio_output_set(0, BIT4, BIT4, 0);
-
-    // Start looking for the received message.
-    os_timer_disarm(&serial_rx_timer);
-    os_timer_arm(&serial_rx_timer, 5, 0);
+    DBG_TRACE("Expected len = %d.\n", expected_len);
+
+    // Send the request to the inverter, then wait for the reply, discarding any previous messages so that they don't
+    // get in the way. The wait only starts timing once the request has been sent.
+    if (DBG_ENABLED(DBG_LEVEL_TRACE)) {
+        os_printf("tx (%d): ", 9);
+        debug_print_packet(tx_packet, 9);
+    }
+    if (!rs485_send(tx_packet, 9, request_sent_cb)) {
+        DBG_WARN("Unable to send command %d, the bus is still busy.\n", current_command_index);
+        return false;
+    }
+    rs485_receive(rx_buffer, expected_len, turnaround_ms(current_inverter), inverter_rx_cb);
+    return true;
 }
 
 /*
- * Receives a response from a command request, either preparing for the next send, or completing the HTTP
- * call to the server, as necessary.
+ * Receives a response from a command request, storing its value if it's valid. Returns whether it was.
  */
-void ICACHE_FLASH_ATTR process_response() {
+LOCAL bool ICACHE_FLASH_ATTR process_response() {
     // Validate the packet.
     if ((rx_buffer[0] != STX) ||
         (rx_buffer[1] != GATEWAY_ADDR) ||
-        (rx_buffer[2] != INVERTER_ID) ||
+        (rx_buffer[2] != current_inverter->id) ||
         (rx_buffer[3] != (COMMAND_LENGTHS[current_command_index] + COMMAND_LEN)) ||
         (rx_buffer[4] != COMMANDS[current_command_index][0]) ||
         (rx_buffer[5] != COMMANDS[current_command_index][1]) ||
         (rx_buffer[COMMAND_LENGTHS[current_command_index] + 8] != ETX)) {
-        // The packet's contents are not valid.
-        os_printf("Packet mismatch. Received: ");
-        debug_print_packet(rx_buffer, rx_buffer_len);
-
-        uint8_t *expected = (uint8_t *)os_malloc(current_command_index + 8);
-        if (expected) {
-            expected[0] = STX;
-            expected[1] = GATEWAY_ADDR;
-            expected[2] = INVERTER_ID;
-            expected[3] = COMMAND_LENGTHS[current_command_index] + COMMAND_LEN;
-            expected[4] = COMMANDS[current_command_index][0];
-            expected[5] = COMMANDS[current_command_index][1];
-            expected[COMMAND_LENGTHS[current_command_index] + 8] = ETX;
-            os_printf("Expected: ");
-            debug_print_packet(expected, rx_buffer_len);
-            os_free(expected);
+        // The packet's contents are not valid, show the difference if anyone's looking.
+        if (DBG_ENABLED(DBG_LEVEL_WARN)) {
+            os_printf("Packet mismatch. Received: ");
+            debug_print_packet(rx_buffer, rx_buffer_len);
+
+            uint8_t *expected = (uint8_t *)os_malloc(current_command_index + 8);
+            if (expected) {
+                expected[0] = STX;
+                expected[1] = GATEWAY_ADDR;
+                expected[2] = current_inverter->id;
+                expected[3] = COMMAND_LENGTHS[current_command_index] + COMMAND_LEN;
+                expected[4] = COMMANDS[current_command_index][0];
+                expected[5] = COMMANDS[current_command_index][1];
+                expected[COMMAND_LENGTHS[current_command_index] + 8] = ETX;
+                os_printf("Expected: ");
+                debug_print_packet(expected, rx_buffer_len);
+                os_free(expected);
+            }
         }
+        return false;
     }
     
     // Check the checksum.
     uint16_t msg_crc =  (rx_buffer[data_len + 6] & 0xFF) | 
                        ((rx_buffer[data_len + 7] << 8) & 0xFF00);
-    uint16_t crc = calculate_crc16(rx_buffer, data_len + 6);
+    // The STX byte isn't included in the CRC, to match the inverter's calculation.
+    uint16_t crc = calculate_crc16(0, &rx_buffer[1], data_len + 5);
     if (msg_crc != crc) {
         // The CRC's don't match.
-        os_printf("Packet CRC mismatch, received %x, expected %x.\n", msg_crc, crc);
-        debug_print_packet(rx_buffer, expected_len);
-        return;
+        DBG_WARN("Packet CRC mismatch, received %x, expected %x.\n", msg_crc, crc);
+        if (DBG_ENABLED(DBG_LEVEL_WARN)) {
+            debug_print_packet(rx_buffer, expected_len);
+        }
+        return false;
     }
         
     // If we get here, then we're good, store the received value.
-    os_printf("Response %d accepted.\n", current_command_index);
+    DBG_TRACE("Response %d from inverter %d accepted.\n", current_command_index, current_inverter->id);
     if (COMMAND_LENGTHS[current_command_index] == 1) {
-        inverter_values[current_command_index] = rx_buffer[6];
+        current_inverter->values[current_command_index] = rx_buffer[6];
     } else if (COMMAND_LENGTHS[current_command_index] == 2) {
-        inverter_values[current_command_index] = (rx_buffer[6] << 8) + rx_buffer[7];
+        current_inverter->values[current_command_index] = (rx_buffer[6] << 8) + rx_buffer[7];
     } else if (COMMAND_LENGTHS[current_command_index] == 4) {
-        inverter_values[current_command_index] = (rx_buffer[6] << 24) +
+        current_inverter->values[current_command_index] = (rx_buffer[6] << 24) +
                                                  (rx_buffer[7] << 16) + 
                                                  (rx_buffer[8] <<  8) +
                                                   rx_buffer[9];
     }
+    current_inverter->polled[current_command_index] = true;
+    return true;
+}
 
-    if (current_command_index == COMMAND_COUNT - 1) {
-        // We've finished retrieving all of the values, send them to the server.
-        os_printf("Preparing transmission of tag values.\n");
-        string_builder *content = create_string_builder(128);
-        if (content == NULL) {
-            os_printf("Unable to create string builder to send result contents.");
-        } else {
-            // Create the content portion of the HTTP request.
-            bool add_ok = true;
-            add_ok &= append_string_builder(content, "{\"tags\":{");
-            for (uint8_t ii = 0; ii < COMMAND_COUNT; ii++) {
-                if (ii > 0) {
-                    add_ok &= append_string_builder(content, ",\"");
-                } else {
-                    add_ok &= append_string_builder(content, "\"");
-                }
-                add_ok &= append_string_builder(content, COMMAND_TAGS[ii]);
-                add_ok &= append_string_builder(content, "\":");
-                add_ok &= append_int32_string_builder(content, inverter_values[ii]);
-            }
-            if (timeout) {
-                timeout = false;
-                add_ok &= append_string_builder(content, "},\"groups\":{\"2\":\"healthy\"}}");
-            } else {
-                add_ok &= append_string_builder(content, "}}");
-            }
+/*
+ * Copies the values received since the last report, along with any changes in the inverters' health, and sends them
+ * to the server. While the previous report is still being sent, its contents are written from the report values a
+ * window at a time, so this report is held back until it's done, the values carrying on building up meanwhile.
+ */
+LOCAL void ICACHE_FLASH_ATTR report_poll() {
+    if (value_buf != NULL) {
+        DBG_DEBUG("Holding back tag values, the previous ones are still being sent.\n");
+        report_pending = true;
+        return;
+    }
+    report_pending = false;
 
-            // Send the contents to the server via an HTTP POST for processing.
-            if (add_ok) {
-                os_printf("Prepared tag data contents of length %d.\n", content->len);
-                tagwriter_post(content);
-            } else {
-                os_printf("Unable to prepare tag data contents, current length %d.\n", content->len);
-            }
+    bool changed = false;
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        inverter *inv = &inverters[ii];
+        os_memcpy(inv->report_values, inv->values, sizeof(inv->report_values));
+        os_memcpy(inv->report_polled, inv->polled, sizeof(inv->report_polled));
+
+        // Only changes in health are reported.
+        uint8_t health = inv->responding ? HEALTH_HEALTHY : HEALTH_UNHEALTHY;
+        inv->report_health = (health != inv->reported_health) ? health : HEALTH_UNKNOWN;
+        inv->reported_health = health;
+
+        for (uint8_t jj = 0; jj < COMMAND_COUNT; jj++) {
+            changed |= inv->polled[jj];
+        }
+        changed |= (inv->report_health != HEALTH_UNKNOWN);
+        os_memset(inv->polled, 0, sizeof(inv->polled));
+    }
+
+    if (changed) {
+        DBG_DEBUG("Preparing transmission of tag values.\n");
+        tagwriter_post(write_tag_values);
+    }
+}
+
+/*
+ * Returns true if any inverter's health has changed since it was last reported.
+ */
+LOCAL bool ICACHE_FLASH_ATTR health_changed() {
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        uint8_t health = inverters[ii].responding ? HEALTH_HEALTHY : HEALTH_UNHEALTHY;
+        if (health != inverters[ii].reported_health) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Sends the next command due in the current poll straight away, or reports the values to the server if there are none
+ * left and a report is due (or an inverter's health has changed). Commands for any inverter dropped from the poll are
+ * skipped.
+ *
+ * The Delta protocol only allows one request to be outstanding on the half-duplex bus, so each request waits for the
+ * reply to the one before (or its timeout). The gap between them is kept to the byte time that rs485_send drives the
+ * line idle for before each frame.
+ */
+LOCAL void ICACHE_FLASH_ATTR poll_next() {
+    while ((poll_pos < poll_queue_len) && inverters[poll_inverters[poll_pos]].dropped) {
+        poll_pos++;
+    }
+    if (poll_pos < poll_queue_len) {
+        current_inverter = &inverters[poll_inverters[poll_pos]];
+        current_command_index = poll_commands[poll_pos];
+        poll_pos++;
+        if (send_data_request()) {
+            send_failures = 0;
+        } else if (++send_failures < SEND_TRIES_MAX) {
+            // The bus is busy here, which is no fault of the inverter's, so try the same request again shortly.
+            poll_pos--;
+            os_timer_disarm(&retry_timer);
+            os_timer_setfn(&retry_timer, (os_timer_func_t *)poll_next, NULL);
+            os_timer_arm(&retry_timer, SEND_RETRY_MS, 0);
+        } else {
+            // Give up on the request for this poll, leaving the inverter's health as it was, and carry on.
+            DBG_ERROR("Command %d to inverter %d skipped, the bus stayed busy.\n", current_command_index,
+                      current_inverter->id);
+            send_failures = 0;
+            poll_next();
         }
     } else {
-        // There's still more to go. Advance to the next command index.
-        current_command_index++;
-        send_data_request();
+        // We've finished retrieving the values that were due.
+        polling = false;
+        if (report_due || health_changed()) {
+            report_due = false;
+            report_poll();
+        }
     }
 }
 
 /*
- * Call-back used to begin the transmission of requests for values from the Delta inverter.
+ * Call-back used to begin the transmission of requests for the values from the Delta inverters that are due.
  */
 void ICACHE_FLASH_ATTR transmit_cb() {
-    current_command_index = 0;
-    send_data_request();
+    // A report that falls due during a skipped poll is made at the end of the poll in progress.
+    report_due |= (poll_count % REPORT_PERIOD == 0);
+    if (polling) {
+        DBG_WARN("Poll %d skipped, the previous one is still in progress.\n", poll_count);
+        poll_count++;
+        return;
+    }
+
+    // Queue up the commands that are due in this poll, taking each inverter in turn so that they all share the bus
+    // evenly. An inverter that isn't responding is only sent one command, to see if it's back, so that its timeouts
+    // don't hold up the others.
+    poll_queue_len = 0;
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        inverters[ii].dropped = false;
+    }
+    for (uint8_t cc = 0; cc < COMMAND_COUNT; cc++) {
+        for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+            inverter *inv = &inverters[ii];
+            if ((cc < inv->command_count) && (poll_count % COMMAND_PERIODS[inv->commands[cc]] == 0) && !inv->dropped) {
+                poll_inverters[poll_queue_len] = ii;
+                poll_commands[poll_queue_len] = inv->commands[cc];
+                poll_queue_len++;
+                inv->dropped = !inv->responding;
+            }
+        }
+    }
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        inverters[ii].dropped = false;
+    }
+    poll_count++;
+
+    polling = true;
+    poll_pos = 0;
+    poll_next();
 }
 
 /*
- * Call-back used when the serial timer has expired. We use this to check for any more data arriving at the serial port.
+ * Call-back for when a reply has been received from an inverter, or it didn't reply in time.
  */
-void ICACHE_FLASH_ATTR serial_rx_cb() {
-    // Process the incoming bytes (if any) and see if we have enough for a response to our message.
-    bool complete = uart_rx();
-
-    if (complete) {
-        // We have received enough characters to process the message.
-        process_response();
-        rx_buffer_len = 0;
-        rx_attempts = 0;
+LOCAL void ICACHE_FLASH_ATTR inverter_rx_cb(uint8_t status, uint8_t len) {
+    rx_buffer_len = len;
+    if (status == RS485_RX_FRAME) {
+        // We have received enough characters to process the message. An invalid one is skipped, the value just isn't
+        // updated in this poll, and it isn't timed either as it may not be this inverter's reply.
+        uint32_t received_time = system_get_time();
+        current_inverter->responding = true;
+        if (process_response()) {
+            update_turnaround(current_inverter, len, received_time);
+        }
     } else {
-        rx_attempts++;
-        if (rx_attempts > RETRY_LIMIT) {
-            // Set the timeout flag, and reset the current command index to indicate that we shouldn't process any data.
-            os_printf("Timeout received while waiting for response for command %d.\n", current_command_index);
-            timeout = true;
-            current_command_index = -1;
-            rx_buffer_len = 0;
-            rx_attempts = 0;
-
-            // Send a message to mark the group as unhealthy.
-            string_builder *content = create_string_builder(30);
-            if (content == NULL) {
-                os_printf("Unable to create string builder to send timeout message.");
-            } else {
-                // Create the content portion of the HTTP request.
-                bool add_ok = true;
-                add_ok &= append_string_builder(content, "{\"groups\":{\"2\":\"unhealthy\"}}");
-
-                // Send the contents to the server via an HTTP POST for processing.
-                if (add_ok) {
-                    tagwriter_post(content);
-                }
+        // Drop the inverter from the rest of this poll, so the others aren't held up, and mark it as unhealthy. The
+        // turnaround is measured again from scratch, in case the inverter has slowed down.
+        DBG_WARN("Timeout received while waiting for response for command %d from inverter %d.\n",
+                 current_command_index, current_inverter->id);
+        current_inverter->responding = false;
+        current_inverter->dropped = true;
+        current_inverter->turnaround_known = false;
+    }
+    poll_next();
+}
+
+/*
+ * Task that handles disconnecting from the web server, the frames received from the inverter, and reports held back.
+ */
+LOCAL void ICACHE_FLASH_ATTR main_task(os_event_t *event) {
+    switch (event->sig) {
+        case MAIN_SIG_DISCONNECT:
+            disconnect();
+            break;
+        case MAIN_SIG_RS485:
+            rs485_event(event->par);
+            break;
+        case MAIN_SIG_REPORT:
+            // A report held back while the previous one was sent. One in the middle of a poll waits for its end.
+            if (report_pending && !polling) {
+                report_poll();
             }
-        } else {
-            // We haven't received enough bytes yet, but there's still time, restart the timer for another go.
-            os_timer_disarm(&serial_rx_timer);
-            os_timer_arm(&serial_rx_timer, 5, 0);
-        }
+            break;
     }
 }
 
@@ -681,9 +940,9 @@ LOCAL void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *event) {
                 len = 32;
             }
             strncpy(ssid, event->event_info.connected.ssid, len + 1);
-            os_printf("Received EVENT_STAMODE_CONNECTED. "
-                      "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
-                      ssid, MAC2STR(event->event_info.connected.bssid), event->event_info.connected.channel);
+            DBG_PRINTF(DBG_LEVEL_INFO, "Received EVENT_STAMODE_CONNECTED. "
+                       "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
+                       ssid, MAC2STR(event->event_info.connected.bssid), event->event_info.connected.channel);
             break;
         }
         case EVENT_STAMODE_DISCONNECTED: {
@@ -694,21 +953,25 @@ LOCAL void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *event) {
                 len = 32;
             }
             strncpy(ssid, event->event_info.connected.ssid, len + 1);
-            os_printf("Received EVENT_STAMODE_DISCONNECTED. "
-                      "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
-                      ssid, MAC2STR(event->event_info.disconnected.bssid), event->event_info.disconnected.reason);
+            DBG_PRINTF(DBG_LEVEL_INFO, "Received EVENT_STAMODE_DISCONNECTED. "
+                       "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
+                       ssid, MAC2STR(event->event_info.disconnected.bssid), event->event_info.disconnected.reason);
             break;
         }
         case EVENT_STAMODE_GOT_IP:
             // We have an IP address, ready to run. Return the IP address, too.
-            os_printf("Received EVENT_STAMODE_GOT_IP. IP = "IPSTR", mask = "IPSTR", gateway = "IPSTR"\n", 
-                      IP2STR(&event->event_info.got_ip.ip.addr), 
-                      IP2STR(&event->event_info.got_ip.mask.addr),
-                      IP2STR(&event->event_info.got_ip.gw));
+            DBG_PRINTF(DBG_LEVEL_INFO,
+                       "Received EVENT_STAMODE_GOT_IP. IP = "IPSTR", mask = "IPSTR", gateway = "IPSTR"\n",
+                       IP2STR(&event->event_info.got_ip.ip.addr),
+                       IP2STR(&event->event_info.got_ip.mask.addr),
+                       IP2STR(&event->event_info.got_ip.gw));
+
+            // The debug messages need to be sent from the new IP address.
+            dbg_reconnect();
             break;
         case EVENT_STAMODE_DHCP_TIMEOUT:
             // We couldn't get an IP address via DHCP, so we'll have to try re-connecting.
-            os_printf("Received EVENT_STAMODE_DHCP_TIMEOUT.\n");
+            DBG_WARN("Received EVENT_STAMODE_DHCP_TIMEOUT.\n");
             wifi_station_disconnect();
             wifi_station_connect();
             break;
@@ -734,47 +997,62 @@ LOCAL void ICACHE_FLASH_ATTR wifi_init() {
 }
 
 
+/*
+ * Sets up the inverters' state before the first poll: each starts off as responding, so that it's sent every command
+ * due, with no values received, nothing reported and its turnaround still to be measured.
+ */
+LOCAL void ICACHE_FLASH_ATTR init_inverters() {
+    for (uint8_t ii = 0; ii < INVERTER_COUNT; ii++) {
+        inverter *inv = &inverters[ii];
+        os_memset(inv->values, 0, sizeof(inv->values));
+        os_memset(inv->polled, 0, sizeof(inv->polled));
+        inv->responding = true;
+        inv->dropped = false;
+        inv->reported_health = HEALTH_UNKNOWN;
+        inv->turnaround_avg_us = 0;
+        inv->turnaround_dev_us = 0;
+        inv->turnaround_known = false;
+        os_memset(inv->report_values, 0, sizeof(inv->report_values));
+        os_memset(inv->report_polled, 0, sizeof(inv->report_polled));
+        inv->report_health = HEALTH_UNKNOWN;
+    }
+}
+
 /*
  * Entry point for the program. Sets up the microcontroller for use.
  */
 void user_init(void) {
-    // Initialise the serial port.
+    // Count this boot if the firmware has just been flashed, before anything else can crash, so that firmware which
+    // never makes it through start-up is still rolled back.
+    ota_check_boot();
+
+    // The RS485 bus is timed in microseconds, which has to be set up before any timers are used.
+    system_timer_reinit();
+
+    // Initialise the serial ports, receiving from the inverter on UART 0 and transmitting to it on UART 1, with GPIO 4
+    // high for the transmissions (for the RS485 converter).
     //uart_init(BIT_RATE_19200, BIT_RATE_19200);
-    uart_div_modify(UART0, UART_CLK_FREQ / 19200);
-    uart_div_modify(UART1, UART_CLK_FREQ / 19200);
     PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_U1TXD_BK);
-
-    // Reset the Rx/Tx UART FIFOs.
-    SET_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST | UART_TXFIFO_RST);
-    CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_RXFIFO_RST | UART_TXFIFO_RST);
-    SET_PERI_REG_MASK(UART_CONF0(UART1), UART_RXFIFO_RST | UART_TXFIFO_RST);
-    CLEAR_PERI_REG_MASK(UART_CONF0(UART1), UART_RXFIFO_RST | UART_TXFIFO_RST);
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4);
+    PIN_PULLUP_DIS(PERIPHS_IO_MUX_GPIO4_U);
+    system_os_task(main_task, MAIN_TASK_PRI, main_queue, MAIN_QUEUE_LEN);
+    rs485_init(INVERTER_BAUD_RATE, UART1, 4, MAIN_TASK_PRI, MAIN_SIG_RS485);
 
     // Swap the UART 0 pins over, to suppress the start-up output.
     //system_uart_swap();
 
-    // GPIO 4 is an output, start with it low.
-    PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4);
-    PIN_PULLUP_DIS(PERIPHS_IO_MUX_GPIO4_U);
-    gpio_output_set(0, BIT4, BIT4, 0);
-
     // Start the network.
     wifi_init();
 
+    // Initialise the network debugging, first so that everything else can use it.
+    dbg_init();
+
     // Initialise the OTA flash system.
     ota_init();
 
-    // Initialise the network debugging.
-    dbg_init();
-
-    // Start a timer for the transmissions, every five minutes.
+    // Start a timer for the polls of the inverter, once the inverters are ready to be polled.
+    init_inverters();
     os_timer_disarm(&transmit_timer);
     os_timer_setfn(&transmit_timer, (os_timer_func_t *)transmit_cb, (void *)0);
-    //os_timer_arm(&transmit_timer, 5 * 60 * 1000, 1);
-    os_timer_arm(&transmit_timer, 1 * 60 * 1000, 1);
-
-    // Prepare a timer for checking if we've received any messages from the inverter, but don't start it now 
-    // (we haven't sent anything yet!)
-    os_timer_disarm(&serial_rx_timer);
-    os_timer_setfn(&serial_rx_timer, (os_timer_func_t *)serial_rx_cb, (void *)0);
+    os_timer_arm(&transmit_timer, POLL_INTERVAL_MS, 1);
 }
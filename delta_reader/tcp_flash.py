@@ -3,83 +3,502 @@
 # tcp_flash.py - flashes an ESP8266 microcontroller via 'raw' TCP/IP (not HTTP).
 #
 # Usage:
-#   tcp_flash.py <host|IP> <user1.bin> <user2.bin>
+#   tcp_flash.py [-z] <host|IP> <user1.bin> <user2.bin> [<old user1.bin> <old user2.bin>]
+#   tcp_flash.py [-z] [-j <jobs>] -f <inventory> <user1.bin> <user2.bin> [<old user1.bin> <old user2.bin>]
 #
 # Where:
-#   <host|IP>    the hostname or IP address of the ESP8266 to be flashed.
-#   <user1.bin>  the file holding the first flash format file. Used when the currently used flash is user2.bin
-#   <user2.bin>  the file holding the second flash format file. Used when the currently used flash is user1.bin
+#   -z               compresses the firmware (or patch) with heatshrink before sending it.
+#   -j <jobs>        the number of ESP8266s flashed at the same time in fleet mode (default 8).
+#   -f <inventory>   flashes every ESP8266 listed in the inventory file, one host or IP per line. Blank lines and
+#                    anything after a '#' are ignored.
+#   <host|IP>        the hostname or IP address of the ESP8266 to be flashed.
+#   <user1.bin>      the file holding the first flash format file. Used when the currently used flash is user2.bin
+#   <user2.bin>      the file holding the second flash format file. Used when the currently used flash is user1.bin
+#   <old user1.bin>  optional, the user1.bin file currently on the ESP8266. When supplied with <old user2.bin>, only a
+#                    patch against the currently running firmware is sent, rather than the whole firmware.
+#   <old user2.bin>  optional, the user2.bin file currently on the ESP8266.
+#
+# Any host may be given as <host>:<port> to flash something listening on a port other than the usual one. To try out
+# fleet mode without any ESP8266s, run host/build/ota_server (see host/Makefile) on a few local addresses, e.g.
+# "ota_server -i 127.0.1.1 -f 1.flash", and list those addresses in the inventory.
 #
 # Author: Ian Marshall
 # Date: 27/05/2016
 #
 
+import getopt
+import Queue
 import socket
+import struct
 import sys
+import threading
+import time
+import zlib
 
 PORT=65056
 
-# Verify the parameters.
-if len(sys.argv) < 3:
+# The number of times a connection is attempted, resuming the transfer where possible, before giving up.
+RETRIES=5
+
+# The number of seconds to wait between connection attempts.
+RETRY_DELAY=2
+
+# The number of ESP8266s flashed at the same time in fleet mode, unless overridden with -j.
+DEFAULT_JOBS=8
+
+# The number of bytes passed to the socket at a time when sending the firmware, so that progress can be tracked.
+SEND_CHUNK=4096
+
+# The number of seconds to wait for a flashed ESP8266 to come back up before reporting that it didn't.
+REBOOT_TIMEOUT=60
+
+# The number of seconds between fleet progress reports.
+PROGRESS_INTERVAL=5
+
+# The number of bytes used to find matching blocks between the old and new firmware when creating a patch.
+PATCH_BLOCK=16
+
+# The minimum number of matching bytes for a copy from the old firmware to be worthwhile in a patch.
+PATCH_MIN_COPY=24
+
+# Patch operation codes, these must match tcp_ota.c.
+PATCH_OP_COPY=0x01
+PATCH_OP_INSERT=0x02
+
+# The reply from firmware that doesn't understand a header line, which is what firmware predating the optional headers
+# sends when given one.
+UNEXPECTED_HEADER='ERR: Unexpected header.'
+
+# The heatshrink window and look-ahead sizes (in bits), these must match heatshrink.h.
+HS_WINDOW_BITS=10
+HS_LOOKAHEAD_BITS=5
+
+# The maximum number of earlier positions checked for each match when compressing.
+HS_MAX_CANDIDATES=64
+
+def make_patch(old, new):
+	"""Creates a patch that rebuilds "new" from "old" using copy and insert operations."""
+	# Index the old firmware by the blocks at each word boundary.
+	index = {}
+	for ii in xrange(0, len(old) - PATCH_BLOCK + 1, 4):
+		index.setdefault(old[ii:ii + PATCH_BLOCK], ii)
+
+	patch = []
+	literal_start = 0
+	pos = 0
+	while pos <= len(new) - PATCH_BLOCK:
+		src = index.get(new[pos:pos + PATCH_BLOCK])
+		if src is None:
+			pos += 1
+			continue
+
+		# Extend the match backwards (into the pending literal bytes) and forwards as far as it goes.
+		start = pos
+		while start > literal_start and src > 0 and new[start - 1] == old[src - 1]:
+			start -= 1
+			src -= 1
+		end = pos + PATCH_BLOCK
+		old_end = src + (end - start)
+		while end < len(new) and old_end < len(old) and new[end] == old[old_end]:
+			end += 1
+			old_end += 1
+		if end - start < PATCH_MIN_COPY:
+			pos += 1
+			continue
+
+		# Emit the literal bytes leading up to the match, then the copy itself.
+		if start > literal_start:
+			patch.append(struct.pack('<BI', PATCH_OP_INSERT, start - literal_start))
+			patch.append(new[literal_start:start])
+		patch.append(struct.pack('<BII', PATCH_OP_COPY, src, end - start))
+		literal_start = pos = end
+
+	# Anything left over is sent literally.
+	if literal_start < len(new):
+		patch.append(struct.pack('<BI', PATCH_OP_INSERT, len(new) - literal_start))
+		patch.append(new[literal_start:])
+	return ''.join(patch)
+
+def heatshrink_compress(data):
+	"""Compresses data in the heatshrink format, as decoded by heatshrink.c."""
+	window = 1 << HS_WINDOW_BITS
+	max_len = 1 << HS_LOOKAHEAD_BITS
+
+	# Bits are written most significant first.
+	out = bytearray()
+	acc = [0, 0]
+	def put_bits(value, count):
+		acc[0] = (acc[0] << count) | value
+		acc[1] += count
+		while acc[1] >= 8:
+			acc[1] -= 8
+			out.append((acc[0] >> acc[1]) & 0xFF)
+		acc[0] &= (1 << acc[1]) - 1
+
+	# Earlier positions, keyed by the two bytes found there.
+	chains = {}
+	pos = 0
+	while pos < len(data):
+		# Find the longest match within the window, checking the most recent positions first.
+		best_len = 0
+		best_off = 0
+		limit = min(max_len, len(data) - pos)
+		candidates = chains.get(data[pos:pos + 2], [])
+		for cand in reversed(candidates[-HS_MAX_CANDIDATES:]):
+			if pos - cand > window:
+				break
+			length = 0
+			while length < limit and data[cand + length] == data[pos + length]:
+				length += 1
+			if length > best_len:
+				best_len = length
+				best_off = pos - cand
+				if length == limit:
+					break
+
+		# A back-reference costs 1 + window + look-ahead bits, a literal 9 bits per byte.
+		if best_len * 9 > 1 + HS_WINDOW_BITS + HS_LOOKAHEAD_BITS:
+			put_bits(0, 1)
+			put_bits(best_off - 1, HS_WINDOW_BITS)
+			put_bits(best_len - 1, HS_LOOKAHEAD_BITS)
+			step = best_len
+		else:
+			put_bits(1, 1)
+			put_bits(ord(data[pos]), 8)
+			step = 1
+
+		# Remember the positions just passed, only keeping the most recent ones that will be checked.
+		for ii in xrange(pos, pos + step):
+			chain = chains.setdefault(data[ii:ii + 2], [])
+			chain.append(ii)
+			if len(chain) > 2 * HS_MAX_CANDIDATES:
+				del chain[:HS_MAX_CANDIDATES]
+		pos += step
+
+	# Pad out the final byte with zeroes.
+	if acc[1] > 0:
+		put_bits(0, 8 - acc[1])
+	return str(out)
+
+class HeaderRejected(Exception):
+	"""Raised when the ESP8266 rejects the optional header lines, as firmware predating them does."""
+	pass
+
+class LineReader(object):
+	"""Reads CR/LF terminated lines from a socket."""
+	def __init__(self, s):
+		self.s = s
+		self.buf = ''
+
+	def read_line(self):
+		while '\r\n' not in self.buf:
+			data = self.s.recv(128)
+			if len(data) == 0:
+				raise socket.error('Connection closed by ESP8266')
+			self.buf += data
+		line, self.buf = self.buf.split('\r\n', 1)
+		return line
+
+def split_host(host):
+	"""Splits a "host[:port]" string into the host and port to connect to."""
+	if ':' in host:
+		host, port = host.rsplit(':', 1)
+		return host, int(port)
+	return host, PORT
+
+def new_stats():
+	"""Creates the record of how flashing a single host went."""
+	return {'sent': 0, 'ready': None, 'transfer': 0.0, 'reboot': None, 'code': None, 'requested': None}
+
+def flash(host, user1bin, user2bin, old_user1bin, old_user2bin, compress, extensions, stats, log):
+	"""Performs a single flashing attempt, returning the exit code. Raises socket.error if the connection fails, or
+	HeaderRejected if extensions (the optional header lines not asked for on the command line) were sent and the
+	ESP8266 doesn't understand them. Timings and the number of bytes sent are recorded in stats as the attempt
+	progresses."""
+	# Open the connection to the ESP8266.
+	start = time.time()
+	s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	s.settimeout(5);
+	s.connect(split_host(host))
+	reader = LineReader(s)
+
+	# Send a request for the correct user bin to be flashed.
+	s.send('OTA\r\nGetNextFlash\r\n')
+
+	# Wait for the reply. The running firmware is the other one to that requested.
+	f = None
+	old = None
+	response = reader.read_line()
+	stats['requested'] = response
+	if response == "user1.bin":
+		log('Flashing \"{}\"...'.format(user1bin))
+		f = open(user1bin, "rb")
+		old = old_user2bin
+	elif response == "user2.bin":
+		log('Flashing \"{}\"...'.format(user2bin))
+		f = open(user2bin, "rb")
+		old = old_user1bin
+	else:
+		log('Unknown binary version requested by ESP8266: "{}"'.format(response))
+		return 2
+
+	# Read the firmware file.
+	contents = f.read()
+	f.close()
+
+	# Create a patch against the running firmware, if we know what it is.
+	payload = contents
+	if old is not None:
+		f = open(old, "rb")
+		patch = make_patch(f.read(), contents)
+		f.close()
+		if len(patch) < len(contents):
+			log('Patching from \"{}\", {} bytes instead of {}'.format(old, len(patch), len(contents)))
+			payload = patch
+			s.send('PatchLength: {}\r\n'.format(len(patch)))
+		else:
+			log('Patch from \"{}\" is no smaller than the firmware, sending the full firmware'.format(old))
+
+	# Compress whatever is being sent, if requested.
+	if compress:
+		compressed = heatshrink_compress(payload)
+		log('Compressed {} bytes to {}'.format(len(payload), len(compressed)))
+		payload = compressed
+		s.send('FirmwareEncoding: heatshrink\r\n')
+
+	# Only a full, uncompressed image can be resumed part way through.
+	if extensions and payload is contents:
+		s.send('Resumable\r\n')
+
+	# Send through the CRC of the firmware, so that the ESP8266 can check what it receives and writes to flash.
+	if extensions:
+		s.send('FirmwareCRC32: {:08x}\r\n'.format(zlib.crc32(contents) & 0xFFFFFFFF))
+
+	# Send through the firmware length 
+	s.send('FirmwareLength: {}\r\n'.format(len(contents)))
+
+	# Wait until we get the go-ahead, which tells us where to start from if an earlier attempt was interrupted.
+	offset = 0
+	response = reader.read_line()
+	if response.startswith('ResumeFrom:'):
+		offset = int(response[11:])
+		log('Resuming from byte {}'.format(offset))
+		response = reader.read_line()
+	if response != "Ready":
+		log('Received response: {}'.format(response))
+		s.close()
+		if extensions and response == UNEXPECTED_HEADER:
+			raise HeaderRejected()
+		return 3
+	ready = time.time()
+	stats['ready'] = ready - start
+
+	# Send the firmware, a chunk at a time so that progress can be followed.
+	log('Sending {} bytes of firmware'.format(len(payload) - offset))
+	while offset < len(payload):
+		s.sendall(payload[offset:offset + SEND_CHUNK])
+		stats['sent'] += min(SEND_CHUNK, len(payload) - offset)
+		offset += SEND_CHUNK
+
+	# Wait for the result, skipping over the acknowledgements of each sector written.
+	response = reader.read_line()
+	while response.startswith('Committed:'):
+		response = reader.read_line()
+	stats['transfer'] += time.time() - ready
+	log('Received response: {}'.format(response))
+
+	# Close the connection, as we're now done.
+	s.close()
+	return 0 if response.startswith('Flash upgrade success') else 3
+
+def flash_with_retries(host, user1bin, user2bin, old_user1bin, old_user2bin, compress, stats, log):
+	"""Flashes a single ESP8266, retrying and resuming the transfer where possible. Returns the exit code. Firmware
+	that rejects the optional header lines is flashed again straight away without them."""
+	extensions = True
+	for attempt in range(RETRIES):
+		try:
+			return flash(host, user1bin, user2bin, old_user1bin, old_user2bin, compress, extensions, stats, log)
+		except HeaderRejected:
+			log('"{}" doesn\'t understand the optional headers, flashing without them'.format(host))
+			extensions = False
+		except socket.error as e:
+			log('Connection to "{}" failed: {}'.format(host, e))
+			time.sleep(RETRY_DELAY)
+	log('Giving up after {} attempts'.format(RETRIES))
+	return 4
+
+def wait_for_reboot(host, requested):
+	"""Waits for a flashed ESP8266 to come back up running its new firmware, returning the number of seconds it took
+	(from when the upgrade was reported as successful), or None if it never did. The old firmware still accepts
+	connections until it reboots, so the ESP8266 is only back up once it asks for the other image to that it was just
+	flashed with ("requested")."""
+	start = time.time()
+	while time.time() - start < REBOOT_TIMEOUT:
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		s.settimeout(1)
+		try:
+			s.connect(split_host(host))
+			s.send('OTA\r\nGetNextFlash\r\n')
+			response = LineReader(s).read_line()
+			if response in ('user1.bin', 'user2.bin') and response != requested:
+				s.close()
+				return time.time() - start
+		except socket.error:
+			pass
+		s.close()
+		time.sleep(0.5)
+	return None
+
+def read_inventory(filename):
+	"""Reads the list of hosts to be flashed from an inventory file."""
+	hosts = []
+	f = open(filename, "r")
+	for line in f:
+		line = line.split('#', 1)[0].strip()
+		if len(line) > 0:
+			hosts.append(line)
+	f.close()
+	return hosts
+
+def format_time(seconds):
+	"""Formats a time in seconds for the fleet summary, allowing for it not being known."""
+	return '{:.2f}'.format(seconds) if seconds is not None else '-'
+
+def flash_fleet(hosts, jobs, user1bin, user2bin, old_user1bin, old_user2bin, compress):
+	"""Flashes every host in the list, several at a time, then prints a summary. Returns the exit code of the first
+	host that failed, or 0 if all of them were flashed."""
+	print 'Flashing {} hosts, {} at a time'.format(len(hosts), jobs)
+	output_lock = threading.Lock()
+	pending = Queue.Queue()
+	results = {}
+	for host in hosts:
+		results[host] = new_stats()
+		pending.put(host)
+
+	def worker():
+		while True:
+			try:
+				host = pending.get_nowait()
+			except Queue.Empty:
+				return
+			stats = results[host]
+			def log(message):
+				with output_lock:
+					print '[{}] {}'.format(host, message)
+			stats['start'] = time.time()
+			stats['code'] = flash_with_retries(host, user1bin, user2bin, old_user1bin, old_user2bin, compress, stats,
+				log)
+			if stats['code'] == 0:
+				stats['reboot'] = wait_for_reboot(host, stats['requested'])
+				log('Back up after {} seconds'.format(format_time(stats['reboot'])) if stats['reboot'] is not None
+					else 'Did not come back up running the new firmware within {} seconds'.format(REBOOT_TIMEOUT))
+			stats['done'] = True
+
+	# Start the workers, then report on progress until they've all finished.
+	start = time.time()
+	threads = [threading.Thread(target=worker) for i in range(min(jobs, len(hosts)))]
+	for thread in threads:
+		thread.daemon = True
+		thread.start()
+	while True:
+		alive = [thread for thread in threads if thread.is_alive()]
+		if len(alive) == 0:
+			break
+		alive[0].join(PROGRESS_INTERVAL)
+		done = sum(1 for stats in results.values() if 'done' in stats)
+		active = sum(1 for stats in results.values() if 'start' in stats and 'done' not in stats)
+		sent = sum(stats['sent'] for stats in results.values())
+		with output_lock:
+			print '{}/{} hosts done, {} in progress, {} bytes sent in {:.0f} seconds'.format(done, len(hosts),
+				active, sent, time.time() - start)
+	elapsed = time.time() - start
+
+	# Summarise how each host got on.
+	print ''
+	print '{:<24} {:>6} {:>8} {:>8} {:>8} {:>8} {:>8}'.format('Host', 'Result', 'Bytes', 'Ready s', 'Send s',
+		'Bytes/s', 'Reboot s')
+	code = 0
+	for host in hosts:
+		stats = results[host]
+		rate = stats['sent'] / stats['transfer'] if stats['transfer'] > 0 else None
+		print '{:<24} {:>6} {:>8} {:>8} {:>8} {:>8} {:>8}'.format(host, 'OK' if stats['code'] == 0 else 'FAIL',
+			stats['sent'], format_time(stats['ready']), format_time(stats['transfer'] if stats['transfer'] > 0 else None),
+			'{:.0f}'.format(rate) if rate is not None else '-', format_time(stats['reboot']))
+		if stats['code'] != 0 and code == 0:
+			code = stats['code'] if stats['code'] is not None else 4
+	flashed = sum(1 for stats in results.values() if stats['code'] == 0)
+	sent = sum(stats['sent'] for stats in results.values())
+	print ''
+	print 'Flashed {} of {} hosts in {:.1f} seconds, {:.0f} bytes/s overall'.format(flashed, len(hosts), elapsed,
+		sent / elapsed if elapsed > 0 else 0)
+	return code
+
+def usage():
+	"""Prints the usage instructions."""
 	print 'Usage: '
 	print '   Usage:'
-	print '     tcp_flash.py <host|IP> <user1.bin> <user2.bin>'
+	print '     tcp_flash.py [-z] <host|IP> <user1.bin> <user2.bin> [<old user1.bin> <old user2.bin>]'
+	print '     tcp_flash.py [-z] [-j <jobs>] -f <inventory> <user1.bin> <user2.bin> [<old user1.bin> <old user2.bin>]'
 	print ''
 	print '   Where:'
-	print '     <host|IP>    the hostname or IP address of the ESP8266 to be flashed.'
-	print '     <user1.bin>  the file holding the first flash format file.'
-	print '                  Used when the currently used flash is user2.bin'
-	print '     <user2.bin>  the file holding the second flash format file.'
-	print '                  Used when the currently used flash is user1.bin'
+	print '     -z               compresses the firmware (or patch) with heatshrink before sending it.'
+	print '     -j <jobs>        the number of ESP8266s flashed at the same time in fleet mode (default {}).'.format(
+		DEFAULT_JOBS)
+	print '     -f <inventory>   flashes every ESP8266 listed in the inventory file, one host or IP per line.'
+	print '     <host|IP>        the hostname or IP address of the ESP8266 to be flashed.'
+	print '                      May be given as <host>:<port> to use a port other than {}.'.format(PORT)
+	print '     <user1.bin>      the file holding the first flash format file.'
+	print '                      Used when the currently used flash is user2.bin'
+	print '     <user2.bin>      the file holding the second flash format file.'
+	print '                      Used when the currently used flash is user1.bin'
+	print '     <old user1.bin>  optional, the user1.bin file currently on the ESP8266.'
+	print '                      When supplied, only a patch against the running firmware is sent.'
+	print '     <old user2.bin>  optional, the user2.bin file currently on the ESP8266.'
 	sys.exit(1)
 
-# Copy the parameters to more descriptive variables.
-host = sys.argv[1]
-user1bin = sys.argv[2]
-user2bin = sys.argv[3]
-print 'Flashing to "{}"'.format(host)
-
-# Open the connection to the ESP8266.
-s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-s.settimeout(5);
-s.connect((host, PORT))
-
-# Send a request for the correct user bin to be flashed.
-s.send('OTA\r\nGetNextFlash\r\n')
-
-# Wait for the reply.
-f = None
-response = s.recv(128)
-if response == "user1.bin\r\n":
-	print 'Flashing \"{}\"...'.format(user1bin)
-	f = open(user1bin, "rb")
-elif response == "user2.bin\r\n":
-	print 'Flashing \"{}\"...'.format(user2bin)
-	f = open(user2bin, "rb")
-else:
-	print 'Unknown binary version requested by ESP8266: "{}"'.format(response)
-	sys.exit(2)
-
-# Read the firmware file.
-contents = f.read()
-f.close()
-
-# Send through the firmware length 
-s.send('FirmwareLength: {}\r\n'.format(len(contents)))
-
-# Wait until we get the go-ahead.
-response = s.recv(128)
-if response != "Ready\r\n":
-	print 'Received response: {}'.format(response)
-	sys.exit(3)
-
-# Send the firmware.
-print 'Sending {} bytes of firmware'.format(len(contents))
-s.sendall(contents)
-response = s.recv(128)
-if len(response) > 0:
-	print 'Received response: {}'.format(response)
-
-# Close the connection, as we're now done.
-s.close()
-sys.exit(0)
+# Only flash when run as a script, rather than imported for its functions (by host/heatshrink_test.py, say).
+if __name__ == '__main__':
+	# Pull out any options from the parameters.
+	try:
+		opts, args = getopt.gnu_getopt(sys.argv[1:], 'zj:f:')
+	except getopt.GetoptError as e:
+		print e
+		usage()
+	compress = False
+	jobs = DEFAULT_JOBS
+	inventory = None
+	for opt, value in opts:
+		if opt == '-z':
+			compress = True
+		elif opt == '-j':
+			jobs = int(value)
+		elif opt == '-f':
+			inventory = value
+
+	# Verify the parameters. The host is only given on the command line when there isn't an inventory.
+	if inventory is None:
+		if len(args) < 1:
+			usage()
+		host = args.pop(0)
+	if len(args) != 2 and len(args) != 4 or jobs < 1:
+		usage()
+
+	# Copy the parameters to more descriptive variables.
+	user1bin = args[0]
+	user2bin = args[1]
+	old_user1bin = None
+	old_user2bin = None
+	if len(args) > 2:
+		old_user1bin = args[2]
+		old_user2bin = args[3]
+
+	# Flash the whole fleet if we've been given an inventory.
+	if inventory is not None:
+		sys.exit(flash_fleet(read_inventory(inventory), jobs, user1bin, user2bin, old_user1bin, old_user2bin,
+			compress))
+
+	# Otherwise keep trying until the firmware has been sent, carrying on from where we left off each time if we can.
+	print 'Flashing to "{}"'.format(host)
+	def log(message):
+		print message
+	sys.exit(flash_with_retries(host, user1bin, user2bin, old_user1bin, old_user2bin, compress, new_stats(), log))
@@ -0,0 +1,194 @@
+#!/usr/bin/env python
+#
+# udp_debug_rx.py - receives UDP debug packets, and prints them out
+#
+# Usage:
+#   udp_debug_rx.py [-t <tokens.json>] [-f <firmware.out> ...] [<IP>]
+#
+# Where:
+#   -t <tokens.json>  the format strings of the tokenized messages, as written by dbg_tokens.py during the build.
+#                     Defaults to build/dbg_tokens.json alongside this script.
+#   -f <firmware.out> a firmware image whose symbols name the code addresses in crash reports, which can be given more
+#                     than once. Defaults to build/delta_reader.user1.out and user2.out alongside this script.
+#   <IP>              the IP address from which debug packets are printed, or all addresses, if not supplied
+#
+# Each packet holds one or more records: text output from os_printf, or tokenized messages from DBG_LOG, which are
+# formatted here using the format strings extracted from the source files. Each time the device starts, it also sends
+# the reason it restarted, along with the registers and stack saved if it crashed.
+#
+# Packets carry a sequence number, so they're printed in the order they were sent, even if they arrive out of order.
+# A missing packet is waited for briefly, then reported as lost. Each message is shown with the time it was received
+# and the time (in seconds since the device started) it was logged by the device. A summary of the packets lost from
+# each device is printed on exit (Ctrl-C).
+#
+
+from __future__ import print_function
+from datetime import datetime
+
+import getopt
+import socket
+import sys
+import time
+
+from dbg_decode import *
+
+# The number of seconds to wait for a missing packet before counting it as lost.
+REORDER_WAIT=0.5
+
+def new_device():
+	"""Creates the state kept for each device sending debug packets."""
+	return {'boot_id': None, 'next': 0, 'highest': 0, 'pending': {}, 'received': 0, 'lost': 0, 'out_of_order': 0,
+		'late': 0, 'restarts': 0, 'time_base': 0, 'last_time': 0}
+
+def show(addr, text, logged=None):
+	"""Prints a message from a device, putting the new-lines in the right places."""
+	global last_addr, last_nl
+	if not last_nl and addr != last_addr:
+		# The last message did not end in a new-line, but was from a different IP, so we want to put a new-line in.
+		print('', end='\n')
+
+	# Print the received message.
+	if not last_nl and addr == last_addr:
+		# This is a message continuation, just print the message contents.
+		print(text, end='')
+	else:
+		# Get the current time.
+		dt = datetime.now().strftime('%Y-%m-%d %H-%M-%S.%f')[:-3]
+
+		# Print the address, date/time, device time and the message.
+		if logged is None:
+			print(addr, dt, text, sep=': ', end='')
+		else:
+			print(addr, dt, '{:11.6f}'.format(logged), text, sep=': ', end='')
+
+	# Remember the status of this message, ready for the next one.
+	last_addr = addr
+	last_nl = text[-1:] == '\n'
+
+def show_datagram(addr, device, data):
+	"""Prints the records of a debug packet."""
+	for logged, text in decode_records(data, tokens, symbols):
+		show(addr, text, device_time(device, logged))
+
+def release(addr, device, force=False):
+	"""Prints the packets that are ready, in order. If a packet is missing and the next one has been waited for long
+	enough (or force is set), the missing packets are counted as lost and skipped."""
+	pending = device['pending']
+	while len(pending) > 0:
+		if device['next'] in pending:
+			arrived, data = pending.pop(device['next'])
+			show_datagram(addr, device, data)
+			device['next'] = (device['next'] + 1) & 0xFFFFFFFF
+			continue
+
+		# There's a gap, see if we've waited long enough for it to be filled.
+		first = min(pending, key=lambda seq: (seq - device['next']) & 0xFFFFFFFF)
+		if not force and time.time() - pending[first][0] < REORDER_WAIT:
+			break
+		lost = (first - device['next']) & 0xFFFFFFFF
+		device['lost'] += lost
+		show(addr, '*** {} packet(s) lost ({} to {}).\n'.format(lost, device['next'], (first - 1) & 0xFFFFFFFF))
+		device['next'] = first
+
+def receive(addr, device, data):
+	"""Handles a debug packet, holding it back if there are any missing before it."""
+	boot_id, seq = parse_header(data)
+	device['received'] += 1
+
+	# A new boot ID means that the device has restarted, so its sequence numbers start again.
+	if boot_id != device['boot_id']:
+		if device['boot_id'] is not None:
+			release(addr, device, True)
+			device['restarts'] += 1
+			show(addr, '*** Device restarted.\n')
+		device['boot_id'] = boot_id
+		device['next'] = seq
+		device['highest'] = seq
+		device['time_base'] = 0
+		device['last_time'] = 0
+
+	if seq_before(seq, device['next']) or seq in device['pending']:
+		# We've already given up on this one (or it's a duplicate), show it anyway so that nothing is hidden.
+		if seq_before(seq, device['next']) and device['lost'] > 0:
+			device['lost'] -= 1
+		device['late'] += 1
+		show(addr, '*** Late packet {}:\n'.format(seq))
+		show_datagram(addr, device, data)
+		return
+	if seq_before(seq, device['highest']):
+		device['out_of_order'] += 1
+	else:
+		device['highest'] = seq
+	device['pending'][seq] = (time.time(), data)
+	release(addr, device)
+
+def print_summary():
+	"""Prints the number of packets received and lost from each device."""
+	print('')
+	print('{:<16} {:>10} {:>10} {:>8} {:>12} {:>6} {:>9}'.format('Device', 'Received', 'Lost', 'Loss %', 'Out of order',
+		'Late', 'Restarts'))
+	for addr in sorted(devices):
+		device = devices[addr]
+		total = device['received'] + device['lost']
+		print('{:<16} {:>10} {:>10} {:>8.2f} {:>12} {:>6} {:>9}'.format(addr, device['received'], device['lost'],
+			100.0 * device['lost'] / total if total > 0 else 0, device['out_of_order'], device['late'],
+			device['restarts']))
+
+# Get the filtering details from the parameters, if any.
+tokens_file = default_tokens_file()
+elf_files = []
+opts, args = getopt.getopt(sys.argv[1:], 't:f:')
+for opt, value in opts:
+	if opt == '-t':
+		tokens_file = value
+	elif opt == '-f':
+		elf_files.append(value)
+match_addr = ''
+if len(args) > 0:
+	match_addr = args[0]
+
+# Load the format strings of the tokenized messages.
+tokens = load_tokens(tokens_file)
+if tokens is None:
+	tokens = NO_TOKENS
+	print('No tokenized message formats in "{}", tokenized messages will not be formatted.'.format(tokens_file))
+
+# Load the firmware's symbols, to name the code addresses in crash reports.
+symbols = load_symbols(elf_files if len(elf_files) > 0 else default_elf_files())
+
+# Prepare the UDP socket. The timeout lets us give up on missing packets even when nothing else arrives.
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(('', PORT))
+s.settimeout(REORDER_WAIT / 2)
+
+# Variables that are used to decide if we need to "inject" a new-line character in the output.
+last_addr = ''
+last_nl = True
+
+# The state of each device that has sent debug packets.
+devices = {}
+
+# Repeat until interrupted, to receive multiple packets.
+try:
+	while True:
+		# Wait for a packet to arrive.
+		try:
+			message, (addr, port) = s.recvfrom(2048)
+		except socket.timeout:
+			message = None
+
+		if message is not None and (len(match_addr) == 0 or match_addr == addr):
+			data = bytearray(message)
+			if parse_header(data) is None:
+				show(addr, '<packet without a debug header, {} bytes>\n'.format(len(data)))
+			else:
+				receive(addr, devices.setdefault(addr, new_device()), data)
+
+		# Print anything that's no longer waiting for a missing packet.
+		for addr, device in devices.items():
+			release(addr, device)
+		sys.stdout.flush()
+except KeyboardInterrupt:
+	for addr, device in devices.items():
+		release(addr, device, True)
+	print_summary()
@@ -0,0 +1,208 @@
+#!/usr/bin/env python
+#
+# udp_flash.py - flashes a fleet of ESP8266 microcontrollers at once via UDP multicast.
+#
+# Usage:
+#   udp_flash.py [-g <host:port>] <user1.bin> <user2.bin> [<IP> ...]
+#
+# Where:
+#   -g <host:port>  sends the multicast datagrams to this address rather than the multicast group, such as a stand-in
+#                   for the group that forwards them to simulated devices (see host/fleet_sim.py).
+#   <user1.bin>     the file holding the first flash format file. Used by devices currently running user2.bin
+#   <user2.bin>     the file holding the second flash format file. Used by devices currently running user1.bin
+#   <IP>            the IP addresses of the devices expected to be flashed. If none are given, flashing finishes
+#                   once no device that replies is missing any sectors.
+#
+# Both images are multicast to every device, each device keeping the one for the unit it's not running. After the
+# images have been sent, the devices are asked which sectors they're missing, and just those sectors are sent again
+# until every device has the whole image. Each image is announced along with the length and CRC-32 of the other, so
+# that a device that has already rebooted into its new firmware ignores the announcement of the image for the other
+# unit. Once the expected devices are known, or have replied, only those that haven't completed are asked again,
+# directly rather than via the group.
+#
+
+import getopt
+import random
+import socket
+import struct
+import sys
+import time
+import zlib
+
+# The multicast group and UDP port the devices listen to, these must match tcp_ota.c.
+GROUP='239.255.80.56'
+PORT=65057
+
+# Datagram types and sizes, these must match tcp_ota.c.
+MAGIC='OTAM'
+ANNOUNCE=0x01
+DATA=0x02
+QUERY=0x03
+STATUS=0x04
+STATUS_COMPLETE=0x01
+HEADER_LEN=16
+CHUNK=1024
+SECTOR=4096
+
+# The units of each image (UPGRADE_FW_BIN1 and UPGRADE_FW_BIN2).
+UNITS=[0x00, 0x01]
+
+# The number of seconds to wait between data datagrams, so as not to overrun the devices while they write to flash.
+CHUNK_DELAY=0.004
+
+# The number of seconds to wait for status replies after asking the devices what they're missing.
+QUERY_WAIT=1.0
+
+# The maximum number of repair rounds before giving up.
+MAX_ROUNDS=20
+
+def header(session, kind, unit, sector=0, offset=0, length=0):
+	"""Creates the header of an OTA multicast datagram."""
+	return struct.pack('<4sIBBHHH', MAGIC, session, kind, unit, sector, offset, length)
+
+def send_sector(s, session, unit, image, sector):
+	"""Sends a single sector of an image, in chunks."""
+	start = sector * SECTOR
+	end = min(start + SECTOR, len(image))
+	for offset in range(0, end - start, CHUNK):
+		chunk = image[start + offset:min(start + offset + CHUNK, end)]
+		s.sendto(header(session, DATA, unit, sector, offset, len(chunk)) + chunk, group)
+		time.sleep(CHUNK_DELAY)
+
+def usage():
+	print 'Usage: '
+	print '   Usage:'
+	print '     udp_flash.py [-g <host:port>] <user1.bin> <user2.bin> [<IP> ...]'
+	print ''
+	print '   Where:'
+	print '     -g <host:port>  sends the multicast datagrams to this address rather than the multicast group.'
+	print '     <user1.bin>     the file holding the first flash format file.'
+	print '                     Used by devices currently running user2.bin'
+	print '     <user2.bin>     the file holding the second flash format file.'
+	print '                     Used by devices currently running user1.bin'
+	print '     <IP>            the IP addresses of the devices expected to be flashed.'
+	sys.exit(1)
+
+# Verify the parameters.
+try:
+	opts, args = getopt.getopt(sys.argv[1:], 'g:')
+except getopt.GetoptError:
+	usage()
+if len(args) < 2:
+	usage()
+group = (GROUP, PORT)
+for opt, value in opts:
+	if opt == '-g':
+		host, _, port = value.rpartition(':')
+		if not host or not port.isdigit():
+			usage()
+		group = (host, int(port))
+
+# Read the firmware files, giving each its own session number.
+images = []
+for ii in range(2):
+	f = open(args[ii], 'rb')
+	images.append(f.read())
+	f.close()
+crcs = [zlib.crc32(image) & 0xFFFFFFFF for image in images]
+sessions = [random.randint(1, 0xFFFFFFFF) for ii in range(2)]
+sector_counts = [(len(image) + SECTOR - 1) // SECTOR for image in images]
+expected = set(args[2:])
+
+# Prepare the UDP socket. Status replies come straight back to it.
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+s.bind(('', 0))
+
+def announce(destinations):
+	"""Announces both images, each along with the length and CRC-32 of the other."""
+	for ii in range(2):
+		payload = struct.pack('<IIII', len(images[ii]), crcs[ii], len(images[1 - ii]), crcs[1 - ii])
+		for destination in destinations:
+			s.sendto(header(sessions[ii], ANNOUNCE, UNITS[ii], length=len(payload)) + payload, destination)
+
+def query(destinations):
+	"""Asks which sectors of each image are missing."""
+	for ii in range(2):
+		for destination in destinations:
+			s.sendto(header(sessions[ii], QUERY, UNITS[ii]), destination)
+
+# Send both images in full.
+start_time = time.time()
+announce([group])
+for ii in range(2):
+	print 'Sending {} ({} bytes, session {:08x})'.format(args[ii], len(images[ii]), sessions[ii])
+	for sector in range(sector_counts[ii]):
+		send_sector(s, sessions[ii], UNITS[ii], images[ii], sector)
+
+# Repeat whatever the devices are missing, until they all have everything.
+completed = {}
+seen = set()
+sent_bytes = sum(len(image) for image in images)
+for repair_round in range(MAX_ROUNDS):
+	# Devices that missed the announcement won't answer queries, so announce again first. Only devices still to
+	# complete are asked, directly once they're known, so those that have completed are left alone. Without a list of
+	# devices, the first round goes to the group to find out which there are.
+	if expected:
+		destinations = [(addr, PORT) for addr in sorted(expected - set(completed))]
+	elif repair_round == 0:
+		destinations = [group]
+	else:
+		destinations = [(addr, PORT) for addr in sorted(seen - set(completed))]
+	if not destinations:
+		break
+	announce(destinations)
+	query(destinations)
+
+	# Collect the replies, noting what's missing for each image.
+	missing = [set(), set()]
+	responders = set()
+	s.settimeout(QUERY_WAIT)
+	deadline = time.time() + QUERY_WAIT
+	while time.time() < deadline:
+		try:
+			reply, (addr, port) = s.recvfrom(1024)
+		except socket.timeout:
+			break
+		if len(reply) < HEADER_LEN + 4 or reply[:4] != MAGIC or ord(reply[8]) != STATUS:
+			continue
+		session = struct.unpack('<I', reply[4:8])[0]
+		if session not in sessions:
+			continue
+		ii = sessions.index(session)
+		responders.add(addr)
+		seen.add(addr)
+		flags, count = struct.unpack('<BxH', reply[HEADER_LEN:HEADER_LEN + 4])
+		if flags & STATUS_COMPLETE:
+			if addr not in completed:
+				completed[addr] = time.time() - start_time
+				print '{} complete after {:.1f}s'.format(addr, completed[addr])
+			continue
+		bitmap = reply[HEADER_LEN + 4:]
+		for sector in range(sector_counts[ii]):
+			if sector // 8 >= len(bitmap) or not (ord(bitmap[sector // 8]) & (1 << (sector % 8))):
+				missing[ii].add(sector)
+
+	# See if we're done.
+	if expected and expected.issubset(completed):
+		break
+	if not expected and not missing[0] and not missing[1] and not (responders - set(completed)):
+		break
+
+	# Send the missing sectors again.
+	print 'Round {}: {} device(s) replied, resending {} sector(s)'.format(
+		repair_round + 1, len(responders), len(missing[0]) + len(missing[1]))
+	for ii in range(2):
+		for sector in sorted(missing[ii]):
+			send_sector(s, sessions[ii], UNITS[ii], images[ii], sector)
+			sent_bytes += min(SECTOR, len(images[ii]) - sector * SECTOR)
+
+# Report the results.
+elapsed = time.time() - start_time
+print '{} device(s) flashed in {:.1f}s, {} bytes sent ({:.0f} bytes/s)'.format(
+	len(completed), elapsed, sent_bytes, sent_bytes / elapsed)
+failed = expected - set(completed)
+if failed:
+	print 'Not flashed: {}'.format(', '.join(sorted(failed)))
+	sys.exit(2)
+sys.exit(0)
@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+#
+# dbg_level.py - shows, and optionally changes, the debug level of each module of an ESP8266.
+#
+# Usage:
+#   dbg_level.py <host|IP> [<module>=<level> ...]
+#
+# Where:
+#   <host|IP>  the hostname or IP address of the ESP8266.
+#   <module>   the module whose debug level is changed (e.g. ota), or "all" for every module.
+#   <level>    the new debug level: none, error, warn, info, debug or trace.
+#
+# The debug levels are only held in RAM, so go back to their defaults when the ESP8266 restarts. Messages above the
+# level compiled in (DBG_LEVEL in the Makefile) are never sent, whatever the debug level.
+#
+
+import os
+import re
+import socket
+import sys
+
+# The UDP port and magic of the control datagrams, these must match udp_debug.h.
+PORT=65433
+MAGIC='DBGL'
+
+# The debug levels, in order, these must match udp_debug.h.
+LEVELS=['none', 'error', 'warn', 'info', 'debug', 'trace']
+
+# The header defining the module numbers.
+HEADER=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'include', 'udp_debug.h')
+
+# The number of seconds to wait for the reply, and the number of times the request is sent.
+TIMEOUT=1.0
+ATTEMPTS=3
+
+def read_modules():
+	"""Reads the module numbers from the header, returning a dictionary of module name to number."""
+	f = open(HEADER, 'r')
+	modules = dict((name.lower(), int(number)) for name, number in
+		re.findall(r'#define DBG_MODULE_(\w+) (\d+)', f.read()) if name != 'COUNT')
+	f.close()
+	return modules
+
+def usage(modules):
+	"""Prints the usage instructions."""
+	print 'Usage:'
+	print '   dbg_level.py <host|IP> [<module>=<level> ...]'
+	print ''
+	print 'Where:'
+	print '   <host|IP>  the hostname or IP address of the ESP8266.'
+	print '   <module>   the module whose debug level is changed, or "all" for every module.'
+	print '              One of: {}.'.format(', '.join(sorted(modules, key=modules.get)))
+	print '   <level>    the new debug level: {}.'.format(', '.join(LEVELS))
+	sys.exit(1)
+
+# Verify the parameters, turning each change into a module and level pair.
+modules = read_modules()
+if len(sys.argv) < 2:
+	usage(modules)
+request = MAGIC
+for change in sys.argv[2:]:
+	module, _, level = change.lower().partition('=')
+	if (module != 'all' and module not in modules) or level not in LEVELS:
+		usage(modules)
+	request += chr(0 if module == 'all' else modules[module]) + chr(LEVELS.index(level))
+
+# Send the request, and wait for the reply with the current debug levels.
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(TIMEOUT)
+reply = None
+for attempt in range(ATTEMPTS):
+	s.sendto(request, (sys.argv[1], PORT))
+	try:
+		reply, addr = s.recvfrom(256)
+	except socket.timeout:
+		continue
+	if reply[:len(MAGIC)] == MAGIC:
+		break
+	reply = None
+if reply is None:
+	print 'No reply from {}.'.format(sys.argv[1])
+	sys.exit(2)
+
+# Show the debug level of each module.
+names = dict((number, name) for name, number in modules.items())
+for ii, level in enumerate(bytearray(reply[len(MAGIC):])):
+	name = names.get(ii + 1, str(ii + 1))
+	print '{:<10} {}'.format(name, LEVELS[level] if level < len(LEVELS) else level)
@@ -19,6 +19,56 @@
 // Stores the address to which debug packets are sent in an ip_addr structure.
 #define DBG_ADDR(ip) (ip)[0] = 10; (ip)[1] = 0; (ip)[2] = 1; (ip)[3] = 253;
 
+// The modules that print debug messages, so that each can have its own debug level. Every source file using the
+// DBG_ macros defines DBG_MODULE as one of these.
+#define DBG_MODULE_MAIN 1
+#define DBG_MODULE_OTA 2
+
+// The number of entries needed in an array indexed by module.
+#define DBG_MODULE_COUNT 3
+
+// The debug levels, from the most to the least important. A message is only printed if its level is no higher than
+// the module's current debug level, so DBG_LEVEL_NONE turns off all of a module's messages.
+#define DBG_LEVEL_NONE 0
+#define DBG_LEVEL_ERROR 1
+#define DBG_LEVEL_WARN 2
+#define DBG_LEVEL_INFO 3
+#define DBG_LEVEL_DEBUG 4
+#define DBG_LEVEL_TRACE 5
+
+// The most detailed debug level compiled in, usually set by the Makefile. Messages above this level are removed by the
+// compiler altogether, so cost nothing at all.
+#ifndef DBG_COMPILE_LEVEL
+#define DBG_COMPILE_LEVEL DBG_LEVEL_TRACE
+#endif
+
+// The debug level of every module at start-up, until changed by a control datagram.
+#define DBG_DEFAULT_LEVEL DBG_LEVEL_INFO
+
+// The UDP port listened to for control datagrams, which set the debug level of each module. Each is made up of the
+// DBG_CONTROL_MAGIC, followed by pairs of bytes: a module (or 0 for all modules) and the debug level to give it. The
+// reply holds the same magic, followed by the debug level of each module in turn, starting with module 1.
+#define DBG_CONTROL_PORT 65433
+#define DBG_CONTROL_MAGIC "DBGL"
+#define DBG_CONTROL_MAGIC_LEN 4
+
+// The current debug level of each module.
+extern uint8_t dbg_levels[DBG_MODULE_COUNT];
+
+// Whether messages of the given level are currently printed by this source file's module. This is a constant false for
+// levels that aren't compiled in, so that anything depending on it is removed.
+#define DBG_ENABLED(level) (((level) <= DBG_COMPILE_LEVEL) && ((level) <= dbg_levels[DBG_MODULE]))
+
+/*
+ * Prints a debug message with os_printf at the given level, if that level is currently enabled for the module.
+ */
+#define DBG_PRINTF(level, ...) do { if (DBG_ENABLED(level)) { os_printf(__VA_ARGS__); } } while (0)
+#define DBG_ERROR(...) DBG_PRINTF(DBG_LEVEL_ERROR, __VA_ARGS__)
+#define DBG_WARN(...) DBG_PRINTF(DBG_LEVEL_WARN, __VA_ARGS__)
+#define DBG_INFO(...) DBG_PRINTF(DBG_LEVEL_INFO, __VA_ARGS__)
+#define DBG_DEBUG(...) DBG_PRINTF(DBG_LEVEL_DEBUG, __VA_ARGS__)
+#define DBG_TRACE(...) DBG_PRINTF(DBG_LEVEL_TRACE, __VA_ARGS__)
+
 /*
  * Performs the required initialisation to pass debug information through the network.
  */
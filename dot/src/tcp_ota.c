@@ -18,6 +18,10 @@
 #include "upgrade.h"
 #include "espmissingincludes.h"
 #include "tcp_ota.h"
+#include "udp_debug.h"
+
+// The module used to identify this file's debug messages.
+#define DBG_MODULE DBG_MODULE_OTA
 
 // The TCP port used to listen to for connections.
 #define OTA_PORT 65056
@@ -293,7 +297,7 @@ LOCAL void ICACHE_FLASH_ATTR ota_rx_cb(void *arg, char *data, uint16_t len) {
 
                     if (ota_firmware_received == ota_firmware_size) {
                         // We've flashed all of the firmware now, reboot into the new firmware.
-                        os_printf("Preparing to update firmware.\n");
+                        DBG_INFO("Preparing to update firmware.\n");
                         espconn_send(conn, "Flash upgrade success. Rebooting in 2s.\r\n", 41);
                         os_free(ota_firmware);
                         ota_firmware_size = 0;
@@ -301,7 +305,7 @@ LOCAL void ICACHE_FLASH_ATTR ota_rx_cb(void *arg, char *data, uint16_t len) {
                         ota_firmware_len = 0;
                         ota_state = REBOOTING;
                         system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
-                        os_printf("Scheduling reboot.\n");
+                        DBG_INFO("Scheduling reboot.\n");
                         os_timer_disarm(&ota_reboot_timer);
                         os_timer_setfn(&ota_reboot_timer, (os_timer_func_t *)system_upgrade_reboot, NULL);
                         os_timer_arm(&ota_reboot_timer, 2000, 1);
@@ -408,8 +412,8 @@ LOCAL void ICACHE_FLASH_ATTR ota_recon_cb(void *arg, int8_t err) {
  */
 LOCAL void ICACHE_FLASH_ATTR ota_tcp_connect_cb(void *arg) {
     struct espconn *conn = (struct espconn *)arg;
-    os_printf("TCP OTA connection received from "IPSTR":%d\n",
-              IP2STR(conn->proto.tcp->remote_ip), conn->proto.tcp->remote_port);
+    DBG_INFO("TCP OTA connection received from "IPSTR":%d\n",
+             IP2STR(conn->proto.tcp->remote_ip), conn->proto.tcp->remote_port);
 
     // See if this connection is allowed.
     if (ota_ip == 0) {
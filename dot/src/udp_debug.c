@@ -25,6 +25,15 @@ LOCAL char dbg_buffer[DBG_BUFFER_LEN];
 // The number of bytes currently used in the debug buffer.
 LOCAL uint8_t dbg_buffer_len = 0;
 
+// The current debug level of each module.
+uint8_t dbg_levels[DBG_MODULE_COUNT] = { DBG_DEFAULT_LEVEL, DBG_DEFAULT_LEVEL, DBG_DEFAULT_LEVEL };
+
+// Structure holding the UDP connection information for receiving the debug control datagrams.
+LOCAL struct espconn dbg_control_conn;
+
+// UDP specific protocol structure for receiving the debug control datagrams.
+LOCAL esp_udp dbg_control_proto;
+
 /*
  * Receives a single character of output for debugging. This is used to send through the data via UDP.
  */
@@ -53,9 +62,56 @@ LOCAL void dbg_putc(char c) {
     }
 }
 
+/*
+ * Receive call-back for the debug control datagrams. Sets the debug level of each module listed, then replies to the
+ * sender with the debug levels of all the modules.
+ */
+LOCAL void ICACHE_FLASH_ATTR dbg_control_rx_cb(void *arg, char *data, unsigned short len) {
+    struct espconn *conn = (struct espconn *)arg;
+    if ((len < DBG_CONTROL_MAGIC_LEN) || (os_memcmp(data, DBG_CONTROL_MAGIC, DBG_CONTROL_MAGIC_LEN) != 0)) {
+        return;
+    }
+
+    // Set the debug levels, ignoring unknown modules.
+    for (unsigned short ii = DBG_CONTROL_MAGIC_LEN; ii + 1 < len; ii += 2) {
+        uint8_t module = data[ii];
+        uint8_t level = data[ii + 1];
+        if (level > DBG_LEVEL_TRACE) {
+            level = DBG_LEVEL_TRACE;
+        }
+        if (module == 0) {
+            for (uint8_t jj = 1; jj < DBG_MODULE_COUNT; jj++) {
+                dbg_levels[jj] = level;
+            }
+        } else if (module < DBG_MODULE_COUNT) {
+            dbg_levels[module] = level;
+        }
+    }
+
+    // Reply to whoever sent the datagram.
+    remot_info *remote = NULL;
+    if (espconn_get_connection_info(conn, &remote, 0) != ESPCONN_OK) {
+        return;
+    }
+    os_memcpy(conn->proto.udp->remote_ip, remote->remote_ip, 4);
+    conn->proto.udp->remote_port = remote->remote_port;
+    uint8_t reply[DBG_CONTROL_MAGIC_LEN + DBG_MODULE_COUNT - 1];
+    os_memcpy(reply, DBG_CONTROL_MAGIC, DBG_CONTROL_MAGIC_LEN);
+    os_memcpy(&reply[DBG_CONTROL_MAGIC_LEN], &dbg_levels[1], DBG_MODULE_COUNT - 1);
+    espconn_send(conn, reply, sizeof(reply));
+}
+
 /*
  * Performs the required initialisation to pass debug information through the network.
  */
 void ICACHE_FLASH_ATTR dbg_init() {
     os_install_putc1(dbg_putc);
+
+    // Listen for control datagrams changing the debug levels.
+    dbg_control_proto.local_port = DBG_CONTROL_PORT;
+    dbg_control_conn.type = ESPCONN_UDP;
+    dbg_control_conn.state = ESPCONN_NONE;
+    dbg_control_conn.proto.udp = &dbg_control_proto;
+    espconn_create(&dbg_control_conn);
+    espconn_regist_recvcb(&dbg_control_conn, dbg_control_rx_cb);
 }
@@ -15,6 +15,9 @@
 #include "tcp_ota.h"
 #include "udp_debug.h"
 
+// The module used to identify this file's debug messages.
+#define DBG_MODULE DBG_MODULE_MAIN
+
 // Change the below values to suit your own network.
 #define SSID "YOUR_NETWORK_SSID"
 #define PASSWD "YOUR_NETWORK_PASSWORD"
@@ -75,7 +78,7 @@ LOCAL void ICACHE_FLASH_ATTR pb_response_cb(void *arg, char *data, uint16_t len)
 
     if (status != 200) {
         // There was a problem.
-        os_printf("Error returned from Pushbullet: \"%s\".\n", data);
+        DBG_ERROR("Error returned from Pushbullet: \"%s\".\n", data);
     }
 
     // Close the connection ASAP, now we're done with it.
@@ -92,14 +95,14 @@ LOCAL void ICACHE_FLASH_ATTR pb_disconnect_task(os_event_t *event) {
  */
 LOCAL void ICACHE_FLASH_ATTR pb_connect_cb(void *arg) {
     struct espconn *conn = (struct espconn *)arg;
-    os_printf("Connected to Pushbullet API web server.\n");
+    DBG_INFO("Connected to Pushbullet API web server.\n");
 
     // Register a call-back for when we receive data.
     espconn_regist_recvcb(conn, pb_response_cb);
 
     // Send through the Pushbullet request.
     int8_t res = espconn_secure_send(conn, PB_REQUEST, PB_REQUEST_LEN);
-    os_printf("Sent %s with result %d.\n", PB_REQUEST, res);
+    DBG_DEBUG("Sent %s with result %d.\n", PB_REQUEST, res);
 }
 
 /*
@@ -107,7 +110,7 @@ LOCAL void ICACHE_FLASH_ATTR pb_connect_cb(void *arg) {
  */
 LOCAL void ICACHE_FLASH_ATTR pb_disc_cb(void *arg) {
     pb_in_progress = false;
-    os_printf("Disconnected from Pushbullet.\n");
+    DBG_INFO("Disconnected from Pushbullet.\n");
 }
 
 /*
@@ -115,7 +118,7 @@ LOCAL void ICACHE_FLASH_ATTR pb_disc_cb(void *arg) {
  */
 LOCAL void ICACHE_FLASH_ATTR pb_recon_cb(void *arg, int8_t err) {
     pb_in_progress = false;
-    os_printf("Connection failed to Pushbullet - %d.\n", err);
+    DBG_ERROR("Connection failed to Pushbullet - %d.\n", err);
 }
 
 /*
@@ -126,7 +129,7 @@ LOCAL void ICACHE_FLASH_ATTR have_pb_ip(const char *name, ip_addr_t *addr, void
 
     if (addr == NULL) {
         // We couldn't get the IP after all.
-        os_printf("Unable to get IP address for Pushbullet.\n");
+        DBG_ERROR("Unable to get IP address for Pushbullet.\n");
         pb_in_progress = false;
         return;
     }
@@ -143,23 +146,23 @@ LOCAL void ICACHE_FLASH_ATTR have_pb_ip(const char *name, ip_addr_t *addr, void
     espconn_regist_disconcb(conn, pb_disc_cb);
     espconn_regist_reconcb(conn, pb_recon_cb);
 
-    os_printf("Connecting to %d.%d.%d.%d:%d.\n", IP2STR(&addr->addr), conn->proto.tcp->remote_port);
+    DBG_INFO("Connecting to %d.%d.%d.%d:%d.\n", IP2STR(&addr->addr), conn->proto.tcp->remote_port);
     espconn_secure_set_size(0x01, 6144);
     int8_t res = espconn_secure_connect(conn);
     if (res) {
         pb_in_progress = false;
         switch (res) {
             case ESPCONN_MEM:
-                os_printf("Unable to connect to Pushbullet server - out of memory.\n");
+                DBG_ERROR("Unable to connect to Pushbullet server - out of memory.\n");
                 break;
             case ESPCONN_ISCONN:
-                os_printf("Unable to connect to Pushbullet server - already connected.\n");
+                DBG_ERROR("Unable to connect to Pushbullet server - already connected.\n");
                 break;
             case ESPCONN_ARG:
-                os_printf("Unable to connect to Pushbullet server - illegal argument.\n");
+                DBG_ERROR("Unable to connect to Pushbullet server - illegal argument.\n");
                 break;
             default:
-                os_printf("Unable to connect to Pushbullet server - unknown error.\n");
+                DBG_ERROR("Unable to connect to Pushbullet server - unknown error.\n");
                 break;
         }
     }
@@ -174,14 +177,14 @@ LOCAL void gpio_interrupt(uint32_t intr_mask, void *arg) {
     // Get the interrupt information.
     uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
     gpio_intr_ack(intr_mask);
-    os_printf("GPIO interrupt - %04x, %04x.\n", intr_mask, gpio_status);
+    DBG_DEBUG("GPIO interrupt - %04x, %04x.\n", intr_mask, gpio_status);
 
     // Notify Pushbullet, if we're not already.
     if (!pb_in_progress) {
         pb_in_progress = true;
         espconn_gethostbyname(&pb_conn, PB_HOSTNAME, &pb_ip, have_pb_ip);
     } else {
-        os_printf("Not sending to pushbullet, as call is currently in progress.\n");
+        DBG_WARN("Not sending to pushbullet, as call is currently in progress.\n");
     }
 
     // Re-assert the interrupt for this pin.
@@ -204,9 +207,9 @@ LOCAL void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *event) {
                 len = 32;
             }
             strncpy(ssid, event->event_info.connected.ssid, len + 1);
-            os_printf("Received EVENT_STAMODE_CONNECTED. "
-                      "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
-                      ssid, MAC2STR(event->event_info.connected.bssid), event->event_info.connected.channel);
+            DBG_INFO("Received EVENT_STAMODE_CONNECTED. "
+                     "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
+                     ssid, MAC2STR(event->event_info.connected.bssid), event->event_info.connected.channel);
             break;
         }
         case EVENT_STAMODE_DISCONNECTED: {
@@ -217,21 +220,21 @@ LOCAL void ICACHE_FLASH_ATTR wifi_event_cb(System_Event_t *event) {
                 len = 32;
             }
             strncpy(ssid, event->event_info.connected.ssid, len + 1);
-            os_printf("Received EVENT_STAMODE_DISCONNECTED. "
-                      "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
-                      ssid, MAC2STR(event->event_info.disconnected.bssid), event->event_info.disconnected.reason);
+            DBG_INFO("Received EVENT_STAMODE_DISCONNECTED. "
+                     "SSID = %s, BSSID = "MACSTR", channel = %d.\n",
+                     ssid, MAC2STR(event->event_info.disconnected.bssid), event->event_info.disconnected.reason);
             break;
         }
         case EVENT_STAMODE_GOT_IP:
             // We have an IP address, ready to run. Return the IP address, too.
-            os_printf("Received EVENT_STAMODE_GOT_IP. IP = "IPSTR", mask = "IPSTR", gateway = "IPSTR"\n", 
-                      IP2STR(&event->event_info.got_ip.ip.addr), 
-                      IP2STR(&event->event_info.got_ip.mask.addr),
-                      IP2STR(&event->event_info.got_ip.gw));
+            DBG_INFO("Received EVENT_STAMODE_GOT_IP. IP = "IPSTR", mask = "IPSTR", gateway = "IPSTR"\n", 
+                     IP2STR(&event->event_info.got_ip.ip.addr), 
+                     IP2STR(&event->event_info.got_ip.mask.addr),
+                     IP2STR(&event->event_info.got_ip.gw));
             break;
         case EVENT_STAMODE_DHCP_TIMEOUT:
             // We couldn't get an IP address via DHCP, so we'll have to try re-connecting.
-            os_printf("Received EVENT_STAMODE_DHCP_TIMEOUT.\n");
+            DBG_WARN("Received EVENT_STAMODE_DHCP_TIMEOUT.\n");
             wifi_station_disconnect();
             wifi_station_connect();
             break;
@@ -22,7 +22,6 @@
 #include "webpages-espfs.h"
 #include "cgiwebsocket.h"
 
-#include "string_builder.h"
 #include "tcp_ota.h"
 #include "udp_debug.h"
 
@@ -111,19 +110,11 @@ LOCAL void ICACHE_FLASH_ATTR set_servo(int8_t position) {
 	pwm_set_duty(pwm_duty, 0);
 	pwm_start();
 
-	// Send the information to all web socket listeners.
-	string_builder *sb = create_string_builder(128);
-	if (sb == NULL) {
-		os_printf("Unable to create string builder for web socket reply.");
-	} else {
-		append_string_builder(sb, "{\"angle\": ");
-		append_int32_string_builder(sb, servo_angle);
-		append_string_builder(sb, ", \"duty\": ");
-		append_int32_string_builder(sb, pwm_duty);
-		append_string_builder(sb, "}");
-		cgiWebsockBroadcast("/ws.cgi", sb->buf, sb->len, WEBSOCK_FLAG_NONE);
-		free_string_builder(sb);
-	}
+	// Send the information to all web socket listeners. A web socket message has to be sent in one piece, but it's
+	// small enough to format on the stack rather than the heap.
+	char msg[48];
+	int len = os_sprintf(msg, "{\"angle\": %d, \"duty\": %d}", (int32_t)servo_angle, (int32_t)pwm_duty);
+	cgiWebsockBroadcast("/ws.cgi", msg, len, WEBSOCK_FLAG_NONE);
 }
 
 /*
@@ -74,8 +74,8 @@ bool ICACHE_FLASH_ATTR append_string_builder(string_builder *buf, const char *st
 
     // Add the string.
     os_memmove(&buf->buf[buf->len], str, len - 1);
-    buf->buf[buf->len + len] = '\0';
     buf->len += len - 1;
+    buf->buf[buf->len] = '\0';
     return true;
 }
 
@@ -134,9 +134,9 @@ LOCAL bool ICACHE_FLASH_ATTR resize_string_builder(string_builder *buf,
                                                    unsigned int additional_required) {
     // Find the new size of the builder.
     int new_size;
-    if ((buf->allocated + buf->allocated - buf->len) < additional_required) {
+    if (buf->allocated < additional_required) {
         // Merely doubling the builder won't help, create the additional requried.
-        new_size = buf->len + additional_required;
+        new_size = buf->allocated + additional_required;
     } else {
         new_size = buf->allocated + buf->allocated;
     }
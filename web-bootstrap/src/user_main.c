@@ -23,7 +23,6 @@
 #include "cgiwifi.h"
 
 #include "tcp_ota.h"
-#include "string_builder.h"
 
 /*
  * Returns a HTML page, with an appropriate error code and string.
@@ -46,27 +45,27 @@ LOCAL void httpCodeReturn(HttpdConnData *connData, uint16_t code, char *title, c
  * CGI function to return the current status of the WiFi connection as JSON data.
  */
 LOCAL int cgi_wifi_status(HttpdConnData *connData) {
-	string_builder *sb = create_string_builder(128);
-	if (sb == NULL) {
-		httpCodeReturn(connData, 500, "Resource error", "Unable to allocate internal memory for request.");
-		return HTTPD_CGI_DONE;
-	}
+	// Write the header. Each part of the JSON is then sent as it's found, httpdSend gathering them in the connection's
+	// send buffer, rather than building the whole response in memory first.
+	httpdStartResponse(connData, 200);
+	httpdHeader(connData, "Content-Type", "text/json");
+	httpdEndHeaders(connData);
 
 	// Get the operating mode status.
 	uint8_t mode = wifi_get_opmode_default();
-	append_string_builder(sb, "{\"opmode\": \"");
+	httpdSend(connData, "{\"opmode\": \"", -1);
 	switch (mode) {
 		case STATION_MODE:
-			append_string_builder(sb, "Station");
+			httpdSend(connData, "Station", -1);
 			break;
 		case SOFTAP_MODE:
-			append_string_builder(sb, "Access Point");
+			httpdSend(connData, "Access Point", -1);
 			break;
 		case STATIONAP_MODE:
-			append_string_builder(sb, "Station and Access Point");
+			httpdSend(connData, "Station and Access Point", -1);
 			break;
 		default:
-			append_string_builder(sb, "Unknown");
+			httpdSend(connData, "Unknown", -1);
 			break;
 	}
 
@@ -74,84 +73,81 @@ LOCAL int cgi_wifi_status(HttpdConnData *connData) {
     struct ip_info info;
 	bool res = wifi_get_ip_info(SOFTAP_IF, &info);
 	if (!res) {
-		append_string_builder(sb, "\", \"ap\": { \"ip\": \"Unknown\"");
+		httpdSend(connData, "\", \"ap\": { \"ip\": \"Unknown\"", -1);
 	} else {
 		char buf[20];
 		os_sprintf(buf, IPSTR, IP2STR(&info.ip));
-		append_string_builder(sb, "\", \"ap\": { \"ip\": \"");
-		append_string_builder(sb, buf);
-		append_string_builder(sb, "\"");
+		httpdSend(connData, "\", \"ap\": { \"ip\": \"", -1);
+		httpdSend(connData, buf, -1);
+		httpdSend(connData, "\"", -1);
 	}
 	uint8_t mac[6];
 	char mac_str[18];
 	wifi_get_macaddr(SOFTAP_IF, mac);
-	append_string_builder(sb, ", \"mac\": \"");
+	httpdSend(connData, ", \"mac\": \"", -1);
 	os_sprintf(mac_str, MACSTR, MAC2STR(mac));
-	append_string_builder(sb, mac_str);
-	int32_t clients = (int32_t)wifi_softap_get_station_num();
-	append_string_builder(sb, "\", \"clientCount\": ");
-	append_int32_string_builder(sb, clients);
-	append_string_builder(sb, "}");
+	httpdSend(connData, mac_str, -1);
+	char num_str[12];
+	os_sprintf(num_str, "%d", (int32_t)wifi_softap_get_station_num());
+	httpdSend(connData, "\", \"clientCount\": ", -1);
+	httpdSend(connData, num_str, -1);
+	httpdSend(connData, "}", -1);
 
 	// Get the station information.
-	append_string_builder(sb, ", \"station\": { \"status\": ");
+	httpdSend(connData, ", \"station\": { \"status\": ", -1);
 	int stnStatus = wifi_station_get_connect_status();
 	switch (stnStatus) {
 		case STATION_IDLE:
-			append_string_builder(sb, "\"Idle\"");
+			httpdSend(connData, "\"Idle\"", -1);
 			break;
 		case STATION_CONNECTING:
-			append_string_builder(sb, "\"Connecting\"");
+			httpdSend(connData, "\"Connecting\"", -1);
 			break;
 		case STATION_WRONG_PASSWORD:
-			append_string_builder(sb, "\"Incorrect password\"");
+			httpdSend(connData, "\"Incorrect password\"", -1);
 			break;
 		case STATION_NO_AP_FOUND:
-			append_string_builder(sb, "\"Access point not found\"");
+			httpdSend(connData, "\"Access point not found\"", -1);
 			break;
 		case STATION_CONNECT_FAIL:
-			append_string_builder(sb, "\"Connection failed\"");
+			httpdSend(connData, "\"Connection failed\"", -1);
 			break;
 		case STATION_GOT_IP:
-			append_string_builder(sb, "\"Connected\", \"ip\": \"");
+			httpdSend(connData, "\"Connected\", \"ip\": \"", -1);
 			res = wifi_get_ip_info(STATION_IF, &info);
 			if (!res) {
-				append_string_builder(sb, "Unknown\"");
+				httpdSend(connData, "Unknown\"", -1);
 			} else {
 				char buf[20];
 				os_sprintf(buf, IPSTR, IP2STR(&info.ip));
-				append_string_builder(sb, buf);
-				append_string_builder(sb, "\"");
+				httpdSend(connData, buf, -1);
+				httpdSend(connData, "\"", -1);
 			}
 			break;
 	}
 	struct station_config config;
 	res = wifi_station_get_config(&config);
 	if (res) {
-		append_string_builder(sb, ", \"ssid\": \"");
-		append_string_builder(sb, config.ssid);
-		append_string_builder(sb, "\"");
+		httpdSend(connData, ", \"ssid\": \"", -1);
+		httpdSend(connData, config.ssid, -1);
+		httpdSend(connData, "\"", -1);
 	}
 	wifi_get_macaddr(STATION_IF, mac);
-	append_string_builder(sb, ", \"mac\": \"");
+	httpdSend(connData, ", \"mac\": \"", -1);
 	os_sprintf(mac_str, MACSTR, MAC2STR(mac));
-	append_string_builder(sb, mac_str);
-	append_string_builder(sb, "\", \"rssi\": ");
+	httpdSend(connData, mac_str, -1);
+	httpdSend(connData, "\", \"rssi\": ", -1);
 	int8_t rssi = wifi_station_get_rssi();
 	if (rssi == 31) {
-		append_string_builder(sb, "\"Unknown\" }");
+		httpdSend(connData, "\"Unknown\" }", -1);
 	} else {
-		append_int32_string_builder(sb, (int32_t)rssi);
-		append_string_builder(sb, " }");
+		os_sprintf(num_str, "%d", (int32_t)rssi);
+		httpdSend(connData, num_str, -1);
+		httpdSend(connData, " }", -1);
 	}
 
-	// Send the JSON response.
-	append_string_builder(sb, "}");
-	httpdStartResponse(connData, 200);
-	httpdHeader(connData, "Content-Type", "text/json");
-	httpdEndHeaders(connData);
-	httpdSend(connData, sb->buf, sb->len);
-	free_string_builder(sb);
+	// Finish the JSON response.
+	httpdSend(connData, "}", -1);
 	return HTTPD_CGI_DONE;
 }
 